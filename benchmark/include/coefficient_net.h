@@ -0,0 +1,116 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COEFFICIENT_NET_H_W7TQ2MXA
+#define COEFFICIENT_NET_H_W7TQ2MXA
+
+#include <string>
+#include <vector>
+
+#include "model_bundle.h"
+
+// Native implementation of the low-resolution path of HDRNetCurves (and its
+// subclasses), see `HDRNetCurves._coefficients` in hdrnet/models.py:
+//
+//   splat:      log2(net_input_size/spatial_bin) 3x3 stride-2 convs.
+//   global:     two 3x3 stride-2 convs, then three fully connected layers.
+//   local:      two 3x3 convs.
+//   fusion:     relu(local + global).
+//   prediction: 1x1 conv to luma_bins * grid_rows * grid_cols channels.
+//
+// The topology is derived from the bundle header, and the weights are read
+// from the "coefficients/<scope>/{weights,biases}" sections written by
+// hdrnet/bin/pack_model.py, with batch normalization already folded in.
+//
+// Activations are stored HWC (channels fastest) in a single arena that is
+// allocated once at load time; forward() does not allocate.
+class CoefficientNet
+{
+public:
+  explicit CoefficientNet(const ModelBundle &bundle);
+  ~CoefficientNet();
+
+  // Buffer for the (net_input_size, net_input_size, 3) input, values in
+  // [0, 1]. Fill it before calling forward().
+  float *input() { return arena_ + input_offset_; }
+
+  // Runs the network and returns the grid in the same layout as the
+  // `output_coefficients` node of the frozen graph:
+  // (grid_rows, grid_depth, grid_height, grid_width, grid_cols).
+  const float *forward();
+
+  int net_input_size() const { return net_input_size_; }
+  int grid_width() const { return grid_width_; }
+  int grid_height() const { return grid_height_; }
+  int grid_depth() const { return grid_depth_; }
+  int grid_rows() const { return grid_rows_; }
+  int grid_cols() const { return grid_cols_; }
+
+private:
+  // An HWC activation buffer in the arena.
+  struct Activation {
+    size_t offset;
+    int height, width, channels;
+  };
+
+  struct Layer {
+    std::string scope;
+    int kernel_size;
+    int stride;
+    int in_height, in_width, in_channels;
+    int out_height, out_width, out_channels;
+    int pad_top, pad_left;
+    bool relu;
+    bool has_bias;
+
+    // Weights are packed as (out_channels/kBlock, ky, kx, in_channels, kBlock)
+    // and zero-padded to a multiple of kBlock output channels.
+    size_t weights_offset;
+    size_t biases_offset;
+    size_t input_offset;
+    size_t output_offset;
+    // Adds the output of global/fc3 before the activation (fusion).
+    bool add_global;
+  };
+
+  CoefficientNet(const CoefficientNet &) = delete;
+  CoefficientNet &operator=(const CoefficientNet &) = delete;
+
+  Activation allocate(int height, int width, int channels);
+  Activation add_layer(const std::string &scope, const Activation &input,
+      int kernel_size, int stride, int out_channels, bool relu, bool has_bias);
+  void load_layer(const ModelBundle &bundle, Layer &layer);
+  void run_layer(const Layer &layer);
+
+  int net_input_size_;
+  int grid_width_;
+  int grid_height_;
+  int grid_depth_;
+  int grid_rows_;
+  int grid_cols_;
+
+  std::vector<Layer> layers_;
+  // Index of global/fc3, whose output is broadcast into local/conv2.
+  int global_layer_ = -1;
+
+  float *weights_ = nullptr;
+  size_t weights_size_ = 0;
+
+  float *arena_ = nullptr;
+  size_t arena_size_ = 0;
+  size_t input_offset_ = 0;
+  size_t output_offset_ = 0;
+};
+
+#endif /* end of include guard: COEFFICIENT_NET_H_W7TQ2MXA */
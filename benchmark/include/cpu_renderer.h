@@ -0,0 +1,94 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CPU_RENDERER_H_R8WQK4ZT
+#define CPU_RENDERER_H_R8WQK4ZT
+
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "grid_codec.h"
+#include "model_bundle.h"
+
+// CPU version of StandardRenderer (assets/std.frag): computes the curve-based
+// guide and slices the grid with trilinear, clamp-to-edge interpolation.
+// Unlike the GL renderers it needs no context and takes images of any size,
+// so it can be shared by several threads.
+class CpuRenderer
+{
+public:
+  CpuRenderer(int grid_width, int grid_height, int grid_depth,
+      std::string checkpoint_path, const ModelBundle *bundle);
+
+  // Renders the RGB `input` with `coeffs`, laid out as the
+  // `output_coefficients` node: (3, grid_depth, grid_height, grid_width, 4).
+  // `output` is (re)allocated to the size of `input`. Thread-safe.
+  void render(const cv::Mat &input, const float *coeffs, cv::Mat &output) const;
+  // Same, slicing the quantized codes directly: the codes are interpolated
+  // and only the 12 sampled coefficients are dequantized.
+  void render(const cv::Mat &input, const QuantizedGrid &grid,
+      cv::Mat &output) const;
+
+  // Renders the pixels of rows [y_begin, y_end) whose x and y are both
+  // multiples of `stride`, except those where both are multiples of
+  // `skip_stride` (0 skips none), and fills the stride x stride block below
+  // and to the right of each with its value: a reduced-resolution render, or
+  // a refinement of one. `output` must already have the size of `input`.
+  // Each rendered pixel is exactly as render() computes it. Thread-safe.
+  void render_lattice(const cv::Mat &input, const float *coeffs, int stride,
+      int skip_stride, int y_begin, int y_end, cv::Mat &output) const;
+
+  // Renders the pixels in columns [x_begin, x_end) of rows [y_begin, y_end)
+  // only, as render() does. `output` must already have the size of `input`.
+  // Thread-safe.
+  void render_region(const cv::Mat &input, const float *coeffs, int x_begin,
+      int x_end, int y_begin, int y_end, cv::Mat &output) const;
+  // Renders the rectangle of `input` of the size of `tile` whose top-left
+  // pixel is (x_begin, y_begin) into `tile`, which may be a view into a larger
+  // image. The rectangle must be inside `input`. Each pixel is exactly as
+  // render() computes it. Thread-safe.
+  void render_tile(const cv::Mat &input, const float *coeffs, int x_begin,
+      int y_begin, cv::Mat &tile) const;
+
+  // The two grid cells that pixel `i` of an axis of `size` pixels samples,
+  // along an axis of `grid_size` cells (clamped, so they can be equal).
+  static void pixel_cells(int i, int size, int grid_size, int *cell0,
+      int *cell1);
+
+  int grid_width() const { return grid_width_; }
+  int grid_height() const { return grid_height_; }
+  int grid_depth() const { return grid_depth_; }
+
+private:
+  template <typename Grid>
+  void render_grid(const cv::Mat &input, const Grid &grid, cv::Mat &output) const;
+  // Renders the RGB pixel `in` at horizontal texture coordinate `tx`, in a
+  // row with taps gy0, gy1 and weight wy, into `out`.
+  template <typename Grid>
+  void render_pixel(const Grid &grid, const unsigned char *in, float tx,
+      int gy0, int gy1, float wy, unsigned char *out) const;
+
+  int grid_width_;
+  int grid_height_;
+  int grid_depth_;
+
+  // Same layout as the uniforms of std.frag.
+  float ccm_[3*4];
+  float mix_matrix_[4];
+  float shifts_[16*3];
+  float slopes_[16*3];
+};
+
+#endif /* end of include guard: CPU_RENDERER_H_R8WQK4ZT */
@@ -0,0 +1,114 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DEADLINE_SCHEDULER_H_P5XGD2QE
+#define DEADLINE_SCHEDULER_H_P5XGD2QE
+
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "processor.h"
+#include "timer.h"
+
+// Ways to produce a frame, from best to fastest.
+enum Quality {
+  // Run the network and render.
+  QUALITY_FULL = 0,
+  // Render with the grid of the previous full-quality frame.
+  QUALITY_REUSE_GRID,
+  // Same, at 1/DeadlineProcessor::kReducedScale of the resolution in each
+  // dimension, upsampled.
+  QUALITY_REDUCED,
+  // Apply per-channel curves fitted to the last full-quality frame, on the
+  // CPU. No network, no GL.
+  QUALITY_LUT,
+  NUM_QUALITIES
+};
+
+const char *quality_name(Quality quality);
+
+// Running estimate of a stage latency: exponentially weighted mean and mean
+// deviation, predicted as mean + 2 deviations (as for TCP retransmit timers).
+class LatencyEstimate
+{
+public:
+  void add(double ms);
+  // Forgets the history and starts over from `ms`.
+  void reset(double ms);
+  bool valid() const { return valid_; }
+  double predict() const { return mean_ + 2.0*deviation_; }
+
+private:
+  bool valid_ = false;
+  double mean_ = 0.0;
+  double deviation_ = 0.0;
+};
+
+typedef struct DeadlineStats {
+  int frames = 0;
+  int hits = 0;
+  int frames_at[NUM_QUALITIES] = {0};
+
+  double hit_rate() const { return frames > 0 ? static_cast<double>(hits)/frames : 0.0; }
+  double degraded_rate() const {
+    return frames > 0 ? 1.0 - static_cast<double>(frames_at[QUALITY_FULL])/frames : 0.0;
+  }
+} DeadlineStats;
+
+// Runs a HybridGLProcessor under a per-frame deadline. Before each frame, it
+// predicts the time of each quality level from recent per-stage latencies and
+// picks the best one that fits in the time left, with a safety margin, falling
+// back to the one predicted to be fastest.
+class DeadlineProcessor
+{
+public:
+  DeadlineProcessor(HybridGLProcessor *processor, double deadline_ms);
+
+  BenchmarkResult process(const cv::Mat &input, cv::Mat &output);
+
+  Quality last_quality() const { return last_quality_; }
+  const DeadlineStats &stats() const { return stats_; }
+
+private:
+  Quality choose();
+  void fit_lut(const cv::Mat &input, const cv::Mat &output);
+
+  // After this many degraded frames in a row, run one full-quality frame and
+  // restart the estimates from it, since they are stale.
+  static const int kProbeInterval = 8;
+  // Downscaling of QUALITY_REDUCED frames.
+  static const int kReducedScale = 2;
+
+  HybridGLProcessor *processor_;
+  double deadline_;
+  DeadlineStats stats_;
+  Timer timer_;
+  Timer frame_timer_;
+
+  LatencyEstimate prepare_;
+  LatencyEstimate forward_;
+  // Input upload and render, at full and reduced resolution. Both span the
+  // same calls on every path that measures them.
+  LatencyEstimate render_;
+  LatencyEstimate reduced_;
+  LatencyEstimate lut_;
+
+  Quality last_quality_ = QUALITY_FULL;
+  int degraded_streak_ = 0;
+  std::vector<float> grid_;
+  cv::Mat lut_table_;
+};
+
+#endif /* end of include guard: DEADLINE_SCHEDULER_H_P5XGD2QE */
@@ -0,0 +1,166 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRID_CODEC_H_T9BLQ3WE
+#define GRID_CODEC_H_T9BLQ3WE
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compact transport format for coefficient grids, e.g. between the network and
+// renderer processes (see shm_ring.h).
+//
+// Each channel (one affine coefficient, i.e. one (row, col) of the grid) is
+// quantized to int8 or int16 codes with its own scale and offset:
+//
+//   value = offset + scale*code
+//
+// A keyframe carries the scales and every code. With delta encoding, the
+// frames in between only carry, for the blocks of kGridDeltaBlock codes that
+// changed, the int8 difference to the previous frame's codes, reusing the
+// keyframe's scales.
+// The encoder tracks the codes the decoder will reconstruct, so errors don't
+// accumulate, and falls back to a keyframe when a value leaves the keyframe's
+// range or moves by more than an int8 step.
+//
+// Frame layout (little-endian):
+//   GridFrameHeader
+//   keyframe: float scale[channels], float offset[channels],
+//             codes[channels][depth*height*width]
+//   delta:    uint8 changed[ceil(blocks/8)] (bitmask over the planar codes),
+//             int8 delta[codes of the changed blocks]
+static const char kGridMagic[4] = {'H', 'D', 'R', 'G'};
+static const uint8_t kGridVersion = 1;
+static const int kGridDeltaBlock = 64;
+
+enum GridPrecision {
+  GRID_INT8 = 1,
+  GRID_INT16 = 2,
+};
+
+enum GridFrameFlags {
+  GRID_KEYFRAME = 1,
+};
+
+struct GridFrameHeader {
+  char magic[4];
+  uint8_t version;
+  uint8_t precision;
+  uint8_t flags;
+  uint8_t reserved;
+  uint32_t sequence;
+  uint32_t payload_size;
+  // Shape of the output_coefficients node.
+  uint16_t rows;
+  uint16_t depth;
+  uint16_t height;
+  uint16_t width;
+  uint16_t cols;
+  uint16_t reserved2;
+};
+
+static_assert(sizeof(GridFrameHeader) == 28, "GridFrameHeader layout changed");
+
+// Grid in the output_coefficients layout: (rows, depth, height, width, cols).
+typedef struct GridShape {
+  int rows = 3;
+  int depth = 0;
+  int height = 0;
+  int width = 0;
+  int cols = 4;
+
+  int channels() const { return rows*cols; }
+  int voxels() const { return depth*height*width; }
+  size_t size() const { return static_cast<size_t>(channels())*voxels(); }
+} GridShape;
+
+typedef struct GridCodecOptions {
+  GridPrecision precision = GRID_INT16;
+  bool delta = false;
+  // With delta, a keyframe is sent at least every this many frames.
+  int keyframe_interval = 30;
+} GridCodecOptions;
+
+// Decoded grid, kept quantized. Codes are planar, channel c = row*cols + col
+// holding depth*height*width codes in (depth, height, width) order, so that
+// kernels can read them directly: the trilinear interpolation of codes, times
+// scale(c) plus offset(c), is the interpolation of the values.
+class QuantizedGrid
+{
+public:
+  explicit QuantizedGrid(const GridShape &shape);
+
+  // Applies an encoded frame. Returns false if it is malformed, has another
+  // shape, or is a delta frame that doesn't follow a frame we decoded.
+  bool decode(const uint8_t *data, size_t size);
+
+  // Writes the values in the output_coefficients layout.
+  void dequantize(float *grid) const;
+
+  const GridShape &shape() const { return shape_; }
+  GridPrecision precision() const { return precision_; }
+  bool valid() const { return valid_; }
+  float scale(int channel) const { return scales_[channel]; }
+  float offset(int channel) const { return offsets_[channel]; }
+  // Valid for the matching precision().
+  const int8_t *codes8(int channel) const {
+    return codes8_.data() + static_cast<size_t>(channel)*shape_.voxels();
+  }
+  const int16_t *codes16(int channel) const {
+    return codes16_.data() + static_cast<size_t>(channel)*shape_.voxels();
+  }
+
+private:
+  friend class GridEncoder;
+
+  GridShape shape_;
+  GridPrecision precision_ = GRID_INT16;
+  bool valid_ = false;
+  uint32_t sequence_ = 0;
+  std::vector<float> scales_;
+  std::vector<float> offsets_;
+  std::vector<int8_t> codes8_;
+  std::vector<int16_t> codes16_;
+};
+
+class GridEncoder
+{
+public:
+  GridEncoder(const GridShape &shape, const GridCodecOptions &options);
+
+  // Encodes `grid` (output_coefficients layout) into `out`, replacing its
+  // contents. Returns whether a keyframe was written.
+  bool encode(const float *grid, std::vector<uint8_t> *out);
+
+  // Largest encoded frame, in bytes.
+  size_t max_frame_size() const;
+
+private:
+  void encode_keyframe(std::vector<uint8_t> *out);
+  bool encode_delta(std::vector<uint8_t> *out);
+
+  GridShape shape_;
+  GridCodecOptions options_;
+  uint32_t sequence_ = 0;
+  int since_keyframe_ = 0;
+
+  // The input, planar.
+  std::vector<float> planar_;
+  std::vector<int32_t> codes_;
+  // What the decoder holds after the last frame.
+  QuantizedGrid reference_;
+};
+
+#endif /* end of include guard: GRID_CODEC_H_T9BLQ3WE */
@@ -0,0 +1,60 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INCREMENTAL_RENDERER_H_W7RN2MXC
+#define INCREMENTAL_RENDERER_H_W7RN2MXC
+
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "cpu_renderer.h"
+
+// Re-renders only what a grid edit changes, for local adjustments on large
+// images. Each render() diffs the grid against the previous one, per (x, y)
+// grid column over all depths and coefficients, and re-slices into a
+// persistent output only the pixels that sample a changed column: with
+// trilinear interpolation, the pixels within the two cells around it on each
+// axis. The cost of an edit scales with the area it touches.
+class IncrementalRenderer
+{
+public:
+  explicit IncrementalRenderer(const CpuRenderer *renderer);
+
+  // Renders `input` with `coeffs`, laid out as for CpuRenderer::render(),
+  // into output(), re-slicing only the pixels whose grid cells changed since
+  // the previous call. The first call, one with a different input size, or
+  // the first after invalidate() renders every pixel. Returns the number of
+  // pixels rendered.
+  int64_t render(const cv::Mat &input, const float *coeffs);
+  // Forgets the previous grid, so that the next render() is complete. Call it
+  // when the pixels of the input change.
+  void invalidate() { grid_.clear(); }
+
+  const cv::Mat &output() const { return output_; }
+
+private:
+  const CpuRenderer *renderer_;
+  cv::Mat output_;
+  // The grid output_ was rendered with.
+  std::vector<float> grid_;
+  // The two cells each pixel column (row) samples: cells 2*x and 2*x + 1.
+  std::vector<int> x_cells_;
+  std::vector<int> y_cells_;
+  // Changed grid columns, gy*grid_width + gx.
+  std::vector<char> dirty_;
+};
+
+#endif /* end of include guard: INCREMENTAL_RENDERER_H_W7RN2MXC */
@@ -0,0 +1,88 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef INFERENCE_SERVER_H_J6TNB3WD
+#define INFERENCE_SERVER_H_J6TNB3WD
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "processor.h"
+#include "server_protocol.h"
+
+typedef struct ServerOptions {
+  std::string socket_path = "/tmp/hdrnet.sock";
+  // Largest number of requests whose coefficients are computed together.
+  int max_batch = 8;
+  // Longest time the oldest queued request waits for the batch to fill up.
+  int max_wait_us = 2000;
+  int slice_threads = 2;
+} ServerOptions;
+
+// Serves HDRNetCurves requests over a Unix socket (see server_protocol.h).
+//
+// Each connection has a thread that reads requests and downsamples them. The
+// low-res inputs of concurrent requests are queued for a single batching
+// thread, which runs the network on up to max_batch of them at once. The
+// grids are then handed to a pool of slicing threads, which render at full
+// resolution on the CPU.
+class InferenceServer
+{
+public:
+  InferenceServer(BatchProcessor *processor, const ServerOptions &options);
+  ~InferenceServer();
+
+  // Listens on options.socket_path and serves until interrupt() is called.
+  // Returns false if the socket could not be created.
+  bool run();
+
+  // Makes run() return once in-flight requests are answered. Async-signal
+  // safe.
+  void interrupt();
+
+private:
+  struct Request;
+
+  void serve_connection(int fd);
+  void batch_loop();
+  void slice_loop();
+
+  BatchProcessor *processor_;
+  ServerOptions options_;
+
+  std::atomic<bool> stopping_;
+  std::atomic<int> listen_fd_;
+
+  // Each queue's stopping flag is set under its mutex once nothing more can
+  // be pushed to it; its threads drain it and exit.
+  std::mutex batch_mutex_;
+  std::condition_variable batch_cv_;
+  std::deque<Request*> batch_queue_;
+  bool batch_stopping_ = false;
+
+  std::mutex slice_mutex_;
+  std::condition_variable slice_cv_;
+  std::deque<Request*> slice_queue_;
+  bool slice_stopping_ = false;
+
+  std::mutex connections_mutex_;
+  std::condition_variable connections_cv_;
+  std::vector<int> connection_fds_;
+};
+
+#endif /* end of include guard: INFERENCE_SERVER_H_J6TNB3WD */
@@ -0,0 +1,115 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MODEL_BUNDLE_H_K3VQ8ZRD
+#define MODEL_BUNDLE_H_K3VQ8ZRD
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A packed model bundle holds everything the processors need to start up in a
+// single file: the optimized graph, the guide parameters and the grid
+// metadata. It is written by hdrnet/bin/pack_model.py.
+//
+// Layout (little-endian):
+//   BundleHeader
+//   BundleSection[num_sections]
+//   section payloads, each aligned to kBundleAlignment bytes.
+//
+// Sections are named after the files they replace in the checkpoint
+// directory (e.g. "optimized_graph.pb", "guide_ccm_f32_3x4.bin").
+static const char kBundleMagic[4] = {'H', 'D', 'R', 'B'};
+static const uint32_t kBundleVersion = 1;
+static const uint64_t kBundleAlignment = 64;
+static const char kBundleFilename[] = "model.hdrb";
+
+struct BundleHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_sections;
+  // CRC-32 of the section table.
+  uint32_t table_crc32;
+  char model_name[32];
+
+  // Grid metadata, so we don't need a forward pass to discover it.
+  int32_t net_input_size;
+  int32_t grid_width;
+  int32_t grid_height;
+  int32_t grid_depth;
+  // Number of affine rows (3, or 9 for the multiscale model) and of
+  // coefficients per row (input channels + offset).
+  int32_t grid_rows;
+  int32_t grid_cols;
+
+  // Model hyperparameters.
+  int32_t luma_bins;
+  int32_t spatial_bin;
+  int32_t channel_multiplier;
+  int32_t guide_complexity;
+  int32_t batch_norm;
+  int32_t reserved[5];
+};
+
+struct BundleSection {
+  char name[48];
+  uint64_t offset;
+  uint64_t size;
+  uint32_t crc32;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(BundleHeader) == 112, "BundleHeader layout changed");
+static_assert(sizeof(BundleSection) == 72, "BundleSection layout changed");
+
+uint32_t crc32(const void *data, size_t length);
+
+class ModelBundle
+{
+public:
+  // Memory-maps the bundle at `path` and verifies its checksums.
+  explicit ModelBundle(const std::string &path);
+  ~ModelBundle();
+
+  // Returns true if a bundle file exists at `path`.
+  static bool exists(const std::string &path);
+
+  const BundleHeader &header() const { return *header_; }
+
+  // Returns the section called `name`, or nullptr if there is none.
+  const BundleSection *find(const std::string &name) const;
+
+  const void *data(const BundleSection &section) const {
+    return base_ + section.offset;
+  }
+
+  // Copies `length` floats from section `name` into `output`. Fails if the
+  // section is missing or too small.
+  void read_floats(const std::string &name, int length, float *output) const;
+
+private:
+  ModelBundle(const ModelBundle &) = delete;
+  ModelBundle &operator=(const ModelBundle &) = delete;
+
+  void unmap();
+
+  std::string path_;
+  const uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+
+  const BundleHeader *header_ = nullptr;
+  const BundleSection *sections_ = nullptr;
+};
+
+#endif /* end of include guard: MODEL_BUNDLE_H_K3VQ8ZRD */
@@ -24,12 +24,19 @@
 #include <iostream>
 #include <fstream>
 
+#include "coefficient_net.h"
+#include "cpu_renderer.h"
+#include "model_bundle.h"
 #include "renderer.h"
 #include "timer.h"
 
 namespace tf=tensorflow;
 
 typedef struct BenchmarkResult {
+  // Time to construct the processor (load the model, create the session and
+  // set up the renderer). Measured once, not included in total_time().
+  double startup = 0.0;
+
   double downsampling = 0.0;
   double convert_to_float = 0.0;
   double forward_pass = 0.0;
@@ -41,6 +48,23 @@ typedef struct BenchmarkResult {
   double rendering_gl_readback = 0.0;
   double rendering_direct = 0.0;
 
+  // Deadline scheduling (see deadline_scheduler.h), 0 when disabled. Like
+  // startup, these are set once and not averaged.
+  double deadline = 0.0;
+  double deadline_hit_rate = 0.0;
+  double degraded_rate = 0.0;
+
+  // Progressive rendering (see progressive_renderer.h), 0 when disabled: time
+  // from the start of the frame to the preview, and to the full-quality
+  // frame.
+  double time_to_preview = 0.0;
+  double time_to_full_quality = 0.0;
+
+  // Incremental re-rendering after local grid edits (see
+  // incremental_renderer.h), 0 when disabled. Set once, not averaged.
+  double local_edit_render = 0.0;
+  double local_edit_fraction = 0.0;
+
   double total_time() {
     return downsampling+convert_to_float+forward_pass
         +rendering_gl_coeff+rendering_gl_draw+rendering_gl_readback
@@ -57,6 +81,9 @@ typedef struct BenchmarkResult {
     result.rendering_gl_readback =
       rendering_gl_readback+other.rendering_gl_readback;
     result.rendering_direct = rendering_direct+other.rendering_direct;
+    result.time_to_preview = time_to_preview+other.time_to_preview;
+    result.time_to_full_quality =
+      time_to_full_quality+other.time_to_full_quality;
 
     return result;
   }
@@ -69,6 +96,8 @@ typedef struct BenchmarkResult {
     rendering_gl_draw = rendering_gl_draw/ratio;
     rendering_gl_readback = rendering_gl_readback/ratio;
     rendering_direct = rendering_direct/ratio;
+    time_to_preview = time_to_preview/ratio;
+    time_to_full_quality = time_to_full_quality/ratio;
   }
 
   void save (const std::string &filename) {
@@ -79,13 +108,31 @@ typedef struct BenchmarkResult {
       throw;
     }
     file << "{" << std::endl;
+    file << "\"startup\": " << startup << "," << std::endl;
     file << "\"downsampling\": " << downsampling << "," << std::endl;
     file << "\"convert_to_float\": " <<convert_to_float << "," <<  std::endl;
     file << "\"forward_pass\": " << forward_pass << "," <<  std::endl;
     file << "\"rendering_gl_coeff\": " << rendering_gl_coeff << "," << std::endl;
     file << "\"rendering_gl_draw\": " << rendering_gl_draw << "," << std::endl;
     file << "\"rendering_gl_readback\": " << rendering_gl_readback << "," << std::endl;
-    file << "\"rendering_direct\": " << rendering_direct << std::endl;
+    file << "\"rendering_direct\": " << rendering_direct;
+    if (deadline > 0.0) {
+      file << "," << std::endl;
+      file << "\"deadline\": " << deadline << "," << std::endl;
+      file << "\"deadline_hit_rate\": " << deadline_hit_rate << "," << std::endl;
+      file << "\"degraded_rate\": " << degraded_rate;
+    }
+    if (time_to_full_quality > 0.0) {
+      file << "," << std::endl;
+      file << "\"time_to_preview\": " << time_to_preview << "," << std::endl;
+      file << "\"time_to_full_quality\": " << time_to_full_quality;
+    }
+    if (local_edit_render > 0.0) {
+      file << "," << std::endl;
+      file << "\"local_edit_render\": " << local_edit_render << "," << std::endl;
+      file << "\"local_edit_fraction\": " << local_edit_fraction;
+    }
+    file << std::endl;
     file << "}" << std::endl;
     file.close();
   }
@@ -96,7 +143,10 @@ typedef struct BenchmarkResult {
 class Processor
 {
 public:
-  Processor(int image_width, int image_height, std::string checkpoint_path, bool use_gpu);
+  // When `use_tf` is false, no TensorFlow session is created and the
+  // subclass runs the network itself.
+  Processor(int image_width, int image_height, std::string checkpoint_path,
+      bool use_gpu, bool use_tf = true);
   virtual BenchmarkResult process(const cv::Mat &input, cv::Mat &output) = 0;
   virtual ~Processor ();
 
@@ -113,20 +163,46 @@ protected:
   const std::string output_name_ = "output_coefficients";
   const std::string input_name_ = "lowres_input";
 
-  tf::Session *session_;
+  tf::Session *session_ = nullptr;
   tf::GraphDef graph_def_;
+
+  // Packed model, if the checkpoint directory has one (see model_bundle.h).
+  ModelBundle *bundle_ = nullptr;
 };
 
 
 class HybridGLProcessor : public Processor
 {
 public:
+  // With `native`, the coefficients are computed by CoefficientNet instead of
+  // TensorFlow. This requires a model bundle.
   explicit HybridGLProcessor(
       int image_width, int image_height,
-      std::string checkpoint_path, bool use_gpu, std::string shader_root);
+      std::string checkpoint_path, bool use_gpu, std::string shader_root,
+      bool native = false);
   virtual BenchmarkResult process(const cv::Mat &input, cv::Mat &output) override;
   virtual ~HybridGLProcessor ();
 
+  // The steps of process(), for callers that reuse coefficients across frames
+  // (see video_processor.h).
+  void upload_input(const cv::Mat &input);
+  // Downsamples `input` into the network input buffer.
+  void prepare_input(const cv::Mat &input, BenchmarkResult *result);
+  // Runs the network on the prepared input. The returned grid is valid until
+  // the next call.
+  const float *forward(BenchmarkResult *result);
+  // Renders the uploaded input with `coeffs`, at 1/`scale` of the output
+  // resolution upsampled (see Renderer::render()).
+  void render(const float *coeffs, cv::Mat &output, BenchmarkResult *result,
+      int scale = 1);
+
+  // The network input, (net_input_size, net_input_size, 3) floats in [0, 1].
+  const float *lowres_input();
+  int net_input_size() const { return net_input_size_; }
+  // Number of floats in the grid returned by forward(). Only valid after the
+  // first call to forward().
+  int coefficients_size() const;
+
 protected:
   const int net_input_size_ = 256;
 
@@ -137,6 +213,7 @@ protected:
   int grid_height_;
   int grid_depth_;
 
+  CoefficientNet *native_net_ = nullptr;
   Renderer *renderer_;
 };
 
@@ -145,7 +222,8 @@ class StandardProcessor : public HybridGLProcessor
 public:
   explicit StandardProcessor(
       int image_width, int image_height,
-      std::string checkpoint_path, bool use_gpu, std::string shader_root);
+      std::string checkpoint_path, bool use_gpu, std::string shader_root,
+      bool native = false);
 };
 
 
@@ -154,7 +232,55 @@ class MultiscaleProcessor : public HybridGLProcessor
 public:
   explicit MultiscaleProcessor(
       int image_width, int image_height,
-      std::string checkpoint_path, bool use_gpu, std::string shader_root);
+      std::string checkpoint_path, bool use_gpu, std::string shader_root,
+      bool native = false);
+};
+
+
+// Computes the coefficients of several images in one network evaluation and
+// slices on the CPU (see cpu_renderer.h), for serving concurrent requests.
+// HDRNetCurves models only.
+//
+// Batching needs a graph frozen with `freeze_graph.py --batched`, which adds a
+// `batched_output_coefficients` node; other graphs, and the native network,
+// evaluate a batch one image at a time.
+class BatchProcessor : public Processor
+{
+public:
+  BatchProcessor(std::string checkpoint_path, bool use_gpu, int max_batch,
+      bool native = false);
+  virtual BenchmarkResult process(const cv::Mat &input, cv::Mat &output) override;
+  virtual ~BatchProcessor ();
+
+  // Downsamples `input` into `lowres`, (net_input_size, net_input_size, 3)
+  // floats in [0, 1]. Thread-safe.
+  void prepare_input(const cv::Mat &input, float *lowres) const;
+  // Runs the network on lowres.size() <= max_batch() inputs and writes
+  // coefficients_size() floats to each of `grids`. Not thread-safe.
+  void forward(const std::vector<const float*> &lowres,
+      const std::vector<float*> &grids);
+
+  const CpuRenderer &renderer() const { return *renderer_; }
+  int max_batch() const { return max_batch_; }
+  int net_input_size() const { return net_input_size_; }
+  int grid_width() const { return grid_width_; }
+  int grid_height() const { return grid_height_; }
+  int grid_depth() const { return grid_depth_; }
+  int coefficients_size() const { return 3*grid_depth_*grid_height_*grid_width_*4; }
+
+protected:
+  const int net_input_size_ = 256;
+  const std::string batched_output_name_ = "batched_output_coefficients";
+
+  int max_batch_;
+  bool batched_ = false;
+
+  int grid_width_;
+  int grid_height_;
+  int grid_depth_;
+
+  CoefficientNet *native_net_ = nullptr;
+  CpuRenderer *renderer_ = nullptr;
 };
 
 
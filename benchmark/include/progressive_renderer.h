@@ -0,0 +1,97 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROGRESSIVE_RENDERER_H_T3KQ8VZD
+#define PROGRESSIVE_RENDERER_H_T3KQ8VZD
+
+#include <atomic>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "cpu_renderer.h"
+#include "processor.h"
+#include "timer.h"
+
+// Renders a frame coarse to fine on the CPU, for interactive editing. The
+// first pass renders every preview_stride-th pixel of every preview_stride-th
+// row and fills the block around it, a preview at a reduced resolution. Each
+// following pass halves the stride and renders the pixels of the finer
+// lattice not rendered yet, so every pixel is rendered once, and the last
+// pass (stride 1) leaves the frame exactly as CpuRenderer::render() would.
+//
+// Passes check for cancellation between rows: when new parameters arrive,
+// cancel() from another thread stops the stale frame, and start() begins the
+// next one.
+class ProgressiveRenderer
+{
+public:
+  // `preview_stride` is rounded down to a power of two.
+  ProgressiveRenderer(const CpuRenderer *renderer, int preview_stride);
+
+  // Starts rendering `input` with `coeffs` (as for CpuRenderer::render())
+  // into `output`, (re)allocated to the size of `input`. All three must stay
+  // valid until the last pass. Clears a previous cancel().
+  void start(const cv::Mat &input, const float *coeffs, cv::Mat *output);
+  // Runs the next pass. Returns false if there was none left, or if it was
+  // cancelled, leaving the output of the earlier passes partly refined.
+  bool next_pass();
+  // Runs the remaining passes. Returns false if cancelled.
+  bool finish();
+  // Stops the pass in progress at its next row, and the following ones.
+  // Thread-safe.
+  void cancel() { cancelled_ = true; }
+
+  bool cancelled() const { return cancelled_; }
+  bool done() const { return pass_ == num_passes_; }
+  // Passes run so far, and in total.
+  int pass() const { return pass_; }
+  int num_passes() const { return num_passes_; }
+  // Stride of the lattice rendered by pass `pass`.
+  int stride(int pass) const { return preview_stride_ >> pass; }
+
+private:
+  const CpuRenderer *renderer_;
+  int preview_stride_;
+  int num_passes_;
+
+  const cv::Mat *input_ = nullptr;
+  const float *coeffs_ = nullptr;
+  cv::Mat *output_ = nullptr;
+  int pass_ = 0;
+  std::atomic<bool> cancelled_{false};
+};
+
+// Runs a BatchProcessor's network and then renders progressively (see
+// ProgressiveRenderer), reporting the time to the preview and to the
+// full-quality frame separately. HDRNetCurves models only.
+class ProgressiveProcessor
+{
+public:
+  ProgressiveProcessor(BatchProcessor *processor, int preview_stride);
+
+  BenchmarkResult process(const cv::Mat &input, cv::Mat &output);
+
+  ProgressiveRenderer &renderer() { return progressive_; }
+
+private:
+  BatchProcessor *processor_;
+  ProgressiveRenderer progressive_;
+  Timer timer_;
+  Timer frame_timer_;
+  std::vector<float> lowres_;
+  std::vector<float> grid_;
+};
+
+#endif /* end of include guard: PROGRESSIVE_RENDERER_H_T3KQ8VZD */
@@ -23,6 +23,8 @@
 #include <GL/glew.h>
 #include <GL/freeglut.h>
 
+#include "model_bundle.h"
+
 class Renderer
 {
 public:
@@ -30,14 +32,18 @@ public:
       int output_width, int output_height,
       int grid_width, int grid_height, int grid_depth,
       std::string vertex_shader, std::string fragment_shader,
-      std::string checkpoint_path);
+      std::string checkpoint_path, const ModelBundle *bundle);
   virtual void upload_input(const cv::Mat &input);
+  // With `scale` > 1, draws and reads back only 1/scale of the output in each
+  // dimension, and upsamples it (bilinearly, on the CPU) into `output`.
   virtual void render(const float* const coeffs_data, cv::Mat & output,
-      double *upload_coeff_time, double *draw_time, double *readback_time);
+      double *upload_coeff_time, double *draw_time, double *readback_time,
+      int scale = 1);
   virtual ~Renderer ();
 
 protected:
-  virtual void load_guide_parameters(std::string checkpoint_path) = 0;
+  virtual void load_guide_parameters(
+      std::string checkpoint_path, const ModelBundle *bundle) = 0;
   virtual void gl_extra_setup() = 0;
   virtual void upload_coefficients(const float* const coeffs_data) = 0;
 
@@ -56,6 +62,8 @@ protected:
 
   GLuint output_texture_;
   GLuint framebuffer_;
+  // Readback of reduced-scale renders.
+  cv::Mat reduced_output_;
 
   GLuint coeffs_textures_[3];
 
@@ -75,11 +83,12 @@ public:
       int output_width, int output_height,
       int grid_width, int grid_height, int grid_depth,
       std::string vertex_shader, std::string fragment_shader,
-      std::string checkpoint_path);
+      std::string checkpoint_path, const ModelBundle *bundle);
 
 
 protected:
-  virtual void load_guide_parameters(std::string checkpoint_path) override;
+  virtual void load_guide_parameters(
+      std::string checkpoint_path, const ModelBundle *bundle) override;
   virtual void gl_extra_setup() override;
   virtual void upload_coefficients(const float* const coeffs_data) override;
 
@@ -95,11 +104,12 @@ public:
       int output_width, int output_height,
       int grid_width, int grid_height, int grid_depth,
       std::string vertex_shader, std::string fragment_shader,
-      std::string checkpoint_path);
+      std::string checkpoint_path, const ModelBundle *bundle);
   virtual void upload_input(const cv::Mat &input) override;
 
 protected:
-  virtual void load_guide_parameters(std::string checkpoint_path) override;
+  virtual void load_guide_parameters(
+      std::string checkpoint_path, const ModelBundle *bundle) override;
   virtual void gl_extra_setup() override;
   virtual void upload_coefficients(const float* const coeffs_data) override;
 
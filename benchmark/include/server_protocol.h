@@ -0,0 +1,78 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SERVER_PROTOCOL_H_M2HV7CJX
+#define SERVER_PROTOCOL_H_M2HV7CJX
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Wire format of the inference server (see inference_server.h), over a Unix
+// stream socket, in host byte order. A client sends any number of
+//
+//   RequestHeader, then width*height*3 bytes of RGB
+//
+// and gets one response per request, in order:
+//
+//   ResponseHeader, then width*height*3 bytes of RGB if status is 0.
+static const uint32_t kRequestMagic = 0x51524448;  // "HDRQ"
+static const uint32_t kResponseMagic = 0x53524448;  // "HDRS"
+static const uint32_t kMaxImageSize = 8192;
+
+enum ResponseStatus {
+  RESPONSE_OK = 0,
+  RESPONSE_BAD_REQUEST = 1,
+  RESPONSE_SHUTTING_DOWN = 2,
+};
+
+struct RequestHeader {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t reserved;
+};
+
+struct ResponseHeader {
+  uint32_t magic;
+  int32_t status;
+  uint32_t width;
+  uint32_t height;
+  // Number of requests whose coefficients were computed together.
+  uint32_t batch_size;
+  uint32_t reserved;
+
+  // Server-side latency breakdown in ms, from the time the request was read.
+  float prepare;     // Downsampling.
+  float batch_wait;  // Waiting for the batch to form and the network.
+  float forward;     // Network, for the whole batch.
+  float slice_wait;  // Waiting for a slicing thread.
+  float slice;       // Guide and slicing at full resolution.
+  float total;
+};
+
+static_assert(sizeof(RequestHeader) == 16, "RequestHeader layout changed");
+static_assert(sizeof(ResponseHeader) == 48, "ResponseHeader layout changed");
+
+// Blocking helpers. They return false on EOF or error.
+bool read_fully(int fd, void *data, size_t size);
+bool write_fully(int fd, const void *data, size_t size);
+
+// Returns a listening socket bound to `path` (replacing any stale socket
+// file), or -1.
+int listen_unix(const std::string &path);
+// Returns a socket connected to `path`, or -1.
+int connect_unix(const std::string &path);
+
+#endif /* end of include guard: SERVER_PROTOCOL_H_M2HV7CJX */
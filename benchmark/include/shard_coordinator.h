@@ -0,0 +1,122 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHARD_COORDINATOR_H_Q3MW8XNP
+#define SHARD_COORDINATOR_H_Q3MW8XNP
+
+#include <cstdio>
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "shard_protocol.h"
+
+typedef struct CoordinatorOptions {
+  std::string socket_path = "/tmp/hdrnet_archive.sock";
+  // Initial shards: the file list is cut into this many contiguous ranges,
+  // one per worker, so that a worker reads neighbouring files.
+  int shards = 1;
+  // Items handed out per request. Small chunks keep more work stealable.
+  int chunk = 4;
+  // Progress journal, one "<status>\t<path>" line per finished item. Items
+  // finished in an existing journal are skipped. Empty for none.
+  std::string checkpoint_path;
+  // The journal is fsync'ed every this many items.
+  int sync_interval = 64;
+  // An item in flight on this many workers that disconnected (e.g. crashed on
+  // it) is given up on, as failed.
+  int max_attempts = 3;
+  // Stop with items left once no worker was connected for this long, in ms;
+  // 0 waits forever.
+  int idle_timeout_ms = 0;
+} CoordinatorOptions;
+
+typedef struct WorkerStats {
+  std::string name;
+  int shard = -1;
+  int items = 0;
+  int failures = 0;
+  // Items taken from other shards' queues.
+  int stolen = 0;
+  // Connected time, and time spent on items, in ms.
+  double connected = 0.0;
+  double busy = 0.0;
+
+  double utilization() const { return connected > 0 ? busy/connected : 0.0; }
+} WorkerStats;
+
+// Hands out a file list to worker processes (see shard_protocol.h), which may
+// connect and leave at any time.
+//
+// Each shard has a queue of items. A worker adopts an unowned shard when it
+// connects and is served from the front of its queue; once that runs dry, it
+// steals the back half of the longest remaining queue. Items assigned to a
+// worker that disconnects go back to the front of its shard's queue, and the
+// shard can be adopted or stolen from by the others.
+class ShardCoordinator
+{
+public:
+  ShardCoordinator(const std::vector<std::string> &paths,
+      const CoordinatorOptions &options);
+  ~ShardCoordinator();
+
+  // Serves workers until every item is finished, or until idle_timeout_ms
+  // without workers. Returns false if the socket or the journal could not be
+  // opened.
+  bool run();
+
+  // Items skipped because the journal already had them.
+  int resumed() const { return resumed_; }
+  int finished() const { return finished_; }
+  int failed() const { return failed_; }
+  // Items neither finished nor failed when run() returned.
+  int unfinished() const { return pending_ - finished_; }
+  // Wall time of run(), in ms.
+  double wall_time() const { return wall_time_; }
+  // One entry per worker connection, in order of arrival.
+  const std::vector<WorkerStats> &workers() const { return stats_; }
+
+private:
+  struct Connection;
+
+  void load_checkpoint();
+  void journal(uint32_t index, bool ok);
+  bool handle(Connection *connection);
+  void assign(Connection *connection, uint32_t count);
+  int adopt_shard();
+  void disconnect(Connection *connection);
+  bool done() const;
+
+  std::vector<std::string> paths_;
+  CoordinatorOptions options_;
+
+  std::vector<std::deque<uint32_t>> queues_;
+  std::vector<bool> shard_owned_;
+  std::vector<Connection*> connections_;
+  std::vector<WorkerStats> stats_;
+
+  std::set<std::string> finished_paths_;
+  std::vector<int> attempts_;
+  FILE *journal_ = nullptr;
+  int unsynced_ = 0;
+
+  int resumed_ = 0;
+  int finished_ = 0;
+  int failed_ = 0;
+  int pending_ = 0;
+  double wall_time_ = 0.0;
+};
+
+#endif /* end of include guard: SHARD_COORDINATOR_H_Q3MW8XNP */
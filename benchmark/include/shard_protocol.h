@@ -0,0 +1,91 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHARD_PROTOCOL_H_F6ZK2RYA
+#define SHARD_PROTOCOL_H_F6ZK2RYA
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Messages between the archive coordinator and its workers (see
+// shard_coordinator.h), over a stream socket, in little-endian byte order.
+// Only file paths and results cross the socket, never pixels, so the same
+// protocol works between hosts sharing a file system. A worker sends
+//
+//   HELLO with its name, then REQUEST for up to `count` items,
+//
+// and gets ASSIGN with `count` items (none once the archive is done, after
+// which it disconnects). It sends DONE with the results of its items before
+// requesting more.
+static const uint32_t kShardMagic = 0x44485348;  // "HSHD"
+static const uint32_t kMaxShardPayload = 1 << 24;
+
+enum ShardMessageType {
+  SHARD_HELLO = 1,
+  SHARD_REQUEST = 2,
+  SHARD_ASSIGN = 3,
+  SHARD_DONE = 4,
+};
+
+struct ShardMessage {
+  uint32_t magic;
+  uint32_t type;
+  // Items in the payload (ASSIGN, DONE), or items wanted (REQUEST).
+  uint32_t count;
+  uint32_t payload_size;
+};
+
+static_assert(sizeof(ShardMessage) == 16, "ShardMessage layout changed");
+
+typedef struct ShardItem {
+  // Index in the coordinator's file list.
+  uint32_t index = 0;
+  std::string path;
+} ShardItem;
+
+enum ShardStatus {
+  SHARD_OK = 0,
+  SHARD_LOAD_FAILED = 1,
+  SHARD_SAVE_FAILED = 2,
+};
+
+struct ShardResult {
+  uint32_t index;
+  int32_t status;
+  // Worker-side time, in ms.
+  float load;
+  float process;
+  float save;
+};
+
+static_assert(sizeof(ShardResult) == 20, "ShardResult layout changed");
+
+// Blocking; they return false on EOF, error, or a malformed message.
+bool send_shard_message(int fd, ShardMessageType type, uint32_t count,
+    const std::string &payload = std::string());
+bool receive_shard_message(int fd, ShardMessage *message, std::string *payload);
+
+// ASSIGN payloads: for each item, uint32 index, uint32 path length, path.
+std::string encode_items(const std::vector<ShardItem> &items);
+bool decode_items(const std::string &payload, uint32_t count,
+    std::vector<ShardItem> *items);
+
+// DONE payloads: `count` ShardResults.
+std::string encode_results(const std::vector<ShardResult> &results);
+bool decode_results(const std::string &payload, uint32_t count,
+    std::vector<ShardResult> *results);
+
+#endif /* end of include guard: SHARD_PROTOCOL_H_F6ZK2RYA */
@@ -0,0 +1,155 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHM_RING_H_X4DPN8QC
+#define SHM_RING_H_X4DPN8QC
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Single-producer, single-consumer ring of frames and their coefficient grids
+// in POSIX shared memory, to run the network and the renderer in separate
+// processes on one host.
+//
+// The producer writes the input frame and the grid directly into a slot and
+// publishes it; the consumer renders straight from the slot and releases it.
+// Nothing is copied through the ring. When all slots are in use, acquire()
+// blocks until the consumer releases one (backpressure).
+//
+// Layout: RingHeader, then slot_count slots of slot_size bytes, each a
+// SlotHeader followed by the RGB frame and the grid, 64-byte aligned. The grid
+// is either raw floats or, when grid_bytes is set, a frame encoded with
+// GridEncoder (see grid_codec.h) of up to grid_bytes bytes.
+static const uint32_t kRingMagic = 0x474e4952;  // "RING"
+static const uint32_t kRingVersion = 2;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+    "the ring needs lock-free 64-bit atomics to be shared between processes");
+
+// Fixed at creation by the producer.
+typedef struct RingLayout {
+  uint32_t slot_count = 4;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // Grid, as the output_coefficients node: (3, depth, height, width, 4).
+  uint32_t grid_width = 0;
+  uint32_t grid_height = 0;
+  uint32_t grid_depth = 0;
+  // Capacity for an encoded grid, 0 for raw floats.
+  uint32_t grid_bytes = 0;
+
+  size_t frame_bytes() const { return static_cast<size_t>(width)*height*3; }
+  size_t grid_floats() const {
+    return static_cast<size_t>(3)*grid_depth*grid_height*grid_width*4;
+  }
+  size_t grid_capacity() const {
+    return grid_bytes ? grid_bytes : grid_floats()*sizeof(float);
+  }
+} RingLayout;
+
+struct RingHeader {
+  // Written last by the producer, once the ring is initialized.
+  std::atomic<uint32_t> magic;
+  uint32_t version;
+  RingLayout layout;
+  uint64_t slot_size;
+
+  // Slot counters, each on its own cache line. head is only written by the
+  // producer and tail by the consumer; slot i lives at i % slot_count.
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint32_t> closed;
+  // Total time the producer spent waiting for a free slot, in microseconds.
+  std::atomic<uint64_t> producer_blocked_us;
+};
+
+// Timestamps are steady_clock (CLOCK_MONOTONIC) times in ms, which are
+// comparable across processes.
+struct alignas(64) SlotHeader {
+  uint64_t sequence;
+  // When the producer started on the frame, and when it was published.
+  double acquired;
+  double published;
+  // Producer-side network time.
+  double forward;
+  // Size of the encoded grid, when the layout has grid_bytes.
+  uint64_t grid_size;
+};
+
+typedef struct RingSlot {
+  SlotHeader *header = nullptr;
+  unsigned char *frame = nullptr;
+  // Raw floats, or the encoded frame (as bytes) with grid_bytes.
+  float *grid = nullptr;
+} RingSlot;
+
+class ShmRing
+{
+public:
+  // Creates the ring `name` (e.g. "/hdrnet_ring"), replacing a stale one.
+  // This is the producer side.
+  ShmRing(const std::string &name, const RingLayout &layout);
+  // Opens an existing ring, waiting up to `timeout_ms` for the producer to
+  // create it. This is the consumer side.
+  ShmRing(const std::string &name, int timeout_ms);
+  ~ShmRing();
+
+  const RingLayout &layout() const { return header_->layout; }
+
+  // Producer: returns the next free slot, blocking while the ring is full.
+  RingSlot acquire();
+  // Producer: makes the acquired slot visible to the consumer.
+  void publish();
+  // Producer: no more slots will be published.
+  void close();
+  // Producer: waits until the consumer released every published slot.
+  void drain();
+
+  // Consumer: waits for the next published slot. Returns false once the
+  // producer closed the ring and every slot was consumed.
+  bool next(RingSlot *slot);
+  // Consumer: hands the slot returned by next() back to the producer.
+  void release();
+
+  // Time this side spent waiting on the other, in ms.
+  double waited() const { return waited_; }
+  double producer_blocked() const {
+    return header_->producer_blocked_us.load()/1000.0;
+  }
+
+  static double now();
+
+private:
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+
+  RingSlot slot(uint64_t index);
+  void map(int fd, size_t size);
+
+  std::string name_;
+  bool owner_;
+  uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+  RingHeader *header_ = nullptr;
+
+  // Cached copies of the other side's counter, to touch its cache line only
+  // when the ring looks full (producer) or empty (consumer).
+  uint64_t position_ = 0;
+  uint64_t cached_other_ = 0;
+  double waited_ = 0.0;
+};
+
+#endif /* end of include guard: SHM_RING_H_X4DPN8QC */
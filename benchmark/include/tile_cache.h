@@ -0,0 +1,176 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TILE_CACHE_H_Q4XK8VNE
+#define TILE_CACHE_H_Q4XK8VNE
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "cpu_renderer.h"
+
+// A tile of a rendered image at a zoom level. Level 0 is full resolution and
+// each level above halves it; tile (x, y) covers pixels
+// [x*tile_size, (x + 1)*tile_size) x [y*tile_size, (y + 1)*tile_size) of its
+// level, cut at the right and bottom edges.
+//
+// A level above 0 is the downsampled input sliced with the full-resolution
+// grid, not a downsampled full-resolution render. The guide is computed on
+// averaged pixels, so around edges the result differs from the downsampled
+// render, and halos shift slightly between levels. The tiles of one level
+// agree with each other, since each is its rectangle of a render of the whole
+// level.
+typedef struct TileKey {
+  // The image and grid, as returned by TileCache::add_image().
+  uint64_t image;
+  int zoom;
+  int x;
+  int y;
+
+  bool operator==(const TileKey &other) const {
+    return image == other.image && zoom == other.zoom && x == other.x &&
+      y == other.y;
+  }
+} TileKey;
+
+struct TileKeyHash {
+  size_t operator()(const TileKey &key) const;
+};
+
+typedef struct TileCacheOptions {
+  int tile_size = 256;
+  // Bytes of rendered tiles kept. The least recently requested tiles are
+  // evicted beyond it.
+  size_t byte_budget = 256 << 20;
+  // Threads rendering the neighbours of requested tiles ahead of time, 0
+  // disables prefetching.
+  int prefetch_threads = 2;
+  // Pending prefetches kept; the oldest are dropped, as the viewer has moved
+  // on since.
+  int max_pending_prefetches = 64;
+} TileCacheOptions;
+
+typedef struct TileCacheStats {
+  // Requests answered from the cache, ones that waited for a tile already
+  // being rendered (by a prefetch or another request), and ones that
+  // rendered their tile.
+  int64_t hits = 0;
+  int64_t joins = 0;
+  int64_t misses = 0;
+  // Tiles rendered by prefetching, and how many of them were requested
+  // before being evicted.
+  int64_t prefetched = 0;
+  int64_t prefetch_hits = 0;
+  int64_t evictions = 0;
+  size_t tiles = 0;
+  size_t bytes = 0;
+
+  int64_t requests() const { return hits + joins + misses; }
+  double hit_rate() const {
+    return requests() > 0 ? static_cast<double>(hits)/requests() : 0.0;
+  }
+} TileCacheStats;
+
+// Serves tiles of rendered images to a zoom-and-pan viewer, slicing on the
+// CPU only the tiles it has not rendered yet. Rendered tiles are kept up to a
+// byte budget and evicted least recently requested first. Each request also
+// queues the tiles around it (the 8 neighbours at its level, its parent and
+// its 4 children) for a pool of prefetching threads, newest first. Tiles are
+// keyed by a hash of the image and its grid, so an image re-rendered with
+// another grid never gets stale tiles. Thread-safe.
+class TileCache
+{
+public:
+  TileCache(const CpuRenderer *renderer, const TileCacheOptions &options);
+  ~TileCache();
+
+  // Registers the RGB `input`, rendered with `coeffs` (laid out as for
+  // CpuRenderer::render()), and returns its key. The levels of `input` are
+  // downsampled here, once. Adding the same image and grid again returns the
+  // same key.
+  uint64_t add_image(const cv::Mat &input, const float *coeffs);
+  // Forgets an image and drops its tiles.
+  void remove_image(uint64_t image);
+
+  // Number of levels of an image, up to the first that fits in one tile, and
+  // the number of tiles across and down a level. 0 for unknown images.
+  int num_levels(uint64_t image) const;
+  int tiles_x(uint64_t image, int zoom) const;
+  int tiles_y(uint64_t image, int zoom) const;
+
+  // Returns tile `key`, rendering it if it is not cached, or null if the
+  // image is unknown or the tile out of range. `hit`, if not null, is set to
+  // whether it was cached.
+  std::shared_ptr<const cv::Mat> tile(const TileKey &key, bool *hit = nullptr);
+
+  TileCacheStats stats() const;
+
+private:
+  struct Image {
+    std::vector<cv::Mat> levels;
+    std::vector<float> coeffs;
+  };
+  struct Entry {
+    TileKey key;
+    std::shared_ptr<const cv::Mat> tile;
+    size_t bytes;
+    // Prefetched and not requested yet.
+    bool prefetched;
+  };
+
+  // Whether `key` is a tile of `image`.
+  bool in_range(const Image &image, const TileKey &key) const;
+  std::shared_ptr<const cv::Mat> render(const Image &image,
+      const TileKey &key) const;
+  // Caches `tile`, evicting down to the budget. Requires mutex_.
+  void insert(const TileKey &key, std::shared_ptr<const cv::Mat> tile,
+      bool prefetched);
+  // Queues the tiles around `key` for prefetching. Requires mutex_.
+  void queue_neighbours(const Image &image, const TileKey &key);
+  void prefetch_loop();
+
+  const CpuRenderer *renderer_;
+  TileCacheOptions options_;
+
+  mutable std::mutex mutex_;
+  std::map<uint64_t, std::shared_ptr<const Image>> images_;
+  // Most recently requested first.
+  std::list<Entry> lru_;
+  std::unordered_map<TileKey, std::list<Entry>::iterator, TileKeyHash> index_;
+  size_t bytes_ = 0;
+  // Tiles being rendered; rendered_cv_ is notified as each one is done.
+  std::unordered_set<TileKey, TileKeyHash> rendering_;
+  std::condition_variable rendered_cv_;
+  // Newest first.
+  std::deque<TileKey> prefetch_queue_;
+  std::condition_variable prefetch_cv_;
+  bool stopping_ = false;
+  TileCacheStats stats_;
+
+  std::vector<std::thread> prefetchers_;
+};
+
+#endif /* end of include guard: TILE_CACHE_H_Q4XK8VNE */
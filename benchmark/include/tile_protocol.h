@@ -0,0 +1,64 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TILE_PROTOCOL_H_D3MZ7RUA
+#define TILE_PROTOCOL_H_D3MZ7RUA
+
+#include <cstdint>
+
+#include "server_protocol.h"
+
+// Wire format of the tile server (bin/tiles --role=server), over a Unix stream
+// socket, in host byte order, with the helpers of server_protocol.h. A client
+// sends any number of
+//
+//   TileRequest
+//
+// and gets one response per request, in order:
+//
+//   TileResponse, then width*height*3 bytes of RGB if status is 0.
+//
+// Every response describes the image, so a client can start with tile
+// (0, 0, 0), which always exists. Out of range tiles get
+// RESPONSE_BAD_REQUEST, and the connection stays usable.
+static const uint32_t kTileRequestMagic = 0x51544448;  // "HDTQ"
+static const uint32_t kTileResponseMagic = 0x53544448;  // "HDTS"
+
+struct TileRequest {
+  uint32_t magic;
+  int32_t zoom;
+  int32_t x;
+  int32_t y;
+};
+
+struct TileResponse {
+  uint32_t magic;
+  int32_t status;
+  uint32_t width;
+  uint32_t height;
+  // Whether the tile was served from the cache.
+  uint32_t hit;
+  uint32_t tile_size;
+  // Size of level 0, and number of levels.
+  uint32_t image_width;
+  uint32_t image_height;
+  uint32_t levels;
+  // Server-side time in ms, from the time the request was read.
+  float latency;
+};
+
+static_assert(sizeof(TileRequest) == 16, "TileRequest layout changed");
+static_assert(sizeof(TileResponse) == 40, "TileResponse layout changed");
+
+#endif /* end of include guard: TILE_PROTOCOL_H_D3MZ7RUA */
@@ -24,10 +24,17 @@
 #include <iostream>
 #include <fstream>
 
+#include "model_bundle.h"
+
 cv::Mat load_image(std::string input_path);
 
 void shader_from_file(const std::string filename, GLuint& shader);
 
 void load_binary_data(std::string filename, int length, float* output);
 
+// Reads the model file `name` from `bundle` when one is loaded, and from the
+// checkpoint directory otherwise.
+void load_model_data(const ModelBundle *bundle, std::string checkpoint_path,
+    std::string name, int length, float* output);
+
 #endif /* end of include guard: UTILS_H_JWUMPG6C */
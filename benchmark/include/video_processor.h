@@ -0,0 +1,99 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VIDEO_PROCESSOR_H_K3RZ8VNB
+#define VIDEO_PROCESSOR_H_K3RZ8VNB
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "processor.h"
+#include "timer.h"
+
+typedef struct VideoOptions {
+  // Skip the forward pass when the mean absolute difference between the
+  // low-res input and the one of the last evaluated frame is below this
+  // (values in [0, 1]), and reuse its grid. 0 evaluates every keyframe.
+  double change_threshold = 0.0;
+
+  // Only run the network on every Nth frame and linearly interpolate the grids
+  // of the frames in between. Output is delayed by up to N-1 frames.
+  int keyframe_interval = 1;
+} VideoOptions;
+
+typedef struct VideoStats {
+  int frames = 0;
+  int evaluations = 0;
+  // Summed over all frames.
+  BenchmarkResult timing;
+  double change_detection = 0.0;
+  double interpolation = 0.0;
+  // Wall-clock time for the whole stream, including decoding, in ms.
+  double wall_time = 0.0;
+
+  double fraction_saved() const {
+    return frames > 0 ? 1.0 - static_cast<double>(evaluations)/frames : 0.0;
+  }
+
+  double fps() const {
+    return wall_time > 0.0 ? 1000.0*frames/wall_time : 0.0;
+  }
+
+  void save(const std::string &filename);
+} VideoStats;
+
+// Streams frames through a HybridGLProcessor, reusing or interpolating the
+// coefficient grid across frames instead of running the network on each one.
+class VideoProcessor
+{
+public:
+  VideoProcessor(HybridGLProcessor *processor, const VideoOptions &options);
+
+  // Processes the next frame (RGB, the size the processor was created for).
+  // Rendered frames are appended to `outputs` in order; with
+  // keyframe_interval > 1 they may belong to earlier calls.
+  void process(const cv::Mat &frame, std::vector<cv::Mat> *outputs);
+
+  // Renders the frames still waiting for a keyframe.
+  void flush(std::vector<cv::Mat> *outputs);
+
+  VideoStats &stats() { return stats_; }
+
+private:
+  // Computes (or reuses) the grid of `frame` into next_grid_.
+  void keyframe(const cv::Mat &frame, BenchmarkResult *result);
+  // Renders `frame` with `grid`.
+  void render(const cv::Mat &frame, const float *grid,
+      BenchmarkResult *result, std::vector<cv::Mat> *outputs);
+
+  HybridGLProcessor *processor_;
+  VideoOptions options_;
+  VideoStats stats_;
+  Timer timer_;
+
+  // Low-res input of the last evaluated frame.
+  std::vector<float> last_lowres_;
+  // Grids of the previous and the latest keyframe.
+  std::vector<float> grid_;
+  std::vector<float> next_grid_;
+  std::vector<float> blended_grid_;
+
+  // Frames since the last keyframe.
+  std::deque<cv::Mat> pending_;
+};
+
+#endif /* end of include guard: VIDEO_PROCESSOR_H_K3RZ8VNB */
@@ -0,0 +1,313 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Renders a photo archive with HDRNetCurves in several worker processes. The
+// coordinator shards the file list and rebalances it by work stealing (see
+// shard_coordinator.h); progress is journaled so that an interrupted run
+// resumes where it stopped. With --workers=N it starts N local workers;
+// more can join with --role=worker, e.g.
+//
+//   bin/archive --checkpoint_path=<dir> --input_path=<dir or list.txt>
+//     --output_directory=<dir> --workers=4
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <gflags/gflags.h>
+
+#include "processor.h"
+#include "server_protocol.h"
+#include "shard_coordinator.h"
+#include "shard_protocol.h"
+#include "timer.h"
+#include "utils.h"
+
+DEFINE_string(role, "coordinator", "coordinator or worker.");
+DEFINE_string(checkpoint_path, "", "Path to the network checkpoint (HDRNetCurves).");
+DEFINE_string(input_path, "", "coordinator: directory of images, a .txt list of paths, or one image.");
+DEFINE_string(output_directory, "", "Destination of the rendered images, the journal and the report.");
+DEFINE_string(socket_path, "/tmp/hdrnet_archive.sock", "Unix socket of the coordinator.");
+DEFINE_int32(workers, 1, "coordinator: local worker processes to start (0 to only serve --role=worker processes).");
+DEFINE_int32(shards, 0, "coordinator: initial shards of the file list (default: --workers).");
+DEFINE_int32(chunk, 4, "Items per work request.");
+DEFINE_bool(resume, true, "coordinator: skip the items finished in the journal (<output_directory>/progress.tsv).");
+DEFINE_int32(idle_timeout_ms, 60000, "coordinator: stop once no worker was connected for this long (0 waits forever).");
+DEFINE_int32(connect_timeout_ms, 10000, "worker: how long to wait for the coordinator.");
+DEFINE_bool(use_gpu, false, "worker: run the network on gpu.");
+DEFINE_bool(native, false, "worker: compute the coefficients with the built-in C++ network (requires model.hdrb).");
+
+namespace {
+
+bool has_image_extension(const std::string &path) {
+  const size_t dot = path.find_last_of('.');
+  if (dot == std::string::npos) {
+    return false;
+  }
+  std::string extension = path.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extension == "png" || extension == "jpg" || extension == "jpeg" ||
+    extension == "tif" || extension == "tiff";
+}
+
+// Same inputs as hdrnet/bin/run.py, except that list entries are relative to
+// the list's directory.
+std::vector<std::string> input_list(const std::string &path) {
+  std::vector<std::string> paths;
+  DIR *dir = opendir(path.c_str());
+  if (dir) {
+    while (dirent *entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (has_image_extension(name)) {
+        paths.push_back(path + "/" + name);
+      }
+    }
+    closedir(dir);
+    std::sort(paths.begin(), paths.end());
+  } else if (path.size() > 4 && path.substr(path.size() - 4) == ".txt") {
+    const size_t slash = path.find_last_of('/');
+    const std::string root = slash == std::string::npos ? "" :
+      path.substr(0, slash + 1);
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      paths.push_back(line[0] == '/' ? line : root + line);
+    }
+  } else if (has_image_extension(path)) {
+    paths.push_back(path);
+  }
+  return paths;
+}
+
+std::string output_path(const std::string &path) {
+  const size_t slash = path.find_last_of('/');
+  return FLAGS_output_directory + "/" +
+    (slash == std::string::npos ? path : path.substr(slash + 1));
+}
+
+int run_worker(const std::string &checkpoint_path) {
+  // Load the model first, so that connected time is time available for work.
+  BatchProcessor net(checkpoint_path, FLAGS_use_gpu, 1, FLAGS_native);
+
+  int fd = -1;
+  Timer timer;
+  timer.start();
+  while ((fd = connect_unix(FLAGS_socket_path)) < 0) {
+    if (timer.duration() > FLAGS_connect_timeout_ms) {
+      std::cout << "Failed to connect to " << FLAGS_socket_path << std::endl;
+      return 1;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  char host[256] = {0};
+  gethostname(host, sizeof(host) - 1);
+  const std::string name = std::string(host) + ":" + std::to_string(getpid());
+  if (!send_shard_message(fd, SHARD_HELLO, 0, name)) {
+    close(fd);
+    return 1;
+  }
+
+  std::vector<float> lowres(net.net_input_size()*net.net_input_size()*3);
+  std::vector<float> grid(3*net.grid_depth()*net.grid_height()*net.grid_width()*4);
+  std::vector<ShardItem> items;
+  std::vector<ShardResult> results;
+  cv::Mat output, output_bgr;
+  int processed = 0;
+  while (true) {
+    ShardMessage message;
+    std::string payload;
+    // EOF instead of an empty assignment also means we are done.
+    if (!send_shard_message(fd, SHARD_REQUEST, FLAGS_chunk) ||
+        !receive_shard_message(fd, &message, &payload) ||
+        message.type != SHARD_ASSIGN ||
+        !decode_items(payload, message.count, &items) || items.empty()) {
+      break;
+    }
+
+    results.clear();
+    for (const ShardItem &item : items) {
+      ShardResult result = ShardResult();
+      result.index = item.index;
+      timer.start();
+      cv::Mat image = load_image(item.path);
+      result.load = timer.duration();
+      if (!image.data) {
+        result.status = SHARD_LOAD_FAILED;
+        results.push_back(result);
+        continue;
+      }
+
+      timer.start();
+      net.prepare_input(image, lowres.data());
+      net.forward({lowres.data()}, {grid.data()});
+      net.renderer().render(image, grid.data(), output);
+      result.process = timer.duration();
+
+      timer.start();
+      cv::cvtColor(output, output_bgr, CV_RGB2BGR, 3);
+      if (!cv::imwrite(output_path(item.path), output_bgr)) {
+        result.status = SHARD_SAVE_FAILED;
+      }
+      result.save = timer.duration();
+      results.push_back(result);
+      ++processed;
+    }
+    if (!send_shard_message(fd, SHARD_DONE, results.size(),
+          encode_results(results))) {
+      break;
+    }
+  }
+  close(fd);
+  std::cout << "Worker " << name << ": " << processed << " images." << std::endl;
+  return 0;
+}
+
+int run_coordinator(const std::string &checkpoint_path) {
+  const std::vector<std::string> paths = input_list(FLAGS_input_path);
+  if (paths.empty()) {
+    std::cout << "No images in " << FLAGS_input_path << std::endl;
+    return 1;
+  }
+
+  CoordinatorOptions options;
+  options.socket_path = FLAGS_socket_path;
+  options.shards = FLAGS_shards > 0 ? FLAGS_shards : std::max(1, FLAGS_workers);
+  options.chunk = FLAGS_chunk;
+  options.checkpoint_path = FLAGS_output_directory + "/progress.tsv";
+  options.idle_timeout_ms = FLAGS_idle_timeout_ms;
+  if (!FLAGS_resume) {
+    remove(options.checkpoint_path.c_str());
+  }
+  ShardCoordinator coordinator(paths, options);
+
+  // Workers only load the model, then wait for the socket.
+  std::cout.flush();
+  std::vector<pid_t> children;
+  for (int i = 0; i < FLAGS_workers; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(run_worker(checkpoint_path));
+    } else if (pid > 0) {
+      children.push_back(pid);
+    } else {
+      std::cout << "Failed to start worker " << i << std::endl;
+    }
+  }
+
+  std::cout << "Rendering " << paths.size() << " images in "
+    << options.shards << " shards." << std::endl;
+  const bool ok = coordinator.run();
+  for (pid_t pid : children) {
+    waitpid(pid, nullptr, 0);
+  }
+  if (!ok) {
+    return 1;
+  }
+
+  const int finished = coordinator.finished();
+  const double wall_time = coordinator.wall_time();
+  const double throughput = wall_time > 0 ? 1000.0*finished/wall_time : 0.0;
+  std::cout << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Archive (" << paths.size() << " images, "
+    << coordinator.resumed() << " done in a previous run)" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Rendered: " << finished - coordinator.failed() << ", failed: "
+    << coordinator.failed() << ", left: " << coordinator.unfinished()
+    << std::endl;
+  std::cout << "Throughput: " << throughput << " images/s" << std::endl;
+  for (const WorkerStats &worker : coordinator.workers()) {
+    std::cout << "  " << worker.name << " (shard " << worker.shard << "): "
+      << worker.items << " images, " << worker.stolen << " stolen, "
+      << 100.0*worker.utilization() << "% busy" << std::endl;
+  }
+  std::cout << "------------------------------" << std::endl;
+  std::cout << std::endl;
+
+  const std::string json_output_path = FLAGS_output_directory + "/archive.json";
+  std::ofstream file;
+  file.open(json_output_path, std::ios::out);
+  if(!file) {
+    std::cout << "Failed to open file for writing " << json_output_path << std::endl;
+    throw;
+  }
+  file << "{" << std::endl;
+  file << "\"images\": " << paths.size() << "," << std::endl;
+  file << "\"resumed\": " << coordinator.resumed() << "," << std::endl;
+  file << "\"rendered\": " << finished - coordinator.failed() << "," << std::endl;
+  file << "\"failed\": " << coordinator.failed() << "," << std::endl;
+  file << "\"unfinished\": " << coordinator.unfinished() << "," << std::endl;
+  file << "\"wall_time\": " << wall_time << "," << std::endl;
+  file << "\"throughput\": " << throughput << "," << std::endl;
+  file << "\"workers\": [" << std::endl;
+  const std::vector<WorkerStats> &workers = coordinator.workers();
+  for (size_t i = 0; i < workers.size(); ++i) {
+    file << "  {\"name\": \"" << workers[i].name << "\""
+      << ", \"shard\": " << workers[i].shard
+      << ", \"images\": " << workers[i].items
+      << ", \"failed\": " << workers[i].failures
+      << ", \"stolen\": " << workers[i].stolen
+      << ", \"busy\": " << workers[i].busy
+      << ", \"connected\": " << workers[i].connected
+      << ", \"utilization\": " << workers[i].utilization() << "}"
+      << (i + 1 < workers.size() ? "," : "") << std::endl;
+  }
+  file << "]" << std::endl;
+  file << "}" << std::endl;
+  file.close();
+  return coordinator.failed() > 0 || coordinator.unfinished() > 0 ? 1 : 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_checkpoint_path.empty()) {
+      std::cerr << "--checkpoint_path is required." << std::endl;
+      return 1;
+  }
+  if (FLAGS_output_directory.empty()) {
+      std::cerr << "--output_directory is required." << std::endl;
+      return 1;
+  }
+  std::string checkpoint_path = FLAGS_checkpoint_path + "/";
+
+  if (FLAGS_role == "worker") {
+    return run_worker(checkpoint_path);
+  } else if (FLAGS_role == "coordinator") {
+    if (FLAGS_input_path.empty()) {
+      std::cerr << "--input_path is required." << std::endl;
+      return 1;
+    }
+    return run_coordinator(checkpoint_path);
+  }
+  std::cerr << "--role should be coordinator or worker." << std::endl;
+  return 1;
+}
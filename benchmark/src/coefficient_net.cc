@@ -0,0 +1,253 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "coefficient_net.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+// Output channels are computed kBlock at a time, one SIMD register each.
+const int kBlock = 8;
+typedef float Vec __attribute__((vector_size(kBlock*sizeof(float))));
+
+// Offsets into the arenas are rounded up so that every block is aligned.
+size_t round_up(size_t n) {
+  return (n + kBlock - 1)/kBlock*kBlock;
+}
+
+float *allocate_floats(size_t n) {
+  void *p = nullptr;
+  if (posix_memalign(&p, 64, std::max<size_t>(n, 1)*sizeof(float)) != 0) {
+    std::cout << "Failed to allocate " << n << " floats" << std::endl;
+    throw;
+  }
+  std::memset(p, 0, n*sizeof(float));
+  return static_cast<float*>(p);
+}
+
+// TF "SAME" padding: returns the output extent and the padding before.
+void same_padding(int in, int kernel_size, int stride, int *out, int *pad) {
+  *out = (in + stride - 1)/stride;
+  const int pad_total = std::max((*out - 1)*stride + kernel_size - in, 0);
+  *pad = pad_total/2;
+}
+
+}  // namespace
+
+CoefficientNet::CoefficientNet(const ModelBundle &bundle)
+{
+  const BundleHeader &h = bundle.header();
+  net_input_size_ = h.net_input_size;
+  grid_width_ = h.grid_width;
+  grid_height_ = h.grid_height;
+  grid_depth_ = h.grid_depth;
+  grid_rows_ = h.grid_rows;
+  grid_cols_ = h.grid_cols;
+
+  const int gd = h.luma_bins;
+  const int cm = h.channel_multiplier;
+  if (gd <= 0 || cm <= 0 || h.spatial_bin <= 0 ||
+      net_input_size_ % h.spatial_bin != 0) {
+    std::cout << "Bundle does not describe a coefficient network" << std::endl;
+    throw;
+  }
+
+  // Mirrors HDRNetCurves._coefficients.
+  Activation input = allocate(net_input_size_, net_input_size_, 3);
+  input_offset_ = input.offset;
+
+  Activation splat = input;
+  for (int i = 0, size = net_input_size_; size > h.spatial_bin; ++i, size /= 2) {
+    std::stringstream scope;
+    scope << "splat/conv" << i+1;
+    splat = add_layer(scope.str(), splat, 3, 2, cm*(1 << i)*gd, true, true);
+  }
+
+  Activation global = splat;
+  global = add_layer("global/conv1", global, 3, 2, 8*cm*gd, true, true);
+  global = add_layer("global/conv2", global, 3, 2, 8*cm*gd, true, true);
+  // Flattening (h, w, c) is free in HWC.
+  global = Activation{global.offset, 1, 1,
+    global.height*global.width*global.channels};
+  global = add_layer("global/fc1", global, 1, 1, 32*cm*gd, true, true);
+  global = add_layer("global/fc2", global, 1, 1, 16*cm*gd, true, true);
+  global = add_layer("global/fc3", global, 1, 1, 8*cm*gd, false, true);
+  global_layer_ = layers_.size() - 1;
+
+  Activation local = splat;
+  local = add_layer("local/conv1", local, 3, 1, 8*cm*gd, true, true);
+  // Fusion: relu(local/conv2 + global/fc3), fused into the conv.
+  local = add_layer("local/conv2", local, 3, 1, 8*cm*gd, true, false);
+  layers_.back().add_global = true;
+
+  Activation prediction = add_layer("prediction/conv1", local, 1, 1,
+      gd*grid_rows_*grid_cols_, false, true);
+  if (prediction.height != grid_height_ || prediction.width != grid_width_ ||
+      gd != grid_depth_) {
+    std::cout << "Coefficient network does not match the grid size" << std::endl;
+    throw;
+  }
+  output_offset_ = allocate(grid_rows_*grid_depth_*grid_height_,
+      grid_width_, grid_cols_).offset;
+
+  arena_ = allocate_floats(arena_size_);
+  weights_ = allocate_floats(weights_size_);
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    load_layer(bundle, layers_[i]);
+  }
+}
+
+CoefficientNet::~CoefficientNet()
+{
+  free(arena_);
+  free(weights_);
+}
+
+CoefficientNet::Activation CoefficientNet::allocate(
+    int height, int width, int channels) {
+  Activation a = {arena_size_, height, width, channels};
+  arena_size_ += round_up(static_cast<size_t>(height)*width*channels);
+  return a;
+}
+
+CoefficientNet::Activation CoefficientNet::add_layer(
+    const std::string &scope, const Activation &input,
+    int kernel_size, int stride, int out_channels, bool relu, bool has_bias) {
+  Layer l;
+  l.scope = scope;
+  l.kernel_size = kernel_size;
+  l.stride = stride;
+  l.in_height = input.height;
+  l.in_width = input.width;
+  l.in_channels = input.channels;
+  same_padding(input.height, kernel_size, stride, &l.out_height, &l.pad_top);
+  same_padding(input.width, kernel_size, stride, &l.out_width, &l.pad_left);
+  l.out_channels = out_channels;
+  l.relu = relu;
+  l.has_bias = has_bias;
+  l.add_global = false;
+
+  const size_t padded_channels = round_up(out_channels);
+  l.weights_offset = weights_size_;
+  weights_size_ += padded_channels*kernel_size*kernel_size*input.channels;
+  l.biases_offset = weights_size_;
+  weights_size_ += padded_channels;
+
+  Activation output = allocate(l.out_height, l.out_width, out_channels);
+  l.input_offset = input.offset;
+  l.output_offset = output.offset;
+  layers_.push_back(l);
+  return output;
+}
+
+void CoefficientNet::load_layer(const ModelBundle &bundle, Layer &l) {
+  // TF stores conv weights as (ky, kx, in, out) and fc weights as (in, out).
+  const int k = l.kernel_size;
+  const int n = k*k*l.in_channels*l.out_channels;
+  std::vector<float> weights(n);
+  bundle.read_floats("coefficients/"+l.scope+"/weights", n, weights.data());
+
+  float *packed = weights_ + l.weights_offset;
+  const size_t block_size = static_cast<size_t>(k)*k*l.in_channels*kBlock;
+  for (int tap = 0; tap < k*k; ++tap)
+  for (int ci = 0; ci < l.in_channels; ++ci)
+  for (int co = 0; co < l.out_channels; ++co) {
+    packed[(co/kBlock)*block_size + (tap*l.in_channels + ci)*kBlock + co%kBlock] =
+      weights[(tap*l.in_channels + ci)*l.out_channels + co];
+  }
+
+  if (l.has_bias) {
+    bundle.read_floats("coefficients/"+l.scope+"/biases", l.out_channels,
+        weights_ + l.biases_offset);
+  }
+}
+
+void CoefficientNet::run_layer(const Layer &l) {
+  const float *in = arena_ + l.input_offset;
+  float *out = arena_ + l.output_offset;
+  const float *weights = weights_ + l.weights_offset;
+  const float *biases = weights_ + l.biases_offset;
+  const float *global = l.add_global ?
+    arena_ + layers_[global_layer_].output_offset : nullptr;
+
+  const int k = l.kernel_size;
+  const int nblocks = (l.out_channels + kBlock - 1)/kBlock;
+  const size_t block_size = static_cast<size_t>(k)*k*l.in_channels*kBlock;
+
+  for (int oy = 0; oy < l.out_height; ++oy)
+  for (int ox = 0; ox < l.out_width; ++ox) {
+    const int iy0 = oy*l.stride - l.pad_top;
+    const int ix0 = ox*l.stride - l.pad_left;
+    float *out_px = out + (static_cast<size_t>(oy)*l.out_width + ox)*l.out_channels;
+
+    for (int ob = 0; ob < nblocks; ++ob) {
+      const float *w = weights + ob*block_size;
+      Vec acc = *reinterpret_cast<const Vec*>(biases + ob*kBlock);
+
+      for (int ky = 0; ky < k; ++ky) {
+        const int iy = iy0 + ky;
+        if (iy < 0 || iy >= l.in_height) {
+          continue;  // Zero padding.
+        }
+        for (int kx = 0; kx < k; ++kx) {
+          const int ix = ix0 + kx;
+          if (ix < 0 || ix >= l.in_width) {
+            continue;
+          }
+          const float *in_px =
+            in + (static_cast<size_t>(iy)*l.in_width + ix)*l.in_channels;
+          const Vec *w_tap = reinterpret_cast<const Vec*>(
+              w + (ky*k + kx)*l.in_channels*kBlock);
+          for (int ci = 0; ci < l.in_channels; ++ci) {
+            acc += in_px[ci]*w_tap[ci];
+          }
+        }
+      }
+
+      // Fused epilogue: fusion term, activation, store.
+      const int c0 = ob*kBlock;
+      const int nc = std::min(kBlock, l.out_channels - c0);
+      for (int c = 0; c < nc; ++c) {
+        float value = global ? acc[c] + global[c0 + c] : acc[c];
+        out_px[c0 + c] = l.relu ? std::max(value, 0.0f) : value;
+      }
+    }
+  }
+}
+
+const float *CoefficientNet::forward() {
+  for (size_t i = 0; i < layers_.size(); ++i) {
+    run_layer(layers_[i]);
+  }
+
+  // Unroll the packed prediction, see `unroll_grid` in models.py: channel
+  // (p*grid_rows + o)*grid_depth + z holds coefficient (o, p) of depth bin z.
+  const float *prediction = arena_ + layers_.back().output_offset;
+  float *grid = arena_ + output_offset_;
+  const int channels = layers_.back().out_channels;
+  for (int o = 0; o < grid_rows_; ++o)
+  for (int z = 0; z < grid_depth_; ++z)
+  for (int y = 0; y < grid_height_; ++y)
+  for (int x = 0; x < grid_width_; ++x)
+  for (int p = 0; p < grid_cols_; ++p) {
+    grid[(((o*grid_depth_ + z)*grid_height_ + y)*grid_width_ + x)*grid_cols_ + p] =
+      prediction[(y*grid_width_ + x)*channels + (p*grid_rows_ + o)*grid_depth_ + z];
+  }
+  return grid;
+}
@@ -0,0 +1,265 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cpu_renderer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "utils.h"
+
+namespace {
+
+// Linear interpolation taps at texture coordinate `t` in [0, 1] over `size`
+// texels, with GL_CLAMP_TO_EDGE.
+inline void linear_taps(float t, int size, int *i0, int *i1, float *w1) {
+  const float x = t*size - 0.5f;
+  const float fx = std::floor(x);
+  *w1 = x - fx;
+  *i0 = std::max(0, std::min(static_cast<int>(fx), size - 1));
+  *i1 = std::max(0, std::min(static_cast<int>(fx) + 1, size - 1));
+}
+
+// Coefficient (r, k) at `voxel` of a float grid in the output_coefficients
+// layout.
+struct FloatGrid {
+  const float *coeffs;
+  int row_stride;
+
+  float at(int r, int k, int voxel) const {
+    return coeffs[r*row_stride + 4*voxel + k];
+  }
+  float finish(int, int, float sample) const { return sample; }
+};
+
+// Same, from quantized codes. Trilinear weights sum to one, so interpolating
+// the codes and then applying the channel's scale and offset is exact.
+template <typename T>
+struct CodeGrid {
+  const QuantizedGrid *grid;
+  const T *codes[3][4];
+
+  float at(int r, int k, int voxel) const { return codes[r][k][voxel]; }
+  float finish(int r, int k, float sample) const {
+    return grid->offset(4*r + k) + grid->scale(4*r + k)*sample;
+  }
+};
+
+}  // namespace
+
+CpuRenderer::CpuRenderer(int grid_width, int grid_height, int grid_depth,
+    std::string checkpoint_path, const ModelBundle *bundle)
+  : grid_width_(grid_width), grid_height_(grid_height), grid_depth_(grid_depth)
+{
+  load_model_data(bundle, checkpoint_path, "guide_ccm_f32_3x4.bin", 3*4, ccm_);
+  load_model_data(bundle, checkpoint_path, "guide_mix_matrix_f32_1x4.bin", 4, mix_matrix_);
+  load_model_data(bundle, checkpoint_path, "guide_shifts_f32_16x3.bin", 16*3, shifts_);
+  load_model_data(bundle, checkpoint_path, "guide_slopes_f32_16x3.bin", 16*3, slopes_);
+}
+
+void CpuRenderer::render(const cv::Mat &input, const float *coeffs,
+    cv::Mat &output) const {
+  FloatGrid grid;
+  grid.coeffs = coeffs;
+  grid.row_stride = grid_depth_*grid_height_*grid_width_*4;
+  render_grid(input, grid, output);
+}
+
+void CpuRenderer::render(const cv::Mat &input, const QuantizedGrid &grid,
+    cv::Mat &output) const {
+  const GridShape &shape = grid.shape();
+  if (shape.rows != 3 || shape.cols != 4 || shape.width != grid_width_ ||
+      shape.height != grid_height_ || shape.depth != grid_depth_ ||
+      !grid.valid()) {
+    std::cout << "Quantized grid doesn't match the renderer" << std::endl;
+    throw;
+  }
+  if (grid.precision() == GRID_INT8) {
+    CodeGrid<int8_t> codes;
+    codes.grid = &grid;
+    for (int r = 0; r < 3; ++r)
+    for (int k = 0; k < 4; ++k) {
+      codes.codes[r][k] = grid.codes8(4*r + k);
+    }
+    render_grid(input, codes, output);
+  } else {
+    CodeGrid<int16_t> codes;
+    codes.grid = &grid;
+    for (int r = 0; r < 3; ++r)
+    for (int k = 0; k < 4; ++k) {
+      codes.codes[r][k] = grid.codes16(4*r + k);
+    }
+    render_grid(input, codes, output);
+  }
+}
+
+void CpuRenderer::render_lattice(const cv::Mat &input, const float *coeffs,
+    int stride, int skip_stride, int y_begin, int y_end,
+    cv::Mat &output) const {
+  FloatGrid grid;
+  grid.coeffs = coeffs;
+  grid.row_stride = grid_depth_*grid_height_*grid_width_*4;
+
+  const int width = input.cols;
+  const int height = input.rows;
+  // First lattice row at or after y_begin.
+  for (int y = (y_begin + stride - 1)/stride*stride; y < std::min(y_end, height);
+      y += stride) {
+    const bool skipped_row = skip_stride > 0 && y % skip_stride == 0;
+    const unsigned char *in = input.ptr<unsigned char>(y);
+    unsigned char *out = output.ptr<unsigned char>(y);
+    const int block_height = std::min(stride, height - y);
+
+    int gy0, gy1;
+    float wy;
+    linear_taps((y + 0.5f)/height, grid_height_, &gy0, &gy1, &wy);
+
+    for (int x = 0; x < width; x += stride) {
+      if (skipped_row && x % skip_stride == 0) {
+        continue;
+      }
+      render_pixel(grid, in + 3*x, (x + 0.5f)/width, gy0, gy1, wy, out + 3*x);
+      const int block_width = std::min(stride, width - x);
+      for (int by = 0; by < block_height; ++by) {
+        unsigned char *block = output.ptr<unsigned char>(y + by) + 3*x;
+        for (int bx = (by == 0 ? 1 : 0); bx < block_width; ++bx) {
+          block[3*bx] = out[3*x];
+          block[3*bx + 1] = out[3*x + 1];
+          block[3*bx + 2] = out[3*x + 2];
+        }
+      }
+    }
+  }
+}
+
+void CpuRenderer::render_region(const cv::Mat &input, const float *coeffs,
+    int x_begin, int x_end, int y_begin, int y_end, cv::Mat &output) const {
+  x_begin = std::max(x_begin, 0);
+  y_begin = std::max(y_begin, 0);
+  x_end = std::min(x_end, input.cols);
+  y_end = std::min(y_end, input.rows);
+  if (x_begin >= x_end || y_begin >= y_end) {
+    return;
+  }
+  cv::Mat region = output(
+      cv::Rect(x_begin, y_begin, x_end - x_begin, y_end - y_begin));
+  render_tile(input, coeffs, x_begin, y_begin, region);
+}
+
+void CpuRenderer::render_tile(const cv::Mat &input, const float *coeffs,
+    int x_begin, int y_begin, cv::Mat &tile) const {
+  FloatGrid grid;
+  grid.coeffs = coeffs;
+  grid.row_stride = grid_depth_*grid_height_*grid_width_*4;
+
+  const int width = input.cols;
+  const int height = input.rows;
+  for (int ty = 0; ty < tile.rows; ++ty) {
+    const int y = y_begin + ty;
+    const unsigned char *in = input.ptr<unsigned char>(y) + 3*x_begin;
+    unsigned char *out = tile.ptr<unsigned char>(ty);
+
+    int gy0, gy1;
+    float wy;
+    linear_taps((y + 0.5f)/height, grid_height_, &gy0, &gy1, &wy);
+
+    for (int tx = 0; tx < tile.cols; ++tx) {
+      render_pixel(grid, in + 3*tx, (x_begin + tx + 0.5f)/width, gy0, gy1, wy,
+          out + 3*tx);
+    }
+  }
+}
+
+void CpuRenderer::pixel_cells(int i, int size, int grid_size, int *cell0,
+    int *cell1) {
+  float unused_weight;
+  linear_taps((i + 0.5f)/size, grid_size, cell0, cell1, &unused_weight);
+}
+
+template <typename Grid>
+void CpuRenderer::render_grid(const cv::Mat &input, const Grid &grid,
+    cv::Mat &output) const {
+  const int width = input.cols;
+  const int height = input.rows;
+  output.create(height, width, CV_8UC3);
+
+  for (int y = 0; y < height; ++y) {
+    const unsigned char *in = input.ptr<unsigned char>(y);
+    unsigned char *out = output.ptr<unsigned char>(y);
+
+    int gy0, gy1;
+    float wy;
+    linear_taps((y + 0.5f)/height, grid_height_, &gy0, &gy1, &wy);
+
+    for (int x = 0; x < width; ++x) {
+      render_pixel(grid, in + 3*x, (x + 0.5f)/width, gy0, gy1, wy, out + 3*x);
+    }
+  }
+}
+
+template <typename Grid>
+void CpuRenderer::render_pixel(const Grid &grid, const unsigned char *in,
+    float tx, int gy0, int gy1, float wy, unsigned char *out) const {
+  const float rgba[4] = {in[0]/255.0f, in[1]/255.0f, in[2]/255.0f, 1.0f};
+
+  // Guide: rgba*uGuideCcm, then a sum of ReLU curves per channel, then the
+  // mix.
+  float guide = mix_matrix_[3];
+  for (int c = 0; c < 3; ++c) {
+    float t = 0.0f;
+    for (int k = 0; k < 4; ++k) {
+      t += rgba[k]*ccm_[4*c + k];
+    }
+    float curve = 0.0f;
+    for (int i = 0; i < 16; ++i) {
+      curve += slopes_[3*i + c]*std::max(0.0f, t - shifts_[3*i + c]);
+    }
+    guide += curve*mix_matrix_[c];
+  }
+  guide = std::max(0.0f, std::min(guide, 1.0f));
+
+  int gx0, gx1, gz0, gz1;
+  float wx, wz;
+  linear_taps(tx, grid_width_, &gx0, &gx1, &wx);
+  linear_taps(guide, grid_depth_, &gz0, &gz1, &wz);
+
+  // Trilinear sample of the 12 affine coefficients.
+  float affine[3][4] = {{0.0f}};
+  for (int dz = 0; dz < 2; ++dz)
+  for (int dy = 0; dy < 2; ++dy)
+  for (int dx = 0; dx < 2; ++dx) {
+    const float w = (dz ? wz : 1.0f - wz)*(dy ? wy : 1.0f - wy)*
+      (dx ? wx : 1.0f - wx);
+    const int voxel = ((dz ? gz1 : gz0)*grid_height_ +
+          (dy ? gy1 : gy0))*grid_width_ + (dx ? gx1 : gx0);
+    for (int r = 0; r < 3; ++r)
+    for (int k = 0; k < 4; ++k) {
+      affine[r][k] += w*grid.at(r, k, voxel);
+    }
+  }
+  for (int r = 0; r < 3; ++r)
+  for (int k = 0; k < 4; ++k) {
+    affine[r][k] = grid.finish(r, k, affine[r][k]);
+  }
+
+  for (int r = 0; r < 3; ++r) {
+    float value = 0.0f;
+    for (int k = 0; k < 4; ++k) {
+      value += affine[r][k]*rgba[k];
+    }
+    value = std::max(0.0f, std::min(value, 1.0f));
+    out[r] = static_cast<unsigned char>(value*255.0f + 0.5f);
+  }
+}
@@ -0,0 +1,212 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deadline_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace {
+
+// Weight of a new sample in the running estimates.
+const double kAlpha = 0.25;
+
+// The curves are fitted on every kLutStride-th pixel in x and y.
+const int kLutStride = 4;
+
+// A quality level fits if its predicted time, plus this fraction of it, is
+// within the time left for the frame: the estimates lag behind load changes.
+const double kSafetyMargin = 0.1;
+
+}  // namespace
+
+const char *quality_name(Quality quality) {
+  switch (quality) {
+    case QUALITY_FULL: return "full";
+    case QUALITY_REUSE_GRID: return "reuse_grid";
+    case QUALITY_REDUCED: return "reduced";
+    case QUALITY_LUT: return "lut";
+    default: return "unknown";
+  }
+}
+
+void LatencyEstimate::add(double ms) {
+  if (!valid_) {
+    reset(ms);
+    return;
+  }
+  deviation_ = (1.0 - kAlpha)*deviation_ + kAlpha*std::fabs(ms - mean_);
+  mean_ = (1.0 - kAlpha)*mean_ + kAlpha*ms;
+}
+
+void LatencyEstimate::reset(double ms) {
+  mean_ = ms;
+  deviation_ = ms/2;
+  valid_ = true;
+}
+
+DeadlineProcessor::DeadlineProcessor(HybridGLProcessor *processor,
+    double deadline_ms)
+  : processor_(processor), deadline_(deadline_ms)
+{
+}
+
+Quality DeadlineProcessor::choose() {
+  // Nothing to fall back on yet, or time to measure the full path again.
+  if (grid_.empty() || !forward_.valid() ||
+      degraded_streak_ >= kProbeInterval) {
+    return QUALITY_FULL;
+  }
+  const double budget = deadline_ - frame_timer_.duration();
+  auto fits = [budget](double ms) { return ms*(1.0 + kSafetyMargin) <= budget; };
+  const double full = prepare_.predict() + forward_.predict() + render_.predict();
+  if (fits(full)) {
+    return QUALITY_FULL;
+  }
+  if (fits(render_.predict())) {
+    return QUALITY_REUSE_GRID;
+  }
+  // The faster levels are tried once before they have been timed.
+  if (!reduced_.valid() || fits(reduced_.predict())) {
+    return QUALITY_REDUCED;
+  }
+  // The curves need neither the network nor GL.
+  if (!lut_table_.empty() && (!lut_.valid() || fits(lut_.predict()))) {
+    return QUALITY_LUT;
+  }
+  // Nothing fits: take whichever is predicted to miss by the least.
+  Quality best = QUALITY_REUSE_GRID;
+  double best_ms = render_.predict();
+  if (reduced_.predict() < best_ms) {
+    best = QUALITY_REDUCED;
+    best_ms = reduced_.predict();
+  }
+  if (!lut_table_.empty() && lut_.predict() < best_ms) {
+    best = QUALITY_LUT;
+  }
+  return best;
+}
+
+BenchmarkResult DeadlineProcessor::process(const cv::Mat &input, cv::Mat &output) {
+  frame_timer_.start();
+  BenchmarkResult result;
+  const Quality quality = choose();
+  const bool probe = degraded_streak_ >= kProbeInterval;
+
+  switch (quality) {
+    case QUALITY_FULL: {
+      // The upload overlaps with the network, but is counted with the render
+      // as on the other paths.
+      double ms[3];
+      timer_.start();
+      processor_->upload_input(input);
+      const double upload_ms = timer_.duration();
+      timer_.start();
+      processor_->prepare_input(input, &result);
+      ms[0] = timer_.duration();
+
+      timer_.start();
+      const float *coeffs = processor_->forward(&result);
+      ms[1] = timer_.duration();
+      grid_.assign(coeffs, coeffs + processor_->coefficients_size());
+
+      timer_.start();
+      processor_->render(grid_.data(), output, &result);
+      ms[2] = upload_ms + timer_.duration();
+
+      LatencyEstimate *stages[3] = {&prepare_, &forward_, &render_};
+      for (int i = 0; i < 3; ++i) {
+        if (probe) {
+          stages[i]->reset(ms[i]);
+        } else {
+          stages[i]->add(ms[i]);
+        }
+      }
+
+      fit_lut(input, output);
+      break;
+    }
+    case QUALITY_REUSE_GRID:
+      timer_.start();
+      processor_->upload_input(input);
+      processor_->render(grid_.data(), output, &result);
+      render_.add(timer_.duration());
+      break;
+    case QUALITY_REDUCED:
+      timer_.start();
+      processor_->upload_input(input);
+      processor_->render(grid_.data(), output, &result, kReducedScale);
+      reduced_.add(timer_.duration());
+      break;
+    case QUALITY_LUT:
+      timer_.start();
+      cv::LUT(input, lut_table_, output);
+      result.rendering_direct = timer_.duration();
+      lut_.add(result.rendering_direct);
+      break;
+    default:
+      break;
+  }
+
+  degraded_streak_ = quality == QUALITY_FULL ? 0 : degraded_streak_ + 1;
+  last_quality_ = quality;
+  ++stats_.frames;
+  ++stats_.frames_at[quality];
+  if (frame_timer_.duration() <= deadline_) {
+    ++stats_.hits;
+  }
+  return result;
+}
+
+void DeadlineProcessor::fit_lut(const cv::Mat &input, const cv::Mat &output) {
+  // Per-channel mean output for each input value.
+  double sum[3][256] = {{0}};
+  int count[3][256] = {{0}};
+  for (int y = 0; y < input.rows; y += kLutStride) {
+    const unsigned char *in = input.ptr<unsigned char>(y);
+    const unsigned char *out = output.ptr<unsigned char>(y);
+    for (int x = 0; x < input.cols; x += kLutStride)
+    for (int c = 0; c < 3; ++c) {
+      sum[c][in[3*x + c]] += out[3*x + c];
+      ++count[c][in[3*x + c]];
+    }
+  }
+
+  lut_table_.create(1, 256, CV_8UC3);
+  unsigned char *table = lut_table_.ptr<unsigned char>(0);
+  for (int c = 0; c < 3; ++c) {
+    // Values that do not occur are interpolated between their neighbors, with
+    // 0 and 255 as anchors at the ends.
+    int prev = -1;
+    for (int v = 0; v <= 256; ++v) {
+      if (v < 256 && count[c][v] == 0) {
+        continue;
+      }
+      const double value_at_v = v < 256 ? sum[c][v]/count[c][v] : 255.0;
+      const double value_at_prev = prev >= 0 ? sum[c][prev]/count[c][prev] : 0.0;
+      for (int u = prev + 1; u <= std::min(v, 255); ++u) {
+        const double t = v > prev ? static_cast<double>(u - prev)/(v - prev) : 1.0;
+        double value = (1.0 - t)*value_at_prev + t*value_at_v;
+        if (u == v && v < 256) {
+          value = value_at_v;
+        }
+        table[3*u + c] = static_cast<unsigned char>(
+            std::max(0.0, std::min(255.0, value + 0.5)));
+      }
+      prev = v;
+    }
+  }
+}
@@ -0,0 +1,485 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "grid_codec.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// Codes are converted kBlock at a time, one SIMD register of floats each.
+const int kBlock = 8;
+typedef float Vec __attribute__((vector_size(kBlock*sizeof(float))));
+typedef int32_t IVec __attribute__((vector_size(kBlock*sizeof(int32_t))));
+// Half blocks, for subtract_reference(), which keeps the codes it widens to
+// int32: without AVX2, widening a whole block does not vectorize.
+const int kHalfBlock = kBlock/2;
+typedef int32_t HalfIVec __attribute__((vector_size(kHalfBlock*sizeof(int32_t))));
+
+// With delta encoding, keyframes leave this fraction of their range as
+// headroom, so that drifting values don't force the next keyframe.
+const float kDeltaHeadroom = 0.125f;
+
+template <typename T> struct CodeTraits;
+template <> struct CodeTraits<int8_t> {
+  static const int kMax = 127;
+  typedef int8_t Block __attribute__((vector_size(kBlock*sizeof(int8_t))));
+  typedef int8_t HalfBlock
+    __attribute__((vector_size(kHalfBlock*sizeof(int8_t))));
+};
+template <> struct CodeTraits<int16_t> {
+  static const int kMax = 32767;
+  typedef int16_t Block __attribute__((vector_size(kBlock*sizeof(int16_t))));
+  typedef int16_t HalfBlock
+    __attribute__((vector_size(kHalfBlock*sizeof(int16_t))));
+};
+
+// Unaligned loads and stores. Vectors are passed by reference: passing them by
+// value would depend on the instruction set (-Wpsabi).
+template <typename V, typename T>
+inline void load(V &v, const T *p) {
+  std::memcpy(&v, p, sizeof(v));
+}
+
+template <typename V, typename T>
+inline void store(T *p, const V &v) {
+  std::memcpy(p, &v, sizeof(v));
+}
+
+inline int quantize_scalar(float x, float offset, float inv_scale, int max) {
+  const float q = (x - offset)*inv_scale;
+  return std::max(-max, std::min(static_cast<int>(std::lround(q)), max));
+}
+
+// codes = round((x - offset)/scale), clamped to the code range. Returns
+// whether any value was out of range.
+bool quantize(const float *x, int n, float offset, float scale, int max,
+    int32_t *codes) {
+  const float inv_scale = 1.0f/scale;
+  const float limit = max + 0.5f;
+  const Vec voffset = Vec{} + offset;
+  const Vec vinv = Vec{} + inv_scale;
+  const Vec vlimit = Vec{} + limit;
+  const Vec vmax = Vec{} + static_cast<float>(max);
+  const Vec vhalf = Vec{} + 0.5f;
+  IVec out_of_range = IVec{};
+  int i = 0;
+  for (; i + kBlock <= n; i += kBlock) {
+    Vec q;
+    load(q, x + i);
+    q = (q - voffset)*vinv;
+    out_of_range |= (q > vlimit) | (q < -vlimit);
+    q = q > vmax ? vmax : q;
+    q = q < -vmax ? -vmax : q;
+    // Round half away from zero; the conversion truncates.
+    q += q < 0 ? -vhalf : vhalf;
+    store(codes + i, __builtin_convertvector(q, IVec));
+  }
+  bool clamped = false;
+  for (int k = 0; k < kBlock; ++k) {
+    clamped |= out_of_range[k] != 0;
+  }
+  for (; i < n; ++i) {
+    const float q = (x[i] - offset)*inv_scale;
+    clamped |= std::fabs(q) > limit;
+    codes[i] = quantize_scalar(x[i], offset, inv_scale, max);
+  }
+  return clamped;
+}
+
+template <typename T>
+void narrow(const int32_t *codes, int n, T *out) {
+  typedef typename CodeTraits<T>::Block Block;
+  int i = 0;
+  for (; i + kBlock <= n; i += kBlock) {
+    IVec c;
+    load(c, codes + i);
+    store(out + i, __builtin_convertvector(c, Block));
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<T>(codes[i]);
+  }
+}
+
+// codes += delta, clamped to the code range.
+template <typename T>
+void apply_delta(const int8_t *delta, int n, T *codes) {
+  typedef typename CodeTraits<T>::Block Block;
+  typedef int8_t DeltaBlock __attribute__((vector_size(kBlock*sizeof(int8_t))));
+  const int max = CodeTraits<T>::kMax;
+  const IVec vmax = IVec{} + max;
+  int i = 0;
+  for (; i + kBlock <= n; i += kBlock) {
+    Block b;
+    DeltaBlock d;
+    load(b, codes + i);
+    load(d, delta + i);
+    IVec c = __builtin_convertvector(b, IVec) + __builtin_convertvector(d, IVec);
+    c = c > vmax ? vmax : c;
+    c = c < -vmax ? -vmax : c;
+    store(codes + i, __builtin_convertvector(c, Block));
+  }
+  for (; i < n; ++i) {
+    codes[i] = static_cast<T>(std::max(-max, std::min(codes[i] + delta[i], max)));
+  }
+}
+
+// codes -= reference. Returns whether any difference is out of the int8
+// range; `changed` is set to whether any is not zero.
+template <typename T>
+bool subtract_reference(const T *reference, int n, int32_t *codes,
+    bool *changed) {
+  typedef typename CodeTraits<T>::HalfBlock HalfBlock;
+  const int max = CodeTraits<int8_t>::kMax;
+  const HalfIVec vmax = HalfIVec{} + max;
+  HalfIVec out_of_range = HalfIVec{};
+  HalfIVec nonzero = HalfIVec{};
+  int i = 0;
+  for (; i + kHalfBlock <= n; i += kHalfBlock) {
+    HalfBlock r;
+    HalfIVec c;
+    load(r, reference + i);
+    load(c, codes + i);
+    c -= __builtin_convertvector(r, HalfIVec);
+    out_of_range |= (c > vmax) | (c < -vmax);
+    nonzero |= c;
+    store(codes + i, c);
+  }
+  bool clamped = false;
+  bool any = false;
+  for (int k = 0; k < kHalfBlock; ++k) {
+    clamped |= out_of_range[k] != 0;
+    any |= nonzero[k] != 0;
+  }
+  for (; i < n; ++i) {
+    const int32_t delta = codes[i] - reference[i];
+    clamped |= delta < -max || delta > max;
+    any |= delta != 0;
+    codes[i] = delta;
+  }
+  *changed = any;
+  return clamped;
+}
+
+// Writes offset + scale*codes into every `stride`th float of `out`.
+template <typename T>
+void dequantize_channel(const T *codes, int n, float offset, float scale,
+    int stride, float *out) {
+  typedef typename CodeTraits<T>::Block Block;
+  const Vec voffset = Vec{} + offset;
+  const Vec vscale = Vec{} + scale;
+  int i = 0;
+  for (; i + kBlock <= n; i += kBlock) {
+    Block b;
+    load(b, codes + i);
+    const Vec v = voffset + vscale*__builtin_convertvector(b, Vec);
+    for (int k = 0; k < kBlock; ++k) {
+      out[(i + k)*stride] = v[k];
+    }
+  }
+  for (; i < n; ++i) {
+    out[i*stride] = offset + scale*codes[i];
+  }
+}
+
+int code_size(GridPrecision precision) {
+  return precision == GRID_INT8 ? 1 : 2;
+}
+
+int code_max(GridPrecision precision) {
+  return precision == GRID_INT8 ? CodeTraits<int8_t>::kMax
+    : CodeTraits<int16_t>::kMax;
+}
+
+GridFrameHeader make_header(const GridShape &shape, GridPrecision precision,
+    bool keyframe, uint32_t sequence, size_t payload_size) {
+  GridFrameHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kGridMagic, sizeof(kGridMagic));
+  header.version = kGridVersion;
+  header.precision = precision;
+  header.flags = keyframe ? GRID_KEYFRAME : 0;
+  header.sequence = sequence;
+  header.payload_size = payload_size;
+  header.rows = shape.rows;
+  header.depth = shape.depth;
+  header.height = shape.height;
+  header.width = shape.width;
+  header.cols = shape.cols;
+  return header;
+}
+
+}  // namespace
+
+QuantizedGrid::QuantizedGrid(const GridShape &shape)
+  : shape_(shape), scales_(shape.channels(), 0.0f),
+    offsets_(shape.channels(), 0.0f)
+{
+}
+
+bool QuantizedGrid::decode(const uint8_t *data, size_t size) {
+  GridFrameHeader header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, kGridMagic, sizeof(kGridMagic)) != 0 ||
+      header.version != kGridVersion ||
+      header.payload_size != size - sizeof(header) ||
+      (header.precision != GRID_INT8 && header.precision != GRID_INT16) ||
+      header.rows != shape_.rows || header.depth != shape_.depth ||
+      header.height != shape_.height || header.width != shape_.width ||
+      header.cols != shape_.cols) {
+    return false;
+  }
+  const GridPrecision precision = static_cast<GridPrecision>(header.precision);
+  const bool keyframe = header.flags & GRID_KEYFRAME;
+  const int channels = shape_.channels();
+  const uint8_t *payload = data + sizeof(header);
+
+  if (keyframe) {
+    const size_t expected = channels*2*sizeof(float) +
+      shape_.size()*code_size(precision);
+    if (header.payload_size != expected) {
+      return false;
+    }
+    std::memcpy(scales_.data(), payload, channels*sizeof(float));
+    payload += channels*sizeof(float);
+    std::memcpy(offsets_.data(), payload, channels*sizeof(float));
+    payload += channels*sizeof(float);
+    if (precision == GRID_INT8) {
+      codes8_.resize(shape_.size());
+      codes16_.clear();
+      std::memcpy(codes8_.data(), payload, shape_.size());
+    } else {
+      codes16_.resize(shape_.size());
+      codes8_.clear();
+      std::memcpy(codes16_.data(), payload, shape_.size()*sizeof(int16_t));
+    }
+    precision_ = precision;
+  } else {
+    // Deltas only apply to the frame they were computed against.
+    if (!valid_ || precision != precision_ || header.sequence != sequence_ + 1) {
+      valid_ = false;
+      return false;
+    }
+    const size_t size = shape_.size();
+    const size_t blocks = (size + kGridDeltaBlock - 1)/kGridDeltaBlock;
+    const size_t mask_size = (blocks + 7)/8;
+    if (header.payload_size < mask_size) {
+      return false;
+    }
+    const uint8_t *mask = payload;
+    payload += mask_size;
+    size_t changed = 0;
+    for (size_t b = 0; b < blocks; ++b) {
+      if ((mask[b/8] >> (b%8)) & 1) {
+        changed += std::min<size_t>(kGridDeltaBlock, size - b*kGridDeltaBlock);
+      }
+    }
+    if (header.payload_size != mask_size + changed) {
+      return false;
+    }
+    for (size_t b = 0; b < blocks; ++b) {
+      if (!((mask[b/8] >> (b%8)) & 1)) {
+        continue;
+      }
+      const size_t start = b*kGridDeltaBlock;
+      const int n = std::min<size_t>(kGridDeltaBlock, size - start);
+      const int8_t *delta = reinterpret_cast<const int8_t*>(payload);
+      if (precision == GRID_INT8) {
+        apply_delta(delta, n, codes8_.data() + start);
+      } else {
+        apply_delta(delta, n, codes16_.data() + start);
+      }
+      payload += n;
+    }
+  }
+  sequence_ = header.sequence;
+  valid_ = true;
+  return true;
+}
+
+void QuantizedGrid::dequantize(float *grid) const {
+  const int voxels = shape_.voxels();
+  for (int r = 0; r < shape_.rows; ++r)
+  for (int k = 0; k < shape_.cols; ++k) {
+    const int c = r*shape_.cols + k;
+    float *out = grid + static_cast<size_t>(r)*voxels*shape_.cols + k;
+    if (precision_ == GRID_INT8) {
+      dequantize_channel(codes8(c), voxels, offsets_[c], scales_[c],
+          shape_.cols, out);
+    } else {
+      dequantize_channel(codes16(c), voxels, offsets_[c], scales_[c],
+          shape_.cols, out);
+    }
+  }
+}
+
+GridEncoder::GridEncoder(const GridShape &shape, const GridCodecOptions &options)
+  : shape_(shape), options_(options), planar_(shape.size()),
+    codes_(shape.size()), reference_(shape)
+{
+  if (shape.channels() > 0xffff || shape.depth > 0xffff ||
+      shape.height > 0xffff || shape.width > 0xffff) {
+    std::cout << "Grid too large to encode" << std::endl;
+    throw;
+  }
+}
+
+size_t GridEncoder::max_frame_size() const {
+  // Delta frames are never larger than keyframes: at most one byte per code
+  // plus one bit per block, against 8 bytes of scale and offset per channel.
+  return sizeof(GridFrameHeader) + shape_.channels()*2*sizeof(float) +
+    shape_.size()*code_size(options_.precision);
+}
+
+bool GridEncoder::encode(const float *grid, std::vector<uint8_t> *out) {
+  // To planar, so that each channel is contiguous.
+  const int voxels = shape_.voxels();
+  for (int r = 0; r < shape_.rows; ++r) {
+    const float *row = grid + static_cast<size_t>(r)*voxels*shape_.cols;
+    for (int k = 0; k < shape_.cols; ++k) {
+      float *channel = planar_.data() +
+        static_cast<size_t>(r*shape_.cols + k)*voxels;
+      for (int i = 0; i < voxels; ++i) {
+        channel[i] = row[i*shape_.cols + k];
+      }
+    }
+  }
+
+  bool keyframe = !options_.delta || !reference_.valid() ||
+    since_keyframe_ + 1 >= options_.keyframe_interval;
+  if (!keyframe && !encode_delta(out)) {
+    keyframe = true;
+  }
+  if (keyframe) {
+    encode_keyframe(out);
+    since_keyframe_ = 0;
+  } else {
+    ++since_keyframe_;
+  }
+  ++sequence_;
+
+  // Track what the decoder sees, so that deltas are against it.
+  if (options_.delta && !reference_.decode(out->data(), out->size())) {
+    std::cout << "Failed to decode our own grid frame" << std::endl;
+    throw;
+  }
+  return keyframe;
+}
+
+void GridEncoder::encode_keyframe(std::vector<uint8_t> *out) {
+  const int channels = shape_.channels();
+  const int voxels = shape_.voxels();
+  const int max = code_max(options_.precision);
+  const size_t codes_bytes = shape_.size()*code_size(options_.precision);
+  const size_t payload_size = channels*2*sizeof(float) + codes_bytes;
+
+  out->resize(sizeof(GridFrameHeader) + payload_size);
+  const GridFrameHeader header = make_header(shape_, options_.precision, true,
+      sequence_, payload_size);
+  uint8_t *p = out->data();
+  std::memcpy(p, &header, sizeof(header));
+  float *scales = reinterpret_cast<float*>(p + sizeof(header));
+  float *offsets = scales + channels;
+  uint8_t *codes = reinterpret_cast<uint8_t*>(offsets + channels);
+
+  for (int c = 0; c < channels; ++c) {
+    const float *x = planar_.data() + static_cast<size_t>(c)*voxels;
+    const auto range = std::minmax_element(x, x + voxels);
+    float half_range = 0.5f*(*range.second - *range.first);
+    if (options_.delta) {
+      half_range *= 1.0f + kDeltaHeadroom;
+    }
+    // A constant channel still needs a usable scale for later deltas.
+    half_range = std::max(half_range,
+        1e-6f*std::max(1.0f, std::fabs(*range.first)));
+    float scale = half_range/max;
+    float offset = 0.5f*(*range.first + *range.second);
+    std::memcpy(scales + c, &scale, sizeof(float));
+    std::memcpy(offsets + c, &offset, sizeof(float));
+
+    int32_t *q = codes_.data() + static_cast<size_t>(c)*voxels;
+    quantize(x, voxels, offset, scale, max, q);
+    // The header and scales keep the codes 2-byte aligned.
+    if (options_.precision == GRID_INT8) {
+      narrow(q, voxels, reinterpret_cast<int8_t*>(codes) +
+          static_cast<size_t>(c)*voxels);
+    } else {
+      narrow(q, voxels, reinterpret_cast<int16_t*>(codes) +
+          static_cast<size_t>(c)*voxels);
+    }
+  }
+}
+
+bool GridEncoder::encode_delta(std::vector<uint8_t> *out) {
+  const int channels = shape_.channels();
+  const int voxels = shape_.voxels();
+  const int max = code_max(options_.precision);
+  const size_t size = shape_.size();
+  const size_t blocks = (size + kGridDeltaBlock - 1)/kGridDeltaBlock;
+  const size_t mask_size = (blocks + 7)/8;
+
+  // Quantize with the keyframe's scales; anything out of its range or more
+  // than an int8 step away from the reference needs a new keyframe.
+  for (int c = 0; c < channels; ++c) {
+    if (quantize(planar_.data() + static_cast<size_t>(c)*voxels, voxels,
+          reference_.offset(c), reference_.scale(c), max,
+          codes_.data() + static_cast<size_t>(c)*voxels)) {
+      return false;
+    }
+  }
+  std::vector<uint8_t> mask(mask_size, 0);
+  size_t changed = 0;
+  for (size_t b = 0; b < blocks; ++b) {
+    const size_t start = b*kGridDeltaBlock;
+    const int n = std::min<size_t>(kGridDeltaBlock, size - start);
+    bool block_changed = false;
+    const bool out_of_range = options_.precision == GRID_INT8 ?
+      subtract_reference(reference_.codes8_.data() + start, n,
+          codes_.data() + start, &block_changed) :
+      subtract_reference(reference_.codes16_.data() + start, n,
+          codes_.data() + start, &block_changed);
+    if (out_of_range) {
+      return false;
+    }
+    if (block_changed) {
+      mask[b/8] |= 1 << (b%8);
+      changed += n;
+    }
+  }
+
+  const size_t payload_size = mask_size + changed;
+  out->resize(sizeof(GridFrameHeader) + payload_size);
+  const GridFrameHeader header = make_header(shape_, options_.precision, false,
+      sequence_, payload_size);
+  uint8_t *p = out->data();
+  std::memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  std::memcpy(p, mask.data(), mask_size);
+  p += mask_size;
+  for (size_t b = 0; b < blocks; ++b) {
+    if (mask[b/8] & (1 << (b%8))) {
+      const size_t start = b*kGridDeltaBlock;
+      const int n = std::min<size_t>(kGridDeltaBlock, size - start);
+      narrow(codes_.data() + start, n, reinterpret_cast<int8_t*>(p));
+      p += n;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,235 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the grid transport formats of grid_codec.h on the coefficients of
+// a video (or a still image): bytes per frame against raw floats, the error on
+// the coefficients and on the rendered frames, and the codec's own cost.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <gflags/gflags.h>
+
+#include "cpu_renderer.h"
+#include "grid_codec.h"
+#include "processor.h"
+#include "timer.h"
+#include "utils.h"
+
+DEFINE_string(checkpoint_path, "", "Path to the network checkpoint (HDRNetCurves).");
+DEFINE_string(input_path, "", "Image used as every frame.");
+DEFINE_string(video_path, "", "Video to measure on instead of --input_path.");
+DEFINE_int32(frames, 100, "Maximum number of frames.");
+DEFINE_int32(keyframe_interval, 30, "With delta encoding, frames between keyframes.");
+DEFINE_bool(use_gpu, false, "Run the network on gpu.");
+DEFINE_bool(native, false, "Compute the coefficients with the built-in C++ network (requires model.hdrb).");
+DEFINE_string(output_path, "", "Optional JSON report.");
+
+namespace {
+
+typedef struct CodecResult {
+  std::string name;
+  GridCodecOptions options;
+  double bytes = 0.0;
+  int keyframes = 0;
+  double encode = 0.0;
+  double decode = 0.0;
+  double max_error = 0.0;
+  double mean_error = 0.0;
+  // Rendered with the codes against rendered with the floats.
+  double squared_error = 0.0;
+  int max_pixel_error = 0;
+} CodecResult;
+
+double psnr(double mse) {
+  return mse > 0 ? 10.0*std::log10(255.0*255.0/mse) : INFINITY;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_checkpoint_path.empty()) {
+      std::cerr << "--checkpoint_path is required." << std::endl;
+      return 1;
+  }
+  if (FLAGS_input_path.empty() && FLAGS_video_path.empty()) {
+    std::cerr << "--input_path or --video_path is required." << std::endl;
+    return 1;
+  }
+  std::string checkpoint_path = FLAGS_checkpoint_path + "/";
+
+  cv::Mat image;
+  cv::VideoCapture capture;
+  if (!FLAGS_video_path.empty()) {
+    if (!capture.open(FLAGS_video_path)) {
+      std::cout << "Failed to open " << FLAGS_video_path << std::endl;
+      return 1;
+    }
+  } else {
+    image = load_image(FLAGS_input_path);
+    if (!image.data) {
+      std::cout << "Failed to load " << FLAGS_input_path << std::endl;
+      return 1;
+    }
+  }
+
+  BatchProcessor net(checkpoint_path, FLAGS_use_gpu, 1, FLAGS_native);
+  GridShape shape;
+  shape.depth = net.grid_depth();
+  shape.height = net.grid_height();
+  shape.width = net.grid_width();
+
+  std::vector<CodecResult> results;
+  for (int delta = 0; delta < 2; ++delta)
+  for (GridPrecision precision : {GRID_INT16, GRID_INT8}) {
+    CodecResult result;
+    result.name = std::string(precision == GRID_INT8 ? "int8" : "int16") +
+      (delta ? "_delta" : "");
+    result.options.precision = precision;
+    result.options.delta = delta;
+    result.options.keyframe_interval = FLAGS_keyframe_interval;
+    results.push_back(result);
+  }
+  std::vector<GridEncoder> encoders;
+  std::vector<QuantizedGrid> decoders;
+  for (const CodecResult &result : results) {
+    encoders.emplace_back(shape, result.options);
+    decoders.emplace_back(shape);
+  }
+
+  std::vector<float> lowres(net.net_input_size()*net.net_input_size()*3);
+  std::vector<float> grid(shape.size()), dequantized(shape.size());
+  std::vector<uint8_t> encoded;
+  cv::Mat frame, frame_bgr, reference, rendered;
+  Timer timer;
+  int frames = 0;
+  while (frames < FLAGS_frames) {
+    if (capture.isOpened()) {
+      if (!capture.read(frame_bgr)) {
+        break;
+      }
+      cv::cvtColor(frame_bgr, frame, CV_BGR2RGB, 3);
+    } else {
+      frame = image;
+    }
+    net.prepare_input(frame, lowres.data());
+    net.forward({lowres.data()}, {grid.data()});
+    net.renderer().render(frame, grid.data(), reference);
+
+    for (size_t i = 0; i < results.size(); ++i) {
+      CodecResult &result = results[i];
+      timer.start();
+      result.keyframes += encoders[i].encode(grid.data(), &encoded);
+      result.encode += timer.duration();
+      result.bytes += encoded.size();
+
+      timer.start();
+      if (!decoders[i].decode(encoded.data(), encoded.size())) {
+        std::cout << "Failed to decode " << result.name << " frame " << frames
+          << std::endl;
+        return 1;
+      }
+      result.decode += timer.duration();
+
+      decoders[i].dequantize(dequantized.data());
+      double error = 0.0;
+      for (size_t j = 0; j < grid.size(); ++j) {
+        const double e = std::fabs(dequantized[j] - grid[j]);
+        result.max_error = std::max(result.max_error, e);
+        error += e;
+      }
+      result.mean_error += error/grid.size();
+
+      net.renderer().render(frame, decoders[i], rendered);
+      double squared_error = 0.0;
+      for (int y = 0; y < rendered.rows; ++y) {
+        const unsigned char *a = reference.ptr<unsigned char>(y);
+        const unsigned char *b = rendered.ptr<unsigned char>(y);
+        for (int x = 0; x < rendered.cols*3; ++x) {
+          const int e = std::abs(a[x] - b[x]);
+          result.max_pixel_error = std::max(result.max_pixel_error, e);
+          squared_error += e*e;
+        }
+      }
+      result.squared_error += squared_error/(rendered.total()*3);
+    }
+    ++frames;
+    printf("Frame %d.\r", frames);
+  }
+  printf("\n");
+  if (frames == 0) {
+    std::cout << "No frames." << std::endl;
+    return 1;
+  }
+
+  const double float_bytes = shape.size()*sizeof(float);
+  std::cout << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Grid transport (" << frames << " frames, " << float_bytes
+    << " bytes as floats)" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  for (const CodecResult &result : results) {
+    std::cout << result.name << ": " << result.bytes/frames << " bytes/frame ("
+      << float_bytes*frames/result.bytes << "x smaller), "
+      << result.keyframes << " keyframes" << std::endl;
+    std::cout << "  coefficient error: mean " << result.mean_error/frames
+      << ", max " << result.max_error << std::endl;
+    std::cout << "  rendered: PSNR " << psnr(result.squared_error/frames)
+      << " dB, max " << result.max_pixel_error << "/255" << std::endl;
+    std::cout << "  encode " << result.encode/frames << " ms, decode "
+      << result.decode/frames << " ms" << std::endl;
+  }
+  std::cout << "------------------------------" << std::endl;
+  std::cout << std::endl;
+
+  if (!FLAGS_output_path.empty()) {
+    std::ofstream file;
+    file.open(FLAGS_output_path, std::ios::out);
+    if(!file) {
+      std::cout << "Failed to open file for writing " << FLAGS_output_path << std::endl;
+      throw;
+    }
+    file << "{" << std::endl;
+    file << "\"frames\": " << frames << "," << std::endl;
+    file << "\"float_bytes\": " << float_bytes << "," << std::endl;
+    file << "\"codecs\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+      const CodecResult &result = results[i];
+      file << "  {\"name\": \"" << result.name << "\""
+        << ", \"bytes\": " << result.bytes/frames
+        << ", \"keyframes\": " << result.keyframes
+        << ", \"mean_error\": " << result.mean_error/frames
+        << ", \"max_error\": " << result.max_error
+        << ", \"mse\": " << result.squared_error/frames
+        << ", \"max_pixel_error\": " << result.max_pixel_error
+        << ", \"encode\": " << result.encode/frames
+        << ", \"decode\": " << result.decode/frames << "}"
+        << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    file << "]" << std::endl;
+    file << "}" << std::endl;
+    file.close();
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "incremental_renderer.h"
+
+#include <algorithm>
+
+namespace {
+
+void axis_cells(int size, int grid_size, std::vector<int> *cells) {
+  cells->resize(2*size);
+  for (int i = 0; i < size; ++i) {
+    CpuRenderer::pixel_cells(i, size, grid_size, &(*cells)[2*i],
+        &(*cells)[2*i + 1]);
+  }
+}
+
+}  // namespace
+
+IncrementalRenderer::IncrementalRenderer(const CpuRenderer *renderer)
+  : renderer_(renderer)
+{
+}
+
+int64_t IncrementalRenderer::render(const cv::Mat &input,
+    const float *coeffs) {
+  const int width = input.cols;
+  const int height = input.rows;
+  const int grid_width = renderer_->grid_width();
+  const int grid_height = renderer_->grid_height();
+  const int grid_depth = renderer_->grid_depth();
+  const int grid_size = 3*grid_depth*grid_height*grid_width*4;
+
+  if (grid_.empty() || output_.empty() || output_.cols != width ||
+      output_.rows != height) {
+    output_.create(height, width, CV_8UC3);
+    axis_cells(width, grid_width, &x_cells_);
+    axis_cells(height, grid_height, &y_cells_);
+    renderer_->render_region(input, coeffs, 0, width, 0, height, output_);
+    grid_.assign(coeffs, coeffs + grid_size);
+    return static_cast<int64_t>(width)*height;
+  }
+
+  // Layout (3, grid_depth, grid_height, grid_width, 4).
+  dirty_.assign(grid_width*grid_height, 0);
+  for (int rz = 0; rz < 3*grid_depth; ++rz)
+  for (int column = 0; column < grid_width*grid_height; ++column) {
+    const int offset = 4*(rz*grid_width*grid_height + column);
+    if (!std::equal(coeffs + offset, coeffs + offset + 4,
+          grid_.begin() + offset)) {
+      dirty_[column] = 1;
+    }
+  }
+  std::copy(coeffs, coeffs + grid_size, grid_.begin());
+
+  // Rows sampling the same two grid rows form a band, in which a pixel is
+  // dirty if one of the four columns it samples is.
+  int64_t rendered = 0;
+  int y_begin = 0;
+  while (y_begin < height) {
+    const int gy0 = y_cells_[2*y_begin];
+    const int gy1 = y_cells_[2*y_begin + 1];
+    int y_end = y_begin + 1;
+    while (y_end < height && y_cells_[2*y_end] == gy0 &&
+        y_cells_[2*y_end + 1] == gy1) {
+      ++y_end;
+    }
+    const char *dirty0 = &dirty_[gy0*grid_width];
+    const char *dirty1 = &dirty_[gy1*grid_width];
+    auto dirty = [&](int x) {
+      const int gx0 = x_cells_[2*x];
+      const int gx1 = x_cells_[2*x + 1];
+      return dirty0[gx0] || dirty0[gx1] || dirty1[gx0] || dirty1[gx1];
+    };
+
+    int x = 0;
+    while (x < width) {
+      if (!dirty(x)) {
+        ++x;
+        continue;
+      }
+      const int x_begin = x;
+      while (x < width && dirty(x)) {
+        ++x;
+      }
+      renderer_->render_region(input, coeffs, x_begin, x, y_begin, y_end,
+          output_);
+      rendered += static_cast<int64_t>(x - x_begin)*(y_end - y_begin);
+    }
+    y_begin = y_end;
+  }
+  return rendered;
+}
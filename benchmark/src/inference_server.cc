@@ -0,0 +1,269 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "inference_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "timer.h"
+
+struct InferenceServer::Request {
+  cv::Mat input;
+  cv::Mat output;
+  std::vector<float> lowres;
+  std::vector<float> grid;
+
+  // Started when the request has been read; the stage boundaries below are
+  // read from it.
+  Timer timer;
+  std::chrono::steady_clock::time_point queued;
+  double batch_start = 0.0;
+  double forward_done = 0.0;
+  ResponseHeader response = ResponseHeader();
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done = false;
+};
+
+InferenceServer::InferenceServer(BatchProcessor *processor,
+    const ServerOptions &options)
+  : processor_(processor), options_(options), stopping_(false), listen_fd_(-1)
+{
+  options_.max_batch = std::max(1, std::min(options_.max_batch,
+        processor_->max_batch()));
+  options_.slice_threads = std::max(1, options_.slice_threads);
+}
+
+InferenceServer::~InferenceServer()
+{
+}
+
+void InferenceServer::interrupt() {
+  stopping_ = true;
+  int fd = listen_fd_;
+  if (fd >= 0) {
+    // Wakes up accept().
+    shutdown(fd, SHUT_RDWR);
+  }
+}
+
+bool InferenceServer::run() {
+  int fd = listen_unix(options_.socket_path);
+  if (fd < 0) {
+    std::cout << "Failed to listen on " << options_.socket_path << std::endl;
+    return false;
+  }
+  listen_fd_ = fd;
+  std::cout << "Listening on " << options_.socket_path << " (max_batch "
+    << options_.max_batch << ", max_wait " << options_.max_wait_us << " us, "
+    << options_.slice_threads << " slicing threads)." << std::endl;
+
+  std::thread batcher(&InferenceServer::batch_loop, this);
+  std::vector<std::thread> slicers;
+  for (int i = 0; i < options_.slice_threads; ++i) {
+    slicers.emplace_back(&InferenceServer::slice_loop, this);
+  }
+
+  while (!stopping_) {
+    int client = accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connection_fds_.push_back(client);
+    std::thread(&InferenceServer::serve_connection, this, client).detach();
+  }
+  std::cout << "Shutting down." << std::endl;
+
+  // Stop reading new requests; the ones in flight are still answered.
+  {
+    std::unique_lock<std::mutex> lock(connections_mutex_);
+    for (int client : connection_fds_) {
+      shutdown(client, SHUT_RD);
+    }
+    connections_cv_.wait(lock, [this] { return connection_fds_.empty(); });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(batch_mutex_);
+    batch_stopping_ = true;
+  }
+  batch_cv_.notify_all();
+  batcher.join();
+  {
+    std::lock_guard<std::mutex> lock(slice_mutex_);
+    slice_stopping_ = true;
+  }
+  slice_cv_.notify_all();
+  for (std::thread &slicer : slicers) {
+    slicer.join();
+  }
+
+  listen_fd_ = -1;
+  close(fd);
+  unlink(options_.socket_path.c_str());
+  return true;
+}
+
+void InferenceServer::serve_connection(int fd) {
+  const int lowres_size =
+    processor_->net_input_size()*processor_->net_input_size()*3;
+  while (true) {
+    RequestHeader header;
+    if (!read_fully(fd, &header, sizeof(header))) {
+      break;
+    }
+    if (header.magic != kRequestMagic ||
+        header.width == 0 || header.width > kMaxImageSize ||
+        header.height == 0 || header.height > kMaxImageSize) {
+      // We can't find the next request in the stream anymore.
+      ResponseHeader response = ResponseHeader();
+      response.magic = kResponseMagic;
+      response.status = RESPONSE_BAD_REQUEST;
+      write_fully(fd, &response, sizeof(response));
+      break;
+    }
+
+    Request request;
+    request.input.create(header.height, header.width, CV_8UC3);
+    if (!read_fully(fd, request.input.data, request.input.total()*3)) {
+      break;
+    }
+    request.timer.start();
+    request.lowres.resize(lowres_size);
+    processor_->prepare_input(request.input, request.lowres.data());
+    request.response.prepare = request.timer.duration();
+
+    {
+      std::lock_guard<std::mutex> lock(batch_mutex_);
+      request.queued = std::chrono::steady_clock::now();
+      batch_queue_.push_back(&request);
+    }
+    batch_cv_.notify_one();
+    {
+      std::unique_lock<std::mutex> lock(request.mutex);
+      request.cv.wait(lock, [&request] { return request.done; });
+    }
+
+    request.response.magic = kResponseMagic;
+    request.response.status = RESPONSE_OK;
+    request.response.width = header.width;
+    request.response.height = header.height;
+    if (!write_fully(fd, &request.response, sizeof(request.response)) ||
+        !write_fully(fd, request.output.data, request.output.total()*3)) {
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  connection_fds_.erase(
+      std::find(connection_fds_.begin(), connection_fds_.end(), fd));
+  close(fd);
+  connections_cv_.notify_all();
+}
+
+void InferenceServer::batch_loop() {
+  const int grid_size = processor_->coefficients_size();
+  const size_t max_batch = options_.max_batch;
+  const std::chrono::microseconds max_wait(options_.max_wait_us);
+
+  std::vector<Request*> batch;
+  std::vector<const float*> lowres;
+  std::vector<float*> grids;
+  Timer timer;
+  while (true) {
+    batch.clear();
+    {
+      std::unique_lock<std::mutex> lock(batch_mutex_);
+      batch_cv_.wait(lock, [this] {
+          return batch_stopping_ || !batch_queue_.empty(); });
+      if (batch_queue_.empty()) {
+        return;
+      }
+      // Give concurrent requests a chance to join the oldest one.
+      batch_cv_.wait_until(lock, batch_queue_.front()->queued + max_wait,
+          [this, max_batch] {
+            return batch_stopping_ || batch_queue_.size() >= max_batch; });
+      const size_t n = std::min(batch_queue_.size(), max_batch);
+      batch.assign(batch_queue_.begin(), batch_queue_.begin() + n);
+      batch_queue_.erase(batch_queue_.begin(), batch_queue_.begin() + n);
+    }
+
+    lowres.clear();
+    grids.clear();
+    for (Request *request : batch) {
+      request->batch_start = request->timer.duration();
+      request->grid.resize(grid_size);
+      lowres.push_back(request->lowres.data());
+      grids.push_back(request->grid.data());
+    }
+    timer.start();
+    processor_->forward(lowres, grids);
+    const double forward = timer.duration();
+
+    {
+      std::lock_guard<std::mutex> lock(slice_mutex_);
+      for (Request *request : batch) {
+        request->forward_done = request->timer.duration();
+        request->response.batch_size = batch.size();
+        request->response.batch_wait =
+          request->batch_start - request->response.prepare;
+        request->response.forward = forward;
+        slice_queue_.push_back(request);
+      }
+    }
+    slice_cv_.notify_all();
+  }
+}
+
+void InferenceServer::slice_loop() {
+  while (true) {
+    Request *request;
+    {
+      std::unique_lock<std::mutex> lock(slice_mutex_);
+      slice_cv_.wait(lock, [this] {
+          return slice_stopping_ || !slice_queue_.empty(); });
+      if (slice_queue_.empty()) {
+        return;
+      }
+      request = slice_queue_.front();
+      slice_queue_.pop_front();
+    }
+
+    const double slice_start = request->timer.duration();
+    processor_->renderer().render(request->input, request->grid.data(),
+        request->output);
+    const double done = request->timer.duration();
+    request->response.slice_wait = slice_start - request->forward_done;
+    request->response.slice = done - slice_start;
+    request->response.total = done;
+
+    {
+      std::lock_guard<std::mutex> lock(request->mutex);
+      request->done = true;
+    }
+    request->cv.notify_one();
+  }
+}
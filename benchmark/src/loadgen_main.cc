@@ -0,0 +1,230 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Load generator for the inference server: for each concurrency level, that
+// many clients send the same image back to back, and we report throughput
+// against client-side latency percentiles, with the server's breakdown.
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <gflags/gflags.h>
+#include <unistd.h>
+
+#include "server_protocol.h"
+#include "timer.h"
+
+DEFINE_string(socket_path, "/tmp/hdrnet.sock", "Unix socket of the server.");
+DEFINE_string(input_path, "", "Image sent with every request.");
+DEFINE_string(concurrency, "1,2,4,8,16", "Comma-separated numbers of concurrent clients.");
+DEFINE_int32(requests, 50, "Requests per client and concurrency level.");
+DEFINE_string(output_path, "", "Optional JSON report.");
+
+namespace {
+
+typedef struct Sample {
+  double latency;
+  ResponseHeader response;
+} Sample;
+
+typedef struct LevelResult {
+  int concurrency = 0;
+  int requests = 0;
+  int failures = 0;
+  double throughput = 0.0;
+  double p50 = 0.0;
+  double p90 = 0.0;
+  double p99 = 0.0;
+  double batch_size = 0.0;
+  double prepare = 0.0;
+  double batch_wait = 0.0;
+  double forward = 0.0;
+  double slice_wait = 0.0;
+  double slice = 0.0;
+} LevelResult;
+
+// Sends `count` requests on one connection. Returns false on failure.
+bool run_client(const cv::Mat &image, int count, std::vector<Sample> *samples) {
+  int fd = connect_unix(FLAGS_socket_path);
+  if (fd < 0) {
+    return false;
+  }
+  RequestHeader header = RequestHeader();
+  header.magic = kRequestMagic;
+  header.width = image.cols;
+  header.height = image.rows;
+  const size_t size = image.total()*3;
+  std::vector<unsigned char> output(size);
+
+  Timer timer;
+  bool ok = true;
+  for (int i = 0; i < count && ok; ++i) {
+    Sample sample;
+    timer.start();
+    ok = write_fully(fd, &header, sizeof(header)) &&
+      write_fully(fd, image.data, size) &&
+      read_fully(fd, &sample.response, sizeof(sample.response)) &&
+      sample.response.magic == kResponseMagic &&
+      sample.response.status == RESPONSE_OK &&
+      read_fully(fd, output.data(), size);
+    sample.latency = timer.duration();
+    if (ok) {
+      samples->push_back(sample);
+    }
+  }
+  close(fd);
+  return ok;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t i = std::min(sorted.size() - 1,
+      static_cast<size_t>(p*(sorted.size() - 1) + 0.5));
+  return sorted[i];
+}
+
+LevelResult run_level(const cv::Mat &image, int concurrency) {
+  std::vector<std::vector<Sample>> samples(concurrency);
+  std::vector<char> ok(concurrency);
+  std::vector<std::thread> clients;
+
+  Timer timer;
+  timer.start();
+  for (int i = 0; i < concurrency; ++i) {
+    clients.emplace_back([&, i] {
+        ok[i] = run_client(image, FLAGS_requests, &samples[i]); });
+  }
+  for (std::thread &client : clients) {
+    client.join();
+  }
+  const double elapsed = timer.duration();
+
+  LevelResult result;
+  result.concurrency = concurrency;
+  std::vector<double> latencies;
+  for (int i = 0; i < concurrency; ++i) {
+    result.failures += !ok[i];
+    for (const Sample &sample : samples[i]) {
+      latencies.push_back(sample.latency);
+      result.batch_size += sample.response.batch_size;
+      result.prepare += sample.response.prepare;
+      result.batch_wait += sample.response.batch_wait;
+      result.forward += sample.response.forward;
+      result.slice_wait += sample.response.slice_wait;
+      result.slice += sample.response.slice;
+    }
+  }
+  result.requests = latencies.size();
+  const double n = std::max(1, result.requests);
+  result.throughput = elapsed > 0.0 ? 1000.0*result.requests/elapsed : 0.0;
+  result.batch_size /= n;
+  result.prepare /= n;
+  result.batch_wait /= n;
+  result.forward /= n;
+  result.slice_wait /= n;
+  result.slice /= n;
+
+  std::sort(latencies.begin(), latencies.end());
+  result.p50 = percentile(latencies, 0.5);
+  result.p90 = percentile(latencies, 0.9);
+  result.p99 = percentile(latencies, 0.99);
+  return result;
+}
+
+void save(const std::vector<LevelResult> &results, const std::string &filename) {
+  std::ofstream file;
+  file.open(filename, std::ios::out);
+  if(!file) {
+    std::cout << "Failed to open file for writing " << filename << std::endl;
+    throw;
+  }
+  file << "[" << std::endl;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const LevelResult &r = results[i];
+    file << "{\"concurrency\": " << r.concurrency
+      << ", \"requests\": " << r.requests
+      << ", \"failures\": " << r.failures
+      << ", \"throughput\": " << r.throughput
+      << ", \"p50\": " << r.p50
+      << ", \"p90\": " << r.p90
+      << ", \"p99\": " << r.p99
+      << ", \"batch_size\": " << r.batch_size
+      << ", \"prepare\": " << r.prepare
+      << ", \"batch_wait\": " << r.batch_wait
+      << ", \"forward\": " << r.forward
+      << ", \"slice_wait\": " << r.slice_wait
+      << ", \"slice\": " << r.slice << "}"
+      << (i + 1 < results.size() ? "," : "") << std::endl;
+  }
+  file << "]" << std::endl;
+  file.close();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_input_path.empty()) {
+      std::cerr << "--input_path is required." << std::endl;
+      return 1;
+  }
+  cv::Mat image = cv::imread(FLAGS_input_path, CV_LOAD_IMAGE_COLOR);
+  if (!image.data) {
+    std::cout << "Failed to load " << FLAGS_input_path << std::endl;
+    return 1;
+  }
+  cv::cvtColor(image, image, CV_BGR2RGB);
+
+  std::vector<int> levels;
+  std::stringstream stream(FLAGS_concurrency);
+  std::string level;
+  while (std::getline(stream, level, ',')) {
+    levels.push_back(std::max(1, std::stoi(level)));
+  }
+
+  std::cout << image.cols << "x" << image.rows << ", " << FLAGS_requests
+    << " requests per client." << std::endl;
+  printf("%8s %10s %8s %8s %8s %6s %8s %8s %8s %8s\n",
+      "clients", "req/s", "p50", "p90", "p99", "batch",
+      "b_wait", "forward", "s_wait", "slice");
+  std::vector<LevelResult> results;
+  for (int concurrency : levels) {
+    LevelResult r = run_level(image, concurrency);
+    printf("%8d %10.1f %8.2f %8.2f %8.2f %6.2f %8.2f %8.2f %8.2f %8.2f\n",
+        r.concurrency, r.throughput, r.p50, r.p90, r.p99, r.batch_size,
+        r.batch_wait, r.forward, r.slice_wait, r.slice);
+    if (r.failures > 0) {
+      std::cout << r.failures << " clients failed." << std::endl;
+    }
+    results.push_back(r);
+  }
+  std::cout << "(latencies in ms)" << std::endl;
+
+  if (!FLAGS_output_path.empty()) {
+    save(results, FLAGS_output_path);
+  }
+  return 0;
+}
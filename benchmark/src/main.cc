@@ -13,9 +13,13 @@
 // limitations under the License.
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <random>
+#include <string>
+#include <vector>
 
 #include <GL/glew.h>
 #include <GL/freeglut.h>
@@ -27,6 +31,10 @@
 #include "timer.h"
 #include "processor.h"
 #include "utils.h"
+#include "deadline_scheduler.h"
+#include "incremental_renderer.h"
+#include "progressive_renderer.h"
+#include "video_processor.h"
 
 DEFINE_bool(use_gpu, false, "Run computation on gpu.");
 DEFINE_int32(burn_iters, 2, "Iterations to run without benchmarking.");
@@ -35,6 +43,180 @@ DEFINE_string(output_directory, "", "Destination for the output image and report
 DEFINE_string(input_path, "", "Path to the input image file (tested on square images only).");
 DEFINE_string(checkpoint_path, "", "Path to the network checkpoint");
 DEFINE_string(mode, "HDRNetCurves", "Type of network (HDRNetCurves, HDRNetGaussianPyrNN, Direct)");
+DEFINE_bool(native, false, "Compute the coefficients with the built-in C++ network instead of TensorFlow (requires model.hdrb).");
+DEFINE_string(video_path, "", "Process a video file instead of --input_path, reusing coefficients across frames.");
+DEFINE_double(change_threshold, 0.0, "Video mode: skip the network when the mean absolute low-res change since the last evaluated frame is below this.");
+DEFINE_int32(keyframe_interval, 1, "Video mode: run the network every N frames and interpolate grids in between.");
+DEFINE_double(deadline_ms, 0.0, "Per-frame deadline; when predicted to be missed, reuse the last grid, at full or half resolution, or apply a fitted LUT instead. 0 disables.");
+DEFINE_int32(progressive_stride, 0, "Render on the CPU coarse to fine, starting with every N-th pixel (a power of two), and report the time to preview and to full quality. 0 disables.");
+DEFINE_int32(local_edit_cells, 0, "Render on the CPU, and also time incremental re-renders after edits of N x N grid cells. 0 disables.");
+DEFINE_bool(check_native, false, "Instead of benchmarking, compare the coefficients of the native network (model.hdrb) with the TensorFlow graph's, on the input and on random images, and fail beyond --native_tolerance.");
+DEFINE_double(native_tolerance, 1e-3, "Largest coefficient difference allowed by --check_native, relative to the largest TensorFlow coefficient.");
+
+// Streams --video_path through `processor`, writes the result next to the
+// report and prints the fraction of network evaluations saved.
+int process_video(HybridGLProcessor *processor, cv::VideoCapture &capture,
+    const std::string &video_output_path, const std::string &json_output_path)
+{
+  VideoOptions options;
+  options.change_threshold = FLAGS_change_threshold;
+  options.keyframe_interval = FLAGS_keyframe_interval;
+  VideoProcessor video(processor, options);
+
+  const double fps = capture.get(CV_CAP_PROP_FPS);
+  cv::VideoWriter writer;
+  std::vector<cv::Mat> outputs;
+  cv::Mat frame_bgr, frame_rgb, output_bgr;
+
+  Timer wall_timer;
+  wall_timer.start();
+  bool done = false;
+  while (!done) {
+    if (capture.read(frame_bgr)) {
+      cv::cvtColor(frame_bgr, frame_rgb, CV_BGR2RGB, 3);
+      video.process(frame_rgb, &outputs);
+    } else {
+      video.flush(&outputs);
+      done = true;
+    }
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      if (!writer.isOpened()) {
+        writer.open(video_output_path, CV_FOURCC('M', 'J', 'P', 'G'),
+            fps > 0 ? fps : 30.0, outputs[i].size());
+      }
+      cv::cvtColor(outputs[i], output_bgr, CV_RGB2BGR, 3);
+      writer.write(output_bgr);
+    }
+    outputs.clear();
+    printf("Processed frame %d.\r", video.stats().frames);
+  }
+  printf("\n");
+
+  VideoStats &stats = video.stats();
+  stats.wall_time = wall_timer.duration();
+  const double n = stats.frames > 0 ? stats.frames : 1;
+  std::cout << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Video (" << stats.frames << " frames)" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Network evaluations: " << stats.evaluations << " ("
+    << 100.0*stats.fraction_saved() << "% saved)" << std::endl;
+  std::cout << "Throughput (incl. decode, encode): " << stats.fps() << " fps"
+    << std::endl;
+  std::cout << "Change detection: " << stats.change_detection/n << " ms"
+    << std::endl;
+  std::cout << "Grid interpolation: " << stats.interpolation/n << " ms"
+    << std::endl;
+  std::cout << "Net forward pass: " << stats.timing.forward_pass/n << " ms"
+    << std::endl;
+  std::cout << "Rendering (GL: upload coeffs, draw, readback): "
+    << (stats.timing.rendering_gl_coeff + stats.timing.rendering_gl_draw
+        + stats.timing.rendering_gl_readback)/n << " ms" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << std::endl;
+
+  stats.save(json_output_path);
+  return 0;
+}
+
+// Runs the TensorFlow graph and the native network on the low-res `input`
+// and on a few random images, and compares their coefficients. Returns the
+// exit status: 0 if every difference is within --native_tolerance.
+int check_native(const std::string &checkpoint_path, const cv::Mat &input)
+{
+  BatchProcessor reference(checkpoint_path, FLAGS_use_gpu, 1, false);
+  BatchProcessor native(checkpoint_path, false, 1, true);
+  if (reference.coefficients_size() != native.coefficients_size()) {
+    std::cout << "Grid sizes differ: " << reference.coefficients_size()
+      << " (TensorFlow) vs " << native.coefficients_size() << " (native)"
+      << std::endl;
+    return 1;
+  }
+
+  const int size = reference.net_input_size();
+  std::vector<std::vector<float>> inputs(4,
+      std::vector<float>(size*size*3));
+  reference.prepare_input(input, inputs[0].data());
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  for (size_t i = 1; i < inputs.size(); ++i) {
+    for (float &value : inputs[i]) {
+      value = uniform(rng);
+    }
+  }
+
+  std::vector<float> expected(reference.coefficients_size());
+  std::vector<float> actual(native.coefficients_size());
+  bool ok = true;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    reference.forward({inputs[i].data()}, {expected.data()});
+    native.forward({inputs[i].data()}, {actual.data()});
+    double scale = 0.0;
+    double max_error = 0.0;
+    size_t worst = 0;
+    for (size_t j = 0; j < expected.size(); ++j) {
+      scale = std::max(scale, std::fabs(static_cast<double>(expected[j])));
+      const double error = std::fabs(static_cast<double>(actual[j]) - expected[j]);
+      if (error > max_error) {
+        max_error = error;
+        worst = j;
+      }
+    }
+    const double relative = scale > 0.0 ? max_error/scale : max_error;
+    const bool pass = relative <= FLAGS_native_tolerance;
+    std::cout << (i == 0 ? "Input image" : "Random image " + std::to_string(i))
+      << ": max difference " << max_error << " (" << relative
+      << " of the largest coefficient) at " << worst << ", "
+      << (pass ? "ok" : "FAILED") << std::endl;
+    ok = ok && pass;
+  }
+  return ok ? 0 : 1;
+}
+
+// Edits a local_edit_cells x local_edit_cells block of the grid of `input`
+// `iters` times, at a different place each time, and times the incremental
+// re-render of each edit against a complete render.
+void measure_local_edits(BatchProcessor *processor, const cv::Mat &input,
+    int iters, BenchmarkResult *result)
+{
+  const CpuRenderer &renderer = processor->renderer();
+  std::vector<float> lowres(
+      processor->net_input_size()*processor->net_input_size()*3);
+  std::vector<float> grid(processor->coefficients_size());
+  processor->prepare_input(input, lowres.data());
+  processor->forward({lowres.data()}, {grid.data()});
+
+  IncrementalRenderer incremental(&renderer);
+  Timer timer;
+  timer.start();
+  incremental.render(input, grid.data());
+  const double full_render = timer.duration();
+
+  const int cells = std::min(FLAGS_local_edit_cells,
+      std::min(renderer.grid_width(), renderer.grid_height()));
+  double render_time = 0.0;
+  double rendered = 0.0;
+  for (int i = 0; i < iters; ++i) {
+    // Raise the offset of every channel in the block, at all depths.
+    const int gx_begin = (i*cells) % (renderer.grid_width() - cells + 1);
+    const int gy_begin = (i*cells/2) % (renderer.grid_height() - cells + 1);
+    for (int rz = 0; rz < 3*renderer.grid_depth(); ++rz)
+    for (int gy = gy_begin; gy < gy_begin + cells; ++gy)
+    for (int gx = gx_begin; gx < gx_begin + cells; ++gx) {
+      grid[4*((rz*renderer.grid_height() + gy)*renderer.grid_width() + gx) + 3]
+        += 0.05f;
+    }
+    timer.start();
+    rendered += incremental.render(input, grid.data());
+    render_time += timer.duration();
+  }
+  result->local_edit_render = render_time/iters;
+  result->local_edit_fraction = rendered/iters/(input.cols*input.rows);
+  std::cout << "Local edit (" << cells << "x" << cells << " cells): "
+    << result->local_edit_render << " ms, "
+    << 100.0*result->local_edit_fraction << "% of the pixels (complete render: "
+    << full_render << " ms)" << std::endl;
+}
 
 int main(int argc, char *argv[])
 {
@@ -49,8 +231,8 @@ int main(int argc, char *argv[])
   std::string input_path = FLAGS_input_path;
   std::string checkpoint_path = FLAGS_checkpoint_path;
 
-  if (FLAGS_input_path.empty()) {
-      std::cerr << "--input_path is required." << std::endl;
+  if (FLAGS_input_path.empty() && FLAGS_video_path.empty()) {
+      std::cerr << "--input_path or --video_path is required." << std::endl;
       return 1;
   }
   if (FLAGS_checkpoint_path.empty()) {
@@ -73,54 +255,158 @@ int main(int argc, char *argv[])
 
   std::cout << std::endl << "Model: " << model_name << "." << std::endl;
 
-  std::cout << "Loading " << input_path << ".";
-  cv::Mat image = load_image(input_path);
-  if (!image.data) {
-    std::cout << " FAILED" << std::endl;
-    return 1;
+  cv::Mat image;
+  cv::VideoCapture capture;
+  int image_width, image_height;
+  if (!FLAGS_video_path.empty()) {
+    std::cout << "Opening " << FLAGS_video_path << ".";
+    if (!capture.open(FLAGS_video_path)) {
+      std::cout << " FAILED" << std::endl;
+      return 1;
+    }
+    image_width = capture.get(CV_CAP_PROP_FRAME_WIDTH);
+    image_height = capture.get(CV_CAP_PROP_FRAME_HEIGHT);
+  } else {
+    std::cout << "Loading " << input_path << ".";
+    image = load_image(input_path);
+    if (!image.data) {
+      std::cout << " FAILED" << std::endl;
+      return 1;
+    }
+    image_width = image.size().width;
+    image_height = image.size().height;
   }
-  int image_width = image.size().width;
-  int image_height = image.size().height;
   std::cout <<  image_width << "x" << image_height << std::endl;
 
+  if (FLAGS_check_native) {
+    if (FLAGS_mode != "HDRNetCurves" || !FLAGS_video_path.empty()) {
+      std::cout << "--check_native requires HDRNetCurves on an image"
+        << std::endl;
+      return 1;
+    }
+    return check_native(checkpoint_path, image);
+  }
+
+  Timer startup_timer;
+  startup_timer.start();
   Processor *processor = nullptr;
-  if(FLAGS_mode == "HDRNetCurves") {
+  if (FLAGS_progressive_stride > 0 || FLAGS_local_edit_cells > 0) {
+    if (FLAGS_mode != "HDRNetCurves" || !FLAGS_video_path.empty() ||
+        FLAGS_deadline_ms > 0.0) {
+      std::cout << "--progressive_stride and --local_edit_cells require "
+        << "HDRNetCurves on an image, without --deadline_ms" << std::endl;
+      return 1;
+    }
+    // Rendered on the CPU, which can stop between rows or render part of the
+    // frame.
+    processor = new BatchProcessor(checkpoint_path, use_gpu, 1, FLAGS_native);
+  } else if(FLAGS_mode == "HDRNetCurves") {
     processor = new StandardProcessor(
-        image_width, image_height, checkpoint_path, use_gpu, root+"assets/");
+        image_width, image_height, checkpoint_path, use_gpu, root+"assets/",
+        FLAGS_native);
   } else if (FLAGS_mode == "Direct"){
     processor = new DirectNetProcessor(
         image_width, image_height, checkpoint_path, use_gpu);
   } else if(FLAGS_mode == "HDRNetGaussianPyrNN") {
     int net_input_size = 256;
     processor = new MultiscaleProcessor(
-        image_width, image_height, checkpoint_path, use_gpu, root+"assets/");
+        image_width, image_height, checkpoint_path, use_gpu, root+"assets/",
+        FLAGS_native);
   } else {
     std::cout << "Unrecognized mode " << FLAGS_mode << std::endl;
     return 1;
   }
+  double startup_time = startup_timer.duration();
+
+  if (capture.isOpened()) {
+    HybridGLProcessor *hybrid = dynamic_cast<HybridGLProcessor*>(processor);
+    if (!hybrid) {
+      std::cout << "Video mode requires HDRNetCurves or HDRNetGaussianPyrNN"
+        << std::endl;
+      return 1;
+    }
+    int status = process_video(hybrid, capture,
+        FLAGS_output_directory + "/" + model_name + ".avi", json_output_path);
+    delete processor;
+    return status;
+  }
+
+  DeadlineProcessor *scheduler = nullptr;
+  if (FLAGS_deadline_ms > 0.0) {
+    HybridGLProcessor *hybrid = dynamic_cast<HybridGLProcessor*>(processor);
+    if (!hybrid) {
+      std::cout << "--deadline_ms requires HDRNetCurves or HDRNetGaussianPyrNN"
+        << std::endl;
+      return 1;
+    }
+    scheduler = new DeadlineProcessor(hybrid, FLAGS_deadline_ms);
+  }
+
+  ProgressiveProcessor *progressive = nullptr;
+  if (FLAGS_progressive_stride > 0) {
+    progressive = new ProgressiveProcessor(
+        static_cast<BatchProcessor*>(processor), FLAGS_progressive_stride);
+  }
 
   cv::Mat output_rgb(image_height, image_width, CV_8UC3, cv::Scalar(0));
+  auto process = [&]() {
+    if (progressive) {
+      return progressive->process(image, output_rgb);
+    }
+    return scheduler ? scheduler->process(image, output_rgb)
+                     : processor->process(image, output_rgb);
+  };
 
   // Discard first few iterations.
   for (int i = 0; i < burn_iters; ++i) {
     printf("Burning in: iteration %d of %d.\r", i, burn_iters);
-    processor->process(image, output_rgb);
+    process();
   }
   printf("\n");
 
   // -- Processing ------------------------------
   BenchmarkResult result;
+  DeadlineStats burn_in_stats;
+  if (scheduler) {
+    burn_in_stats = scheduler->stats();
+  }
   for (int i = 0; i < iters; ++i) {
     printf("Running actual benchmark: iteration %d of %d.\r", i, iters);
-    result = result + processor->process(image, output_rgb);
+    result = result + process();
   }
   printf("\n");
 
   result /= iters;
+  result.startup = startup_time;
+  if (FLAGS_local_edit_cells > 0) {
+    measure_local_edits(static_cast<BatchProcessor*>(processor), image, iters,
+        &result);
+  }
+  if (scheduler) {
+    // Only count the benchmarked frames.
+    DeadlineStats stats = scheduler->stats();
+    stats.frames -= burn_in_stats.frames;
+    stats.hits -= burn_in_stats.hits;
+    for (int q = 0; q < NUM_QUALITIES; ++q) {
+      stats.frames_at[q] -= burn_in_stats.frames_at[q];
+    }
+    result.deadline = FLAGS_deadline_ms;
+    result.deadline_hit_rate = stats.hit_rate();
+    result.degraded_rate = stats.degraded_rate();
+    std::cout << "Deadline " << FLAGS_deadline_ms << " ms: "
+      << 100.0*result.deadline_hit_rate << "% on time, frames at";
+    for (int q = 0; q < NUM_QUALITIES; ++q) {
+      std::cout << " " << quality_name(static_cast<Quality>(q)) << "="
+        << stats.frames_at[q];
+    }
+    std::cout << std::endl;
+  }
   std::cout << std::endl;
   std::cout << "------------------------------" << std::endl;
   std::cout << "Benchmark (" << iters << " iterations)" << std::endl;
   std::cout << "------------------------------" << std::endl;
+  std::cout << "Startup (load model, create session): " <<
+    result.startup << " ms" << std::endl;
   std::cout << "Downsampling (CPU, Nearest): " <<
     result.downsampling << " ms" << std::endl;
   std::cout << "Convert input to float: " <<
@@ -136,6 +422,13 @@ int main(int argc, char *argv[])
   std::cout << "Rendering (GL: readback): " <<
     result.rendering_gl_readback << " ms" << std::endl;
   std::cout << "Total: " << result.total_time() << " ms" << std::endl;
+  if (progressive) {
+    std::cout << "Time to preview (stride "
+      << progressive->renderer().stride(0) << "): "
+      << result.time_to_preview << " ms" << std::endl;
+    std::cout << "Time to full quality (" << progressive->renderer().num_passes()
+      << " passes): " << result.time_to_full_quality << " ms" << std::endl;
+  }
   std::cout << "------------------------------" << std::endl;
   std::cout << std::endl;
 
@@ -148,6 +441,8 @@ int main(int argc, char *argv[])
   std::cout << "done." << std::endl;
 
 
+  delete progressive;
+  delete scheduler;
   delete processor;
 
   return 0;
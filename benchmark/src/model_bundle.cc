@@ -0,0 +1,162 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "model_bundle.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+uint32_t crc32(const void *data, size_t length) {
+  // Standard CRC-32 (polynomial 0xEDB88320), same as Python's zlib.crc32.
+  static uint32_t table[256] = {0};
+  static bool table_ready = false;
+  if (!table_ready) {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+    table_ready = true;
+  }
+
+  const uint8_t *bytes = static_cast<const uint8_t*>(data);
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < length; ++i) {
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+bool ModelBundle::exists(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+ModelBundle::ModelBundle(const std::string &path) : path_(path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cout << "Failed to open bundle " << path << std::endl;
+    throw;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    std::cout << "Failed to stat bundle " << path << std::endl;
+    throw;
+  }
+  size_ = st.st_size;
+  void *mapped = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cout << "Failed to map bundle " << path << std::endl;
+    throw;
+  }
+  base_ = static_cast<const uint8_t*>(mapped);
+  // From here on, failures unmap the bundle before throwing: the destructor
+  // of an object whose constructor throws does not run.
+
+  if (size_ < sizeof(BundleHeader)) {
+    std::cout << "Bundle " << path << " is truncated" << std::endl;
+    unmap();
+    throw;
+  }
+  header_ = reinterpret_cast<const BundleHeader*>(base_);
+  if (std::memcmp(header_->magic, kBundleMagic, 4) != 0) {
+    std::cout << path << " is not a model bundle" << std::endl;
+    unmap();
+    throw;
+  }
+  if (header_->version != kBundleVersion) {
+    std::cout << "Unsupported bundle version " << header_->version
+      << " (expected " << kBundleVersion << ")" << std::endl;
+    unmap();
+    throw;
+  }
+
+  const size_t table_size = header_->num_sections*sizeof(BundleSection);
+  if (size_ < sizeof(BundleHeader) + table_size) {
+    std::cout << "Bundle " << path << " is truncated" << std::endl;
+    unmap();
+    throw;
+  }
+  sections_ = reinterpret_cast<const BundleSection*>(
+      base_ + sizeof(BundleHeader));
+  if (crc32(sections_, table_size) != header_->table_crc32) {
+    std::cout << "Bundle " << path << ": corrupt section table" << std::endl;
+    unmap();
+    throw;
+  }
+
+  for (uint32_t i = 0; i < header_->num_sections; ++i) {
+    const BundleSection &s = sections_[i];
+    if (s.offset % kBundleAlignment != 0 || s.offset > size_ ||
+        s.size > size_ - s.offset) {
+      std::cout << "Bundle " << path << ": section " << s.name
+        << " is out of bounds" << std::endl;
+      unmap();
+      throw;
+    }
+    if (crc32(base_ + s.offset, s.size) != s.crc32) {
+      std::cout << "Bundle " << path << ": checksum mismatch in section "
+        << s.name << std::endl;
+      unmap();
+      throw;
+    }
+  }
+}
+
+ModelBundle::~ModelBundle()
+{
+  unmap();
+}
+
+void ModelBundle::unmap() {
+  if (base_) {
+    munmap(const_cast<uint8_t*>(base_), size_);
+    base_ = nullptr;
+  }
+}
+
+const BundleSection *ModelBundle::find(const std::string &name) const {
+  for (uint32_t i = 0; i < header_->num_sections; ++i) {
+    if (std::strncmp(sections_[i].name, name.c_str(),
+                     sizeof(sections_[i].name)) == 0) {
+      return sections_ + i;
+    }
+  }
+  return nullptr;
+}
+
+void ModelBundle::read_floats(
+    const std::string &name, int length, float *output) const {
+  const BundleSection *section = find(name);
+  if (!section) {
+    std::cout << "Bundle " << path_ << " has no section " << name << std::endl;
+    throw;
+  }
+  if (section->size < sizeof(float)*length) {
+    std::cout << "Bundle " << path_ << ": section " << name
+      << " is too small" << std::endl;
+    throw;
+  }
+  std::memcpy(output, data(*section), sizeof(float)*length);
+}
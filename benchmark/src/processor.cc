@@ -15,10 +15,20 @@
 #include "processor.h"
 
 
-Processor::Processor(int image_width, int image_height, std::string checkpoint_path, bool use_gpu)
+Processor::Processor(int image_width, int image_height,
+    std::string checkpoint_path, bool use_gpu, bool use_tf)
   : image_width_(image_width), image_height_(image_height),
     checkpoint_path_(checkpoint_path)
 {
+  if (ModelBundle::exists(checkpoint_path+kBundleFilename)) {
+    std::cout << "Loading model bundle " << checkpoint_path+kBundleFilename
+      << std::endl;
+    bundle_ = new ModelBundle(checkpoint_path+kBundleFilename);
+  }
+  if (!use_tf) {
+    return;
+  }
+
   // Create Session
   tf::Status status = tf::NewSession(tf::SessionOptions(), &session_);
   if (!status.ok()) {
@@ -26,12 +36,20 @@ Processor::Processor(int image_width, int image_height, std::string checkpoint_p
     throw;
   }
 
-  // Read in the protobuf graph
-  status = tf::ReadBinaryProto(
-      tf::Env::Default(), checkpoint_path+"optimized_graph.pb", &graph_def_);
-  if (!status.ok()) {
-    std::cout << status.ToString() << std::endl;
-    throw;
+  // Read in the protobuf graph, from the packed bundle when there is one.
+  if (bundle_) {
+    const BundleSection *graph = bundle_->find("optimized_graph.pb");
+    if (!graph || !graph_def_.ParseFromArray(bundle_->data(*graph), graph->size)) {
+      std::cout << "Failed to parse graph from bundle" << std::endl;
+      throw;
+    }
+  } else {
+    status = tf::ReadBinaryProto(
+        tf::Env::Default(), checkpoint_path+"optimized_graph.pb", &graph_def_);
+    if (!status.ok()) {
+      std::cout << status.ToString() << std::endl;
+      throw;
+    }
   }
   std::string device_name;
   if (use_gpu) {
@@ -54,14 +72,38 @@ Processor::Processor(int image_width, int image_height, std::string checkpoint_p
 
 Processor::~Processor()
 {
-  session_->Close();
+  if (session_) {
+    session_->Close();
+  }
+  delete bundle_;
 }
 
 
 HybridGLProcessor::HybridGLProcessor(int image_width, int image_height,
-    std::string checkpoint_path, bool use_gpu, std::string shader_root)
-    : Processor(image_width, image_height, checkpoint_path, use_gpu)
+    std::string checkpoint_path, bool use_gpu, std::string shader_root,
+    bool native)
+    : Processor(image_width, image_height, checkpoint_path, use_gpu, !native)
 {
+  if (native) {
+    if (!bundle_) {
+      std::cout << "Native inference requires a model bundle, "
+        << "see hdrnet/bin/pack_model.py" << std::endl;
+      throw;
+    }
+    std::cout << "Using the native coefficient network for inference."
+      << std::endl;
+    native_net_ = new CoefficientNet(*bundle_);
+    if (native_net_->net_input_size() != net_input_size_) {
+      std::cout << "Unexpected network input size "
+        << native_net_->net_input_size() << std::endl;
+      throw;
+    }
+    grid_depth_ = native_net_->grid_depth();
+    grid_height_ = native_net_->grid_height();
+    grid_width_ = native_net_->grid_width();
+    return;
+  }
+
   input_tensor_  = tf::Tensor(
       tf::DT_FLOAT, tf::TensorShape({1, net_input_size_,
       net_input_size_, 3}));
@@ -69,76 +111,288 @@ HybridGLProcessor::HybridGLProcessor(int image_width, int image_height,
     {input_name_, input_tensor_},
   };
 
-  tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
-  grid_depth_  = outputs_[0].dim_size(1);
-  grid_height_ = outputs_[0].dim_size(2);
-  grid_width_ = outputs_[0].dim_size(3);
+  if (bundle_) {
+    grid_depth_ = bundle_->header().grid_depth;
+    grid_height_ = bundle_->header().grid_height;
+    grid_width_ = bundle_->header().grid_width;
+  } else {
+    // No metadata: run the network once to discover the grid dimensions.
+    tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
+    if (!status.ok()) {
+      std::cout << status.ToString() << std::endl;
+      throw;
+    }
+    grid_depth_  = outputs_[0].dim_size(1);
+    grid_height_ = outputs_[0].dim_size(2);
+    grid_width_ = outputs_[0].dim_size(3);
+  }
 }
 
 
 StandardProcessor::StandardProcessor(int image_width, int image_height,
-    std::string checkpoint_path, bool use_gpu, std::string shader_root)
-    : HybridGLProcessor(image_width, image_height, checkpoint_path, use_gpu, shader_root)
+    std::string checkpoint_path, bool use_gpu, std::string shader_root,
+    bool native)
+    : HybridGLProcessor(image_width, image_height, checkpoint_path, use_gpu,
+        shader_root, native)
 {
   vertex_shader_ = shader_root+"std.vert";
   fragment_shader_ = shader_root+"std.frag";
   renderer_ = new StandardRenderer(image_width, image_height,
       grid_width_, grid_height_, grid_depth_,
-      vertex_shader_, fragment_shader_, checkpoint_path);
+      vertex_shader_, fragment_shader_, checkpoint_path, bundle_);
 };
 
 
 MultiscaleProcessor::MultiscaleProcessor(int image_width, int image_height,
-    std::string checkpoint_path, bool use_gpu, std::string shader_root)
-    : HybridGLProcessor(image_width, image_height, checkpoint_path, use_gpu, shader_root)
+    std::string checkpoint_path, bool use_gpu, std::string shader_root,
+    bool native)
+    : HybridGLProcessor(image_width, image_height, checkpoint_path, use_gpu,
+        shader_root, native)
 {
   vertex_shader_ = shader_root+"std.vert";
   fragment_shader_ = shader_root+"gpyrnn.frag";
   renderer_ = new MultiscaleRenderer(image_width, image_height,
       grid_width_, grid_height_, grid_depth_,
-      vertex_shader_, fragment_shader_, checkpoint_path);
+      vertex_shader_, fragment_shader_, checkpoint_path, bundle_);
 };
 
 
 BenchmarkResult HybridGLProcessor::process(const cv::Mat &input, cv::Mat &output) {
   // Upload image to GPU while we process the lowres on CPU
-  renderer_->upload_input(input);
+  upload_input(input);
 
   BenchmarkResult result;
+  prepare_input(input, &result);
+  const float* coeffs_data = forward(&result);
+  render(coeffs_data, output, &result);
+
+  return result;
+}
 
+void HybridGLProcessor::upload_input(const cv::Mat &input) {
+  renderer_->upload_input(input);
+}
+
+const float *HybridGLProcessor::lowres_input() {
+  return native_net_ ?
+    native_net_->input() : input_tensor_.flat<float>().data();
+}
+
+void HybridGLProcessor::prepare_input(const cv::Mat &input,
+    BenchmarkResult *result) {
   // Downsample
   timer_.start();
   cv::Mat input_lowres;
   cv::resize(input, input_lowres, cv::Size(net_input_size_, net_input_size_), 0, 0, cv::INTER_NEAREST);
-  result.downsampling = timer_.duration();
+  result->downsampling = timer_.duration();
 
   timer_.start();
-  float* lowres_data = input_tensor_.flat<float>().data();
+  float* lowres_data = native_net_ ?
+    native_net_->input() : input_tensor_.flat<float>().data();
   for (int y = 0; y < net_input_size_; ++y)
   for (int x = 0; x < net_input_size_; ++x)
   for (int c = 0; c < 3; ++c) {
     lowres_data[c+3*(x+net_input_size_*y)] = input_lowres.data[c+3*(x+net_input_size_*y)]/255.0f;
   }
-  result.convert_to_float = timer_.duration();
+  result->convert_to_float = timer_.duration();
+}
 
+const float *HybridGLProcessor::forward(BenchmarkResult *result) {
   timer_.start();
-  tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
-  if (!status.ok()) {
-    std::cout << status.ToString() << std::endl;
-    throw;
+  const float* coeffs_data = nullptr;
+  if (native_net_) {
+    coeffs_data = native_net_->forward();
+  } else {
+    tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
+    if (!status.ok()) {
+      std::cout << status.ToString() << std::endl;
+      throw;
+    }
+    coeffs_data = outputs_[0].flat<float>().data();
   }
-  result.forward_pass = timer_.duration();
+  result->forward_pass = timer_.duration();
+  return coeffs_data;
+}
 
-  float* coeffs_data = outputs_[0].flat<float>().data();
-  renderer_->render(coeffs_data, output, &(result.rendering_gl_coeff),
-          &(result.rendering_gl_draw), &(result.rendering_gl_readback));
+void HybridGLProcessor::render(const float *coeffs, cv::Mat &output,
+    BenchmarkResult *result, int scale) {
+  renderer_->render(coeffs, output, &(result->rendering_gl_coeff),
+          &(result->rendering_gl_draw), &(result->rendering_gl_readback),
+          scale);
+}
 
-  return result;
+int HybridGLProcessor::coefficients_size() const {
+  if (native_net_) {
+    return native_net_->grid_rows()*native_net_->grid_depth()*
+      native_net_->grid_height()*native_net_->grid_width()*
+      native_net_->grid_cols();
+  }
+  if (outputs_.empty()) {
+    std::cout << "coefficients_size() called before forward()" << std::endl;
+    throw;
+  }
+  return outputs_[0].NumElements();
 }
 
 HybridGLProcessor::~HybridGLProcessor()
 {
   delete renderer_;
+  delete native_net_;
+}
+
+
+BatchProcessor::BatchProcessor(std::string checkpoint_path, bool use_gpu,
+    int max_batch, bool native)
+    : Processor(0, 0, checkpoint_path, use_gpu, !native), max_batch_(max_batch)
+{
+  if (max_batch_ < 1) {
+    std::cout << "max_batch should be at least 1" << std::endl;
+    throw;
+  }
+  if (native) {
+    if (!bundle_) {
+      std::cout << "Native inference requires a model bundle, "
+        << "see hdrnet/bin/pack_model.py" << std::endl;
+      throw;
+    }
+    native_net_ = new CoefficientNet(*bundle_);
+    grid_depth_ = native_net_->grid_depth();
+    grid_height_ = native_net_->grid_height();
+    grid_width_ = native_net_->grid_width();
+  } else {
+    for (const tf::NodeDef &node : graph_def_.node()) {
+      if (node.name() == batched_output_name_) {
+        batched_ = true;
+      }
+    }
+    if (!batched_ && max_batch_ > 1) {
+      std::cout << "The graph has no " << batched_output_name_
+        << " node, batches will be evaluated one image at a time "
+        << "(see freeze_graph.py --batched)." << std::endl;
+    }
+
+    input_tensor_  = tf::Tensor(
+        tf::DT_FLOAT, tf::TensorShape({1, net_input_size_,
+        net_input_size_, 3}));
+    inputs_ = {
+      {input_name_, input_tensor_},
+    };
+    if (bundle_) {
+      grid_depth_ = bundle_->header().grid_depth;
+      grid_height_ = bundle_->header().grid_height;
+      grid_width_ = bundle_->header().grid_width;
+    } else {
+      tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
+      if (!status.ok()) {
+        std::cout << status.ToString() << std::endl;
+        throw;
+      }
+      grid_depth_  = outputs_[0].dim_size(1);
+      grid_height_ = outputs_[0].dim_size(2);
+      grid_width_ = outputs_[0].dim_size(3);
+    }
+  }
+
+  renderer_ = new CpuRenderer(grid_width_, grid_height_, grid_depth_,
+      checkpoint_path, bundle_);
+}
+
+
+BatchProcessor::~BatchProcessor()
+{
+  delete renderer_;
+  delete native_net_;
+}
+
+
+void BatchProcessor::prepare_input(const cv::Mat &input, float *lowres) const {
+  cv::Mat input_lowres;
+  cv::resize(input, input_lowres, cv::Size(net_input_size_, net_input_size_), 0, 0, cv::INTER_NEAREST);
+  const int size = net_input_size_*net_input_size_*3;
+  for (int i = 0; i < size; ++i) {
+    lowres[i] = input_lowres.data[i]/255.0f;
+  }
+}
+
+
+void BatchProcessor::forward(const std::vector<const float*> &lowres,
+    const std::vector<float*> &grids) {
+  const int n = lowres.size();
+  const int lowres_size = net_input_size_*net_input_size_*3;
+  const int grid_size = coefficients_size();
+  if (n > max_batch_) {
+    std::cout << "Batch of " << n << " exceeds max_batch " << max_batch_
+      << std::endl;
+    throw;
+  }
+
+  if (native_net_) {
+    for (int i = 0; i < n; ++i) {
+      std::copy(lowres[i], lowres[i] + lowres_size, native_net_->input());
+      const float *coeffs = native_net_->forward();
+      std::copy(coeffs, coeffs + grid_size, grids[i]);
+    }
+    return;
+  }
+
+  if (!batched_) {
+    for (int i = 0; i < n; ++i) {
+      std::copy(lowres[i], lowres[i] + lowres_size,
+          input_tensor_.flat<float>().data());
+      tf::Status status = session_->Run(inputs_, {output_name_}, {}, &outputs_);
+      if (!status.ok()) {
+        std::cout << status.ToString() << std::endl;
+        throw;
+      }
+      const float *coeffs = outputs_[0].flat<float>().data();
+      std::copy(coeffs, coeffs + grid_size, grids[i]);
+    }
+    return;
+  }
+
+  tf::Tensor batch(tf::DT_FLOAT,
+      tf::TensorShape({n, net_input_size_, net_input_size_, 3}));
+  float *batch_data = batch.flat<float>().data();
+  for (int i = 0; i < n; ++i) {
+    std::copy(lowres[i], lowres[i] + lowres_size, batch_data + i*lowres_size);
+  }
+  tf::Status status = session_->Run({{input_name_, batch}},
+      {batched_output_name_}, {}, &outputs_);
+  if (!status.ok()) {
+    std::cout << status.ToString() << std::endl;
+    throw;
+  }
+  if (outputs_[0].NumElements() != static_cast<int64_t>(n)*grid_size) {
+    std::cout << "Unexpected batched output size "
+      << outputs_[0].NumElements() << std::endl;
+    throw;
+  }
+  // (batch, grid_rows, grid_depth, grid_height, grid_width, grid_cols).
+  const float *coeffs = outputs_[0].flat<float>().data();
+  for (int i = 0; i < n; ++i) {
+    std::copy(coeffs + i*grid_size, coeffs + (i + 1)*grid_size, grids[i]);
+  }
+}
+
+
+BenchmarkResult BatchProcessor::process(const cv::Mat &input, cv::Mat &output) {
+  BenchmarkResult result;
+  std::vector<float> lowres(net_input_size_*net_input_size_*3);
+  std::vector<float> grid(coefficients_size());
+
+  timer_.start();
+  prepare_input(input, lowres.data());
+  result.downsampling = timer_.duration();
+
+  timer_.start();
+  forward({lowres.data()}, {grid.data()});
+  result.forward_pass = timer_.duration();
+
+  timer_.start();
+  renderer_->render(input, grid.data(), output);
+  result.rendering_direct = timer_.duration();
+
+  return result;
 }
 
 
@@ -0,0 +1,100 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "progressive_renderer.h"
+
+#include <iostream>
+
+ProgressiveRenderer::ProgressiveRenderer(const CpuRenderer *renderer,
+    int preview_stride)
+  : renderer_(renderer), preview_stride_(1), num_passes_(1)
+{
+  while (2*preview_stride_ <= preview_stride) {
+    preview_stride_ *= 2;
+    ++num_passes_;
+  }
+}
+
+void ProgressiveRenderer::start(const cv::Mat &input, const float *coeffs,
+    cv::Mat *output) {
+  input_ = &input;
+  coeffs_ = coeffs;
+  output_ = output;
+  output_->create(input.rows, input.cols, CV_8UC3);
+  pass_ = 0;
+  cancelled_ = false;
+}
+
+bool ProgressiveRenderer::next_pass() {
+  if (done() || cancelled_) {
+    return false;
+  }
+  const int lattice_stride = stride(pass_);
+  // The first pass has no coarser lattice to skip.
+  const int skip_stride = pass_ > 0 ? stride(pass_ - 1) : 0;
+  for (int y = 0; y < input_->rows; y += lattice_stride) {
+    if (cancelled_) {
+      return false;
+    }
+    renderer_->render_lattice(*input_, coeffs_, lattice_stride, skip_stride,
+        y, y + 1, *output_);
+  }
+  ++pass_;
+  return true;
+}
+
+bool ProgressiveRenderer::finish() {
+  while (!done()) {
+    if (!next_pass()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+ProgressiveProcessor::ProgressiveProcessor(BatchProcessor *processor,
+    int preview_stride)
+  : processor_(processor),
+    progressive_(&processor->renderer(), preview_stride),
+    lowres_(processor->net_input_size()*processor->net_input_size()*3),
+    grid_(processor->coefficients_size())
+{
+}
+
+BenchmarkResult ProgressiveProcessor::process(const cv::Mat &input,
+    cv::Mat &output) {
+  BenchmarkResult result;
+  frame_timer_.start();
+
+  timer_.start();
+  processor_->prepare_input(input, lowres_.data());
+  result.downsampling = timer_.duration();
+
+  timer_.start();
+  processor_->forward({lowres_.data()}, {grid_.data()});
+  result.forward_pass = timer_.duration();
+
+  timer_.start();
+  progressive_.start(input, grid_.data(), &output);
+  progressive_.next_pass();
+  result.time_to_preview = frame_timer_.duration();
+  if (!progressive_.finish()) {
+    std::cout << "Progressive render cancelled" << std::endl;
+  }
+  result.rendering_direct = timer_.duration();
+  result.time_to_full_quality = frame_timer_.duration();
+
+  return result;
+}
@@ -14,6 +14,7 @@
 
 #include "renderer.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <chrono>
 #include <thread>
@@ -23,7 +24,7 @@
 Renderer::Renderer(int output_width, int output_height,
     int grid_width, int grid_height, int grid_depth,
     std::string vertex_shader_path, std::string fragment_shader_path,
-    std::string checkpoint_path)
+    std::string checkpoint_path, const ModelBundle *bundle)
   : output_width_(output_width), output_height_(output_height),
     grid_width_(grid_width), grid_height_(grid_height), grid_depth_(grid_depth)
 {
@@ -117,7 +118,8 @@ Renderer::Renderer(int output_width, int output_height,
 }
 
 void Renderer::render(const float* const coeffs_data, cv::Mat & output,
-        double *upload_coeff_time, double *draw_time, double *readback_time) {
+        double *upload_coeff_time, double *draw_time, double *readback_time,
+        int scale) {
   glQueryCounter(query_ids_[0], GL_TIMESTAMP);
 
   // Upload coefficient grid to GPU
@@ -125,13 +127,27 @@ void Renderer::render(const float* const coeffs_data, cv::Mat & output,
 
   glQueryCounter(query_ids_[1], GL_TIMESTAMP);
 
+  // The quad covers the viewport and samples the input by texture
+  // coordinates, so a smaller viewport renders a downscaled output.
+  const int width = std::max(output_width_/scale, 1);
+  const int height = std::max(output_height_/scale, 1);
+  glViewport(0, 0, width, height);
   glClear(GL_COLOR_BUFFER_BIT);
   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
   glQueryCounter(query_ids_[2], GL_TIMESTAMP);
 
-  glReadPixels(0, 0, output_width_, output_height_,
-               GL_RGB, GL_UNSIGNED_BYTE, (GLvoid*) output.data);
+  if (scale > 1) {
+    reduced_output_.create(height, width, CV_8UC3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height,
+                 GL_RGB, GL_UNSIGNED_BYTE, (GLvoid*) reduced_output_.data);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glViewport(0, 0, output_width_, output_height_);
+  } else {
+    glReadPixels(0, 0, output_width_, output_height_,
+                 GL_RGB, GL_UNSIGNED_BYTE, (GLvoid*) output.data);
+  }
   glQueryCounter(query_ids_[3], GL_TIMESTAMP);
 
   // Wait until all results are available.
@@ -168,6 +184,11 @@ void Renderer::render(const float* const coeffs_data, cv::Mat & output,
           timestamps[3] - timestamps[2],
           (timestamps[3] - timestamps[2]) * 1e-6);
 #endif
+
+  if (scale > 1) {
+    cv::resize(reduced_output_, output, output.size(), 0, 0,
+        cv::INTER_LINEAR);
+  }
 }
 
 
@@ -183,27 +204,28 @@ StandardRenderer::StandardRenderer(
     int output_width, int output_height,
     int grid_width, int grid_height, int grid_depth,
     std::string vertex_shader, std::string fragment_shader,
-    std::string checkpoint_path) :
+    std::string checkpoint_path, const ModelBundle *bundle) :
   Renderer(output_width, output_height,
       grid_width, grid_height, grid_depth,
       vertex_shader, fragment_shader,
-      checkpoint_path)
+      checkpoint_path, bundle)
 {
   // Bind affine coefficients to three texture samplers, one row each.
   gl_extra_setup();
-  load_guide_parameters(checkpoint_path);
+  load_guide_parameters(checkpoint_path, bundle);
 };
 
-void StandardRenderer::load_guide_parameters(std::string checkpoint_path) {
+void StandardRenderer::load_guide_parameters(
+    std::string checkpoint_path, const ModelBundle *bundle) {
   float ccm[3*4] = {0};
   float mix_matrix[4*1] = {0};
   float shifts[16*3] = {0};
   float slopes[16*3] = {0};
 
-  load_binary_data(checkpoint_path+"guide_ccm_f32_3x4.bin", 3*4, ccm);
-  load_binary_data(checkpoint_path+"guide_mix_matrix_f32_1x4.bin", 4, mix_matrix);
-  load_binary_data(checkpoint_path+"guide_shifts_f32_16x3.bin", 16*3, shifts);
-  load_binary_data(checkpoint_path+"guide_slopes_f32_16x3.bin", 16*3, slopes);
+  load_model_data(bundle, checkpoint_path, "guide_ccm_f32_3x4.bin", 3*4, ccm);
+  load_model_data(bundle, checkpoint_path, "guide_mix_matrix_f32_1x4.bin", 4, mix_matrix);
+  load_model_data(bundle, checkpoint_path, "guide_shifts_f32_16x3.bin", 16*3, shifts);
+  load_model_data(bundle, checkpoint_path, "guide_slopes_f32_16x3.bin", 16*3, slopes);
 
   glProgramUniformMatrix3x4fv(
       program_,
@@ -256,19 +278,20 @@ MultiscaleRenderer::MultiscaleRenderer(
     int output_width, int output_height,
     int grid_width, int grid_height, int grid_depth,
     std::string vertex_shader, std::string fragment_shader,
-    std::string checkpoint_path) :
+    std::string checkpoint_path, const ModelBundle *bundle) :
   Renderer(output_width, output_height,
       grid_width, grid_height, grid_depth,
       vertex_shader, fragment_shader,
-      checkpoint_path)
+      checkpoint_path, bundle)
 {
   // Bind affine coefficients to three texture samplers, one row each.
   gl_extra_setup();
-  load_guide_parameters(checkpoint_path);
+  load_guide_parameters(checkpoint_path, bundle);
 };
 
 
-void MultiscaleRenderer::load_guide_parameters(std::string checkpoint_path) {
+void MultiscaleRenderer::load_guide_parameters(
+    std::string checkpoint_path, const ModelBundle *bundle) {
   float *guide_conv1 = new float[4*16*3]();
   float *guide_conv2 = new float[17*1*3]();
 
@@ -276,11 +299,11 @@ void MultiscaleRenderer::load_guide_parameters(std::string checkpoint_path) {
   {
     std::stringstream sstm;
     sstm << "guide_level" << i << "_conv1.bin";
-    load_binary_data(checkpoint_path+sstm.str(), 4*16, guide_conv1 + 4*16*i);
+    load_model_data(bundle, checkpoint_path, sstm.str(), 4*16, guide_conv1 + 4*16*i);
 
     std::stringstream sstm2;
     sstm2 << "guide_level" << i << "_conv2.bin";
-    load_binary_data(checkpoint_path+sstm2.str(), 17, guide_conv2 + 17*i);
+    load_model_data(bundle, checkpoint_path, sstm2.str(), 17, guide_conv2 + 17*i);
   }
 
   glProgramUniform4fv(
@@ -0,0 +1,70 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <csignal>
+#include <iostream>
+
+#include <gflags/gflags.h>
+
+#include "inference_server.h"
+#include "processor.h"
+
+DEFINE_string(checkpoint_path, "", "Path to the network checkpoint (HDRNetCurves).");
+DEFINE_string(socket_path, "/tmp/hdrnet.sock", "Unix socket to listen on.");
+DEFINE_bool(use_gpu, false, "Run the network on gpu.");
+DEFINE_bool(native, false, "Compute the coefficients with the built-in C++ network instead of TensorFlow (requires model.hdrb).");
+DEFINE_int32(max_batch, 8, "Largest number of requests evaluated by the network at once.");
+DEFINE_int32(max_wait_us, 2000, "Longest time a request waits for its batch to fill up.");
+DEFINE_int32(slice_threads, 2, "Threads slicing at full resolution.");
+
+namespace {
+
+InferenceServer *server = nullptr;
+
+void handle_signal(int) {
+  if (server) {
+    server->interrupt();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_checkpoint_path.empty()) {
+      std::cerr << "--checkpoint_path is required." << std::endl;
+      return 1;
+  }
+  std::string checkpoint_path = FLAGS_checkpoint_path + "/";
+
+  BatchProcessor processor(checkpoint_path, FLAGS_use_gpu, FLAGS_max_batch,
+      FLAGS_native);
+
+  ServerOptions options;
+  options.socket_path = FLAGS_socket_path;
+  options.max_batch = FLAGS_max_batch;
+  options.max_wait_us = FLAGS_max_wait_us;
+  options.slice_threads = FLAGS_slice_threads;
+  InferenceServer inference_server(&processor, options);
+
+  server = &inference_server;
+  std::signal(SIGINT, handle_signal);
+  std::signal(SIGTERM, handle_signal);
+  bool ok = inference_server.run();
+  server = nullptr;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,328 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shard_coordinator.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server_protocol.h"
+#include "timer.h"
+
+struct ShardCoordinator::Connection {
+  int fd = -1;
+  // Into stats_.
+  int worker = -1;
+  int shard = -1;
+  // Asked for work while none was left but other workers still had some,
+  // which may come back if they disconnect.
+  bool waiting = false;
+  uint32_t wanted = 0;
+  std::vector<uint32_t> in_flight;
+  Timer connected;
+};
+
+ShardCoordinator::ShardCoordinator(const std::vector<std::string> &paths,
+    const CoordinatorOptions &options)
+  : paths_(paths), options_(options)
+{
+  options_.shards = std::max(1, options_.shards);
+  options_.chunk = std::max(1, options_.chunk);
+}
+
+ShardCoordinator::~ShardCoordinator()
+{
+  for (Connection *connection : connections_) {
+    close(connection->fd);
+    delete connection;
+  }
+  if (journal_) {
+    fclose(journal_);
+  }
+}
+
+void ShardCoordinator::load_checkpoint() {
+  std::ifstream file(options_.checkpoint_path);
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t tab = line.find('\t');
+    // Failed items are retried.
+    if (tab != std::string::npos && line.substr(0, tab) == "ok") {
+      finished_paths_.insert(line.substr(tab + 1));
+    }
+  }
+}
+
+void ShardCoordinator::journal(uint32_t index, bool ok) {
+  if (!journal_) {
+    return;
+  }
+  fprintf(journal_, "%s\t%s\n", ok ? "ok" : "failed", paths_[index].c_str());
+  fflush(journal_);
+  if (++unsynced_ >= options_.sync_interval) {
+    fsync(fileno(journal_));
+    unsynced_ = 0;
+  }
+}
+
+bool ShardCoordinator::done() const {
+  return finished_ == pending_;
+}
+
+int ShardCoordinator::adopt_shard() {
+  // Prefer the unowned shard with the most work left.
+  int best = -1;
+  for (size_t s = 0; s < queues_.size(); ++s) {
+    if (!shard_owned_[s] &&
+        (best < 0 || queues_[s].size() > queues_[best].size())) {
+      best = s;
+    }
+  }
+  if (best < 0) {
+    // More workers than shards: start empty and steal.
+    queues_.emplace_back();
+    shard_owned_.push_back(false);
+    best = queues_.size() - 1;
+  }
+  shard_owned_[best] = true;
+  return best;
+}
+
+void ShardCoordinator::assign(Connection *connection, uint32_t count) {
+  std::deque<uint32_t> &queue = queues_[connection->shard];
+  if (queue.empty()) {
+    // Steal the back half of the longest queue, owned or not.
+    size_t victim = 0;
+    for (size_t s = 1; s < queues_.size(); ++s) {
+      if (queues_[s].size() > queues_[victim].size()) {
+        victim = s;
+      }
+    }
+    std::deque<uint32_t> &other = queues_[victim];
+    const size_t stolen = (other.size() + 1)/2;
+    queue.insert(queue.end(), other.end() - stolen, other.end());
+    other.erase(other.end() - stolen, other.end());
+    stats_[connection->worker].stolen += stolen;
+  }
+
+  if (queue.empty() && !done()) {
+    connection->waiting = true;
+    connection->wanted = count;
+    return;
+  }
+  connection->waiting = false;
+
+  std::vector<ShardItem> items;
+  const size_t n = std::min<size_t>(queue.size(),
+      std::min<uint32_t>(std::max<uint32_t>(count, 1), options_.chunk));
+  for (size_t i = 0; i < n; ++i) {
+    ShardItem item;
+    item.index = queue.front();
+    item.path = paths_[item.index];
+    items.push_back(item);
+    connection->in_flight.push_back(item.index);
+    queue.pop_front();
+  }
+  if (!send_shard_message(connection->fd, SHARD_ASSIGN, items.size(),
+        encode_items(items))) {
+    // Requeued when the poll loop sees the hangup.
+    std::cout << "Failed to send work to " << stats_[connection->worker].name
+      << std::endl;
+  }
+}
+
+bool ShardCoordinator::handle(Connection *connection) {
+  ShardMessage message;
+  std::string payload;
+  if (!receive_shard_message(connection->fd, &message, &payload)) {
+    return false;
+  }
+  WorkerStats &stats = stats_[connection->worker];
+  switch (message.type) {
+    case SHARD_HELLO:
+      stats.name = payload;
+      return true;
+    case SHARD_REQUEST:
+      if (!connection->in_flight.empty()) {
+        // Results first, so that nothing is lost if the worker dies.
+        return false;
+      }
+      assign(connection, message.count);
+      return true;
+    case SHARD_DONE: {
+      std::vector<ShardResult> results;
+      if (!decode_results(payload, message.count, &results)) {
+        return false;
+      }
+      for (const ShardResult &result : results) {
+        auto it = std::find(connection->in_flight.begin(),
+            connection->in_flight.end(), result.index);
+        if (it == connection->in_flight.end()) {
+          return false;
+        }
+        connection->in_flight.erase(it);
+        journal(result.index, result.status == SHARD_OK);
+        ++finished_;
+        ++stats.items;
+        stats.busy += result.load + result.process + result.save;
+        if (result.status != SHARD_OK) {
+          ++failed_;
+          ++stats.failures;
+          std::cout << "Failed on " << paths_[result.index] << std::endl;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+void ShardCoordinator::disconnect(Connection *connection) {
+  WorkerStats &stats = stats_[connection->worker];
+  stats.connected = connection->connected.duration();
+  if (!connection->in_flight.empty()) {
+    std::cout << "Lost " << (stats.name.empty() ? "a worker" : stats.name)
+      << " with " << connection->in_flight.size() << " items in flight"
+      << std::endl;
+    std::deque<uint32_t> &queue = queues_[connection->shard];
+    for (auto it = connection->in_flight.rbegin();
+        it != connection->in_flight.rend(); ++it) {
+      if (++attempts_[*it] < options_.max_attempts) {
+        queue.push_front(*it);
+        continue;
+      }
+      std::cout << "Giving up on " << paths_[*it] << std::endl;
+      journal(*it, false);
+      ++finished_;
+      ++failed_;
+    }
+  }
+  shard_owned_[connection->shard] = false;
+  close(connection->fd);
+  connections_.erase(std::find(connections_.begin(), connections_.end(),
+        connection));
+  delete connection;
+}
+
+bool ShardCoordinator::run() {
+  Timer wall_timer;
+  wall_timer.start();
+
+  if (!options_.checkpoint_path.empty()) {
+    load_checkpoint();
+    journal_ = fopen(options_.checkpoint_path.c_str(), "a");
+    if (!journal_) {
+      std::cout << "Failed to open " << options_.checkpoint_path << std::endl;
+      return false;
+    }
+  }
+
+  // Contiguous ranges of what is left.
+  std::vector<uint32_t> left;
+  for (size_t i = 0; i < paths_.size(); ++i) {
+    if (finished_paths_.count(paths_[i])) {
+      ++resumed_;
+    } else {
+      left.push_back(i);
+    }
+  }
+  pending_ = left.size();
+  attempts_.assign(paths_.size(), 0);
+  queues_.assign(options_.shards, std::deque<uint32_t>());
+  shard_owned_.assign(options_.shards, false);
+  for (size_t i = 0; i < left.size(); ++i) {
+    queues_[i*options_.shards/left.size()].push_back(left[i]);
+  }
+
+  int listen_fd = listen_unix(options_.socket_path);
+  if (listen_fd < 0) {
+    std::cout << "Failed to listen on " << options_.socket_path << std::endl;
+    return false;
+  }
+
+  Timer idle;
+  idle.start();
+  while (!done()) {
+    if (!connections_.empty()) {
+      idle.start();
+    } else if (options_.idle_timeout_ms > 0 &&
+        idle.duration() > options_.idle_timeout_ms) {
+      std::cout << "No workers for " << options_.idle_timeout_ms
+        << " ms, stopping with " << unfinished() << " items left" << std::endl;
+      break;
+    }
+    std::vector<pollfd> fds(1 + connections_.size());
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < connections_.size(); ++i) {
+      fds[i + 1].fd = connections_[i]->fd;
+      fds[i + 1].events = POLLIN;
+    }
+    if (poll(fds.data(), fds.size(), 1000) < 0) {
+      continue;
+    }
+
+    // Handle the connections of this poll before accepting new ones, which
+    // shifts connections_.
+    std::vector<Connection*> ready;
+    for (size_t i = 0; i < connections_.size(); ++i) {
+      if (fds[i + 1].revents) {
+        ready.push_back(connections_[i]);
+      }
+    }
+    for (Connection *connection : ready) {
+      if (!handle(connection)) {
+        disconnect(connection);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        Connection *connection = new Connection();
+        connection->fd = fd;
+        connection->worker = stats_.size();
+        connection->shard = adopt_shard();
+        connection->connected.start();
+        stats_.push_back(WorkerStats());
+        stats_.back().shard = connection->shard;
+        connections_.push_back(connection);
+      }
+    }
+    // Requeued items, or the end of the archive, for the idle workers.
+    for (Connection *connection : std::vector<Connection*>(connections_)) {
+      if (connection->waiting) {
+        assign(connection, connection->wanted);
+      }
+    }
+  }
+  close(listen_fd);
+  unlink(options_.socket_path.c_str());
+
+  // Workers still connected get no more work: they all asked for it or are
+  // about to, and see the end of the archive as an empty assignment or EOF.
+  while (!connections_.empty()) {
+    disconnect(connections_.back());
+  }
+  if (journal_) {
+    fsync(fileno(journal_));
+  }
+  wall_time_ = wall_timer.duration();
+  return true;
+}
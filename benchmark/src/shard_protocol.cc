@@ -0,0 +1,110 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shard_protocol.h"
+
+#include <cstring>
+
+#include "server_protocol.h"
+
+namespace {
+
+void append(std::string *out, const void *data, size_t size) {
+  out->append(static_cast<const char*>(data), size);
+}
+
+}  // namespace
+
+bool send_shard_message(int fd, ShardMessageType type, uint32_t count,
+    const std::string &payload) {
+  if (payload.size() > kMaxShardPayload) {
+    return false;
+  }
+  ShardMessage message;
+  message.magic = kShardMagic;
+  message.type = type;
+  message.count = count;
+  message.payload_size = payload.size();
+  // One write, so that small messages go out in one segment.
+  std::string buffer;
+  buffer.reserve(sizeof(message) + payload.size());
+  append(&buffer, &message, sizeof(message));
+  buffer += payload;
+  return write_fully(fd, buffer.data(), buffer.size());
+}
+
+bool receive_shard_message(int fd, ShardMessage *message, std::string *payload) {
+  if (!read_fully(fd, message, sizeof(*message)) ||
+      message->magic != kShardMagic ||
+      message->payload_size > kMaxShardPayload) {
+    return false;
+  }
+  payload->resize(message->payload_size);
+  return message->payload_size == 0 ||
+    read_fully(fd, &(*payload)[0], message->payload_size);
+}
+
+std::string encode_items(const std::vector<ShardItem> &items) {
+  std::string out;
+  for (const ShardItem &item : items) {
+    const uint32_t size = item.path.size();
+    append(&out, &item.index, sizeof(item.index));
+    append(&out, &size, sizeof(size));
+    out += item.path;
+  }
+  return out;
+}
+
+bool decode_items(const std::string &payload, uint32_t count,
+    std::vector<ShardItem> *items) {
+  items->clear();
+  size_t offset = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    ShardItem item;
+    uint32_t size;
+    if (payload.size() - offset < sizeof(item.index) + sizeof(size)) {
+      return false;
+    }
+    std::memcpy(&item.index, payload.data() + offset, sizeof(item.index));
+    std::memcpy(&size, payload.data() + offset + sizeof(item.index), sizeof(size));
+    offset += sizeof(item.index) + sizeof(size);
+    if (payload.size() - offset < size) {
+      return false;
+    }
+    item.path = payload.substr(offset, size);
+    offset += size;
+    items->push_back(item);
+  }
+  return offset == payload.size();
+}
+
+std::string encode_results(const std::vector<ShardResult> &results) {
+  std::string out;
+  if (!results.empty()) {
+    append(&out, results.data(), results.size()*sizeof(ShardResult));
+  }
+  return out;
+}
+
+bool decode_results(const std::string &payload, uint32_t count,
+    std::vector<ShardResult> *results) {
+  if (payload.size() != static_cast<size_t>(count)*sizeof(ShardResult)) {
+    return false;
+  }
+  results->resize(count);
+  if (count > 0) {
+    std::memcpy(results->data(), payload.data(), payload.size());
+  }
+  return true;
+}
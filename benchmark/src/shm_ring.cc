@@ -0,0 +1,224 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "shm_ring.h"
+
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const uint64_t kAlignment = 64;
+
+uint64_t align(uint64_t size) {
+  return (size + kAlignment - 1)/kAlignment*kAlignment;
+}
+
+// Spins for a short while, then yields, then sleeps until `ready()`. Frames
+// take milliseconds, so the sleeps cost little latency and spare a core.
+template <typename Ready>
+void wait_until(Ready ready) {
+  for (int i = 0; !ready(); ++i) {
+    if (i < 1000) {
+      continue;
+    } else if (i < 1100) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+  }
+}
+
+}  // namespace
+
+double ShmRing::now() {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ShmRing::ShmRing(const std::string &name, const RingLayout &layout)
+  : name_(name), owner_(true)
+{
+  if (layout.slot_count < 1) {
+    std::cout << "A ring needs at least one slot" << std::endl;
+    throw;
+  }
+  const uint64_t slot_size = align(sizeof(SlotHeader)) +
+    align(layout.frame_bytes()) + align(layout.grid_capacity());
+  const size_t size = align(sizeof(RingHeader)) + slot_size*layout.slot_count;
+
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    std::cout << "Failed to create shared memory " << name << std::endl;
+    throw;
+  }
+  if (ftruncate(fd, size) < 0) {
+    std::cout << "Failed to size shared memory " << name << std::endl;
+    ::close(fd);
+    throw;
+  }
+  map(fd, size);
+
+  header_ = new (base_) RingHeader();
+  header_->version = kRingVersion;
+  header_->layout = layout;
+  header_->slot_size = slot_size;
+  header_->head = 0;
+  header_->tail = 0;
+  header_->closed = 0;
+  header_->producer_blocked_us = 0;
+  header_->magic.store(kRingMagic, std::memory_order_release);
+}
+
+ShmRing::ShmRing(const std::string &name, int timeout_ms)
+  : name_(name), owner_(false)
+{
+  const double deadline = now() + timeout_ms;
+  while (true) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(RingHeader)) {
+      map(fd, st.st_size);
+      header_ = reinterpret_cast<RingHeader*>(base_);
+      if (header_->magic.load(std::memory_order_acquire) == kRingMagic) {
+        break;
+      }
+      munmap(base_, size_);
+      base_ = nullptr;
+      header_ = nullptr;
+    } else if (fd >= 0) {
+      ::close(fd);
+    }
+    if (now() > deadline) {
+      std::cout << "Timed out waiting for shared memory " << name << std::endl;
+      throw;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+
+  if (header_->version != kRingVersion) {
+    std::cout << "Unsupported ring version " << header_->version << std::endl;
+    throw;
+  }
+  if (size_ < align(sizeof(RingHeader)) +
+      header_->slot_size*header_->layout.slot_count) {
+    std::cout << "Truncated ring " << name << std::endl;
+    throw;
+  }
+}
+
+ShmRing::~ShmRing()
+{
+  if (base_) {
+    munmap(base_, size_);
+  }
+  if (owner_) {
+    shm_unlink(name_.c_str());
+  }
+}
+
+void ShmRing::map(int fd, size_t size) {
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED) {
+    std::cout << "Failed to map shared memory " << name_ << std::endl;
+    throw;
+  }
+  base_ = static_cast<uint8_t*>(base);
+  size_ = size;
+}
+
+RingSlot ShmRing::slot(uint64_t index) {
+  const RingLayout &layout = header_->layout;
+  uint8_t *base = base_ + align(sizeof(RingHeader)) +
+    header_->slot_size*(index % layout.slot_count);
+  RingSlot slot;
+  slot.header = reinterpret_cast<SlotHeader*>(base);
+  slot.frame = base + align(sizeof(SlotHeader));
+  slot.grid = reinterpret_cast<float*>(slot.frame + align(layout.frame_bytes()));
+  return slot;
+}
+
+RingSlot ShmRing::acquire() {
+  const uint64_t slot_count = header_->layout.slot_count;
+  if (position_ - cached_other_ >= slot_count) {
+    cached_other_ = header_->tail.load(std::memory_order_acquire);
+  }
+  if (position_ - cached_other_ >= slot_count) {
+    const double start = now();
+    wait_until([this, slot_count] {
+        cached_other_ = header_->tail.load(std::memory_order_acquire);
+        return position_ - cached_other_ < slot_count; });
+    const double blocked = now() - start;
+    waited_ += blocked;
+    header_->producer_blocked_us += static_cast<uint64_t>(blocked*1000.0);
+  }
+
+  RingSlot result = slot(position_);
+  result.header->sequence = position_;
+  result.header->acquired = now();
+  result.header->forward = 0.0;
+  result.header->grid_size = 0;
+  return result;
+}
+
+void ShmRing::publish() {
+  slot(position_).header->published = now();
+  ++position_;
+  header_->head.store(position_, std::memory_order_release);
+}
+
+void ShmRing::close() {
+  header_->closed.store(1, std::memory_order_release);
+}
+
+void ShmRing::drain() {
+  wait_until([this] {
+      return header_->tail.load(std::memory_order_acquire) == position_; });
+}
+
+bool ShmRing::next(RingSlot *result) {
+  if (position_ == cached_other_) {
+    cached_other_ = header_->head.load(std::memory_order_acquire);
+  }
+  if (position_ == cached_other_) {
+    const double start = now();
+    wait_until([this] {
+        cached_other_ = header_->head.load(std::memory_order_acquire);
+        return position_ != cached_other_ ||
+          header_->closed.load(std::memory_order_acquire); });
+    waited_ += now() - start;
+    // close() comes after the last publish(), so this sees every slot.
+    cached_other_ = header_->head.load(std::memory_order_acquire);
+    if (position_ == cached_other_) {
+      return false;
+    }
+  }
+  *result = slot(position_);
+  return true;
+}
+
+void ShmRing::release() {
+  ++position_;
+  header_->tail.store(position_, std::memory_order_release);
+}
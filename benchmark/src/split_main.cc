@@ -0,0 +1,356 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Split execution of HDRNetCurves: `--role=net` computes the coefficients and
+// `--role=render` renders, in separate processes connected by a shared-memory
+// ring (see shm_ring.h). Start the net process first, e.g.
+//
+//   bin/split --role=net --checkpoint_path=<dir> --input_path=<image> &
+//   bin/split --role=render --checkpoint_path=<dir> --output_directory=<dir>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include <GL/glew.h>
+#include <GL/freeglut.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <gflags/gflags.h>
+
+#include "cpu_renderer.h"
+#include "grid_codec.h"
+#include "processor.h"
+#include "renderer.h"
+#include "shm_ring.h"
+#include "timer.h"
+#include "utils.h"
+
+DEFINE_string(role, "", "net or render.");
+DEFINE_string(ring, "/hdrnet_ring", "Name of the shared-memory ring.");
+DEFINE_int32(slots, 4, "net: frames in flight between the two processes.");
+DEFINE_string(checkpoint_path, "", "Path to the network checkpoint (HDRNetCurves).");
+DEFINE_string(input_path, "", "net: image sent as every frame.");
+DEFINE_string(video_path, "", "net: video to stream instead of --input_path.");
+DEFINE_int32(frames, 100, "net: number of frames when streaming --input_path.");
+DEFINE_bool(use_gpu, false, "net: run the network on gpu.");
+DEFINE_bool(native, false, "net: compute the coefficients with the built-in C++ network (requires model.hdrb).");
+DEFINE_string(grid_codec, "float", "net: grid transport, float, int16 or int8 (see grid_codec.h).");
+DEFINE_bool(grid_delta, false, "net: delta-encode quantized grids against the previous frame.");
+DEFINE_int32(keyframe_interval, 30, "net: with --grid_delta, frames between keyframes.");
+DEFINE_bool(cpu_render, false, "render: slice on the CPU instead of with OpenGL.");
+DEFINE_int32(open_timeout_ms, 10000, "render: how long to wait for the net process.");
+DEFINE_string(output_directory, "", "render: destination for the last frame and the report.");
+
+namespace {
+
+double mean(const std::vector<double> &values) {
+  double sum = 0.0;
+  for (double value : values) {
+    sum += value;
+  }
+  return values.empty() ? 0.0 : sum/values.size();
+}
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0.0;
+  }
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1,
+      static_cast<size_t>(p*(values.size() - 1) + 0.5))];
+}
+
+int run_net(const std::string &checkpoint_path) {
+  cv::Mat image;
+  cv::VideoCapture capture;
+  RingLayout layout;
+  if (!FLAGS_video_path.empty()) {
+    if (!capture.open(FLAGS_video_path)) {
+      std::cout << "Failed to open " << FLAGS_video_path << std::endl;
+      return 1;
+    }
+    layout.width = capture.get(CV_CAP_PROP_FRAME_WIDTH);
+    layout.height = capture.get(CV_CAP_PROP_FRAME_HEIGHT);
+  } else {
+    image = load_image(FLAGS_input_path);
+    if (!image.data) {
+      std::cout << "Failed to load " << FLAGS_input_path << std::endl;
+      return 1;
+    }
+    layout.width = image.cols;
+    layout.height = image.rows;
+  }
+
+  BatchProcessor net(checkpoint_path, FLAGS_use_gpu, 1, FLAGS_native);
+  layout.slot_count = FLAGS_slots;
+  layout.grid_width = net.grid_width();
+  layout.grid_height = net.grid_height();
+  layout.grid_depth = net.grid_depth();
+
+  GridShape shape;
+  shape.depth = layout.grid_depth;
+  shape.height = layout.grid_height;
+  shape.width = layout.grid_width;
+  GridEncoder *encoder = nullptr;
+  if (FLAGS_grid_codec != "float") {
+    GridCodecOptions options;
+    options.precision = FLAGS_grid_codec == "int8" ? GRID_INT8 : GRID_INT16;
+    options.delta = FLAGS_grid_delta;
+    options.keyframe_interval = FLAGS_keyframe_interval;
+    encoder = new GridEncoder(shape, options);
+    layout.grid_bytes = encoder->max_frame_size();
+  }
+  std::vector<float> grid(encoder ? shape.size() : 0);
+  std::vector<uint8_t> encoded;
+  size_t grid_bytes = 0;
+
+  ShmRing ring(FLAGS_ring, layout);
+  std::cout << "Created ring " << FLAGS_ring << " (" << layout.slot_count
+    << " slots of " << layout.width << "x" << layout.height << ")." << std::endl;
+
+  std::vector<float> lowres(net.net_input_size()*net.net_input_size()*3);
+  cv::Mat frame_bgr;
+  Timer wall_timer, timer;
+  wall_timer.start();
+  int frames = 0;
+  while (capture.isOpened() || frames < FLAGS_frames) {
+    RingSlot slot = ring.acquire();
+    // Decode straight into the slot.
+    cv::Mat frame(layout.height, layout.width, CV_8UC3, slot.frame);
+    if (capture.isOpened()) {
+      if (!capture.read(frame_bgr)) {
+        break;
+      }
+      cv::cvtColor(frame_bgr, frame, CV_BGR2RGB, 3);
+    } else {
+      image.copyTo(frame);
+    }
+
+    timer.start();
+    net.prepare_input(frame, lowres.data());
+    if (encoder) {
+      net.forward({lowres.data()}, {grid.data()});
+      encoder->encode(grid.data(), &encoded);
+      std::memcpy(slot.grid, encoded.data(), encoded.size());
+      slot.header->grid_size = encoded.size();
+      grid_bytes += encoded.size();
+    } else {
+      net.forward({lowres.data()}, {slot.grid});
+    }
+    slot.header->forward = timer.duration();
+    ring.publish();
+    ++frames;
+    printf("Published frame %d.\r", frames);
+  }
+  ring.close();
+  printf("\n");
+  // Keep the ring alive until the renderer has caught up, so that it can
+  // attach even to a short stream.
+  ring.drain();
+
+  const double wall_time = wall_timer.duration();
+  std::cout << "Net: " << frames << " frames, "
+    << (wall_time > 0 ? 1000.0*frames/wall_time : 0.0) << " fps, blocked on "
+    << "the renderer for " << ring.waited() << " ms." << std::endl;
+  if (encoder && frames > 0) {
+    std::cout << "Grid: " << grid_bytes/frames << " bytes/frame, "
+      << shape.size()*sizeof(float) << " as floats." << std::endl;
+  }
+  delete encoder;
+  return 0;
+}
+
+int run_render(const std::string &checkpoint_path, int argc, char *argv[]) {
+  ShmRing ring(FLAGS_ring, FLAGS_open_timeout_ms);
+  const RingLayout &layout = ring.layout();
+  std::cout << "Opened ring " << FLAGS_ring << " (" << layout.slot_count
+    << " slots of " << layout.width << "x" << layout.height << ")." << std::endl;
+
+  ModelBundle *bundle = nullptr;
+  if (ModelBundle::exists(checkpoint_path+kBundleFilename)) {
+    bundle = new ModelBundle(checkpoint_path+kBundleFilename);
+  }
+  CpuRenderer *cpu_renderer = nullptr;
+  Renderer *renderer = nullptr;
+  if (FLAGS_cpu_render) {
+    cpu_renderer = new CpuRenderer(layout.grid_width, layout.grid_height,
+        layout.grid_depth, checkpoint_path, bundle);
+  } else {
+    glutInit(&argc, argv);
+    std::string root = argv[0];
+    root = root.substr(0, root.find_last_of("/"));
+    root = root.substr(0, root.find_last_of("/"))+"/";
+    renderer = new StandardRenderer(layout.width, layout.height,
+        layout.grid_width, layout.grid_height, layout.grid_depth,
+        root+"assets/std.vert", root+"assets/std.frag", checkpoint_path,
+        bundle);
+  }
+
+  GridShape shape;
+  shape.depth = layout.grid_depth;
+  shape.height = layout.grid_height;
+  shape.width = layout.grid_width;
+  QuantizedGrid quantized(shape);
+  std::vector<float> dequantized(layout.grid_bytes ? shape.size() : 0);
+  size_t grid_bytes = 0;
+
+  cv::Mat output(layout.height, layout.width, CV_8UC3, cv::Scalar(0));
+  std::vector<double> latency, queue_wait, render_time, forward_time;
+  double upload_time, draw_time, readback_time;
+  Timer wall_timer, timer;
+  RingSlot slot;
+  bool started = false;
+  while (ring.next(&slot)) {
+    if (!started) {
+      // Don't count the wait for the first frame.
+      wall_timer.start();
+      started = true;
+    }
+    const double start = ShmRing::now();
+    queue_wait.push_back(start - slot.header->published);
+    forward_time.push_back(slot.header->forward);
+
+    timer.start();
+    cv::Mat input(layout.height, layout.width, CV_8UC3, slot.frame);
+    const float *grid = slot.grid;
+    if (layout.grid_bytes) {
+      if (slot.header->grid_size > layout.grid_bytes ||
+          !quantized.decode(reinterpret_cast<const uint8_t*>(slot.grid),
+            slot.header->grid_size)) {
+        std::cout << "Bad grid in frame " << slot.header->sequence << std::endl;
+        return 1;
+      }
+      grid_bytes += slot.header->grid_size;
+      // The CPU renderer slices the codes directly; GL takes floats.
+      if (!cpu_renderer) {
+        quantized.dequantize(dequantized.data());
+        grid = dequantized.data();
+      }
+    }
+    if (cpu_renderer && layout.grid_bytes) {
+      cpu_renderer->render(input, quantized, output);
+    } else if (cpu_renderer) {
+      cpu_renderer->render(input, grid, output);
+    } else {
+      renderer->upload_input(input);
+      renderer->render(grid, output,
+          &upload_time, &draw_time, &readback_time);
+    }
+    render_time.push_back(timer.duration());
+    latency.push_back(ShmRing::now() - slot.header->acquired);
+    ring.release();
+    printf("Rendered frame %zu.\r", latency.size());
+  }
+  printf("\n");
+  const double wall_time = started ? wall_timer.duration() : 0.0;
+  const int frames = latency.size();
+  const double grid_size = layout.grid_bytes ?
+    (frames > 0 ? static_cast<double>(grid_bytes)/frames : 0.0) :
+    layout.grid_floats()*sizeof(float);
+
+  std::cout << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Split execution (" << frames << " frames, "
+    << layout.slot_count << " slots)" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Throughput: " << (wall_time > 0 ? 1000.0*frames/wall_time : 0.0)
+    << " fps" << std::endl;
+  std::cout << "Latency (acquire to rendered): mean " << mean(latency)
+    << " ms, p50 " << percentile(latency, 0.5) << " ms, p99 "
+    << percentile(latency, 0.99) << " ms" << std::endl;
+  std::cout << "Net forward pass: " << mean(forward_time) << " ms" << std::endl;
+  std::cout << "Queued in ring: " << mean(queue_wait) << " ms" << std::endl;
+  std::cout << "Rendering: " << mean(render_time) << " ms" << std::endl;
+  std::cout << "Grid: " << grid_size << " bytes/frame ("
+    << grid_size/(layout.grid_floats()*sizeof(float)) << " of float)"
+    << std::endl;
+  std::cout << "Renderer starved: " << ring.waited() << " ms" << std::endl;
+  std::cout << "Net blocked (backpressure): " << ring.producer_blocked()
+    << " ms" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << std::endl;
+
+  if (!FLAGS_output_directory.empty()) {
+    const std::string json_output_path =
+      FLAGS_output_directory + "/split.json";
+    std::ofstream file;
+    file.open(json_output_path, std::ios::out);
+    if(!file) {
+      std::cout << "Failed to open file for writing " << json_output_path << std::endl;
+      throw;
+    }
+    file << "{" << std::endl;
+    file << "\"frames\": " << frames << "," << std::endl;
+    file << "\"slots\": " << layout.slot_count << "," << std::endl;
+    file << "\"fps\": " << (wall_time > 0 ? 1000.0*frames/wall_time : 0.0) << "," << std::endl;
+    file << "\"latency_mean\": " << mean(latency) << "," << std::endl;
+    file << "\"latency_p50\": " << percentile(latency, 0.5) << "," << std::endl;
+    file << "\"latency_p99\": " << percentile(latency, 0.99) << "," << std::endl;
+    file << "\"forward_pass\": " << mean(forward_time) << "," << std::endl;
+    file << "\"queue_wait\": " << mean(queue_wait) << "," << std::endl;
+    file << "\"rendering\": " << mean(render_time) << "," << std::endl;
+    file << "\"grid_bytes\": " << grid_size << "," << std::endl;
+    file << "\"renderer_starved\": " << ring.waited() << "," << std::endl;
+    file << "\"net_blocked\": " << ring.producer_blocked() << std::endl;
+    file << "}" << std::endl;
+    file.close();
+
+    if (frames > 0) {
+      cv::Mat output_bgr;
+      cv::cvtColor(output, output_bgr, CV_RGB2BGR, 3);
+      cv::imwrite(FLAGS_output_directory + "/split.png", output_bgr);
+    }
+  }
+
+  delete renderer;
+  delete cpu_renderer;
+  delete bundle;
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_checkpoint_path.empty()) {
+      std::cerr << "--checkpoint_path is required." << std::endl;
+      return 1;
+  }
+  std::string checkpoint_path = FLAGS_checkpoint_path + "/";
+
+  if (FLAGS_grid_codec != "float" && FLAGS_grid_codec != "int16" &&
+      FLAGS_grid_codec != "int8") {
+    std::cerr << "--grid_codec should be float, int16 or int8." << std::endl;
+    return 1;
+  }
+
+  if (FLAGS_role == "net") {
+    if (FLAGS_input_path.empty() && FLAGS_video_path.empty()) {
+      std::cerr << "--input_path or --video_path is required." << std::endl;
+      return 1;
+    }
+    return run_net(checkpoint_path);
+  } else if (FLAGS_role == "render") {
+    return run_render(checkpoint_path, argc, argv);
+  }
+  std::cerr << "--role should be net or render." << std::endl;
+  return 1;
+}
@@ -0,0 +1,314 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tile_cache.h"
+
+#include <algorithm>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+namespace {
+
+const uint64_t kFnvOffset = 14695981039346656037ull;
+const uint64_t kFnvPrime = 1099511628211ull;
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i])*kFnvPrime;
+  }
+  return hash;
+}
+
+}  // namespace
+
+size_t TileKeyHash::operator()(const TileKey &key) const {
+  uint64_t hash = fnv1a(kFnvOffset, &key.image, sizeof(key.image));
+  hash = fnv1a(hash, &key.zoom, sizeof(key.zoom));
+  hash = fnv1a(hash, &key.x, sizeof(key.x));
+  return static_cast<size_t>(fnv1a(hash, &key.y, sizeof(key.y)));
+}
+
+TileCache::TileCache(const CpuRenderer *renderer,
+    const TileCacheOptions &options)
+  : renderer_(renderer), options_(options)
+{
+  options_.tile_size = std::max(1, options_.tile_size);
+  options_.max_pending_prefetches = std::max(0, options_.max_pending_prefetches);
+  for (int i = 0; i < options_.prefetch_threads; ++i) {
+    prefetchers_.emplace_back(&TileCache::prefetch_loop, this);
+  }
+}
+
+TileCache::~TileCache()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  prefetch_cv_.notify_all();
+  for (std::thread &prefetcher : prefetchers_) {
+    prefetcher.join();
+  }
+}
+
+uint64_t TileCache::add_image(const cv::Mat &input, const float *coeffs) {
+  const size_t grid_size = 3*renderer_->grid_depth()*renderer_->grid_height()*
+    renderer_->grid_width()*4;
+  uint64_t key = fnv1a(kFnvOffset, &input.cols, sizeof(input.cols));
+  key = fnv1a(key, &input.rows, sizeof(input.rows));
+  for (int y = 0; y < input.rows; ++y) {
+    key = fnv1a(key, input.ptr<unsigned char>(y), 3*input.cols);
+  }
+  key = fnv1a(key, coeffs, grid_size*sizeof(float));
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (images_.count(key)) {
+      return key;
+    }
+  }
+
+  std::shared_ptr<Image> image = std::make_shared<Image>();
+  image->coeffs.assign(coeffs, coeffs + grid_size);
+  image->levels.push_back(input);
+  while (image->levels.back().cols > options_.tile_size ||
+         image->levels.back().rows > options_.tile_size) {
+    const cv::Mat &previous = image->levels.back();
+    cv::Mat level;
+    cv::resize(previous, level,
+        cv::Size((previous.cols + 1)/2, (previous.rows + 1)/2), 0, 0,
+        cv::INTER_AREA);
+    image->levels.push_back(level);
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  images_.emplace(key, image);
+  return key;
+}
+
+void TileCache::remove_image(uint64_t image) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  images_.erase(image);
+  for (auto it = lru_.begin(); it != lru_.end();) {
+    if (it->key.image == image) {
+      bytes_ -= it->bytes;
+      index_.erase(it->key);
+      it = lru_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+int TileCache::num_levels(uint64_t image) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(image);
+  return it == images_.end() ? 0 : it->second->levels.size();
+}
+
+int TileCache::tiles_x(uint64_t image, int zoom) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(image);
+  if (it == images_.end() || zoom < 0 ||
+      zoom >= static_cast<int>(it->second->levels.size())) {
+    return 0;
+  }
+  const int width = it->second->levels[zoom].cols;
+  return (width + options_.tile_size - 1)/options_.tile_size;
+}
+
+int TileCache::tiles_y(uint64_t image, int zoom) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = images_.find(image);
+  if (it == images_.end() || zoom < 0 ||
+      zoom >= static_cast<int>(it->second->levels.size())) {
+    return 0;
+  }
+  const int height = it->second->levels[zoom].rows;
+  return (height + options_.tile_size - 1)/options_.tile_size;
+}
+
+std::shared_ptr<const cv::Mat> TileCache::tile(const TileKey &key,
+    bool *hit) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto image_it = images_.find(key.image);
+  if (image_it == images_.end() || !in_range(*image_it->second, key)) {
+    return nullptr;
+  }
+  // Keeps the image alive while rendering without the lock.
+  std::shared_ptr<const Image> image = image_it->second;
+
+  std::shared_ptr<const cv::Mat> result;
+  bool joined = false;
+  while (!result) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      Entry &entry = *it->second;
+      if (entry.prefetched) {
+        entry.prefetched = false;
+        ++stats_.prefetch_hits;
+      }
+      result = entry.tile;
+      lru_.splice(lru_.begin(), lru_, it->second);
+      if (!joined) {
+        ++stats_.hits;
+      }
+      if (hit) {
+        *hit = !joined;
+      }
+    } else if (rendering_.count(key)) {
+      if (!joined) {
+        ++stats_.joins;
+        joined = true;
+      }
+      rendered_cv_.wait(lock);
+    } else {
+      // Not cached, or evicted as soon as it was rendered by someone else.
+      if (!joined) {
+        ++stats_.misses;
+      }
+      rendering_.insert(key);
+      lock.unlock();
+      result = render(*image, key);
+      lock.lock();
+      rendering_.erase(key);
+      insert(key, result, false);
+      rendered_cv_.notify_all();
+      if (hit) {
+        *hit = false;
+      }
+    }
+  }
+
+  if (!prefetchers_.empty()) {
+    queue_neighbours(*image, key);
+    lock.unlock();
+    prefetch_cv_.notify_all();
+  }
+  return result;
+}
+
+TileCacheStats TileCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TileCacheStats stats = stats_;
+  stats.tiles = lru_.size();
+  stats.bytes = bytes_;
+  return stats;
+}
+
+bool TileCache::in_range(const Image &image, const TileKey &key) const {
+  if (key.zoom < 0 || key.zoom >= static_cast<int>(image.levels.size()) ||
+      key.x < 0 || key.y < 0) {
+    return false;
+  }
+  const cv::Mat &level = image.levels[key.zoom];
+  return key.x*options_.tile_size < level.cols &&
+    key.y*options_.tile_size < level.rows;
+}
+
+std::shared_ptr<const cv::Mat> TileCache::render(const Image &image,
+    const TileKey &key) const {
+  const cv::Mat &level = image.levels[key.zoom];
+  const int x_begin = key.x*options_.tile_size;
+  const int y_begin = key.y*options_.tile_size;
+  std::shared_ptr<cv::Mat> tile = std::make_shared<cv::Mat>(
+      std::min(options_.tile_size, level.rows - y_begin),
+      std::min(options_.tile_size, level.cols - x_begin), CV_8UC3);
+  renderer_->render_tile(level, image.coeffs.data(), x_begin, y_begin, *tile);
+  return tile;
+}
+
+void TileCache::insert(const TileKey &key, std::shared_ptr<const cv::Mat> tile,
+    bool prefetched) {
+  const size_t bytes = tile->total()*tile->elemSize();
+  // Tiles of a removed image, or larger than the whole budget, are not kept.
+  if (!images_.count(key.image) || bytes > options_.byte_budget ||
+      index_.count(key)) {
+    return;
+  }
+  lru_.push_front(Entry{key, tile, bytes, prefetched});
+  index_[key] = lru_.begin();
+  bytes_ += bytes;
+  while (bytes_ > options_.byte_budget) {
+    const Entry &oldest = lru_.back();
+    bytes_ -= oldest.bytes;
+    index_.erase(oldest.key);
+    lru_.pop_back();
+    ++stats_.evictions;
+  }
+}
+
+void TileCache::queue_neighbours(const Image &image, const TileKey &key) {
+  std::vector<TileKey> neighbours;
+  // The parent and the children first, so that the same-level neighbours,
+  // pushed last, are rendered first.
+  neighbours.push_back(TileKey{key.image, key.zoom + 1, key.x/2, key.y/2});
+  for (int dy = 0; dy < 2; ++dy)
+  for (int dx = 0; dx < 2; ++dx) {
+    neighbours.push_back(
+        TileKey{key.image, key.zoom - 1, 2*key.x + dx, 2*key.y + dy});
+  }
+  for (int dy = -1; dy <= 1; ++dy)
+  for (int dx = -1; dx <= 1; ++dx) {
+    if (dx != 0 || dy != 0) {
+      neighbours.push_back(
+          TileKey{key.image, key.zoom, key.x + dx, key.y + dy});
+    }
+  }
+
+  for (const TileKey &neighbour : neighbours) {
+    if (in_range(image, neighbour) && !index_.count(neighbour) &&
+        !rendering_.count(neighbour)) {
+      auto queued = std::find(prefetch_queue_.begin(), prefetch_queue_.end(),
+          neighbour);
+      if (queued != prefetch_queue_.end()) {
+        prefetch_queue_.erase(queued);
+      }
+      prefetch_queue_.push_front(neighbour);
+    }
+  }
+  while (static_cast<int>(prefetch_queue_.size()) >
+         options_.max_pending_prefetches) {
+    prefetch_queue_.pop_back();
+  }
+}
+
+void TileCache::prefetch_loop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    prefetch_cv_.wait(lock, [this] {
+      return stopping_ || !prefetch_queue_.empty();
+    });
+    if (stopping_) {
+      return;
+    }
+    const TileKey key = prefetch_queue_.front();
+    prefetch_queue_.pop_front();
+    auto image_it = images_.find(key.image);
+    if (image_it == images_.end() || index_.count(key) ||
+        rendering_.count(key)) {
+      continue;
+    }
+    std::shared_ptr<const Image> image = image_it->second;
+
+    rendering_.insert(key);
+    lock.unlock();
+    std::shared_ptr<const cv::Mat> tile = render(*image, key);
+    lock.lock();
+    rendering_.erase(key);
+    ++stats_.prefetched;
+    insert(key, tile, true);
+    rendered_cv_.notify_all();
+  }
+}
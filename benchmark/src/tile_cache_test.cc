@@ -0,0 +1,270 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of TileCache: tile keys, LRU eviction and prefetching. Needs no model
+// or GL context.
+//
+//   make test
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "cpu_renderer.h"
+#include "tile_cache.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK failed: " \
+        << #condition << std::endl; \
+      ++failures; \
+    } \
+  } while (0)
+
+const int kGridWidth = 4;
+const int kGridHeight = 4;
+const int kGridDepth = 8;
+const int kTileSize = 16;
+// Levels of 64x64, 32x32 and 16x16 pixels: 4x4, 2x2 and 1x1 tiles.
+const int kImageSize = 64;
+const size_t kTileBytes = kTileSize*kTileSize*3;
+
+// A checkpoint directory with the guide parameters CpuRenderer reads, all
+// zero, in a temporary directory.
+std::string write_checkpoint() {
+  char path[] = "/tmp/tile_cache_test.XXXXXX";
+  if (!mkdtemp(path)) {
+    std::cout << "Failed to create a temporary directory" << std::endl;
+    throw;
+  }
+  const std::string root = std::string(path) + "/";
+  const char *names[] = {"guide_ccm_f32_3x4.bin",
+    "guide_mix_matrix_f32_1x4.bin", "guide_shifts_f32_16x3.bin",
+    "guide_slopes_f32_16x3.bin"};
+  const std::vector<float> zeros(16*3, 0.0f);
+  for (const char *name : names) {
+    std::ofstream file(root + name, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(zeros.data()),
+        zeros.size()*sizeof(float));
+  }
+  return root;
+}
+
+cv::Mat random_image(std::mt19937 *rng) {
+  cv::Mat image(kImageSize, kImageSize, CV_8UC3);
+  std::uniform_int_distribution<int> value(0, 255);
+  for (int y = 0; y < image.rows; ++y) {
+    unsigned char *row = image.ptr<unsigned char>(y);
+    for (int x = 0; x < 3*image.cols; ++x) {
+      row[x] = static_cast<unsigned char>(value(*rng));
+    }
+  }
+  return image;
+}
+
+std::vector<float> random_grid(std::mt19937 *rng) {
+  std::vector<float> grid(3*kGridDepth*kGridHeight*kGridWidth*4);
+  std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+  for (float &v : grid) {
+    v = value(*rng);
+  }
+  return grid;
+}
+
+bool same_pixels(const cv::Mat &a, const cv::Mat &b) {
+  if (a.rows != b.rows || a.cols != b.cols) {
+    return false;
+  }
+  for (int y = 0; y < a.rows; ++y) {
+    const unsigned char *row_a = a.ptr<unsigned char>(y);
+    const unsigned char *row_b = b.ptr<unsigned char>(y);
+    for (int x = 0; x < 3*a.cols; ++x) {
+      if (row_a[x] != row_b[x]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Waits up to a few seconds for the cache to hold `tiles` tiles.
+bool wait_for_tiles(const TileCache &cache, size_t tiles) {
+  for (int i = 0; i < 500; ++i) {
+    if (cache.stats().tiles >= tiles) {
+      return cache.stats().tiles == tiles;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+void test_keys(const CpuRenderer &renderer, std::mt19937 *rng) {
+  TileKeyHash hash;
+  const TileKey key = {7, 1, 2, 3};
+  CHECK(key == (TileKey{7, 1, 2, 3}));
+  CHECK(hash(key) == hash(TileKey{7, 1, 2, 3}));
+  const TileKey others[] = {{8, 1, 2, 3}, {7, 0, 2, 3}, {7, 1, 3, 2},
+    {7, 1, 2, 4}};
+  for (const TileKey &other : others) {
+    CHECK(!(key == other));
+    CHECK(hash(key) != hash(other));
+  }
+
+  TileCacheOptions options;
+  options.tile_size = kTileSize;
+  options.prefetch_threads = 0;
+  TileCache cache(&renderer, options);
+  const cv::Mat input = random_image(rng);
+  const std::vector<float> grid = random_grid(rng);
+  std::vector<float> other_grid = grid;
+  other_grid[0] += 1.0f;
+  const uint64_t image = cache.add_image(input, grid.data());
+  CHECK(cache.add_image(input, grid.data()) == image);
+  CHECK(cache.add_image(input, other_grid.data()) != image);
+
+  CHECK(cache.num_levels(image) == 3);
+  CHECK(cache.tiles_x(image, 0) == 4 && cache.tiles_y(image, 0) == 4);
+  CHECK(cache.tiles_x(image, 1) == 2 && cache.tiles_y(image, 1) == 2);
+  CHECK(cache.tiles_x(image, 2) == 1 && cache.tiles_y(image, 2) == 1);
+  CHECK(cache.num_levels(image + 1) == 0);
+  CHECK(!cache.tile(TileKey{image, 0, 4, 0}));
+  CHECK(!cache.tile(TileKey{image, 3, 0, 0}));
+  CHECK(!cache.tile(TileKey{image + 1, 0, 0, 0}));
+
+  // A full-resolution tile is its rectangle of the full render.
+  cv::Mat full;
+  renderer.render(input, grid.data(), full);
+  std::shared_ptr<const cv::Mat> tile = cache.tile(TileKey{image, 0, 2, 1});
+  CHECK(tile && same_pixels(*tile,
+      full(cv::Rect(2*kTileSize, kTileSize, kTileSize, kTileSize))));
+
+  cache.remove_image(image);
+  CHECK(cache.num_levels(image) == 0);
+  CHECK(cache.stats().tiles == 0);
+}
+
+void test_eviction(const CpuRenderer &renderer, std::mt19937 *rng) {
+  TileCacheOptions options;
+  options.tile_size = kTileSize;
+  options.byte_budget = 3*kTileBytes;
+  options.prefetch_threads = 0;
+  TileCache cache(&renderer, options);
+  const cv::Mat input = random_image(rng);
+  const std::vector<float> grid = random_grid(rng);
+  const uint64_t image = cache.add_image(input, grid.data());
+  const TileKey a = {image, 0, 0, 0};
+  const TileKey b = {image, 0, 1, 0};
+  const TileKey c = {image, 0, 2, 0};
+  const TileKey d = {image, 0, 3, 0};
+
+  bool hit = true;
+  cache.tile(a, &hit);
+  CHECK(!hit);
+  cache.tile(b);
+  cache.tile(c);
+  cache.tile(a, &hit);
+  CHECK(hit);
+  // The budget holds three tiles: b is the least recently requested.
+  cache.tile(d);
+  TileCacheStats stats = cache.stats();
+  CHECK(stats.evictions == 1);
+  CHECK(stats.tiles == 3);
+  CHECK(stats.bytes == 3*kTileBytes);
+  cache.tile(a, &hit);
+  CHECK(hit);
+  cache.tile(d, &hit);
+  CHECK(hit);
+  cache.tile(b, &hit);
+  CHECK(!hit);
+  // Now c was.
+  cache.tile(c, &hit);
+  CHECK(!hit);
+
+  stats = cache.stats();
+  CHECK(stats.hits == 3);
+  CHECK(stats.misses == 6);
+  CHECK(stats.evictions == 3);
+  CHECK(stats.bytes <= options.byte_budget);
+}
+
+void test_prefetch(const CpuRenderer &renderer, std::mt19937 *rng) {
+  TileCacheOptions options;
+  options.tile_size = kTileSize;
+  options.prefetch_threads = 2;
+  TileCache cache(&renderer, options);
+  const cv::Mat input = random_image(rng);
+  const std::vector<float> grid = random_grid(rng);
+  const uint64_t image = cache.add_image(input, grid.data());
+
+  // Queues the 8 neighbours at level 0 and the parent; there are no children.
+  cache.tile(TileKey{image, 0, 1, 1});
+  CHECK(wait_for_tiles(cache, 10));
+  // Everything around it is cached: nothing new is queued.
+  bool hit = false;
+  cache.tile(TileKey{image, 0, 1, 1}, &hit);
+  CHECK(hit);
+  // Queues the parent and the 3 other tiles at level 1; the children are
+  // cached.
+  cache.tile(TileKey{image, 1, 0, 0}, &hit);
+  CHECK(hit);
+  CHECK(wait_for_tiles(cache, 14));
+
+  // Each tile was rendered exactly once.
+  TileCacheStats stats = cache.stats();
+  CHECK(stats.misses == 1);
+  CHECK(stats.prefetched == 13);
+  CHECK(stats.prefetch_hits == 1);
+
+  // Requesting every tile renders the 6 left at level 0, once each, whether
+  // by the request or by a prefetch it joins.
+  for (int zoom = 0; zoom < cache.num_levels(image); ++zoom)
+  for (int y = 0; y < cache.tiles_y(image, zoom); ++y)
+  for (int x = 0; x < cache.tiles_x(image, zoom); ++x) {
+    CHECK(cache.tile(TileKey{image, zoom, x, y}));
+  }
+  CHECK(wait_for_tiles(cache, 21));
+  stats = cache.stats();
+  CHECK(stats.misses + stats.prefetched == 21);
+  CHECK(stats.evictions == 0);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  const CpuRenderer renderer(kGridWidth, kGridHeight, kGridDepth,
+      write_checkpoint(), nullptr);
+  std::mt19937 rng(1);
+  test_keys(renderer, &rng);
+  test_eviction(renderer, &rng);
+  test_prefetch(renderer, &rng);
+  if (failures > 0) {
+    std::cout << failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All tests passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,492 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tile serving for a zoom-and-pan viewer, through the tile cache of
+// tile_cache.h. With --role=local, a simulated viewer requests the tiles of
+// its viewport from the cache directly as it pans and zooms around the image.
+// --role=server serves the tiles over a Unix socket (see tile_protocol.h), and
+// --role=viewer replays the same session against a server. Each reports
+// the hit rate and the latencies of hits and misses.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <gflags/gflags.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "processor.h"
+#include "tile_cache.h"
+#include "tile_protocol.h"
+#include "timer.h"
+#include "utils.h"
+
+DEFINE_string(role, "local", "local (simulated viewer and cache in one process), server or viewer.");
+DEFINE_string(checkpoint_path, "", "Path to the network checkpoint (HDRNetCurves). Not needed by the viewer.");
+DEFINE_string(input_path, "", "Image to serve. Not needed by the viewer.");
+DEFINE_bool(use_gpu, false, "Run the network on gpu.");
+DEFINE_bool(native, false, "Compute the coefficients with the built-in C++ network (requires model.hdrb).");
+DEFINE_string(socket_path, "/tmp/hdrnet_tiles.sock", "Unix socket of the tile server.");
+DEFINE_int32(tile_size, 256, "Tile width and height.");
+DEFINE_int32(cache_mb, 256, "Memory budget of the cached tiles, in MB.");
+DEFINE_int32(prefetch_threads, 2, "Threads prefetching neighbouring tiles, 0 disables prefetching.");
+DEFINE_int32(moves, 300, "Number of pans and zooms of the simulated viewer.");
+DEFINE_int32(viewport_width, 1280, "Width of the simulated viewer's viewport.");
+DEFINE_int32(viewport_height, 720, "Height of the simulated viewer's viewport.");
+DEFINE_int32(think_ms, 30, "Pause of the simulated viewer between moves.");
+DEFINE_int32(seed, 1, "Seed of the simulated viewer's moves.");
+DEFINE_string(output_path, "", "Optional JSON report.");
+
+namespace {
+
+typedef struct ImageGeometry {
+  int width = 0;
+  int height = 0;
+  int levels = 0;
+  int tile_size = 0;
+
+  // Levels halve the size, rounding up, as TileCache does.
+  int level_width(int zoom) const {
+    int size = width;
+    for (int z = 0; z < zoom; ++z) {
+      size = (size + 1)/2;
+    }
+    return size;
+  }
+  int level_height(int zoom) const {
+    int size = height;
+    for (int z = 0; z < zoom; ++z) {
+      size = (size + 1)/2;
+    }
+    return size;
+  }
+} ImageGeometry;
+
+// Fetches a tile, setting whether it was cached. Returns false on failure.
+typedef std::function<bool(int zoom, int x, int y, bool *hit)> TileFetcher;
+
+typedef struct SessionResult {
+  int requests = 0;
+  int failures = 0;
+  int hits = 0;
+  std::vector<double> hit_latencies;
+  std::vector<double> miss_latencies;
+} SessionResult;
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  size_t i = std::min(sorted.size() - 1,
+      static_cast<size_t>(p*(sorted.size() - 1) + 0.5));
+  return sorted[i];
+}
+
+// A viewer that starts zoomed out on the whole image and then pans, mostly
+// keeping its direction, and zooms in and out. After each move it requests
+// the tiles of its viewport, row by row.
+SessionResult run_session(const ImageGeometry &geometry,
+    const TileFetcher &fetch) {
+  std::mt19937 rng(FLAGS_seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  const int directions[8][2] = {
+    {1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+
+  SessionResult result;
+  int zoom = geometry.levels - 1;
+  // Viewport center, in level 0 pixels.
+  double cx = 0.5*geometry.width;
+  double cy = 0.5*geometry.height;
+  int direction = 0;
+  Timer timer;
+  for (int move = 0; move < FLAGS_moves; ++move) {
+    const double scale = static_cast<double>(1 << zoom);
+    const int tile_size = geometry.tile_size;
+    const int tiles_x =
+      (geometry.level_width(zoom) + tile_size - 1)/tile_size;
+    const int tiles_y =
+      (geometry.level_height(zoom) + tile_size - 1)/tile_size;
+    const double left = cx/scale - 0.5*FLAGS_viewport_width;
+    const double top = cy/scale - 0.5*FLAGS_viewport_height;
+    const int tx_begin = std::max(0, static_cast<int>(std::floor(left/tile_size)));
+    const int ty_begin = std::max(0, static_cast<int>(std::floor(top/tile_size)));
+    const int tx_end = std::min(tiles_x, static_cast<int>(
+          std::floor((left + FLAGS_viewport_width - 1)/tile_size)) + 1);
+    const int ty_end = std::min(tiles_y, static_cast<int>(
+          std::floor((top + FLAGS_viewport_height - 1)/tile_size)) + 1);
+
+    for (int ty = ty_begin; ty < ty_end; ++ty)
+    for (int tx = tx_begin; tx < tx_end; ++tx) {
+      bool hit = false;
+      timer.start();
+      const bool ok = fetch(zoom, tx, ty, &hit);
+      const double latency = timer.duration();
+      ++result.requests;
+      if (!ok) {
+        ++result.failures;
+      } else if (hit) {
+        ++result.hits;
+        result.hit_latencies.push_back(latency);
+      } else {
+        result.miss_latencies.push_back(latency);
+      }
+    }
+    if (FLAGS_think_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_think_ms));
+    }
+
+    const double action = uniform(rng);
+    if (action < 0.15 && zoom > 0) {
+      --zoom;
+    } else if (action < 0.3 && zoom < geometry.levels - 1) {
+      ++zoom;
+    } else {
+      if (uniform(rng) < 0.3) {
+        direction = rng() % 8;
+      }
+      // Half a tile at the current level.
+      const double step = 0.5*tile_size*scale;
+      cx = std::min<double>(geometry.width,
+          std::max(0.0, cx + step*directions[direction][0]));
+      cy = std::min<double>(geometry.height,
+          std::max(0.0, cy + step*directions[direction][1]));
+    }
+    printf("Move %d of %d.\r", move + 1, FLAGS_moves);
+    fflush(stdout);
+  }
+  printf("\n");
+  return result;
+}
+
+void report(const SessionResult &session, const TileCacheStats *stats,
+    const std::string &filename) {
+  std::vector<double> hits = session.hit_latencies;
+  std::vector<double> misses = session.miss_latencies;
+  std::sort(hits.begin(), hits.end());
+  std::sort(misses.begin(), misses.end());
+  const double hit_rate = session.requests > 0 ?
+    static_cast<double>(session.hits)/session.requests : 0.0;
+
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Tiles (" << session.requests << " requests, "
+    << session.failures << " failed)" << std::endl;
+  std::cout << "------------------------------" << std::endl;
+  std::cout << "Hit rate: " << 100.0*hit_rate << "%" << std::endl;
+  std::cout << "Hits: p50 " << percentile(hits, 0.5) << " ms, p99 "
+    << percentile(hits, 0.99) << " ms" << std::endl;
+  std::cout << "Misses: p50 " << percentile(misses, 0.5) << " ms, p99 "
+    << percentile(misses, 0.99) << " ms" << std::endl;
+  if (stats) {
+    std::cout << "Cache: " << stats->tiles << " tiles, " << stats->bytes
+      << " bytes, " << stats->evictions << " evictions" << std::endl;
+    std::cout << "Prefetched: " << stats->prefetched << " tiles, "
+      << stats->prefetch_hits << " requested, " << stats->joins
+      << " requests waited for one in flight" << std::endl;
+  }
+
+  if (filename.empty()) {
+    return;
+  }
+  std::ofstream file;
+  file.open(filename, std::ios::out);
+  if(!file) {
+    std::cout << "Failed to open file for writing " << filename << std::endl;
+    throw;
+  }
+  file << "{" << std::endl;
+  file << "\"requests\": " << session.requests << "," << std::endl;
+  file << "\"failures\": " << session.failures << "," << std::endl;
+  file << "\"hit_rate\": " << hit_rate << "," << std::endl;
+  file << "\"hit_p50\": " << percentile(hits, 0.5) << "," << std::endl;
+  file << "\"hit_p99\": " << percentile(hits, 0.99) << "," << std::endl;
+  file << "\"miss_p50\": " << percentile(misses, 0.5) << "," << std::endl;
+  file << "\"miss_p99\": " << percentile(misses, 0.99);
+  if (stats) {
+    file << "," << std::endl;
+    file << "\"cached_tiles\": " << stats->tiles << "," << std::endl;
+    file << "\"cached_bytes\": " << stats->bytes << "," << std::endl;
+    file << "\"evictions\": " << stats->evictions << "," << std::endl;
+    file << "\"prefetched\": " << stats->prefetched << "," << std::endl;
+    file << "\"prefetch_hits\": " << stats->prefetch_hits << "," << std::endl;
+    file << "\"joins\": " << stats->joins;
+  }
+  file << std::endl << "}" << std::endl;
+  file.close();
+}
+
+// Serves the tiles of one image over a Unix socket, a thread per connection.
+class TileServer
+{
+public:
+  TileServer(TileCache *cache, uint64_t image, const ImageGeometry &geometry)
+    : cache_(cache), image_(image), geometry_(geometry), stopping_(false),
+      listen_fd_(-1) {}
+
+  // Serves until interrupt() is called. Returns false if the socket could not
+  // be created.
+  bool run(const std::string &socket_path) {
+    int fd = listen_unix(socket_path);
+    if (fd < 0) {
+      std::cout << "Failed to listen on " << socket_path << std::endl;
+      return false;
+    }
+    listen_fd_ = fd;
+    std::cout << "Listening on " << socket_path << "." << std::endl;
+    while (!stopping_) {
+      int client = accept(fd, nullptr, nullptr);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        break;
+      }
+      std::lock_guard<std::mutex> lock(connections_mutex_);
+      connection_fds_.push_back(client);
+      std::thread(&TileServer::serve_connection, this, client).detach();
+    }
+    std::cout << "Shutting down." << std::endl;
+    {
+      std::unique_lock<std::mutex> lock(connections_mutex_);
+      for (int client : connection_fds_) {
+        shutdown(client, SHUT_RDWR);
+      }
+      connections_cv_.wait(lock, [this] { return connection_fds_.empty(); });
+    }
+    listen_fd_ = -1;
+    close(fd);
+    unlink(socket_path.c_str());
+    return true;
+  }
+
+  // Makes run() return. Async-signal safe.
+  void interrupt() {
+    stopping_ = true;
+    int fd = listen_fd_;
+    if (fd >= 0) {
+      // Wakes up accept().
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+
+private:
+  void serve_connection(int fd) {
+    Timer timer;
+    while (true) {
+      TileRequest request;
+      if (!read_fully(fd, &request, sizeof(request))) {
+        break;
+      }
+      timer.start();
+      TileResponse response = TileResponse();
+      response.magic = kTileResponseMagic;
+      response.tile_size = geometry_.tile_size;
+      response.image_width = geometry_.width;
+      response.image_height = geometry_.height;
+      response.levels = geometry_.levels;
+      if (request.magic != kTileRequestMagic) {
+        // We can't find the next request in the stream anymore.
+        response.status = RESPONSE_BAD_REQUEST;
+        write_fully(fd, &response, sizeof(response));
+        break;
+      }
+
+      bool hit = false;
+      std::shared_ptr<const cv::Mat> tile = cache_->tile(
+          TileKey{image_, request.zoom, request.x, request.y}, &hit);
+      response.latency = timer.duration();
+      if (!tile) {
+        response.status = RESPONSE_BAD_REQUEST;
+        if (!write_fully(fd, &response, sizeof(response))) {
+          break;
+        }
+        continue;
+      }
+      response.status = RESPONSE_OK;
+      response.width = tile->cols;
+      response.height = tile->rows;
+      response.hit = hit;
+      if (!write_fully(fd, &response, sizeof(response)) ||
+          !write_fully(fd, tile->data, tile->total()*3)) {
+        break;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    connection_fds_.erase(std::find(connection_fds_.begin(),
+          connection_fds_.end(), fd));
+    close(fd);
+    connections_cv_.notify_all();
+  }
+
+  TileCache *cache_;
+  uint64_t image_;
+  ImageGeometry geometry_;
+  std::atomic<bool> stopping_;
+  std::atomic<int> listen_fd_;
+
+  std::mutex connections_mutex_;
+  std::condition_variable connections_cv_;
+  std::vector<int> connection_fds_;
+};
+
+TileServer *server = nullptr;
+
+void handle_signal(int) {
+  if (server) {
+    server->interrupt();
+  }
+}
+
+bool request_tile(int fd, int zoom, int x, int y, TileResponse *response,
+    std::vector<unsigned char> *pixels) {
+  TileRequest request;
+  request.magic = kTileRequestMagic;
+  request.zoom = zoom;
+  request.x = x;
+  request.y = y;
+  if (!write_fully(fd, &request, sizeof(request)) ||
+      !read_fully(fd, response, sizeof(*response)) ||
+      response->magic != kTileResponseMagic) {
+    return false;
+  }
+  if (response->status != RESPONSE_OK) {
+    return true;
+  }
+  pixels->resize(static_cast<size_t>(response->width)*response->height*3);
+  return read_fully(fd, pixels->data(), pixels->size());
+}
+
+int run_viewer() {
+  int fd = connect_unix(FLAGS_socket_path);
+  if (fd < 0) {
+    std::cout << "Failed to connect to " << FLAGS_socket_path << std::endl;
+    return 1;
+  }
+  TileResponse response;
+  std::vector<unsigned char> pixels;
+  if (!request_tile(fd, 0, 0, 0, &response, &pixels) ||
+      response.status != RESPONSE_OK) {
+    std::cout << "Failed to get the first tile." << std::endl;
+    close(fd);
+    return 1;
+  }
+  ImageGeometry geometry;
+  geometry.width = response.image_width;
+  geometry.height = response.image_height;
+  geometry.levels = response.levels;
+  geometry.tile_size = response.tile_size;
+  std::cout << geometry.width << "x" << geometry.height << ", "
+    << geometry.levels << " levels of " << geometry.tile_size << "px tiles."
+    << std::endl;
+
+  SessionResult session = run_session(geometry,
+      [&](int zoom, int x, int y, bool *hit) {
+        if (!request_tile(fd, zoom, x, y, &response, &pixels) ||
+            response.status != RESPONSE_OK) {
+          return false;
+        }
+        *hit = response.hit;
+        return true;
+      });
+  close(fd);
+  report(session, nullptr, FLAGS_output_path);
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (FLAGS_role == "viewer") {
+    return run_viewer();
+  }
+  if (FLAGS_role != "local" && FLAGS_role != "server") {
+    std::cerr << "--role must be local, server or viewer." << std::endl;
+    return 1;
+  }
+  if (FLAGS_checkpoint_path.empty() || FLAGS_input_path.empty()) {
+    std::cerr << "--checkpoint_path and --input_path are required." << std::endl;
+    return 1;
+  }
+  std::string checkpoint_path = FLAGS_checkpoint_path + "/";
+
+  cv::Mat image = load_image(FLAGS_input_path);
+  if (!image.data) {
+    std::cout << "Failed to load " << FLAGS_input_path << std::endl;
+    return 1;
+  }
+
+  // The grid is computed once, for the whole image.
+  BatchProcessor net(checkpoint_path, FLAGS_use_gpu, 1, FLAGS_native);
+  std::vector<float> lowres(net.net_input_size()*net.net_input_size()*3);
+  std::vector<float> grid(net.coefficients_size());
+  net.prepare_input(image, lowres.data());
+  net.forward({lowres.data()}, {grid.data()});
+
+  TileCacheOptions options;
+  options.tile_size = FLAGS_tile_size;
+  options.byte_budget = static_cast<size_t>(FLAGS_cache_mb) << 20;
+  options.prefetch_threads = FLAGS_prefetch_threads;
+  TileCache cache(&net.renderer(), options);
+  const uint64_t key = cache.add_image(image, grid.data());
+
+  ImageGeometry geometry;
+  geometry.width = image.cols;
+  geometry.height = image.rows;
+  geometry.levels = cache.num_levels(key);
+  geometry.tile_size = FLAGS_tile_size;
+  std::cout << geometry.width << "x" << geometry.height << ", "
+    << geometry.levels << " levels of " << geometry.tile_size << "px tiles, "
+    << FLAGS_cache_mb << " MB cache, " << FLAGS_prefetch_threads
+    << " prefetching threads." << std::endl;
+
+  if (FLAGS_role == "server") {
+    TileServer tile_server(&cache, key, geometry);
+    server = &tile_server;
+    std::signal(SIGINT, handle_signal);
+    std::signal(SIGTERM, handle_signal);
+    bool ok = tile_server.run(FLAGS_socket_path);
+    server = nullptr;
+    const TileCacheStats stats = cache.stats();
+    std::cout << "Served " << stats.requests() << " tiles, hit rate "
+      << 100.0*stats.hit_rate() << "%, " << stats.prefetched
+      << " prefetched (" << stats.prefetch_hits << " requested), "
+      << stats.evictions << " evictions." << std::endl;
+    return ok ? 0 : 1;
+  }
+
+  SessionResult session = run_session(geometry,
+      [&](int zoom, int x, int y, bool *hit) {
+        return cache.tile(TileKey{key, zoom, x, y}, hit) != nullptr;
+      });
+  const TileCacheStats stats = cache.stats();
+  report(session, &stats, FLAGS_output_path);
+  return 0;
+}
@@ -32,6 +32,15 @@ void load_binary_data(std::string filename, int length, float* output) {
   file.close();
 }
 
+void load_model_data(const ModelBundle *bundle, std::string checkpoint_path,
+    std::string name, int length, float* output) {
+  if (bundle) {
+    bundle->read_floats(name, length, output);
+  } else {
+    load_binary_data(checkpoint_path+name, length, output);
+  }
+}
+
 void shader_from_file(const std::string filename, GLuint& shader) {
   std::ifstream file;
   file.open(filename, std::ios::in);
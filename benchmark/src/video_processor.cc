@@ -0,0 +1,142 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "video_processor.h"
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+void VideoStats::save(const std::string &filename) {
+  std::ofstream file;
+  file.open(filename, std::ios::out);
+  if(!file) {
+    std::cout << "Failed to open file for writing " << filename << std::endl;
+    throw;
+  }
+  const double n = frames > 0 ? frames : 1;
+  file << "{" << std::endl;
+  file << "\"frames\": " << frames << "," << std::endl;
+  file << "\"evaluations\": " << evaluations << "," << std::endl;
+  file << "\"fraction_saved\": " << fraction_saved() << "," << std::endl;
+  file << "\"fps\": " << fps() << "," << std::endl;
+  file << "\"wall_time\": " << wall_time << "," << std::endl;
+  file << "\"change_detection\": " << change_detection/n << "," << std::endl;
+  file << "\"interpolation\": " << interpolation/n << "," << std::endl;
+  file << "\"downsampling\": " << timing.downsampling/n << "," << std::endl;
+  file << "\"convert_to_float\": " << timing.convert_to_float/n << "," << std::endl;
+  file << "\"forward_pass\": " << timing.forward_pass/n << "," << std::endl;
+  file << "\"rendering_gl_coeff\": " << timing.rendering_gl_coeff/n << "," << std::endl;
+  file << "\"rendering_gl_draw\": " << timing.rendering_gl_draw/n << "," << std::endl;
+  file << "\"rendering_gl_readback\": " << timing.rendering_gl_readback/n << std::endl;
+  file << "}" << std::endl;
+  file.close();
+}
+
+VideoProcessor::VideoProcessor(HybridGLProcessor *processor,
+    const VideoOptions &options)
+  : processor_(processor), options_(options)
+{
+  if (options_.keyframe_interval < 1) {
+    std::cout << "keyframe_interval should be at least 1" << std::endl;
+    throw;
+  }
+}
+
+void VideoProcessor::process(const cv::Mat &frame, std::vector<cv::Mat> *outputs) {
+  const bool first = stats_.frames == 0;
+  ++stats_.frames;
+  if (!first && static_cast<int>(pending_.size()) + 1 < options_.keyframe_interval) {
+    pending_.push_back(frame.clone());
+    return;
+  }
+
+  BenchmarkResult result;
+  keyframe(frame, &result);
+
+  // Frames between the previous keyframe and this one.
+  const int n = pending_.size();
+  for (int i = 0; i < n; ++i) {
+    BenchmarkResult blend_result;
+    timer_.start();
+    const float t = static_cast<float>(i + 1)/(n + 1);
+    for (size_t k = 0; k < grid_.size(); ++k) {
+      blended_grid_[k] = (1.0f - t)*grid_[k] + t*next_grid_[k];
+    }
+    stats_.interpolation += timer_.duration();
+    render(pending_.front(), blended_grid_.data(), &blend_result, outputs);
+    pending_.pop_front();
+  }
+
+  grid_.swap(next_grid_);
+  render(frame, grid_.data(), &result, outputs);
+}
+
+void VideoProcessor::flush(std::vector<cv::Mat> *outputs) {
+  if (pending_.empty()) {
+    return;
+  }
+  // Promote the last pending frame to a keyframe.
+  cv::Mat last = pending_.back();
+  pending_.pop_back();
+  --stats_.frames;
+  const int interval = options_.keyframe_interval;
+  options_.keyframe_interval = 1;
+  process(last, outputs);
+  options_.keyframe_interval = interval;
+}
+
+void VideoProcessor::keyframe(const cv::Mat &frame, BenchmarkResult *result) {
+  processor_->prepare_input(frame, result);
+  const float *lowres = processor_->lowres_input();
+  const int size = processor_->net_input_size();
+  const int lowres_size = size*size*3;
+
+  bool evaluate = last_lowres_.empty() || options_.change_threshold <= 0.0;
+  if (!evaluate) {
+    timer_.start();
+    double change = 0.0;
+    for (int i = 0; i < lowres_size; ++i) {
+      change += std::fabs(lowres[i] - last_lowres_[i]);
+    }
+    change /= lowres_size;
+    stats_.change_detection += timer_.duration();
+    evaluate = change >= options_.change_threshold;
+  }
+
+  if (evaluate) {
+    const float *coeffs = processor_->forward(result);
+    const int grid_size = processor_->coefficients_size();
+    next_grid_.assign(coeffs, coeffs + grid_size);
+    last_lowres_.assign(lowres, lowres + lowres_size);
+    if (grid_.empty()) {
+      grid_ = next_grid_;
+      blended_grid_.resize(grid_size);
+    }
+    ++stats_.evaluations;
+  } else {
+    // Static scene: the next keyframe has the same grid as the last one
+    // evaluated.
+    next_grid_ = grid_;
+  }
+}
+
+void VideoProcessor::render(const cv::Mat &frame, const float *grid,
+    BenchmarkResult *result, std::vector<cv::Mat> *outputs) {
+  cv::Mat output(frame.rows, frame.cols, CV_8UC3, cv::Scalar(0));
+  processor_->upload_input(frame);
+  processor_->render(grid, output, result);
+  outputs->push_back(output);
+  stats_.timing = stats_.timing + *result;
+}
@@ -0,0 +1,96 @@
+#!/usr/bin/env python
+# encoding: utf-8
+# Copyright 2016 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Convert RecordWriter .tfrecords to memory-mapped .hdrs shards.
+
+The shards hold the same image pairs, already decoded, and are read by
+ShardDataPipeline without parsing or copying. The output directory gets a
+filelist.txt to pass as the data path, e.g.
+
+  bin/convert_records.py data/train/filelist.txt data/train_shards
+  bin/train.py --data_pipeline ShardDataPipeline data/train_shards/filelist.txt ...
+"""
+
+import argparse
+import logging
+import numpy as np
+import os
+
+import tensorflow as tf
+
+import hdrnet.data_pipeline as dp
+
+
+logging.basicConfig(format="[%(process)d] %(levelname)s %(filename)s:%(lineno)s | %(message)s")
+log = logging.getLogger("convert_records")
+log.setLevel(logging.INFO)
+
+
+def input_records(path):
+  """.tfrecords listed in a txt file (as HDRpDataPipeline), or a single one."""
+  if path.endswith('.tfrecords'):
+    return [path]
+  root = os.path.dirname(os.path.abspath(path))
+  with open(path, 'r') as fid:
+    flist = [l.strip() for l in fid]
+  return [os.path.join(root, f) for f in flist if '.tfrecords' in f]
+
+
+def parse_example(serialized):
+  """Decodes the image pair of a RecordWriter example to numpy arrays."""
+  features = tf.train.Example.FromString(serialized).features.feature
+  data = {}
+  for k in dp.ShardWriter.FEATURES:
+    dtype = dp.REVERSE_TYPEMAP[features[k+'_dtype'].int64_list.value[0]]
+    shape = list(features[k+'_sz'].int64_list.value)
+    data[k] = np.frombuffer(
+        features[k].bytes_list.value[0],
+        dtype=dtype.as_numpy_dtype).reshape(shape)
+  return data
+
+
+def main(args):
+  records = input_records(args.input)
+  if not records:
+    log.error("No .tfrecords in {}".format(args.input))
+    return
+  if not os.path.exists(args.output_dir):
+    os.makedirs(args.output_dir)
+
+  writer = dp.ShardWriter(args.output_dir,
+                          records_per_file=args.samples_per_shard,
+                          prefix=args.prefix)
+  for r in records:
+    for serialized in tf.python_io.tf_record_iterator(r):
+      writer.write(parse_example(serialized))
+    log.info("Converted {} ({} samples so far)".format(r, writer.written))
+  writer.close()
+
+  with open(os.path.join(args.output_dir, 'filelist.txt'), 'w') as fid:
+    for f in writer.filenames:
+      fid.write(os.path.basename(f) + '\n')
+  log.info("Wrote {} samples to {} shards in {}".format(
+      writer.written, writer.nfiles, args.output_dir))
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('input', type=str, help='.tfrecords file, or txt file listing them.')
+  parser.add_argument('output_dir', type=str, help='directory for the .hdrs shards and their filelist.txt.')
+  parser.add_argument('--samples_per_shard', default=500, type=int, help='image pairs per shard.')
+  parser.add_argument('--prefix', default='', type=str, help='prefix of the shard names.')
+  args = parser.parse_args()
+  main(args)
@@ -0,0 +1,126 @@
+#!/usr/bin/env python
+# encoding: utf-8
+# Copyright 2016 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Converts a trained network, slice-apply included, to a TFLite model.
+
+The HDRnet ops are kept as TFLite custom ops, run by the kernels of
+ops/tflite_ops.cc (see ops:benchmark_model_hdrnet).
+"""
+
+import argparse
+import logging
+import os
+import tensorflow as tf
+from tensorflow.python.framework import graph_util
+from tensorflow.python.grappler import tf_optimizer
+
+import hdrnet.hdrnet_ops as hdrnet_ops
+import hdrnet.models as models
+import hdrnet.utils as utils
+
+
+logging.basicConfig(format="[%(process)d] %(levelname)s %(filename)s:%(lineno)s | %(message)s")
+log = logging.getLogger("train")
+log.setLevel(logging.INFO)
+
+
+def fuse_guide(graph_def, output_names):
+  """Runs only the HDRNetGuideFusion pass on a frozen graph."""
+  graph = tf.Graph()
+  with graph.as_default():
+    tf.import_graph_def(graph_def, name='')
+    for name in output_names:
+      graph.add_to_collection('train_op', graph.get_operation_by_name(name))
+    meta_graph = tf.train.export_meta_graph(graph=graph)
+  config = tf.ConfigProto()
+  hdrnet_ops.enable_guide_fusion(config, move_to_cpu=True)
+  rewrite_options = config.graph_options.rewrite_options
+  del rewrite_options.optimizers[:]
+  rewrite_options.optimizers.append('HDRNetGuideFusion')
+  return tf_optimizer.OptimizeGraph(config, meta_graph)
+
+
+def main(args):
+  # Read model parameters
+  checkpoint_path = tf.train.latest_checkpoint(args.checkpoint_dir)
+  if checkpoint_path is None:
+    log.error('Could not find a checkpoint in {}'.format(args.checkpoint_dir))
+    return
+  metapath = ".".join([checkpoint_path, "meta"])
+  log.info("Loading {}".format(metapath))
+  tf.train.import_meta_graph(metapath)
+  with tf.Session() as sess:
+    model_params = utils.get_model_params(sess)
+
+  if not hasattr(models, model_params['model_name']):
+    log.error("Model {} does not exist".format(model_params['model_name']))
+    return
+  mdl = getattr(models, model_params['model_name'])
+
+  # Instantiate new evaluation graph, TFLite needs static shapes.
+  tf.reset_default_graph()
+  sz = model_params['net_input_size']
+  lowres_input = tf.placeholder(
+      tf.float32, [1, sz, sz, 3], name='lowres_input')
+  fullres_input = tf.placeholder(
+      tf.float32, [1, args.height, args.width, 3], name='fullres_input')
+  with tf.variable_scope('inference'):
+    prediction = mdl.inference(
+        lowres_input, fullres_input, model_params, is_training=False)
+  output_tensor = tf.identity(prediction, name='output')
+  saver = tf.train.Saver()
+
+  log.info("Restoring weights from {}".format(checkpoint_path))
+  with tf.Session() as sess:
+    saver.restore(sess, checkpoint_path)
+    graph_def = graph_util.convert_variables_to_constants(
+        sess, sess.graph.as_graph_def(), ['output'])
+
+  if args.fuse_guide:
+    log.info("Fusing the guide into slice-apply")
+    graph_def = fuse_guide(graph_def, ['output'])
+
+  converter = tf.lite.TFLiteConverter(
+      graph_def, None, None,
+      input_arrays_with_shape=[
+          ('lowres_input', lowres_input.get_shape().as_list()),
+          ('fullres_input', fullres_input.get_shape().as_list())],
+      output_arrays=['output'])
+  converter.allow_custom_ops = True
+  converter.target_spec.supported_ops = [tf.lite.OpsSet.TFLITE_BUILTINS]
+  tflite_model = converter.convert()
+
+  output_path = os.path.join(args.checkpoint_dir, "model.tflite")
+  log.info("Writing {} ({} bytes)".format(output_path, len(tflite_model)))
+  with open(output_path, 'wb') as fid:
+    fid.write(tflite_model)
+  log.info('input tensors: {} {}, {} {}'.format(
+      lowres_input.name, lowres_input.shape,
+      fullres_input.name, fullres_input.shape))
+  log.info('output tensor: {} {}'.format(output_tensor.name, output_tensor.shape))
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('checkpoint_dir', type=str, help='path to the checkpoint to convert.')
+  parser.add_argument('--width', type=int, default=1920, help='width of the full-resolution input.')
+  parser.add_argument('--height', type=int, default=1080, help='height of the full-resolution input.')
+  parser.add_argument('--fuse_guide', dest="fuse_guide", action="store_true", help='If true, fuses the guide into the slice-apply.')
+  parser.add_argument('--nofuse_guide', dest="fuse_guide", action="store_false")
+  parser.set_defaults(fuse_guide=True)
+
+  args = parser.parse_args()
+  main(args)
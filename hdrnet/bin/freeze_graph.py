@@ -62,13 +62,23 @@ def main(args):
 
   log.info("Model {}".format(model_params['model_name']))
 
-  input_tensor = tf.placeholder(tf.float32, [1, sz, sz, 3], name='lowres_input')
+  batch_size = None if args.batched else 1
+  input_tensor = tf.placeholder(tf.float32, [batch_size, sz, sz, 3], name='lowres_input')
   with tf.variable_scope('inference'):
     prediction = mdl.inference(input_tensor, input_tensor, model_params, is_training=False)
   if model_params["model_name" ] == "HDRNetGaussianPyrNN":
     output_tensor = tf.get_collection('packed_coefficients')[0]
     output_tensor = tf.transpose(tf.squeeze(output_tensor), [3, 2, 0, 1, 4], name="output_coefficients")
     log.info("Output shape".format(output_tensor.get_shape()))
+  elif args.batched:
+    # packed_coefficients is (batch, h, w, d, rows, cols). output_coefficients
+    # keeps its batch-1 layout for the benchmark; the server uses
+    # batched_output_coefficients, (batch, rows, d, h, w, cols).
+    packed = tf.get_collection('packed_coefficients')[0]
+    output_tensor = tf.transpose(tf.squeeze(packed, axis=[0]), [3, 2, 0, 1, 4], name="output_coefficients")
+    batched_tensor = tf.transpose(packed, [0, 4, 3, 1, 2, 5], name="batched_output_coefficients")
+    log.info("Output shape {}, batched {}".format(
+        output_tensor.get_shape(), batched_tensor.get_shape()))
   else:
     output_tensor = tf.get_collection('packed_coefficients')[0]
     output_tensor = tf.transpose(tf.squeeze(output_tensor), [3, 2, 0, 1, 4], name="output_coefficients")
@@ -79,7 +89,10 @@ def main(args):
 
   log.info("Restoring weights from {}".format(checkpoint_path))
   test_graph_name = "test_graph.pbtxt"
-  with tf.Session() as sess:
+  # Only the coefficients are frozen; the slicing output may be pinned to a GPU
+  # this host does not have.
+  config = tf.ConfigProto(allow_soft_placement=True)
+  with tf.Session(config=config) as sess:
     saver.restore(sess, checkpoint_path)
     tf.train.write_graph(sess.graph, args.checkpoint_dir, test_graph_name)
 
@@ -90,6 +103,8 @@ def main(args):
     output_binary = True
     input_node_names = input_tensor.name.split(":")[0]
     output_node_names = output_tensor.name.split(":")[0]
+    if args.batched and model_params["model_name"] != "HDRNetGaussianPyrNN":
+      output_node_names += "," + batched_tensor.name.split(":")[0]
     restore_op_name = "save/restore_all"
     filename_tensor_name = "save/Const:0"
     clear_devices = False
@@ -187,6 +202,9 @@ def main(args):
 if __name__ == '__main__':
   parser = argparse.ArgumentParser()
   parser.add_argument('checkpoint_dir', default=None, help='')
+  parser.add_argument('--batched', dest='batched', action='store_true',
+                      help='accept any batch size and add a batched_output_coefficients node, for benchmark/bin/server')
+  parser.set_defaults(batched=False)
 
   args = parser.parse_args()
   main(args)
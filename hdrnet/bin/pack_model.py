@@ -0,0 +1,221 @@
+#!/usr/bin/env python
+# encoding: utf-8
+# Copyright 2016 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Pack a model into a single memory-mappable bundle.
+
+Run after freeze_graph.py (and optimize_graph.sh for TF inference). Besides
+the graph and guide parameters, the bundle holds the coefficient network
+weights used by the native C++ runtime (benchmark/src/coefficient_net.cc).
+The bundle layout is documented in benchmark/include/model_bundle.h and must
+be kept in sync.
+"""
+
+import argparse
+import logging
+import numpy as np
+import os
+import struct
+import zlib
+
+import tensorflow as tf
+
+import hdrnet.utils as utils
+import hdrnet.models as models
+
+
+logging.basicConfig(format="[%(process)d] %(levelname)s %(filename)s:%(lineno)s | %(message)s")
+log = logging.getLogger("pack_model")
+log.setLevel(logging.INFO)
+
+BUNDLE_MAGIC = b'HDRB'
+BUNDLE_VERSION = 1
+BUNDLE_ALIGNMENT = 64
+BUNDLE_FILENAME = 'model.hdrb'
+
+HEADER_FORMAT = '<4sIII32s11i5i'
+SECTION_FORMAT = '<48sQQII'
+
+# Files produced by freeze_graph.py for each model.
+GUIDE_FILES = {
+    'HDRNetCurves': [
+        'guide_ccm_f32_3x4.bin',
+        'guide_shifts_f32_16x3.bin',
+        'guide_slopes_f32_16x3.bin',
+        'guide_mix_matrix_f32_1x4.bin',
+    ],
+    'HDRNetPointwiseNNGuide': [
+        'guide_conv1.bin',
+        'guide_conv2.bin',
+    ],
+    'HDRNetGaussianPyrNN': [
+        'guide_level{}_conv{}.bin'.format(lvl, i)
+        for lvl in range(3) for i in [1, 2]],
+}
+
+
+def _align(offset):
+  return (offset + BUNDLE_ALIGNMENT - 1) // BUNDLE_ALIGNMENT * BUNDLE_ALIGNMENT
+
+
+def write_bundle(path, model_name, params, grid_shape, sections):
+  """Writes a bundle.
+
+  Args:
+    path: destination file.
+    model_name: name of the model class.
+    params: dict of model hyperparameters.
+    grid_shape: (width, height, depth, rows, cols) of the coefficient grid.
+    sections: list of (name, bytes) pairs.
+  """
+  table_size = len(sections)*struct.calcsize(SECTION_FORMAT)
+  offset = _align(struct.calcsize(HEADER_FORMAT) + table_size)
+
+  table = b''
+  payload_offsets = []
+  for name, data in sections:
+    if len(name) >= 48:
+      raise ValueError('Section name too long: {}'.format(name))
+    table += struct.pack(SECTION_FORMAT, name.encode('ascii'), offset,
+                         len(data), zlib.crc32(data) & 0xffffffff, 0)
+    payload_offsets.append(offset)
+    offset = _align(offset + len(data))
+
+  gw, gh, gd, rows, cols = grid_shape
+  header = struct.pack(
+      HEADER_FORMAT, BUNDLE_MAGIC, BUNDLE_VERSION, len(sections),
+      zlib.crc32(table) & 0xffffffff, model_name.encode('ascii'),
+      int(params['net_input_size']), gw, gh, gd, rows, cols,
+      int(params['luma_bins']), int(params['spatial_bin']),
+      int(params['channel_multiplier']),
+      int(params.get('guide_complexity', 0)),
+      int(params['batch_norm']),
+      0, 0, 0, 0, 0)
+
+  with open(path, 'wb') as fid:
+    fid.write(header)
+    fid.write(table)
+    for (name, data), data_offset in zip(sections, payload_offsets):
+      fid.write(b'\0'*(data_offset - fid.tell()))
+      fid.write(data)
+  log.info('Wrote {} sections to {}'.format(len(sections), path))
+
+
+def coefficient_layers(params):
+  """Scopes of the layers in HDRNetCurves._coefficients, in order."""
+  n_ds_layers = int(np.log2(params['net_input_size']/params['spatial_bin']))
+  layers = ['splat/conv{}'.format(i+1) for i in range(n_ds_layers)]
+  layers += ['global/conv1', 'global/conv2',
+             'global/fc1', 'global/fc2', 'global/fc3']
+  layers += ['local/conv1', 'local/conv2', 'prediction/conv1']
+  return layers
+
+
+def coefficient_sections(sess, params):
+  """Weights of the coefficient network for the native C++ runtime.
+
+  Batch normalization is folded into the weights and biases, as for the guide
+  parameters in freeze_graph.py. Weights keep the TF layout: (ky, kx, in, out)
+  for convolutions, (in, out) for fully connected layers.
+  """
+  g = tf.get_default_graph()
+  variables = set(v.op.name for v in tf.global_variables())
+  sections = []
+  for layer in coefficient_layers(params):
+    scope = 'inference/coefficients/' + layer
+    w = sess.run(g.get_tensor_by_name(scope+'/weights:0'))
+    nout = w.shape[-1]
+    if scope+'/BatchNorm/beta' in variables:
+      beta, mu, sigma, eps = sess.run([
+          g.get_tensor_by_name(scope+'/BatchNorm/beta:0'),
+          g.get_tensor_by_name(scope+'/BatchNorm/moving_mean:0'),
+          g.get_tensor_by_name(scope+'/BatchNorm/moving_variance:0'),
+          g.get_tensor_by_name(scope+'/BatchNorm/batchnorm/add/y:0')])
+      w = w/np.sqrt(sigma+eps)
+      b = beta - mu/np.sqrt(sigma+eps)
+    elif scope+'/biases' in variables:
+      b = sess.run(g.get_tensor_by_name(scope+'/biases:0'))
+    else:
+      b = None
+    sections.append(('coefficients/{}/weights'.format(layer),
+                     w.astype(np.float32).tobytes()))
+    if b is not None:
+      sections.append(('coefficients/{}/biases'.format(layer),
+                       np.reshape(b, [nout]).astype(np.float32).tobytes()))
+  return sections
+
+
+def main(args):
+  checkpoint_path = tf.train.latest_checkpoint(args.checkpoint_dir)
+  if checkpoint_path is None:
+    log.error('Could not find a checkpoint in {}'.format(args.checkpoint_dir))
+    return
+  metapath = ".".join([checkpoint_path, "meta"])
+  log.info("Loading {}".format(metapath))
+  tf.train.import_meta_graph(metapath)
+  with tf.Session() as sess:
+    model_params = utils.get_model_params(sess)
+
+  model_name = model_params['model_name']
+  if isinstance(model_name, bytes):
+    model_name = model_name.decode('ascii')
+  if not hasattr(models, model_name) or model_name not in GUIDE_FILES:
+    log.error("Model {} cannot be packed".format(model_name))
+    return
+  mdl = getattr(models, model_name)
+
+  # The grid is spatial_bin x spatial_bin x luma_bins, see _coefficients.
+  spatial_bin = int(model_params['spatial_bin'])
+  grid_shape = (spatial_bin, spatial_bin, int(model_params['luma_bins']),
+                mdl.n_out(), mdl.n_in())
+
+  sections = []
+  graph_path = os.path.join(args.checkpoint_dir, 'optimized_graph.pb')
+  if os.path.exists(graph_path):
+    with open(graph_path, 'rb') as fid:
+      sections.append(('optimized_graph.pb', fid.read()))
+  else:
+    log.warning("No optimized_graph.pb, the bundle will only support native "
+                "inference (run optimize_graph.sh first for TF inference)")
+  for fname in GUIDE_FILES[model_name]:
+    fpath = os.path.join(args.checkpoint_dir, fname)
+    if not os.path.exists(fpath):
+      log.error("Missing {}, run freeze_graph.py first".format(fpath))
+      return
+    with open(fpath, 'rb') as fid:
+      sections.append((fname, fid.read()))
+
+  # Instantiate the evaluation graph to read back the network weights.
+  tf.reset_default_graph()
+  sz = model_params['net_input_size']
+  input_tensor = tf.placeholder(tf.float32, [1, sz, sz, 3], name='lowres_input')
+  with tf.variable_scope('inference'):
+    mdl.inference(input_tensor, input_tensor, model_params, is_training=False)
+  saver = tf.train.Saver()
+  with tf.Session() as sess:
+    log.info("Restoring weights from {}".format(checkpoint_path))
+    saver.restore(sess, checkpoint_path)
+    sections += coefficient_sections(sess, model_params)
+
+  write_bundle(os.path.join(args.checkpoint_dir, BUNDLE_FILENAME),
+               model_name, model_params, grid_shape, sections)
+
+
+if __name__ == '__main__':
+  parser = argparse.ArgumentParser()
+  parser.add_argument('checkpoint_dir', default=None, help='')
+
+  args = parser.parse_args()
+  main(args)
@@ -18,6 +18,7 @@
 
 import argparse
 import cv2
+import json
 import logging
 import numpy as np
 import os
@@ -30,6 +31,7 @@ import sys
 import time
 import tensorflow as tf
 
+import hdrnet.hdrnet_ops as hdrnet_ops
 import hdrnet.models as models
 import hdrnet.utils as utils
 
@@ -58,6 +60,31 @@ def get_input_list(path):
   return inputs
 
 
+def write_guide_stats(path, histogram, occupancy, num_images):
+  """Summarizes the guide statistics accumulated over the inputs as json.
+
+  The occupancy per depth bin, and the depth bins each spatial cell uses, tell
+  whether params['luma_bins'] is larger than the guide needs.
+  """
+  cells = occupancy.reshape([-1, occupancy.shape[-1]])
+  touched = np.sum(cells > 0, axis=-1)
+  depth_occupancy = np.sum(cells, axis=0)
+  stats = {
+      'num_images': num_images,
+      'grid_shape': list(occupancy.shape),
+      'guide_histogram': histogram.tolist(),
+      'depth_occupancy': depth_occupancy.tolist(),
+      'unused_depth_bins': int(np.sum(depth_occupancy == 0)),
+      'depth_bins_per_cell_mean': float(np.mean(touched)),
+      'depth_bins_per_cell_max': int(np.max(touched)),
+  }
+  with open(path, 'w') as fid:
+    json.dump(stats, fid, indent=2)
+  log.info("Guide uses {} of {} depth bins, {:.1f} per cell on average".format(
+      occupancy.shape[-1] - stats['unused_depth_bins'], occupancy.shape[-1],
+      stats['depth_bins_per_cell_mean']))
+
+
 def main(args):
   setproctitle.setproctitle('hdrnet_run')
 
@@ -95,6 +122,26 @@ def main(args):
   output = tf.cast(255.0*tf.squeeze(tf.clip_by_value(prediction, 0, 1)), tf.uint8)
   saver = tf.train.Saver()
 
+  if args.fuse_guide:
+    # Checkpoints trained without --fused_guide still get the fused op.
+    hdrnet_ops.enable_guide_fusion(config, move_to_cpu=True)
+
+  guide_stats = None
+  if args.telemetry:
+    # Statistics of the first (or only) guide against the grid it slices.
+    t_guide = tf.get_collection('guide')
+    t_coeffs = tf.get_collection('bilateral_coefficients')
+    if len(t_guide) > 0 and len(t_coeffs) > 0:
+      with tf.device('/cpu:0'):
+        guide_stats = hdrnet_ops.bilateral_guide_stats(
+            t_coeffs[0], t_guide[0], num_bins=args.telemetry_bins)
+      histogram_sum = None
+      occupancy_sum = None
+      num_images = 0
+    else:
+      log.warning("Model {} has no guide to collect statistics on".format(
+          model_params['model_name']))
+
   if args.debug:
     coeffs = tf.get_collection('bilateral_coefficients')[0]
     if len(coeffs.get_shape().as_list()) == 6:
@@ -182,7 +229,17 @@ def main(args):
           t_lowres_input: lowres_input
       }
 
-      out_ =  sess.run(output, feed_dict=feed_dict)
+      if guide_stats is not None:
+        out_, (histogram_, occupancy_) = sess.run(
+            [output, guide_stats], feed_dict=feed_dict)
+        if histogram_sum is None:
+          histogram_sum = np.zeros(histogram_.shape[1:], dtype=np.int64)
+          occupancy_sum = np.zeros(occupancy_.shape[1:], dtype=np.int64)
+        histogram_sum += np.sum(histogram_, axis=0)
+        occupancy_sum += np.sum(occupancy_, axis=0)
+        num_images += 1
+      else:
+        out_ =  sess.run(output, feed_dict=feed_dict)
 
       if not os.path.exists(basedir):
         os.makedirs(basedir)
@@ -214,6 +271,10 @@ def main(args):
             output_path = os.path.join(args.output, fname+"_guide_{}.png".format(i))
             skimage.io.imsave(output_path, g)
 
+    if guide_stats is not None and num_images > 0:
+      write_guide_stats(os.path.join(args.output, 'guide_stats.json'),
+                        histogram_sum, occupancy_sum, num_images)
+
 
 
 if __name__ == '__main__':
@@ -230,7 +291,12 @@ if __name__ == '__main__':
   parser.add_argument('--nohdrp', dest="hdrp", action="store_false")
   parser.add_argument('--debug', dest="debug", action="store_true", help='If true, dumps debug data on guide and coefficients.')
   parser.add_argument('--limit', type=int, help="limit the number of images processed.")
-  parser.set_defaults(hdrp=False, debug=False)
+  parser.add_argument('--fuse_guide', dest="fuse_guide", action="store_true", help='If true, fuses the guide into the slice-apply, run on the CPU.')
+  parser.add_argument('--nofuse_guide', dest="fuse_guide", action="store_false")
+  parser.add_argument('--telemetry', dest="telemetry", action="store_true", help='If true, writes guide histograms and grid occupancy to <output>/guide_stats.json.')
+  parser.add_argument('--notelemetry', dest="telemetry", action="store_false")
+  parser.add_argument('--telemetry_bins', type=int, default=64, help="number of bins of the guide histogram.")
+  parser.set_defaults(hdrp=False, debug=False, fuse_guide=False, telemetry=False)
   # pylint: enable=line-too-long
   # -----------------------------------------------------------------------------
 
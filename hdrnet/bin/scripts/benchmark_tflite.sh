@@ -0,0 +1,38 @@
+#!/bin/bash
+# encoding: utf-8
+# Copyright 2016 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Benchmarks a model converted by bin/convert_tflite.py on the CPU, with the
+# HDRnet custom ops. Assumes hdrnet/ops is linked in the TF tree as
+# tensorflow/hdrnet/ops.
+
+TF_BASE=$HOME/projects/third_party/tensorflow
+
+CHKPT=$1
+THREADS=${2:-4}
+
+CURRENT=`pwd`
+
+cd $TF_BASE
+bazel build -c opt tensorflow/hdrnet/ops:benchmark_model_hdrnet
+
+cd $CURRENT
+
+$TF_BASE/bazel-bin/tensorflow/hdrnet/ops/benchmark_model_hdrnet \
+  --graph=$CHKPT/model.tflite \
+  --num_threads=$THREADS \
+  --warmup_runs=5 \
+  --num_runs=50 \
+  --enable_op_profiling=true
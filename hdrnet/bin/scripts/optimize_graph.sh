@@ -18,6 +18,9 @@
 TF_BASE=$HOME/projects/third_party/tensorflow
 
 CHKPT=$1
+# Comma-separated output nodes, e.g. output_coefficients,batched_output_coefficients
+# for graphs frozen with --batched.
+OUTPUTS=${2:-output_coefficients}
 
 echo $CHKPT
 
@@ -38,7 +41,7 @@ $TF_BASE/bazel-bin/tensorflow/tools/graph_transforms/transform_graph \
   --in_graph=$CHKPT/frozen_graph.pb \
   --out_graph=$CHKPT/optimized_graph.pb \
   --inputs='lowres_input' \
-  --outputs='output_coefficients' \
+  --outputs=$OUTPUTS \
   --transforms='strip_unused_nodes remove_nodes(op=Identity, op=CheckNumerics) merge_duplicate_nodes fold_constants(ignore_errors=true) fold_batch_norms sort_by_execution_order strip_unused_nodes'
 
 $TF_BASE/bazel-bin/tensorflow/tools/graph_transforms/summarize_graph \
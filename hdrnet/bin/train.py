@@ -70,8 +70,8 @@ def main(args, model_params, data_params):
         shuffle=True,
         batch_size=args.batch_size, nthreads=args.data_threads,
         fliplr=args.fliplr, flipud=args.flipud, rotate=args.rotate,
-        random_crop=args.random_crop, params=data_params,
-        output_resolution=args.output_resolution)
+        random_crop=args.random_crop, fused_augment=args.fused_augment,
+        params=data_params, output_resolution=args.output_resolution)
     train_samples = train_data_pipeline.samples
 
   if args.eval_data_dir is not None:
@@ -219,6 +219,8 @@ if __name__ == '__main__':
   data_grp.add_argument('--nofliplr', dest="fliplr", action="store_false")
   data_grp.add_argument('--random_crop', dest="random_crop", action="store_true", help='random crop data augmentation.')
   data_grp.add_argument('--norandom_crop', dest="random_crop", action="store_false")
+  data_grp.add_argument('--fused_augment', dest="fused_augment", action="store_true", help='decode and augment batches in one C++ op (ImageFilesDataPipeline only).')
+  data_grp.add_argument('--nofused_augment', dest="fused_augment", action="store_false")
 
   # Model parameters
   model_grp = parser.add_argument_group('model_params')
@@ -230,6 +232,12 @@ if __name__ == '__main__':
   model_grp.add_argument('--nobatch_norm', dest='batch_norm', action='store_false')
   model_grp.add_argument('--channel_multiplier', default=1, type=int,  help='Factor to control net throughput (number of intermediate channels).')
   model_grp.add_argument('--guide_complexity', default=16, type=int,  help='Control complexity of the guide network.')
+  model_grp.add_argument('--fused_guide', dest='fused_guide', action='store_true', help='train with the guide recomputed inside the slicing op (HDRNetCurves and HDRNetPointwiseNNGuide, CPU only).')
+  model_grp.add_argument('--nofused_guide', dest='fused_guide', action='store_false')
+  model_grp.add_argument('--slice_records', dest='slice_records', action='store_true', help='keep per-pixel sample records of the slicing op for a faster gradient, at 20 bytes per pixel (CPU only).')
+  model_grp.add_argument('--noslice_records', dest='slice_records', action='store_false')
+  model_grp.add_argument('--packed_grid', dest='packed_grid', action='store_true', help='slice the prediction conv output without unrolling it into a 6D grid, saving its copies (CPU only, ignored with --fused_guide or --slice_records).')
+  model_grp.add_argument('--nopacked_grid', dest='packed_grid', action='store_false')
 
   # Bilateral grid parameters
   model_grp.add_argument('--luma_bins', default=8, type=int,  help='Number of BGU bins for the luminance.')
@@ -241,6 +249,10 @@ if __name__ == '__main__':
       fliplr=False,
       rotate=False,
       random_crop=True,
+      fused_augment=False,
+      fused_guide=False,
+      slice_records=False,
+      packed_grid=False,
       batch_norm=False)
   # ----------------------------------------------------------------------------
   # pylint: enable=line-too-long
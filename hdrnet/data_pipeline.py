@@ -21,9 +21,12 @@ import magic
 import numpy as np
 import os
 import random
+import struct
 
 import tensorflow as tf
 
+from hdrnet import hdrnet_ops
+
 log = logging.getLogger("root")
 log.setLevel(logging.INFO)
 
@@ -31,6 +34,7 @@ __all__ = [
   'ImageFilesDataPipeline',
   'StyleTransferDataPipeline',
   'HDRpDataPipeline',
+  'ShardDataPipeline',
   ]
 
 def check_dir(dirname):
@@ -60,6 +64,9 @@ class DataPipeline(object):
     min_after_dequeue: minimum number of image used for shuffling the queue.
     shuffle: random shuffle the samples in the queue.
     nthreads: number of threads use to fill up the queue.
+    fused_augment: decode and augment whole batches with the
+      DecodeAugmentPair op instead of per-sample TF ops (only supported by
+      ImageFilesDataPipeline).
     samples: a dict of tensors containing a batch of input samples with keys:
       'image_input' (the source image),
       'image_output' (the filtered image to match),
@@ -77,6 +84,7 @@ class DataPipeline(object):
                flipud=False,
                rotate=False,
                random_crop=False,
+               fused_augment=False,
                params=None,
                nthreads=1, 
                num_epochs=None):
@@ -96,6 +104,7 @@ class DataPipeline(object):
     self.flipud = flipud
     self.rotate = rotate
     self.random_crop = random_crop
+    self.fused_augment = fused_augment
 
     sample = self._produce_one_sample()
     self.samples = self._batch_samples(sample)
@@ -215,6 +224,10 @@ class ImageFilesDataPipeline(DataPipeline):
     input_file = tf.read_file(input_queue)
     output_file = tf.read_file(output_queue)
 
+    if self.fused_augment:
+      # Decoded and augmented a batch at a time, see _batch_samples.
+      return {'input_contents': input_file, 'output_contents': output_file}
+
     if os.path.splitext(input_files[0])[-1] == '.jpg': 
       im_input = tf.image.decode_jpeg(input_file, channels=3)
     else:
@@ -240,6 +253,29 @@ class ImageFilesDataPipeline(DataPipeline):
     sample['image_output'] = fullres[:, :, 3:]
     return sample
 
+  def _batch_samples(self, sample):
+    samples = super(ImageFilesDataPipeline, self)._batch_samples(sample)
+    if not self.fused_augment:
+      return samples
+
+    # One op decodes and augments the whole batch, a sample per thread. Only
+    # the encoded files go through the queue.
+    with tf.name_scope('data_augmentation'):
+      image_input, image_output, lowres_input, lowres_output = (
+          hdrnet_ops.decode_augment_pair(
+              samples['input_contents'], samples['output_contents'],
+              output_height=self.output_resolution[0],
+              output_width=self.output_resolution[1],
+              lowres_size=256,
+              fliplr=self.fliplr, flipud=self.flipud, rotate=self.rotate,
+              random_crop=self.random_crop, seed=1234))
+    return {
+        'image_input': image_input,
+        'image_output': image_output,
+        'lowres_input': lowres_input,
+        'lowres_output': lowres_output,
+        }
+
 
 class HDRpDataPipeline(DataPipeline):
   """Pipeline to process HDR+ dumps
@@ -287,6 +323,56 @@ class HDRpDataPipeline(DataPipeline):
     return sample
 
 
+class ShardDataPipeline(DataPipeline):
+  """Pipeline to process pre-decoded image pairs from .hdrs shards.
+
+  Shards are written by ShardWriter (see bin/convert_records.py) and read with
+  the ReadShardSample op, which maps them and yields each sample without
+  decoding or copying it.
+
+  Assumes :
+    - path points to a txt file listing the shard paths, relative to
+      the root of 'path'.
+  """
+
+  def _produce_one_sample(self):
+    root = os.path.dirname(os.path.abspath(self.path))
+    with open(self.path, 'r') as fid:
+      flist = [l.strip() for l in fid]
+    shard_files = [os.path.join(root, f) for f in flist if f.endswith('.hdrs')]
+    if not shard_files:
+      raise ValueError("No .hdrs shards listed in {}.".format(self.path))
+
+    self.nsamples = 0
+    for f in shard_files:
+      self.nsamples += read_shard_header(f)[0]
+    input_code, output_code = read_shard_header(shard_files[0])[1]
+
+    # Shuffled by index in the op, every epoch.
+    image_input, image_output = hdrnet_ops.read_shard_sample(
+        shards=shard_files,
+        input_dtype=REVERSE_TYPEMAP[input_code],
+        output_dtype=REVERSE_TYPEMAP[output_code],
+        shuffle=self.shuffle,
+        num_epochs=self.num_epochs or 0,
+        seed=1234)
+
+    # normalize input/output
+    with tf.name_scope('normalize_images'):
+      im_input = tf.to_float(image_input)/SHARD_WHITE_LEVELS[input_code]
+      im_output = tf.to_float(image_output)/SHARD_WHITE_LEVELS[output_code]
+
+    inout = tf.concat([im_input, im_output], 2)
+    fullres, inout = self._augment_data(inout, 6)
+
+    sample = {}
+    sample['lowres_input'] = inout[:, :, :3]
+    sample['lowres_output'] = inout[:, :, 3:]
+    sample['image_input'] = fullres[:, :, :3]
+    sample['image_output'] = fullres[:, :, 3:]
+    return sample
+
+
 class StyleTransferDataPipeline(DataPipeline):
   def _produce_one_sample(self):
     # TODO: check dir structure
@@ -351,6 +437,7 @@ TYPEMAP = {
     np.dtype(np.int16): 1,
     np.dtype(np.float32): 2,
     np.dtype(np.int32): 3,
+    np.dtype(np.uint16): 4,
 }
 
 REVERSE_TYPEMAP = {
@@ -358,6 +445,7 @@ REVERSE_TYPEMAP = {
     1: tf.int16,
     2: tf.float32,
     3: tf.int32,
+    4: tf.uint16,
 }
 
 class RecordWriter(object):
@@ -424,6 +512,124 @@ class RecordWriter(object):
     return tf.train.Feature(int64_list=tf.train.Int64List(value=value))
 
 
+# Pre-decoded training shards, see ops/mapped_shard.h for the layout.
+SHARD_MAGIC = 0x53524448  # 'HDRS'
+SHARD_VERSION = 1
+SHARD_ALIGNMENT = 64
+SHARD_HEADER_FORMAT = '<IIIIQQ'
+SHARD_ENTRY_FORMAT = '<QIIIIII'
+
+# Values mapped to 1.0, by TYPEMAP code, as in the other pipelines.
+SHARD_WHITE_LEVELS = {
+    0: 255.0,
+    1: 32767.0,
+    2: 1.0,
+    4: 65535.0,
+}
+
+
+def read_shard_header(path):
+  """Returns the sample count and the (input, output) dtype codes of a shard."""
+  with open(path, 'rb') as fid:
+    header = fid.read(struct.calcsize(SHARD_HEADER_FORMAT))
+    magic, version, nsamples, narrays, index_offset, _ = struct.unpack(
+        SHARD_HEADER_FORMAT, header)
+    if magic != SHARD_MAGIC or version != SHARD_VERSION or narrays != 2:
+      raise ValueError('{} is not a version {} shard.'.format(
+          path, SHARD_VERSION))
+    if nsamples == 0:
+      return 0, (None, None)
+    fid.seek(index_offset)
+    entry_size = struct.calcsize(SHARD_ENTRY_FORMAT)
+    entries = fid.read(2*entry_size)
+    input_code = struct.unpack(SHARD_ENTRY_FORMAT, entries[:entry_size])[1]
+    output_code = struct.unpack(SHARD_ENTRY_FORMAT, entries[entry_size:])[1]
+  return nsamples, (input_code, output_code)
+
+
+class ShardWriter(object):
+  """Writes input/output pairs to .hdrs shards of pre-decoded images.
+
+  Same interface as RecordWriter. Read back with ShardDataPipeline.
+
+  Attributes:
+    output_dir: directory where the .hdrs are saved.
+  """
+
+  FEATURES = ['image_input', 'image_output']
+
+  def __init__(self, output_dir, records_per_file=500, prefix=''):
+    self.output_dir = output_dir
+    self.records_per_file = records_per_file
+    self.written = 0
+    self.nfiles = 0
+    self.prefix = prefix
+    self.filenames = []
+
+    # internal state
+    self._fid = None
+    self._fname = None
+    self._index = []
+
+  def _get_new_filename(self):
+    self.nfiles += 1
+    return os.path.join(self.output_dir, '{}{:06d}.hdrs'.format(self.prefix, self.nfiles))
+
+  def write(self, data):
+    """Write the image pair in data to the currently opened shard.
+
+    Args:
+      data: a dict of (height, width, channels) numpy arrays with keys
+        'image_input' and 'image_output'.
+
+    Returns:
+      The filename just written to.
+    """
+
+    if self.written % self.records_per_file == 0:
+      self.close()
+      self._fname = self._get_new_filename()
+      self.filenames.append(self._fname)
+      self._fid = open(self._fname, 'wb')
+      # Rewritten with the sample count and index offset on close.
+      self._fid.write(b'\0'*struct.calcsize(SHARD_HEADER_FORMAT))
+
+    for k in self.FEATURES:
+      array = np.ascontiguousarray(data[k])
+      if array.ndim != 3:
+        raise ValueError('{} should be (height, width, channels), got shape {}'
+                         .format(k, array.shape))
+      offset = self._pad()
+      self._fid.write(array.tobytes())
+      self._index.append((offset, TYPEMAP[array.dtype], array.shape))
+
+    self.written += 1
+    return self._fname
+
+  def close(self):
+    if self._fid is None:
+      return
+    index_offset = self._pad()
+    for offset, code, shape in self._index:
+      self._fid.write(struct.pack(SHARD_ENTRY_FORMAT, offset, code,
+                                  shape[0], shape[1], shape[2], 0, 0))
+    self._fid.seek(0)
+    self._fid.write(struct.pack(
+        SHARD_HEADER_FORMAT, SHARD_MAGIC, SHARD_VERSION,
+        len(self._index) // len(self.FEATURES), len(self.FEATURES),
+        index_offset, 0))
+    self._fid.close()
+    self._fid = None
+    self._index = []
+
+  def _pad(self):
+    """Pads the current shard to the alignment, returns the new offset."""
+    offset = self._fid.tell()
+    aligned = (offset + SHARD_ALIGNMENT - 1) // SHARD_ALIGNMENT * SHARD_ALIGNMENT
+    self._fid.write(b'\0'*(aligned - offset))
+    return aligned
+
+
 class RecordReader(object):
   """Produces a queue of input/output data from .tfrecords.
 
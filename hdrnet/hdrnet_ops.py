@@ -29,6 +29,16 @@ _hdrnet = tf.load_op_library(path)
 # -- Register operations ------------------------------------------------------
 bilateral_slice = _hdrnet.bilateral_slice
 bilateral_slice_apply = _hdrnet.bilateral_slice_apply
+bilateral_slice_apply_record = _hdrnet.bilateral_slice_apply_record
+bilateral_slice_apply_packed = _hdrnet.bilateral_slice_apply_packed
+decode_augment_pair = _hdrnet.decode_augment_pair
+read_shard_sample = _hdrnet.read_shard_sample
+curve_guide_slice_apply = _hdrnet.curve_guide_slice_apply
+pointwise_guide_slice_apply = _hdrnet.pointwise_guide_slice_apply
+bilateral_guide_stats = _hdrnet.bilateral_guide_stats
+bilateral_splat = _hdrnet.bilateral_splat
+bilateral_grid_blur = _hdrnet.bilateral_grid_blur
+bilateral_affine_fit = _hdrnet.bilateral_affine_fit
 
 # ----------- Register gradients ----------------------------------------------
 @ops.RegisterGradient('BilateralSlice')
@@ -48,6 +58,98 @@ def _bilateral_slice_grad(op, grad):
       grid_tensor, guide_tensor, input_tensor, grad, has_offset=has_offset) 
 
 
+@ops.RegisterGradient('BilateralSliceApplyRecord')
+def _bilateral_slice_apply_record_grad(op, grad, unused_record_grad):
+  grid_tensor = op.inputs[0]
+  input_tensor = op.inputs[2]
+  record_tensor = op.outputs[1]
+  has_offset = op.get_attr('has_offset')
+  return _hdrnet.bilateral_slice_apply_record_grad(
+      grid_tensor, record_tensor, input_tensor, grad, has_offset=has_offset)
+
+
+@ops.RegisterGradient('BilateralSliceApplyPacked')
+def _bilateral_slice_apply_packed_grad(op, grad):
+  grid_tensor = op.inputs[0]
+  guide_tensor = op.inputs[1]
+  input_tensor = op.inputs[2]
+  has_offset = op.get_attr('has_offset')
+  grid_depth = op.get_attr('grid_depth')
+  return _hdrnet.bilateral_slice_apply_packed_grad(
+      grid_tensor, guide_tensor, input_tensor, grad, has_offset=has_offset,
+      grid_depth=grid_depth)
+
+@ops.RegisterGradient('CurveGuideSliceApply')
+def _curve_guide_slice_apply_grad(op, grad):
+  has_offset = op.get_attr('has_offset')
+  return _hdrnet.curve_guide_slice_apply_grad(
+      *(list(op.inputs) + [grad]), has_offset=has_offset)
+
+
+@ops.RegisterGradient('PointwiseGuideSliceApply')
+def _pointwise_guide_slice_apply_grad(op, grad):
+  has_offset = op.get_attr('has_offset')
+  return _hdrnet.pointwise_guide_slice_apply_grad(
+      *(list(op.inputs) + [grad]), has_offset=has_offset)
+
+
+@ops.RegisterGradient('BilateralSplat')
+def _bilateral_splat_grad(op, grad):
+  # Splatting is the transpose of slicing, which is linear in the grid. The
+  # weights channel does not depend on the image. Not differentiable with
+  # respect to the guide.
+  image_tensor = op.inputs[0]
+  guide_tensor = op.inputs[1]
+  if op.get_attr('homogeneous'):
+    grad = grad[..., :-1]
+  image_grad = _hdrnet.bilateral_slice(grad, guide_tensor)
+  image_grad.set_shape(image_tensor.get_shape())
+  return image_grad, None
+
+
+@ops.RegisterGradient('BilateralGridBlur')
+def _bilateral_grid_blur_grad(op, grad):
+  # The blur is self-adjoint.
+  return _hdrnet.bilateral_grid_blur(
+      grad, iterations=op.get_attr('iterations'))
+
+
+ops.NotDifferentiable('BilateralGuideStats')
+ops.NotDifferentiable('BilateralAffineFit')
+
+
+# Grappler passes run after the guide fusion, as by default.
+_DEFAULT_GRAPH_OPTIMIZERS = [
+    'pruning', 'function', 'common_subgraph_elimination', 'constfold',
+    'shape', 'arithmetic', 'layout', 'remap', 'loop', 'dependency', 'memory']
+
+
+def enable_guide_fusion(config, move_to_cpu=False):
+  """Rewrites guide subgraphs into the fused guide ops in sessions of `config`.
+
+  The HDRNetGuideFusion pass replaces the guide of HDRNetCurves or
+  HDRNetPointwiseNNGuide and the slice-apply it feeds by
+  curve_guide_slice_apply or pointwise_guide_slice_apply, in graphs built
+  without params['fused_guide']. It runs first, before the remapper fuses
+  the guide's layers into ops it does not match.
+
+  Args:
+    config: a tf.ConfigProto, modified in place.
+    move_to_cpu: also rewrite slice-apply placed on a GPU, moving it to the
+      CPU, which is all the fused ops run on.
+  Returns:
+    config.
+  """
+  rewrite_options = config.graph_options.rewrite_options
+  fusion = rewrite_options.custom_optimizers.add()
+  fusion.name = 'HDRNetGuideFusion'
+  fusion.parameter_map['move_to_cpu'].b = move_to_cpu
+  optimizers = list(rewrite_options.optimizers) or _DEFAULT_GRAPH_OPTIMIZERS
+  del rewrite_options.optimizers[:]
+  rewrite_options.optimizers.extend([fusion.name] + optimizers)
+  return config
+
+
 # ----------- Register Shape inference ----------------------------------------
 @ops.RegisterShape('BilateralSlice')
 def _bilateral_slice_shape(op):
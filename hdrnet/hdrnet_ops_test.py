@@ -1,11 +1,17 @@
 """Tests for custom tensorflow operators in HDRnet (CUDA only)."""
 
 import collections
+import ctypes
+import os
+import struct
+import subprocess
+import sys
 
 import hdrnet_ops as ops
 import numpy as np
 from parameterized import parameterized
 import tensorflow.compat.v1 as tf
+from tensorflow.python.grappler import tf_optimizer
 
 
 def _assert_tf_shape_equals(test_case, expected_shape, tf_tensor):
@@ -408,5 +414,712 @@ class BilateralSliceApplyTest(tf.test.TestCase):
         grad_tensor_name='input')
 
 
+class BilateralSliceApplyRecordTest(tf.test.TestCase):
+
+  def run_slice_apply(self, save_records):
+    np.random.seed(1234)
+    grid_data = np.random.rand(2, 4, 3, 8, 3 * 4).astype(np.float32)
+    # Guides beyond [0, 1] exercise the ends of the grid.
+    guide_data = np.random.uniform(-0.2, 1.2, (2, 12, 9)).astype(np.float32)
+    input_data = np.random.rand(2, 12, 9, 3).astype(np.float32)
+    backprop_data = np.random.rand(2, 12, 9, 3).astype(np.float32)
+
+    graph = tf.Graph()
+    with graph.as_default():
+      grid_tensor = tf.convert_to_tensor(grid_data, name='grid')
+      guide_tensor = tf.convert_to_tensor(guide_data, name='guide')
+      input_tensor = tf.convert_to_tensor(input_data, name='input')
+      if save_records:
+        output_tensor, record_tensor = ops.bilateral_slice_apply_record(
+            grid_tensor, guide_tensor, input_tensor, has_offset=True)
+        _assert_tf_shape_equals(self, [2, 12, 9, 5], record_tensor)
+      else:
+        output_tensor = ops.bilateral_slice_apply(
+            grid_tensor, guide_tensor, input_tensor, has_offset=True)
+      grad_tensors = tf.gradients(
+          output_tensor, [grid_tensor, guide_tensor, input_tensor],
+          grad_ys=tf.convert_to_tensor(backprop_data))
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        return sess.run([output_tensor] + grad_tensors)
+
+  def test_matches_recompute(self):
+    """Records should give the same output and gradients as recomputing.
+
+    With approximate numerics, the outputs should still be the same, which
+    they are only if the records hold the forward pass's approximate weights,
+    and the gradients should be within the approximation error.
+    """
+    approximate = os.environ.get('HDRNET_APPROXIMATE_NUMERICS', '0') != '0'
+    expected = self.run_slice_apply(save_records=False)
+    actual = self.run_slice_apply(save_records=True)
+    self.assertAllEqual(expected[0], actual[0])
+    tolerance = 1e-5 if approximate else 1e-6
+    for e, a in zip(expected[1:], actual[1:]):
+      _assert_np_shape_equals(self, list(e.shape), a)
+      self.assertAllClose(e, a, rtol=tolerance, atol=tolerance)
+
+  def test_matches_recompute_approximate(self):
+    """test_matches_recompute, with HDRNET_APPROXIMATE_NUMERICS=1.
+
+    The kernels read the variable once per process, hence a new one.
+    """
+    env = dict(os.environ, HDRNET_APPROXIMATE_NUMERICS='1')
+    subprocess.check_call(
+        [sys.executable, os.path.abspath(__file__),
+         'BilateralSliceApplyRecordTest.test_matches_recompute'], env=env)
+
+
+class BilateralSliceApplyPackedTest(tf.test.TestCase):
+
+  def run_slice_apply(self, packed):
+    np.random.seed(1234)
+    n_out, n_in, depth = 3, 4, 8
+    grid_data = np.random.rand(2, 4, 3, depth * n_out * n_in).astype(
+        np.float32)
+    guide_data = np.random.uniform(-0.2, 1.2, (2, 12, 9)).astype(np.float32)
+    input_data = np.random.rand(2, 12, 9, 3).astype(np.float32)
+    backprop_data = np.random.rand(2, 12, 9, 3).astype(np.float32)
+
+    graph = tf.Graph()
+    with graph.as_default():
+      grid_tensor = tf.convert_to_tensor(grid_data, name='grid')
+      guide_tensor = tf.convert_to_tensor(guide_data, name='guide')
+      input_tensor = tf.convert_to_tensor(input_data, name='input')
+      if packed:
+        output_tensor = ops.bilateral_slice_apply_packed(
+            grid_tensor, guide_tensor, input_tensor, has_offset=True,
+            grid_depth=depth)
+      else:
+        # As the unroll_grid block of HDRNetCurves._coefficients.
+        unrolled = tf.stack(tf.split(grid_tensor, n_out * n_in, axis=3),
+                            axis=4)
+        unrolled = tf.stack(tf.split(unrolled, n_in, axis=4), axis=5)
+        unrolled = tf.reshape(unrolled, [2, 4, 3, depth, n_out * n_in])
+        output_tensor = ops.bilateral_slice_apply(
+            unrolled, guide_tensor, input_tensor, has_offset=True)
+      grad_tensors = tf.gradients(
+          output_tensor, [grid_tensor, guide_tensor, input_tensor],
+          grad_ys=tf.convert_to_tensor(backprop_data))
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        return sess.run([output_tensor] + grad_tensors)
+
+  def test_matches_unrolled(self):
+    """The packed grid should give the same output and gradients."""
+    expected = self.run_slice_apply(packed=False)
+    actual = self.run_slice_apply(packed=True)
+    for e, a in zip(expected, actual):
+      _assert_np_shape_equals(self, list(e.shape), a)
+      self.assertAllClose(e, a, rtol=1e-6, atol=1e-6)
+
+class DecodeAugmentPairTest(tf.test.TestCase):
+
+  def run_decode_augment_pair(self, input_data, output_data, **attrs):
+    graph = tf.Graph()
+    with graph.as_default():
+      with tf.device('/cpu:0'):
+        input_contents = tf.stack([tf.image.encode_png(x) for x in input_data])
+        output_contents = tf.stack(
+            [tf.image.encode_png(x) for x in output_data])
+        output_tensors = ops.decode_augment_pair(input_contents,
+                                                 output_contents, **attrs)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        output_data = sess.run(output_tensors)
+    return output_data, output_tensors
+
+  def test_shape(self):
+    batch_size = 2
+    input_data = np.zeros([batch_size, 9, 12, 3], dtype=np.uint8)
+    outputs, output_tensors = self.run_decode_augment_pair(
+        input_data, input_data, output_height=5, output_width=7,
+        lowres_size=4, rotate=True, random_crop=True)
+
+    for i in [0, 1]:
+      _assert_shape_equals(self, [batch_size, 5, 7, 3], outputs[i],
+                           output_tensors[i])
+    for i in [2, 3]:
+      _assert_shape_equals(self, [batch_size, 4, 4, 3], outputs[i],
+                           output_tensors[i])
+
+  def test_center_crop(self):
+    """Without augmentation, matches normalize, crop and resize in numpy."""
+    input_data = np.random.randint(
+        0, 65536, size=[2, 11, 9, 3]).astype(np.uint16)
+    output_data = np.random.randint(0, 256, size=[2, 11, 9, 3]).astype(np.uint8)
+    image_input, image_output, lowres_input, lowres_output = (
+        self.run_decode_augment_pair(
+            input_data, output_data, output_height=6, output_width=4,
+            lowres_size=3)[0])
+
+    expected_input = input_data[:, 2:8, 2:6].astype(np.float32) / 65535.0
+    expected_output = output_data[:, 2:8, 2:6].astype(np.float32) / 255.0
+    self.assertAllClose(expected_input, image_input)
+    self.assertAllClose(expected_output, image_output)
+    # Nearest-neighbour rows 0, 2, 4 and columns 0, 1, 2.
+    self.assertAllClose(expected_input[:, ::2, :3], lowres_input)
+    self.assertAllClose(expected_output[:, ::2, :3], lowres_output)
+
+  def test_flip_rotate(self):
+    """Each sample is one of the 8 flips and rotations, the same for the pair.
+
+    The crop is centered in a square image, so it commutes with them.
+    """
+    batch_size = 16
+    input_data = np.random.randint(
+        0, 256, size=[batch_size, 10, 10, 3]).astype(np.uint8)
+    output_data = 255 - input_data
+    image_input, image_output, _, _ = self.run_decode_augment_pair(
+        input_data, output_data, output_height=4, output_width=4,
+        lowres_size=4, fliplr=True, flipud=True, rotate=True, seed=1)[0]
+
+    for b in range(batch_size):
+      crop = input_data[b, 3:7, 3:7].astype(np.float32) / 255.0
+      candidates = [np.rot90(c, k) for c in [crop, crop[:, ::-1]]
+                    for k in range(4)]
+      matches = [np.allclose(c, image_input[b]) for c in candidates]
+      self.assertTrue(any(matches))
+      self.assertAllClose(1.0 - candidates[matches.index(True)],
+                          image_output[b])
+
+
+def _write_shard(path, pairs):
+  """Writes (input, output) pairs in the layout of ops/mapped_shard.h."""
+  alignment = 64
+  with open(path, 'wb') as fid:
+    fid.write(b'\0' * 32)
+    index = []
+    for pair in pairs:
+      for array in pair:
+        offset = (fid.tell() + alignment - 1) // alignment * alignment
+        fid.write(b'\0' * (offset - fid.tell()))
+        fid.write(array.tobytes())
+        code = {np.dtype(np.uint8): 0, np.dtype(np.uint16): 4}[array.dtype]
+        index.append(struct.pack('<QIIIIII', offset, code, *(array.shape +
+                                                               (0, 0))))
+    index_offset = (fid.tell() + alignment - 1) // alignment * alignment
+    fid.write(b'\0' * (index_offset - fid.tell()))
+    fid.write(b''.join(index))
+    fid.seek(0)
+    fid.write(struct.pack('<IIIIQQ', 0x53524448, 1, len(pairs), 2,
+                          index_offset, 0))
+
+
+class ReadShardSampleTest(tf.test.TestCase):
+
+  def setUp(self):
+    super(ReadShardSampleTest, self).setUp()
+    self.pairs = []
+    for i in range(5):
+      image_input = np.random.randint(
+          0, 65536, size=[4 + i, 6, 3]).astype(np.uint16)
+      image_output = np.full([4 + i, 6, 3], i, dtype=np.uint8)
+      self.pairs.append((image_input, image_output))
+    self.shards = [
+        os.path.join(self.get_temp_dir(), 'a.hdrs'),
+        os.path.join(self.get_temp_dir(), 'b.hdrs')
+    ]
+    _write_shard(self.shards[0], self.pairs[:3])
+    _write_shard(self.shards[1], self.pairs[3:])
+
+  def read_samples(self, count, **attrs):
+    graph = tf.Graph()
+    with graph.as_default():
+      with tf.device('/cpu:0'):
+        samples = ops.read_shard_sample(
+            shards=self.shards, input_dtype=tf.uint16, output_dtype=tf.uint8,
+            **attrs)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        return [sess.run(samples) for _ in range(count)]
+
+  def test_in_order(self):
+    samples = self.read_samples(len(self.pairs), shuffle=False)
+    for (image_input, image_output), pair in zip(samples, self.pairs):
+      self.assertAllEqual(pair[0], image_input)
+      self.assertAllEqual(pair[1], image_output)
+
+  def test_shuffle(self):
+    """Each epoch visits every sample once."""
+    samples = self.read_samples(2 * len(self.pairs), shuffle=True, seed=1)
+    for epoch in range(2):
+      visited = sorted(s[1][0, 0, 0] for s in
+                       samples[epoch * len(self.pairs):][:len(self.pairs)])
+      self.assertEqual(list(range(len(self.pairs))), visited)
+
+  def test_num_epochs(self):
+    with self.assertRaises(tf.errors.OutOfRangeError):
+      self.read_samples(len(self.pairs) + 1, shuffle=False, num_epochs=1)
+
+  def test_dtype_mismatch(self):
+    graph = tf.Graph()
+    with graph.as_default():
+      samples = ops.read_shard_sample(
+          shards=self.shards, input_dtype=tf.uint8, output_dtype=tf.uint8)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        with self.assertRaises(tf.errors.InvalidArgumentError):
+          sess.run(samples)
+
+
+def _curve_guide(x, ccm, ccm_bias, shifts, slopes, mix_weights, mix_bias):
+  """HDRNetCurves._guide in numpy, on flat parameters."""
+  c = x.dot(ccm) + ccm_bias
+  t = np.sum(slopes * np.maximum(c[..., np.newaxis] - shifts, 0), axis=-1)
+  return np.clip(t.dot(mix_weights) + mix_bias, 0, 1)
+
+
+def _pointwise_guide(x, weights1, biases1, weights2, bias2):
+  """HDRNetPointwiseNNGuide._guide in numpy, batch norm folded."""
+  h = np.maximum(x.dot(weights1) + biases1, 0)
+  return 1 / (1 + np.exp(-(h.dot(weights2) + bias2)))
+
+
+def _random_guide_params(nchans=3, npts=4, nfeats=5):
+  """Parameters of the curve and pointwise guides, as the fused ops take them."""
+  curve_params = [
+      (np.eye(nchans) + 0.1 * np.random.randn(nchans, nchans)),
+      0.05 * np.random.randn(nchans),
+      np.tile(np.linspace(0, 1, npts, endpoint=False), (nchans, 1)),
+      0.5 + 0.1 * np.random.randn(nchans, npts),
+      np.ones(nchans) / nchans,
+      np.zeros(1),
+  ]
+  pointwise_params = [
+      np.random.randn(nchans, nfeats),
+      0.1 * np.random.randn(nfeats),
+      np.random.randn(nfeats),
+      0.1 * np.random.randn(1),
+  ]
+  return ([p.astype(np.float32) for p in curve_params],
+          [p.astype(np.float32) for p in pointwise_params])
+
+
+class GuideSliceApplyTest(tf.test.TestCase):
+
+  def setUp(self):
+    np.random.seed(1234)
+    self.grid_shape = (2, 4, 3, 8, 3 * 4)
+    self.input_shape = (2, 12, 9, 3)
+    self.output_shape = (2, 12, 9, 3)
+    self.grid_data = np.random.rand(*self.grid_shape).astype(np.float32)
+    self.input_data = np.random.rand(*self.input_shape).astype(np.float32)
+    self.curve_params, self.pointwise_params = _random_guide_params()
+
+  def run_forward(self, fused_op, guide_fn, params):
+    guide_data = guide_fn(self.input_data, *params).astype(np.float32)
+    graph = tf.Graph()
+    with graph.as_default():
+      grid_tensor = tf.convert_to_tensor(self.grid_data, name='grid')
+      input_tensor = tf.convert_to_tensor(self.input_data, name='input')
+      param_tensors = [tf.convert_to_tensor(p) for p in params]
+      fused_tensor = fused_op(grid_tensor, input_tensor, *param_tensors,
+                              has_offset=True)
+      expected_tensor = ops.bilateral_slice_apply(
+          grid_tensor, tf.convert_to_tensor(guide_data), input_tensor,
+          has_offset=True)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        fused_data, expected_data = sess.run([fused_tensor, expected_tensor])
+    _assert_shape_equals(self, list(self.output_shape), fused_data,
+                         fused_tensor)
+    self.assertAllClose(expected_data, fused_data, rtol=1e-5, atol=1e-5)
+
+  def run_grad_test(self, fused_op, params, index):
+    """Checks the gradient of input `index` (0: grid, 1: input, 2+: params)."""
+    graph = tf.Graph()
+    with graph.as_default():
+      tensors = [tf.convert_to_tensor(d) for d in
+                 [self.grid_data, self.input_data] + params]
+      output_tensor = fused_op(*tensors, has_offset=True)
+      with self.test_session(graph=graph, use_gpu=False):
+        err = tf.test.compute_gradient_error(
+            tensors[index], tensors[index].shape.as_list(),
+            output_tensor, list(self.output_shape))
+    # The guide gradient of slice-apply ignores the clamp at the depth
+    # boundaries, as in the unfused op, hence a looser bound than the grid's.
+    self.assertLess(err, 5e-2)
+
+  def test_curve_forward(self):
+    """The fused op should match slice-apply of the guide from numpy."""
+    self.run_forward(ops.curve_guide_slice_apply, _curve_guide,
+                     self.curve_params)
+
+  def test_pointwise_forward(self):
+    """The fused op should match slice-apply of the guide from numpy."""
+    self.run_forward(ops.pointwise_guide_slice_apply, _pointwise_guide,
+                     self.pointwise_params)
+
+  @parameterized.expand([('grid', 0), ('input', 1), ('ccm', 2),
+                         ('ccm_bias', 3), ('slopes', 5), ('mix_weights', 6)])
+  def test_curve_gradient(self, _, index):
+    """True derivatives should closely match numerical derivatives."""
+    self.run_grad_test(ops.curve_guide_slice_apply, self.curve_params, index)
+
+  @parameterized.expand([('grid', 0), ('input', 1), ('weights1', 2),
+                         ('biases1', 3), ('weights2', 4), ('bias2', 5)])
+  def test_pointwise_gradient(self, _, index):
+    """True derivatives should closely match numerical derivatives."""
+    self.run_grad_test(ops.pointwise_guide_slice_apply, self.pointwise_params,
+                       index)
+
+  def test_extent_from_its_own_parameter(self):
+    """The curve points and features should come from shifts and biases1.
+
+    The other parameters have sizes that would give a different extent, or
+    none at all, if read instead.
+    """
+    nchans, npts, nfeats = 3, 7, 2
+    curve_params = [
+        np.eye(nchans),
+        np.zeros(nchans),
+        np.tile(np.linspace(0, 1, npts, endpoint=False), (nchans, 1)),
+        0.3 + 0.1 * np.random.randn(nchans, npts),
+        np.ones(nchans) / nchans,
+        np.zeros(1),
+    ]
+    pointwise_params = [
+        np.random.randn(nchans, nfeats),
+        0.1 * np.random.randn(nfeats),
+        np.random.randn(nfeats),
+        0.1 * np.random.randn(1),
+    ]
+    self.run_forward(ops.curve_guide_slice_apply, _curve_guide,
+                     [p.astype(np.float32) for p in curve_params])
+    self.run_forward(ops.pointwise_guide_slice_apply, _pointwise_guide,
+                     [p.astype(np.float32) for p in pointwise_params])
+
+  def test_mismatched_parameter_sizes(self):
+    """Parameters that disagree with the extent should be rejected."""
+    params = list(self.curve_params)
+    params[3] = params[3][:, :-1]
+    graph = tf.Graph()
+    with graph.as_default():
+      tensors = [tf.convert_to_tensor(d) for d in
+                 [self.grid_data, self.input_data] + params]
+      output_tensor = ops.curve_guide_slice_apply(*tensors, has_offset=True)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        with self.assertRaises(tf.errors.InvalidArgumentError):
+          sess.run(output_tensor)
+
+  def test_too_many_features(self):
+    """The forward and gradient ops should reject more features than fit."""
+    _, params = _random_guide_params(nfeats=65)
+    graph = tf.Graph()
+    with graph.as_default():
+      tensors = [tf.convert_to_tensor(d) for d in
+                 [self.grid_data, self.input_data] + params]
+      output_tensor = ops.pointwise_guide_slice_apply(*tensors,
+                                                      has_offset=True)
+      grad_tensors = ops._hdrnet.pointwise_guide_slice_apply_grad(
+          *(tensors + [tf.ones(self.output_shape)]), has_offset=True)
+      with self.test_session(graph=graph, use_gpu=False) as sess:
+        with self.assertRaises(tf.errors.InvalidArgumentError):
+          sess.run(output_tensor)
+        with self.assertRaises(tf.errors.InvalidArgumentError):
+          sess.run(grad_tensors)
+
+
+
+class GuideFusionTest(tf.test.TestCase):
+
+  def setUp(self):
+    self.grid_data = np.random.rand(1, 4, 6, 8, 12).astype(np.float32)
+    self.input_data = np.random.rand(1, 16, 24, 3).astype(np.float32)
+
+  def curve_guide(self, input_tensor):
+    """As HDRNetCurves._guide, with constant parameters."""
+    nchans, npts = 3, 4
+    ccm = tf.constant(
+        (np.eye(nchans) + 0.1 * np.random.randn(nchans, nchans)).astype(
+            np.float32))
+    ccm_bias = tf.constant(0.05 * np.random.randn(nchans).astype(np.float32))
+    shifts = tf.constant(np.tile(
+        np.linspace(0, 1, npts, endpoint=False, dtype=np.float32),
+        (1, 1, nchans, 1)))
+    slopes = tf.constant(
+        (0.5 + 0.1 * np.random.randn(1, 1, 1, nchans, npts)).astype(
+            np.float32))
+    guide = tf.matmul(tf.reshape(input_tensor, [-1, nchans]), ccm)
+    guide = tf.nn.bias_add(guide, ccm_bias)
+    guide = tf.reshape(guide, tf.shape(input_tensor))
+    guide = tf.expand_dims(guide, 4)
+    guide = tf.reduce_sum(slopes * tf.nn.relu(guide - shifts),
+                          reduction_indices=[4])
+    guide = tf.nn.conv2d(guide, tf.fill([1, 1, nchans, 1], 1.0 / nchans),
+                         [1, 1, 1, 1], 'SAME')
+    guide = tf.nn.bias_add(guide, tf.zeros([1]))
+    guide = tf.clip_by_value(guide, 0, 1)
+    return tf.squeeze(guide, squeeze_dims=[3])
+
+  def pointwise_guide(self, input_tensor):
+    """As HDRNetPointwiseNNGuide._guide at inference, with constants."""
+    nchans, nfeats = 3, 5
+    weights1 = tf.constant(
+        np.random.randn(1, 1, nchans, nfeats).astype(np.float32))
+    mean = tf.constant(0.1 * np.random.randn(nfeats).astype(np.float32))
+    variance = tf.constant(np.random.rand(nfeats).astype(np.float32) + 0.5)
+    beta = tf.constant(0.1 * np.random.randn(nfeats).astype(np.float32))
+    guide = tf.nn.conv2d(input_tensor, weights1, [1, 1, 1, 1], 'SAME')
+    guide = tf.nn.batch_normalization(guide, mean, variance, beta, None, 1e-3)
+    guide = tf.nn.relu(guide)
+    weights2 = tf.constant(
+        np.random.randn(1, 1, nfeats, 1).astype(np.float32))
+    guide = tf.nn.conv2d(guide, weights2, [1, 1, 1, 1], 'SAME')
+    guide = tf.nn.sigmoid(tf.nn.bias_add(guide, tf.constant([0.1])))
+    return tf.squeeze(guide, squeeze_dims=[3])
+
+  def run_fusion(self, guide_fn, fused_op_name):
+    graph = tf.Graph()
+    with graph.as_default():
+      grid_tensor = tf.placeholder(tf.float32, self.grid_data.shape)
+      input_tensor = tf.placeholder(tf.float32, self.input_data.shape)
+      with tf.device('/cpu:0'):
+        output_tensor = ops.bilateral_slice_apply(
+            grid_tensor, guide_fn(input_tensor), input_tensor,
+            has_offset=True)
+      feed_dict = {grid_tensor: self.grid_data,
+                   input_tensor: self.input_data}
+
+      config = tf.ConfigProto()
+      with tf.Session(graph=graph, config=config) as sess:
+        expected_data = sess.run(output_tensor, feed_dict=feed_dict)
+      ops.enable_guide_fusion(config)
+      with tf.Session(graph=graph, config=config) as sess:
+        fused_data = sess.run(output_tensor, feed_dict=feed_dict)
+
+      graph.add_to_collection('train_op', output_tensor)
+      meta_graph = tf.train.export_meta_graph(graph=graph)
+    optimized = tf_optimizer.OptimizeGraph(config, meta_graph)
+    self.assertIn(fused_op_name, [n.op for n in optimized.node])
+    self.assertNotIn('BilateralSliceApply', [n.op for n in optimized.node])
+    self.assertAllClose(expected_data, fused_data, rtol=1e-4, atol=1e-4)
+
+  def test_curve_guide(self):
+    """The curve guide and slice-apply should become one fused op."""
+    self.run_fusion(self.curve_guide, 'CurveGuideSliceApply')
+
+  def test_pointwise_guide(self):
+    """The pointwise guide and slice-apply should become one fused op."""
+    self.run_fusion(self.pointwise_guide, 'PointwiseGuideSliceApply')
+
+
+class BilateralGridTest(tf.test.TestCase):
+
+  def setUp(self):
+    np.random.seed(1234)
+    self.image_data = np.random.rand(2, 13, 11, 3).astype(np.float32)
+    self.guide_data = np.random.rand(2, 13, 11).astype(np.float32)
+    self.grid_data = np.random.rand(2, 4, 3, 5, 3).astype(np.float32)
+
+  def test_splat_is_transpose_of_slice(self):
+    """<splat(image), grid> should equal <image, slice(grid)>."""
+    with tf.device('/cpu:0'):
+      grid_tensor = ops.bilateral_splat(
+          self.image_data, self.guide_data, grid_height=4, grid_width=3,
+          grid_depth=5, homogeneous=False)
+      sliced_tensor = ops.bilateral_slice(self.grid_data, self.guide_data)
+    with self.test_session(use_gpu=False) as sess:
+      grid_data, sliced_data = sess.run([grid_tensor, sliced_tensor])
+    _assert_shape_equals(self, list(self.grid_data.shape), grid_data,
+                         grid_tensor)
+    self.assertAllClose(np.sum(grid_data * self.grid_data),
+                        np.sum(self.image_data * sliced_data), rtol=1e-5)
+
+  def test_splat_homogeneous(self):
+    """The last channel should accumulate the weights of the pixels."""
+    ones_data = np.ones([2, 13, 11, 1], dtype=np.float32)
+    with tf.device('/cpu:0'):
+      grid_tensor = ops.bilateral_splat(
+          self.image_data, self.guide_data, grid_height=4, grid_width=3,
+          grid_depth=5)
+      weights_tensor = ops.bilateral_splat(
+          ones_data, self.guide_data, grid_height=4, grid_width=3,
+          grid_depth=5, homogeneous=False)
+    with self.test_session(use_gpu=False) as sess:
+      grid_data, weights_data = sess.run([grid_tensor, weights_tensor])
+    _assert_shape_equals(self, [2, 4, 3, 5, 4], grid_data, grid_tensor)
+    self.assertAllClose(weights_data[..., 0], grid_data[..., 3])
+
+  def test_blur_matches_numpy(self):
+    expected = self.grid_data
+    for _ in range(2):
+      for axis in (1, 2, 3):
+        padded = np.concatenate(
+            [np.take(expected, [0], axis=axis), expected,
+             np.take(expected, [-1], axis=axis)], axis=axis)
+        n = expected.shape[axis]
+        expected = 0.25 * (np.take(padded, range(0, n), axis=axis) +
+                           2 * expected +
+                           np.take(padded, range(2, n + 2), axis=axis))
+    with tf.device('/cpu:0'):
+      blurred_tensor = ops.bilateral_grid_blur(self.grid_data, iterations=2)
+    with self.test_session(use_gpu=False) as sess:
+      blurred_data = sess.run(blurred_tensor)
+    self.assertAllClose(expected, blurred_data, rtol=1e-5, atol=1e-6)
+
+  def test_grads(self):
+    with tf.device('/cpu:0'):
+      image_tensor = tf.constant(self.image_data)
+      grid_tensor = ops.bilateral_grid_blur(
+          ops.bilateral_splat(image_tensor, self.guide_data, grid_height=4,
+                              grid_width=3, grid_depth=5))
+      with self.test_session(use_gpu=False):
+        err = tf.test.compute_gradient_error(
+            image_tensor, self.image_data.shape, grid_tensor,
+            [2, 4, 3, 5, 4], x_init_value=self.image_data)
+    self.assertLess(err, 1e-3)
+
+
+class BilateralAffineFitTest(tf.test.TestCase):
+
+  def smooth_image(self, h, w):
+    y, x = np.meshgrid((np.arange(h) + 0.5) / h, (np.arange(w) + 0.5) / w,
+                       indexing='ij')
+    return np.stack(
+        [0.5 + 0.4 * np.sin(3 * (c + 1) * x + 2 * y) for c in range(3)],
+        axis=-1)[np.newaxis].astype(np.float32)
+
+  def test_recovers_affine_map(self):
+    """A global affine map at low resolution should upsample exactly."""
+    affine = np.array([[0.8, 0.1, 0.0, 0.05],
+                       [0.0, 1.2, -0.1, 0.0],
+                       [0.2, 0.0, 0.7, 0.1]], dtype=np.float32)
+    lowres_input = self.smooth_image(48, 64)
+    fullres_input = self.smooth_image(240, 320)
+    def apply_affine(image):
+      return image.dot(affine[:, :3].T) + affine[:, 3]
+    guide = lambda image: np.mean(image, axis=-1)
+
+    with tf.device('/cpu:0'):
+      grid_tensor = ops.bilateral_affine_fit(
+          lowres_input, apply_affine(lowres_input), guide(lowres_input),
+          grid_height=6, grid_width=8, grid_depth=8)
+    with self.test_session(use_gpu=False) as sess:
+      grid_data = sess.run(grid_tensor)
+    _assert_shape_equals(self, [1, 6, 8, 8, 3, 4], grid_data, grid_tensor)
+
+    with tf.device('/cpu:0'):
+      output_tensor = ops.bilateral_slice_apply(
+          grid_data.reshape([1, 6, 8, 8, 12]), guide(fullres_input),
+          fullres_input, has_offset=True)
+    with self.test_session(use_gpu=False) as sess:
+      output_data = sess.run(output_tensor)
+    self.assertAllClose(apply_affine(fullres_input), output_data, atol=2e-3)
+
+
+class BilateralGuideStatsTest(tf.test.TestCase):
+
+  def test_matches_numpy(self):
+    np.random.seed(1234)
+    batch_size, h, w = 2, 23, 37
+    gh, gw, gd = 4, 5, 6
+    num_bins = 8
+    grid_data = np.zeros([batch_size, gh, gw, gd, 12], dtype=np.float32)
+    guide_data = np.random.uniform(
+        -0.2, 1.2, size=[batch_size, h, w]).astype(np.float32)
+
+    with tf.device('/cpu:0'):
+      histogram, occupancy = ops.bilateral_guide_stats(
+          grid_data, guide_data, num_bins=num_bins)
+    with self.test_session(use_gpu=False) as sess:
+      histogram_data, occupancy_data = sess.run([histogram, occupancy])
+    _assert_shape_equals(self, [batch_size, num_bins], histogram_data,
+                         histogram)
+    _assert_shape_equals(self, [batch_size, gh, gw, gd], occupancy_data,
+                         occupancy)
+
+    clamped = np.clip(guide_data, 0, 1)
+    bins = np.minimum((clamped * num_bins).astype(np.int32), num_bins - 1)
+    gz = np.minimum((clamped * gd).astype(np.int32), gd - 1)
+    gy = np.minimum(((np.arange(h) + 0.5) * gh / h).astype(np.int32), gh - 1)
+    gx = np.minimum(((np.arange(w) + 0.5) * gw / w).astype(np.int32), gw - 1)
+    expected_histogram = np.zeros([batch_size, num_bins], dtype=np.int32)
+    expected_occupancy = np.zeros([batch_size, gh, gw, gd], dtype=np.int32)
+    for b in range(batch_size):
+      expected_histogram[b] = np.bincount(bins[b].ravel(), minlength=num_bins)
+      for y in range(h):
+        for x in range(w):
+          expected_occupancy[b, gy[y], gx[x], gz[b, y, x]] += 1
+    self.assertAllEqual(expected_histogram, histogram_data)
+    self.assertAllEqual(expected_occupancy, occupancy_data)
+    self.assertEqual(h * w, occupancy_data[0].sum())
+
+
+class TfLiteOpsTest(tf.test.TestCase):
+  """The TFLite kernels of ops/tflite_ops.cc against the TF ops.
+
+  Converts small graphs of each op, with the HDRnet ops kept as custom ops as
+  in bin/convert_tflite.py, and runs them with TFLite's interpreter. Needs
+  ops:hdrnet_tflite_ops.so in lib/, next to hdrnet_ops.so.
+  """
+
+  def setUp(self):
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'lib',
+                        'hdrnet_tflite_ops.so')
+    if not os.path.exists(path):
+      self.skipTest('{} is not built'.format(path))
+    # The interpreter finds the registerer by name in the global symbols.
+    ctypes.CDLL(path, mode=ctypes.RTLD_GLOBAL)
+    np.random.seed(1234)
+    self.grid_data = np.random.rand(1, 4, 6, 8, 12).astype(np.float32)
+    self.input_data = np.random.rand(1, 16, 24, 3).astype(np.float32)
+    self.guide_data = np.random.rand(1, 16, 24).astype(np.float32)
+    self.curve_params, self.pointwise_params = _random_guide_params()
+
+  def run_converted(self, build_fn, inputs, num_threads):
+    """Returns the outputs of build_fn(*placeholders) from TF and TFLite."""
+    graph = tf.Graph()
+    with graph.as_default():
+      placeholders = [tf.placeholder(tf.float32, d.shape) for d in inputs]
+      with tf.device('/cpu:0'):
+        output_tensor = build_fn(*placeholders)
+      with tf.Session(graph=graph) as sess:
+        expected_data = sess.run(output_tensor,
+                                 feed_dict=dict(zip(placeholders, inputs)))
+        converter = tf.lite.TFLiteConverter.from_session(
+            sess, placeholders, [output_tensor])
+        converter.allow_custom_ops = True
+        converter.target_spec.supported_ops = [tf.lite.OpsSet.TFLITE_BUILTINS]
+        tflite_model = converter.convert()
+
+    interpreter = tf.lite.Interpreter(
+        model_content=tflite_model, num_threads=num_threads,
+        custom_op_registerers=['HDRNetRegisterTfLiteOps'])
+    interpreter.allocate_tensors()
+    for detail, data in zip(interpreter.get_input_details(), inputs):
+      interpreter.set_tensor(detail['index'], data)
+    interpreter.invoke()
+    output_detail = interpreter.get_output_details()[0]
+    return expected_data, interpreter.get_tensor(output_detail['index'])
+
+  @parameterized.expand([('default_pool', None), ('one_thread', 1),
+                         ('two_threads', 2)])
+  def test_bilateral_slice(self, _, num_threads):
+    expected_data, tflite_data = self.run_converted(
+        ops.bilateral_slice, [self.grid_data, self.guide_data], num_threads)
+    self.assertAllClose(expected_data, tflite_data, rtol=1e-5, atol=1e-5)
+
+  @parameterized.expand([('offset', True), ('no_offset', False)])
+  def test_bilateral_slice_apply(self, _, has_offset):
+    grid_data = self.grid_data
+    if not has_offset:
+      grid_data = grid_data[..., :9]
+    expected_data, tflite_data = self.run_converted(
+        lambda grid, guide, image: ops.bilateral_slice_apply(
+            grid, guide, image, has_offset=has_offset),
+        [grid_data, self.guide_data, self.input_data], 2)
+    self.assertAllClose(expected_data, tflite_data, rtol=1e-5, atol=1e-5)
+
+  def test_curve_guide_slice_apply(self):
+    expected_data, tflite_data = self.run_converted(
+        lambda grid, image, *p: ops.curve_guide_slice_apply(
+            grid, image, *p, has_offset=True),
+        [self.grid_data, self.input_data] + self.curve_params, 2)
+    self.assertAllClose(expected_data, tflite_data, rtol=1e-5, atol=1e-5)
+
+  def test_pointwise_guide_slice_apply(self):
+    expected_data, tflite_data = self.run_converted(
+        lambda grid, image, *p: ops.pointwise_guide_slice_apply(
+            grid, image, *p, has_offset=True),
+        [self.grid_data, self.input_data] + self.pointwise_params, 2)
+    self.assertAllClose(expected_data, tflite_data, rtol=1e-5, atol=1e-5)
+
+
 if __name__ == '__main__':
   tf.test.main()
@@ -122,7 +122,8 @@ def bilateral_slice(grid, guide, name=None):
 # pylint: enable=redefined-builtin
 
 
-def bilateral_slice_apply(grid, guide, input_image, has_offset=True, name=None):
+def bilateral_slice_apply(grid, guide, input_image, has_offset=True,
+                          save_records=False, name=None):
   """Slices into a bilateral grid using the guide map.
 
   Args:
@@ -131,6 +132,9 @@ def bilateral_slice_apply(grid, guide, input_image, has_offset=True, name=None):
     guide: (Tensor) [batch_size, h, w ] guide map to slice along.
     input_image: (Tensor) [batch_size, h, w, n_input] input data onto which to
       apply the affine transform.
+    save_records: (bool) keep 5 floats per pixel from the forward pass so that
+      the gradient does not recompute where the guide samples the grid.
+      Faster training for more memory, CPU only.
     name: (string) name for the operation.
   Returns:
     sliced: (Tensor) [batch_size, h, w, n_outputs] sliced output.
@@ -144,11 +148,142 @@ def bilateral_slice_apply(grid, guide, input_image, has_offset=True, name=None):
       grid = tf.reshape(grid, tf.stack([gs[0], gs[1], gs[2], gs[3], gs[4]*gs[5]]))
       # grid = tf.concat(tf.unstack(grid, None, axis=5), 4)
 
-    sliced = hdrnet_ops.bilateral_slice_apply(grid, guide, input_image, has_offset=has_offset)
+    if save_records:
+      sliced, _ = hdrnet_ops.bilateral_slice_apply_record(
+          grid, guide, input_image, has_offset=has_offset)
+    else:
+      sliced = hdrnet_ops.bilateral_slice_apply(grid, guide, input_image, has_offset=has_offset)
     return sliced
 # pylint: enable=redefined-builtin
 
 
+def bilateral_slice_apply_packed(grid, guide, input_image, grid_depth,
+                                 has_offset=True, name=None):
+  """bilateral_slice_apply of a grid still packed as the conv predicting it.
+
+  Args:
+    grid: (Tensor) [batch_size, grid_h, grid_w, depth*n_outputs*n_input]
+      prediction conv output, its channels ordered as n_input pieces of
+      n_outputs pieces of depth values, which HDRNetCurves._coefficients
+      would unroll to a [batch_size, grid_h, grid_w, depth, n_outputs,
+      n_input] grid. CPU only.
+    guide: (Tensor) [batch_size, h, w ] guide map to slice along.
+    input_image: (Tensor) [batch_size, h, w, n_input] input data onto which to
+      apply the affine transform.
+    grid_depth: (int) depth of the grid.
+    name: (string) name for the operation.
+  Returns:
+    sliced: (Tensor) [batch_size, h, w, n_outputs] sliced output.
+  """
+  with tf.name_scope(name):
+    return hdrnet_ops.bilateral_slice_apply_packed(
+        grid, guide, input_image, has_offset=has_offset,
+        grid_depth=grid_depth)
+
+
+def _flatten_grid(grid):
+  """Merges the last two dims of a 6D grid, as bilateral_slice_apply."""
+  gridshape = grid.get_shape().as_list()
+  if len(gridshape) == 6:
+    gs = tf.shape(grid)
+    grid = tf.reshape(grid, tf.stack([gs[0], gs[1], gs[2], gs[3], gs[4]*gs[5]]))
+  return grid
+
+
+def curve_guide_slice_apply(grid, input_image, ccm, ccm_bias, shifts, slopes,
+                            mix_weights, mix_bias, has_offset=True, name=None):
+  """bilateral_slice_apply with the guide of HDRNetCurves, fused.
+
+  The guide is computed per pixel inside the op, in the forward and in the
+  backward pass, so it is never materialized as a network's activations.
+
+  Args:
+    grid: (Tensor) [batch_size, grid_h, grid_w, depth, n_outputs]
+      grid to slice from.
+    input_image: (Tensor) [batch_size, h, w, n_input] input data onto which to
+      apply the affine transform, and from which the guide is computed.
+    ccm, ccm_bias, shifts, slopes, mix_weights, mix_bias: (Tensor) the
+      variables of HDRNetCurves._guide, in any shape of the right size.
+    name: (string) name for the operation.
+  Returns:
+    sliced: (Tensor) [batch_size, h, w, n_outputs] sliced output.
+  """
+
+  with tf.name_scope(name):
+    grid = _flatten_grid(grid)
+    sliced = hdrnet_ops.curve_guide_slice_apply(
+        grid, input_image, ccm, ccm_bias, shifts, slopes, mix_weights,
+        mix_bias, has_offset=has_offset)
+    return sliced
+
+
+def pointwise_guide_slice_apply(grid, input_image, weights1, biases1, weights2,
+                                bias2, has_offset=True, name=None):
+  """bilateral_slice_apply with the guide of HDRNetPointwiseNNGuide, fused.
+
+  Args:
+    grid: (Tensor) [batch_size, grid_h, grid_w, depth, n_outputs]
+      grid to slice from.
+    input_image: (Tensor) [batch_size, h, w, n_input] input data onto which to
+      apply the affine transform, and from which the guide is computed.
+    weights1, biases1: (Tensor) [n_input, n_feats] and [n_feats] first layer,
+      with its batch normalization folded in.
+    weights2, bias2: (Tensor) [n_feats] and [1] second layer.
+    name: (string) name for the operation.
+  Returns:
+    sliced: (Tensor) [batch_size, h, w, n_outputs] sliced output.
+  """
+
+  with tf.name_scope(name):
+    grid = _flatten_grid(grid)
+    sliced = hdrnet_ops.pointwise_guide_slice_apply(
+        grid, input_image, weights1, biases1, weights2, bias2,
+        has_offset=has_offset)
+    return sliced
+
+
+def _luma_guide(image):
+  return tf.clip_by_value(tf.reduce_mean(image, axis=-1), 0, 1)
+
+
+def bilateral_guided_upsample(lowres_input, lowres_output, fullres_input,
+                              grid_size=(16, 16, 8), blur_iterations=1,
+                              regularization=1e-4, guide_fn=_luma_guide,
+                              name=None):
+  """Upsamples the output of any image-to-image model run at low resolution.
+
+  Fits a grid of local affine transforms from lowres_input to lowres_output
+  along a guide, on the CPU, and applies it to fullres_input with
+  bilateral_slice_apply.
+
+  Args:
+    lowres_input: (Tensor) [batch_size, h, w, n_input] the model's input.
+    lowres_output: (Tensor) [batch_size, h, w, n_outputs] the model's output.
+    fullres_input: (Tensor) [batch_size, H, W, n_input] input to upsample the
+      output to.
+    grid_size: (int, int, int) height, width and depth of the grid.
+    blur_iterations: (int) smoothing of the transforms across cells.
+    regularization: (float) pull of each cell towards the identity, in
+      units of pixels.
+    guide_fn: function of an image to its [batch_size, h, w] guide in [0, 1],
+      applied at both resolutions.
+    name: (string) name for the operation.
+  Returns:
+    upsampled: (Tensor) [batch_size, H, W, n_outputs] upsampled output.
+  """
+
+  with tf.name_scope(name):
+    grid_height, grid_width, grid_depth = grid_size
+    with tf.device('/cpu:0'):
+      grid = hdrnet_ops.bilateral_affine_fit(
+          lowres_input, lowres_output, guide_fn(lowres_input),
+          grid_height=grid_height, grid_width=grid_width,
+          grid_depth=grid_depth, blur_iterations=blur_iterations,
+          regularization=regularization)
+    return bilateral_slice_apply(grid, guide_fn(fullres_input),
+                                 fullres_input, has_offset=True)
+
+
 # pylint: disable=redefined-builtin
 def apply(sliced, input_image, has_affine_term=True, name=None):
   """Applies a sliced affined model to the input image.
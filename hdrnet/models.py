@@ -18,7 +18,12 @@ import tensorflow as tf
 import numpy as np
 import os
 
-from hdrnet.layers import (conv, fc, bilateral_slice_apply)
+from tensorflow.python.training import moving_averages
+
+from hdrnet.layers import (conv, fc, bilateral_slice_apply,
+                           bilateral_slice_apply_packed,
+                           curve_guide_slice_apply,
+                           pointwise_guide_slice_apply, w_initializer)
 
 __all__ = [
   'HDRNetCurves',
@@ -43,24 +48,44 @@ class HDRNetCurves(object):
   def inference(cls, lowres_input, fullres_input, params,
                 is_training=False):
 
+    fused_guide = is_training and params.get('fused_guide', False)
+    save_records = is_training and params.get('slice_records', False)
+    # The fused guide and sample record ops take the unrolled grid.
+    packed_grid = (is_training and params.get('packed_grid', False) and
+                   not fused_guide and not save_records)
+
     with tf.variable_scope('coefficients'):
-      bilateral_coeffs = cls._coefficients(lowres_input, params, is_training)
+      bilateral_coeffs = cls._coefficients(lowres_input, params, is_training,
+                                           packed=packed_grid)
       tf.add_to_collection('bilateral_coefficients', bilateral_coeffs)
 
+    if fused_guide:
+      # The fused op recomputes the guide per pixel in both passes: no
+      # full-res guide activations are kept for the backward pass.
+      with tf.variable_scope('guide'):
+        guide_params = cls._fused_guide_params(fullres_input, params)
+      with tf.variable_scope('output'):
+        output = cls._fused_output(fullres_input, guide_params, bilateral_coeffs)
+        tf.add_to_collection('output', output)
+      return output
+
     with tf.variable_scope('guide'):
       guide = cls._guide(fullres_input, params, is_training)
       tf.add_to_collection('guide', guide)
 
     with tf.variable_scope('output'):
-      output = cls._output(
-          fullres_input, guide, bilateral_coeffs)
+      if packed_grid:
+        output = cls._packed_output(fullres_input, guide, bilateral_coeffs,
+                                    params['luma_bins'])
+      else:
+        output = cls._output(fullres_input, guide, bilateral_coeffs,
+                             save_records=save_records)
       tf.add_to_collection('output', output)
 
     return output
 
   @classmethod
-  def _coefficients(cls, input_tensor, params, is_training):
-    bs = input_tensor.get_shape().as_list()[0]
+  def _coefficients(cls, input_tensor, params, is_training, packed=False):
     gd = params['luma_bins']
     cm = params['channel_multiplier']
     spatial_bin = params['spatial_bin']
@@ -92,7 +117,9 @@ class HDRNetCurves(object):
             batch_norm=params['batch_norm'], is_training=is_training,
             scope="conv{}".format(i+1))
       _, lh, lw, lc = current_layer.get_shape().as_list()
-      current_layer = tf.reshape(current_layer, [bs, lh*lw*lc])
+      # -1: the batch size may only be known at run time (freeze_graph.py
+      # --batched).
+      current_layer = tf.reshape(current_layer, [-1, lh*lw*lc])
 
       current_layer = fc(current_layer, 32*cm*gd, 
                          batch_norm=params['batch_norm'], is_training=is_training,
@@ -121,7 +148,7 @@ class HDRNetCurves(object):
     # -----------------------------------------------------------------------
     with tf.name_scope('fusion'):
       fusion_grid = grid_features
-      fusion_global = tf.reshape(global_features, [bs, 1, 1, 8*cm*gd])
+      fusion_global = tf.reshape(global_features, [-1, 1, 1, 8*cm*gd])
       fusion = tf.nn.relu(fusion_grid+fusion_global)
     # -----------------------------------------------------------------------
 
@@ -131,6 +158,8 @@ class HDRNetCurves(object):
       current_layer = conv(current_layer, gd*cls.n_out()*cls.n_in(), 1,
                                   activation_fn=None, scope='conv1')
 
+      prediction = current_layer
+
       with tf.name_scope('unroll_grid'):
         current_layer = tf.stack(
             tf.split(current_layer, cls.n_out()*cls.n_in(), axis=3), axis=4)
@@ -139,6 +168,9 @@ class HDRNetCurves(object):
       tf.add_to_collection('packed_coefficients', current_layer)
     # -----------------------------------------------------------------------
 
+    if packed:
+      # Sliced as is: the unrolled grid above only runs if fetched.
+      return prediction
     return current_layer
 
   @classmethod
@@ -147,13 +179,10 @@ class HDRNetCurves(object):
     nchans = input_tensor.get_shape().as_list()[-1]
 
     guidemap = input_tensor
+    ccm, ccm_bias, shifts, slopes = cls._curve_variables(nchans, npts)
 
     # Color space change
-    idtity = np.identity(nchans, dtype=np.float32) + np.random.randn(1).astype(np.float32)*1e-4
-    ccm = tf.get_variable('ccm', dtype=tf.float32, initializer=idtity)
     with tf.name_scope('ccm'):
-      ccm_bias = tf.get_variable('ccm_bias', shape=[nchans,], dtype=tf.float32, initializer=tf.constant_initializer(0.0))
-
       guidemap = tf.matmul(tf.reshape(input_tensor, [-1, nchans]), ccm)
       guidemap = tf.nn.bias_add(guidemap, ccm_bias, name='ccm_bias_add')
 
@@ -161,17 +190,7 @@ class HDRNetCurves(object):
 
     # Per-channel curve
     with tf.name_scope('curve'):
-      shifts_ = np.linspace(0, 1, npts, endpoint=False, dtype=np.float32)
-      shifts_ = shifts_[np.newaxis, np.newaxis, np.newaxis, :]
-      shifts_ = np.tile(shifts_, (1, 1, nchans, 1))
-
       guidemap = tf.expand_dims(guidemap, 4)
-      shifts = tf.get_variable('shifts', dtype=tf.float32, initializer=shifts_)
-
-      slopes_ = np.zeros([1, 1, 1, nchans, npts], dtype=np.float32)
-      slopes_[:, :, :, :, 0] = 1.0
-      slopes = tf.get_variable('slopes', dtype=tf.float32, initializer=slopes_)
-
       guidemap = tf.reduce_sum(slopes*tf.nn.relu(guidemap-shifts), reduction_indices=[4])
 
     guidemap = tf.contrib.layers.convolution2d(
@@ -190,9 +209,59 @@ class HDRNetCurves(object):
     return guidemap
 
   @classmethod
-  def _output(cls, im, guide, coeffs):
-    with tf.device('/gpu:0'):
-      out = bilateral_slice_apply(coeffs, guide, im, has_offset=True, name='slice')
+  def _output(cls, im, guide, coeffs, save_records=False):
+    # The op saving sample records for the gradient only runs on the CPU.
+    with tf.device('/cpu:0' if save_records else '/gpu:0'):
+      out = bilateral_slice_apply(coeffs, guide, im, has_offset=True,
+                                  save_records=save_records, name='slice')
+    return out
+
+  @classmethod
+  def _packed_output(cls, im, guide, coeffs, grid_depth):
+    with tf.device('/cpu:0'):
+      out = bilateral_slice_apply_packed(coeffs, guide, im, grid_depth,
+                                         has_offset=True, name='slice')
+    return out
+
+  @classmethod
+  def _curve_variables(cls, nchans, npts):
+    """Color transform and per-channel curves of the guide."""
+    idtity = np.identity(nchans, dtype=np.float32) + np.random.randn(1).astype(np.float32)*1e-4
+    ccm = tf.get_variable('ccm', dtype=tf.float32, initializer=idtity)
+    ccm_bias = tf.get_variable('ccm_bias', shape=[nchans,], dtype=tf.float32, initializer=tf.constant_initializer(0.0))
+
+    shifts_ = np.linspace(0, 1, npts, endpoint=False, dtype=np.float32)
+    shifts_ = shifts_[np.newaxis, np.newaxis, np.newaxis, :]
+    shifts_ = np.tile(shifts_, (1, 1, nchans, 1))
+    shifts = tf.get_variable('shifts', dtype=tf.float32, initializer=shifts_)
+
+    slopes_ = np.zeros([1, 1, 1, nchans, npts], dtype=np.float32)
+    slopes_[:, :, :, :, 0] = 1.0
+    slopes = tf.get_variable('slopes', dtype=tf.float32, initializer=slopes_)
+    return ccm, ccm_bias, shifts, slopes
+
+  @classmethod
+  def _fused_guide_params(cls, input_tensor, params):
+    """The variables of _guide, as the inputs of the fused op."""
+    npts = 16  # number of control points for the curve
+    nchans = input_tensor.get_shape().as_list()[-1]
+    ccm, ccm_bias, shifts, slopes = cls._curve_variables(nchans, npts)
+
+    # Same variables as the 1x1 convolution of _guide.
+    with tf.variable_scope('channel_mixing'):
+      mix_weights = tf.contrib.framework.model_variable(
+          'weights', shape=[1, 1, nchans, 1],
+          initializer=tf.constant_initializer(1.0/nchans),
+          collections=[tf.GraphKeys.WEIGHTS])
+      mix_bias = tf.contrib.framework.model_variable(
+          'biases', shape=[1], initializer=tf.constant_initializer(0),
+          collections=[tf.GraphKeys.BIASES])
+    return [ccm, ccm_bias, shifts, slopes, mix_weights, mix_bias]
+
+  @classmethod
+  def _fused_output(cls, im, guide_params, coeffs):
+    with tf.device('/cpu:0'):
+      out = curve_guide_slice_apply(coeffs, im, *guide_params, has_offset=True, name='slice')
     return out
 
 
@@ -209,6 +278,72 @@ class HDRNetPointwiseNNGuide(HDRNetCurves):
     guidemap = tf.squeeze(guidemap, squeeze_dims=[3,])
     return guidemap
 
+  @classmethod
+  def _fused_guide_params(cls, input_tensor, params):
+    """The variables of _guide, with conv1's batch norm folded into conv1.
+
+    conv1 is linear before its normalization, so the batch moments of its
+    output follow from the first two moments of the input, without computing
+    the full-res features.
+    """
+    n_guide_feats = params['guide_complexity']
+    nchans = input_tensor.get_shape().as_list()[-1]
+    epsilon = 0.001  # tf.contrib.layers.batch_norm defaults
+    decay = 0.999
+
+    # Same variables as conv(..., batch_norm=True) and conv(...) in _guide.
+    with tf.variable_scope('conv1'):
+      weights1 = tf.contrib.framework.model_variable(
+          'weights', shape=[1, 1, nchans, n_guide_feats],
+          initializer=w_initializer(), collections=[tf.GraphKeys.WEIGHTS])
+      with tf.variable_scope('BatchNorm'):
+        beta = tf.contrib.framework.model_variable(
+            'beta', shape=[n_guide_feats], initializer=tf.zeros_initializer(),
+            collections=[tf.GraphKeys.BIASES])
+        moving_mean = tf.contrib.framework.model_variable(
+            'moving_mean', shape=[n_guide_feats],
+            initializer=tf.zeros_initializer(), trainable=False,
+            collections=[tf.GraphKeys.MOVING_AVERAGE_VARIABLES])
+        moving_variance = tf.contrib.framework.model_variable(
+            'moving_variance', shape=[n_guide_feats],
+            initializer=tf.ones_initializer(), trainable=False,
+            collections=[tf.GraphKeys.MOVING_AVERAGE_VARIABLES])
+    with tf.variable_scope('conv2'):
+      weights2 = tf.contrib.framework.model_variable(
+          'weights', shape=[1, 1, n_guide_feats, 1],
+          initializer=w_initializer(), collections=[tf.GraphKeys.WEIGHTS])
+      bias2 = tf.contrib.framework.model_variable(
+          'biases', shape=[1], initializer=tf.constant_initializer(0.0),
+          collections=[tf.GraphKeys.BIASES])
+
+    with tf.name_scope('fold_batch_norm'):
+      w1 = tf.reshape(weights1, [nchans, n_guide_feats])
+      x = tf.reshape(input_tensor, [-1, nchans])
+      npix = tf.cast(tf.shape(x)[0], tf.float32)
+      x_mean = tf.reduce_mean(x, 0, keep_dims=True)
+      x_cov = (tf.matmul(x, x, transpose_a=True)/npix -
+               tf.matmul(x_mean, x_mean, transpose_a=True))
+      mean = tf.squeeze(tf.matmul(x_mean, w1), [0])
+      variance = tf.reduce_sum(w1*tf.matmul(x_cov, w1), 0)
+
+      tf.add_to_collection(
+          tf.GraphKeys.UPDATE_OPS, moving_averages.assign_moving_average(
+              moving_mean, mean, decay, zero_debias=False))
+      tf.add_to_collection(
+          tf.GraphKeys.UPDATE_OPS, moving_averages.assign_moving_average(
+              moving_variance, variance, decay, zero_debias=False))
+
+      inv_std = tf.rsqrt(variance + epsilon)
+      weights1 = w1*inv_std
+      biases1 = beta - mean*inv_std
+    return [weights1, biases1, weights2, bias2]
+
+  @classmethod
+  def _fused_output(cls, im, guide_params, coeffs):
+    with tf.device('/cpu:0'):
+      out = pointwise_guide_slice_apply(coeffs, im, *guide_params, has_offset=True, name='slice')
+    return out
+
 
 class HDRNetGaussianPyrNN(HDRNetPointwiseNNGuide):
   """Replace input to the affine model by a pyramid
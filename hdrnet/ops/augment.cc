@@ -0,0 +1,140 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "augment.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace hdrnet {
+namespace {
+
+// c + dx * x + dy * y.
+struct Affine {
+  int c;
+  int dx;
+  int dy;
+};
+
+// n - 1 - a.
+Affine Reflect(int n, const Affine& a) { return {n - 1 - a.c, -a.dx, -a.dy}; }
+
+// Nearest-neighbour source index of `dst`, as the legacy (align_corners=false,
+// no half-pixel centers) TF resize.
+int NearestSource(int dst, int in_size, int out_size) {
+  const float scale = static_cast<float>(in_size) / out_size;
+  return std::min(static_cast<int>(std::floor(dst * scale)), in_size - 1);
+}
+
+template <typename T>
+void CopyRow(nda::array_ref_of_rank<const T, 3> image, int row, int row_dx,
+             int col, int col_dx, int width, const int* xs, float scale,
+             float* out, int out_stride) {
+  const int channels = image.template dim<0>().extent();
+  for (int x = 0; x < width; ++x) {
+    const int sx = xs ? xs[x] : x;
+    const int r = row + row_dx * sx;
+    const int c = col + col_dx * sx;
+    for (int i = 0; i < channels; ++i) {
+      out[i] = scale * image(i, c, r);
+    }
+    out += out_stride;
+  }
+}
+
+}  // namespace
+
+AugmentTransform MakeAugmentTransform(int height, int width,
+                                      const AugmentParams& params) {
+  // Row and column in the rotated image.
+  const Affine i = {params.crop_y, 0, 1};
+  const Affine j = {params.crop_x, 1, 0};
+
+  // Row and column in the flipped image, by inverting tf.image.rot90.
+  Affine fi = i;
+  Affine fj = j;
+  switch (params.quarter_turns & 3) {
+    case 1:
+      fi = j;
+      fj = Reflect(width, i);
+      break;
+    case 2:
+      fi = Reflect(height, i);
+      fj = Reflect(width, j);
+      break;
+    case 3:
+      fi = Reflect(height, j);
+      fj = i;
+      break;
+  }
+
+  const Affine row = params.flip_up_down ? Reflect(height, fi) : fi;
+  const Affine col = params.flip_left_right ? Reflect(width, fj) : fj;
+
+  AugmentTransform transform;
+  transform.row0 = row.c;
+  transform.row_dx = row.dx;
+  transform.row_dy = row.dy;
+  transform.col0 = col.c;
+  transform.col_dx = col.dx;
+  transform.col_dy = col.dy;
+  return transform;
+}
+
+template <typename T>
+void AugmentImage(nda::array_ref_of_rank<const T, 3> image,
+                  const AugmentParams& params, float scale,
+                  nda::array_ref_of_rank<float, 3> fullres,
+                  nda::array_ref_of_rank<float, 3> lowres) {
+  const int image_width = image.template dim<1>().extent();
+  const int image_height = image.template dim<2>().extent();
+  const AugmentTransform t =
+      MakeAugmentTransform(image_height, image_width, params);
+
+  const int width = fullres.dim<1>().extent();
+  const int height = fullres.dim<2>().extent();
+  for (int y = 0; y < height; ++y) {
+    CopyRow(image, t.row0 + t.row_dy * y, t.row_dx, t.col0 + t.col_dy * y,
+            t.col_dx, width, nullptr, scale, &fullres(0, 0, y),
+            fullres.dim<1>().stride());
+  }
+
+  // Low-res pixels sample the crop, so they read the source directly too.
+  const int lowres_width = lowres.dim<1>().extent();
+  const int lowres_height = lowres.dim<2>().extent();
+  std::vector<int> xs(lowres_width);
+  for (int x = 0; x < lowres_width; ++x) {
+    xs[x] = NearestSource(x, width, lowres_width);
+  }
+  for (int y = 0; y < lowres_height; ++y) {
+    const int sy = NearestSource(y, height, lowres_height);
+    CopyRow(image, t.row0 + t.row_dy * sy, t.row_dx, t.col0 + t.col_dy * sy,
+            t.col_dx, lowres_width, xs.data(), scale, &lowres(0, 0, y),
+            lowres.dim<1>().stride());
+  }
+}
+
+template void AugmentImage<uint8_t>(
+    nda::array_ref_of_rank<const uint8_t, 3> image,
+    const AugmentParams& params, float scale,
+    nda::array_ref_of_rank<float, 3> fullres,
+    nda::array_ref_of_rank<float, 3> lowres);
+template void AugmentImage<uint16_t>(
+    nda::array_ref_of_rank<const uint16_t, 3> image,
+    const AugmentParams& params, float scale,
+    nda::array_ref_of_rank<float, 3> fullres,
+    nda::array_ref_of_rank<float, 3> lowres);
+
+}  // namespace hdrnet
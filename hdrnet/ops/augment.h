@@ -0,0 +1,80 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_AUGMENT_H_
+#define HDRNET_OPS_AUGMENT_H_
+
+#include <cstdint>
+
+#include "third_party/array/array.h"
+
+namespace hdrnet {
+
+// One draw of the training data augmentation of data_pipeline.py, applied in
+// this order: flips, rotation, crop.
+struct AugmentParams {
+  bool flip_left_right = false;
+  bool flip_up_down = false;
+  // Counter-clockwise quarter turns, as tf.image.rot90.
+  int quarter_turns = 0;
+  // Top-left corner of the crop in the flipped and rotated image.
+  int crop_y = 0;
+  int crop_x = 0;
+};
+
+// Where output pixel (x, y) comes from in the source image:
+//   row = row0 + row_dx * x + row_dy * y,
+//   col = col0 + col_dx * x + col_dy * y.
+// Flips and quarter turns only permute and negate the axes, so this is exact.
+struct AugmentTransform {
+  int row0 = 0;
+  int row_dx = 0;
+  int row_dy = 1;
+  int col0 = 0;
+  int col_dx = 1;
+  int col_dy = 0;
+};
+
+// The transform of `params` for a (height, width) source image.
+AugmentTransform MakeAugmentTransform(int height, int width,
+                                      const AugmentParams& params);
+
+// Writes the (output width, output height) crop of the flipped and rotated
+// `image` to `fullres`, and its nearest-neighbour resize (as
+// tf.image.resize_images with NEAREST_NEIGHBOR) to `lowres`, multiplying each
+// value by `scale`. Both outputs come straight from `image`, one pass each,
+// without materializing the rotated image.
+//
+// `image` is (c, w, h) with c changing fastest, i.e. a decoded HWC buffer.
+// The caller checks that the crop fits in the rotated image.
+template <typename T>
+void AugmentImage(nda::array_ref_of_rank<const T, 3> image,
+                  const AugmentParams& params, float scale,
+                  nda::array_ref_of_rank<float, 3> fullres,
+                  nda::array_ref_of_rank<float, 3> lowres);
+
+extern template void AugmentImage<uint8_t>(
+    nda::array_ref_of_rank<const uint8_t, 3> image,
+    const AugmentParams& params, float scale,
+    nda::array_ref_of_rank<float, 3> fullres,
+    nda::array_ref_of_rank<float, 3> lowres);
+extern template void AugmentImage<uint16_t>(
+    nda::array_ref_of_rank<const uint16_t, 3> image,
+    const AugmentParams& params, float scale,
+    nda::array_ref_of_rank<float, 3> fullres,
+    nda::array_ref_of_rank<float, 3> lowres);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_AUGMENT_H_
@@ -0,0 +1,238 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "autotune.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+#include <sys/stat.h>
+
+namespace hdrnet {
+
+namespace {
+
+// Timed runs per candidate, after one warm-up run. The minimum is kept.
+constexpr int kTimedRuns = 3;
+
+TuningMode ModeFromEnv() {
+  const char* value = std::getenv("HDRNET_AUTOTUNE");
+  // Opt-in: unless asked, the kernels neither read nor write the cache, and
+  // their schedule does not depend on the host's tuning history.
+  if (value == nullptr) {
+    return TuningMode::kOff;
+  }
+  const std::string mode(value);
+  if (mode == "cached") {
+    return TuningMode::kCached;
+  }
+  if (mode == "tune" || mode == "1") {
+    return TuningMode::kTune;
+  }
+  return TuningMode::kOff;
+}
+
+std::string CachePathFromEnv() {
+  const char* path = std::getenv("HDRNET_TUNING_CACHE");
+  if (path != nullptr) {
+    return path;
+  }
+  const char* home = std::getenv("HOME");
+  return std::string(home ? home : ".") + "/.cache/hdrnet/tuning_cache.tsv";
+}
+
+// mkdir -p for the parent directories of `path`.
+void MakeParentDirs(const std::string& path) {
+  for (size_t pos = path.find('/', 1); pos != std::string::npos;
+       pos = path.find('/', pos + 1)) {
+    mkdir(path.substr(0, pos).c_str(), 0755);
+  }
+}
+
+double TimeMicroseconds(const std::function<void(const Schedule&)>& run,
+                        const Schedule& schedule) {
+  run(schedule);  // Warm up.
+  double best = std::numeric_limits<double>::infinity();
+  for (int i = 0; i < kTimedRuns; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    run(schedule);
+    const std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, elapsed.count());
+  }
+  return best;
+}
+
+}  // namespace
+
+std::string TuningKey(const std::string& kernel,
+                      std::initializer_list<int64_t> extents) {
+  std::stringstream key;
+  key << kernel << ":";
+  bool first = true;
+  for (int64_t extent : extents) {
+    key << (first ? "" : "x") << extent;
+    first = false;
+  }
+  return key.str();
+}
+
+std::string CpuModel() {
+  std::string model = "unknown";
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      const size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        model = line.substr(line.find_first_not_of(' ', colon + 1));
+      }
+      break;
+    }
+  }
+  std::replace(model.begin(), model.end(), '\t', ' ');
+  std::stringstream s;
+  s << model << " x" << std::thread::hardware_concurrency();
+  return s.str();
+}
+
+std::vector<Schedule> CandidateSchedules(int64_t rows, int num_threads) {
+  std::vector<Schedule> candidates;
+  Schedule serial;
+  serial.num_threads = 1;
+  candidates.push_back(serial);
+
+  std::vector<int> thread_counts;
+  for (int t = 2; t < num_threads; t *= 2) {
+    thread_counts.push_back(t);
+  }
+  if (num_threads > 1) {
+    thread_counts.push_back(num_threads);
+  }
+  for (int t : thread_counts) {
+    // chunk = 0 is the pool's default split.
+    for (int64_t chunk : {0, 1, 2, 4, 8, 16, 32}) {
+      if (chunk * t > rows) {
+        break;
+      }
+      Schedule s;
+      s.num_threads = t;
+      s.chunk = chunk;
+      candidates.push_back(s);
+    }
+  }
+  return candidates;
+}
+
+AutoTuner::AutoTuner(TuningMode mode, const std::string& cache_path,
+                     const std::string& cpu_model)
+    : mode_(mode), cache_path_(cache_path), cpu_model_(cpu_model) {}
+
+AutoTuner& AutoTuner::Get() {
+  static AutoTuner* tuner =
+      new AutoTuner(ModeFromEnv(), CachePathFromEnv(), CpuModel());
+  return *tuner;
+}
+
+std::string AutoTuner::PoolKey(const std::string& key) {
+  std::stringstream s;
+  s << key << "@" << WorkerPool::Current().num_threads();
+  return s.str();
+}
+
+Schedule AutoTuner::Select(const std::string& key, int64_t rows,
+                           const std::function<void(const Schedule&)>& run) {
+  if (mode_ == TuningMode::kOff) {
+    return Schedule();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Load();
+    auto it = cache_.find(PoolKey(key));
+    if (it != cache_.end()) {
+      return it->second;
+    }
+    if (mode_ != TuningMode::kTune) {
+      return Schedule();
+    }
+  }
+  return Tune(key, rows, run);
+}
+
+Schedule AutoTuner::Tune(const std::string& key, int64_t rows,
+                         const std::function<void(const Schedule&)>& run) {
+  const std::vector<Schedule> candidates =
+      CandidateSchedules(rows, WorkerPool::Current().num_threads());
+  Schedule best;
+  double best_us = std::numeric_limits<double>::infinity();
+  for (const Schedule& candidate : candidates) {
+    const double us = TimeMicroseconds(run, candidate);
+    if (us < best_us) {
+      best_us = us;
+      best = candidate;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Load();
+  Store(PoolKey(key), best, best_us);
+  return best;
+}
+
+void AutoTuner::Load() {
+  if (loaded_) {
+    return;
+  }
+  loaded_ = true;
+  std::ifstream file(cache_path_);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream fields(line);
+    std::string cpu_model, key, num_threads, chunk;
+    if (!std::getline(fields, cpu_model, '\t') ||
+        !std::getline(fields, key, '\t') ||
+        !std::getline(fields, num_threads, '\t') ||
+        !std::getline(fields, chunk, '\t')) {
+      continue;
+    }
+    if (cpu_model != cpu_model_) {
+      continue;
+    }
+    Schedule schedule;
+    schedule.num_threads = std::atoi(num_threads.c_str());
+    schedule.chunk = std::atoll(chunk.c_str());
+    cache_[key] = schedule;
+  }
+}
+
+void AutoTuner::Store(const std::string& key, const Schedule& schedule,
+                      double microseconds) {
+  cache_[key] = schedule;
+  MakeParentDirs(cache_path_);
+  std::ofstream file(cache_path_, std::ios::app);
+  if (!file) {
+    std::cerr << "Could not write tuning cache " << cache_path_ << std::endl;
+    return;
+  }
+  file << cpu_model_ << "\t" << key << "\t" << schedule.num_threads << "\t"
+       << schedule.chunk << "\t" << microseconds << "\n";
+}
+
+}  // namespace hdrnet
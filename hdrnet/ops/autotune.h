@@ -0,0 +1,98 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_AUTOTUNE_H_
+#define HDRNET_OPS_AUTOTUNE_H_
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+enum class TuningMode {
+  // Always use the pool's default schedule. The default.
+  kOff,
+  // Use schedules from the cache file, never benchmark.
+  kCached,
+  // On a cache miss, benchmark the candidate schedules and store the fastest.
+  kTune,
+};
+
+// Identifies a kernel call: the kernel name and the extents of its arguments,
+// e.g. "BilateralSliceApply:1x480x640x16x16x8x12x3".
+std::string TuningKey(const std::string& kernel,
+                      std::initializer_list<int64_t> extents);
+
+// "model name" from /proc/cpuinfo and the number of hardware threads.
+std::string CpuModel();
+
+// Schedules tried for a kernel with `rows` rows on a pool of `num_threads`.
+std::vector<Schedule> CandidateSchedules(int64_t rows, int num_threads);
+
+// Chooses the thread count and chunk size of the CPU kernels per shape, and
+// persists the choices in a text file with one entry per line:
+//
+//   <cpu model> \t <key> \t <num_threads> \t <chunk> \t <microseconds>
+//
+// Entries for other CPUs are ignored; later entries override earlier ones.
+class AutoTuner {
+ public:
+  AutoTuner(TuningMode mode, const std::string& cache_path,
+            const std::string& cpu_model);
+
+  // Configured with HDRNET_AUTOTUNE (off, the default, cached or tune) and
+  // HDRNET_TUNING_CACHE (default: ~/.cache/hdrnet/tuning_cache.tsv). Only the
+  // TF and TFLite CPU kernels of this directory consult it.
+  static AutoTuner& Get();
+
+  TuningMode mode() const { return mode_; }
+  void set_mode(TuningMode mode) { mode_ = mode; }
+  const std::string& cache_path() const { return cache_path_; }
+
+  // Returns the schedule for `key` on WorkerPool::Current(). On a miss in
+  // kTune mode, benchmarks `run` with each candidate first. `run` must be safe
+  // to call repeatedly, e.g. the kernel writing to its real output.
+  Schedule Select(const std::string& key, int64_t rows,
+                  const std::function<void(const Schedule&)>& run);
+
+  // Benchmarks the candidates regardless of mode and stores the fastest.
+  Schedule Tune(const std::string& key, int64_t rows,
+                const std::function<void(const Schedule&)>& run);
+
+ private:
+  // Qualifies `key` with the size of the current pool.
+  static std::string PoolKey(const std::string& key);
+  void Load();
+  void Store(const std::string& key, const Schedule& schedule,
+             double microseconds);
+
+  TuningMode mode_;
+  const std::string cache_path_;
+  const std::string cpu_model_;
+
+  std::mutex mutex_;
+  bool loaded_ = false;
+  std::map<std::string, Schedule> cache_;
+};
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_AUTOTUNE_H_
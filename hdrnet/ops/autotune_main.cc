@@ -0,0 +1,175 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tunes the CPU kernels ahead of time for one shape and stores the result in
+// the tuning cache, so that the ops can use it with HDRNET_AUTOTUNE=cached:
+//
+//   autotune_main --kernel=slice_apply --width=1920 --height=1080 --grid=16x16x8
+//
+// Flags (defaults in parentheses):
+//   --kernel           slice_apply or slice (slice_apply)
+//   --width, --height  image size (640x480)
+//   --batch            batch size (1)
+//   --grid             grid width x height x depth (16x16x8)
+//   --input_channels   slice_apply input channels (3)
+//   --output_channels  slice_apply output channels (3)
+//   --has_offset       slice_apply affine offset, 0 or 1 (1)
+//   --grid_channels    slice channels (12)
+//   --low_latency      tune with LatencyMode::kLowLatency, 0 or 1 (0)
+//   --cache            cache file (HDRNET_TUNING_CACHE or the default)
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "autotune.h"
+#include "bilateral_slice.h"
+#include "bilateral_slice_apply.h"
+#include "third_party/array/array.h"
+
+namespace {
+
+std::vector<float> RandomBuffer(size_t size, std::mt19937* rng) {
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<float> buffer(size);
+  for (float& v : buffer) v = uniform(*rng);
+  return buffer;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::map<std::string, std::string> flags = {
+      {"kernel", "slice_apply"}, {"width", "640"},
+      {"height", "480"},         {"batch", "1"},
+      {"grid", "16x16x8"},       {"input_channels", "3"},
+      {"output_channels", "3"},  {"has_offset", "1"},
+      {"grid_channels", "12"},   {"low_latency", "0"},
+      {"cache", ""},
+  };
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    const size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos ||
+        flags.count(arg.substr(2, eq - 2)) == 0) {
+      std::fprintf(stderr, "Unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+    flags[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+  auto flag = [&](const std::string& name) {
+    return std::atoi(flags[name].c_str());
+  };
+
+  int grid_width = 0, grid_height = 0, grid_depth = 0;
+  if (std::sscanf(flags["grid"].c_str(), "%dx%dx%d", &grid_width, &grid_height,
+                  &grid_depth) != 3) {
+    std::fprintf(stderr, "--grid should be WxHxD\n");
+    return 1;
+  }
+  const int width = flag("width");
+  const int height = flag("height");
+  const int batch_size = flag("batch");
+
+  hdrnet::AutoTuner tuner(hdrnet::TuningMode::kTune,
+                          flags["cache"].empty()
+                              ? hdrnet::AutoTuner::Get().cache_path()
+                              : flags["cache"],
+                          hdrnet::CpuModel());
+
+  std::mt19937 rng(0);
+  std::vector<float> guide =
+      RandomBuffer(static_cast<size_t>(width) * height * batch_size, &rng);
+  auto guide_ref = nda::make_array_ref(
+      const_cast<const float*>(guide.data()),
+      nda::shape_of_rank<3>(width, height, batch_size));
+  const int64_t rows = static_cast<int64_t>(height) * batch_size;
+
+  std::string key;
+  hdrnet::Schedule schedule;
+  if (flags["kernel"] == "slice_apply") {
+    const int input_channels = flag("input_channels");
+    const int output_channels = flag("output_channels");
+    const int grid_input_channels = input_channels + flag("has_offset");
+    const hdrnet::LatencyMode mode = flag("low_latency")
+                                         ? hdrnet::LatencyMode::kLowLatency
+                                         : hdrnet::LatencyMode::kThroughput;
+    std::vector<float> grid =
+        RandomBuffer(static_cast<size_t>(grid_input_channels) *
+                         output_channels * grid_depth * grid_width *
+                         grid_height * batch_size,
+                     &rng);
+    std::vector<float> input = RandomBuffer(
+        static_cast<size_t>(input_channels) * width * height * batch_size,
+        &rng);
+    std::vector<float> out(static_cast<size_t>(output_channels) * width *
+                           height * batch_size);
+    auto grid_ref = nda::make_array_ref(
+        const_cast<const float*>(grid.data()),
+        nda::shape_of_rank<6>(grid_input_channels, output_channels, grid_depth,
+                              grid_width, grid_height, batch_size));
+    auto input_ref = nda::make_array_ref(
+        const_cast<const float*>(input.data()),
+        nda::shape_of_rank<4>(input_channels, width, height, batch_size));
+    auto out_ref = nda::make_array_ref(
+        out.data(),
+        nda::shape_of_rank<4>(output_channels, width, height, batch_size));
+
+    // Must match TunedBilateralSliceApply.
+    key = hdrnet::TuningKey(
+        "BilateralSliceApply",
+        {batch_size, height, width, grid_height, grid_width, grid_depth,
+         grid_input_channels * output_channels, input_channels});
+    schedule = tuner.Tune(key, rows, [&](const hdrnet::Schedule& candidate) {
+      hdrnet::Schedule s = candidate;
+      s.mode = mode;
+      hdrnet::BilateralSliceApply(grid_ref, guide_ref, input_ref, out_ref, s);
+    });
+  } else if (flags["kernel"] == "slice") {
+    const int grid_channels = flag("grid_channels");
+    std::vector<float> grid = RandomBuffer(
+        static_cast<size_t>(grid_channels) * grid_depth * grid_width *
+            grid_height * batch_size,
+        &rng);
+    std::vector<float> out(static_cast<size_t>(grid_channels) * width *
+                           height * batch_size);
+    auto grid_ref = nda::make_array_ref(
+        const_cast<const float*>(grid.data()),
+        nda::shape_of_rank<5>(grid_channels, grid_depth, grid_width,
+                              grid_height, batch_size));
+    auto out_ref = nda::make_array_ref(
+        out.data(),
+        nda::shape_of_rank<4>(grid_channels, width, height, batch_size));
+
+    // Must match TunedBilateralSlice.
+    key = hdrnet::TuningKey("BilateralSlice",
+                            {batch_size, height, width, grid_height,
+                             grid_width, grid_depth, grid_channels});
+    schedule = tuner.Tune(key, rows, [&](const hdrnet::Schedule& candidate) {
+      hdrnet::BilateralSlice(grid_ref, guide_ref, out_ref, candidate);
+    });
+  } else {
+    std::fprintf(stderr, "Unknown kernel %s\n", flags["kernel"].c_str());
+    return 1;
+  }
+
+  std::printf("%s on %s: num_threads=%d chunk=%lld\n", key.c_str(),
+              hdrnet::CpuModel().c_str(), schedule.num_threads,
+              static_cast<long long>(schedule.chunk));
+  std::printf("Saved to %s\n", tuner.cache_path().c_str());
+  return 0;
+}
@@ -0,0 +1,180 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bilateral_fit.h"
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bilateral_grid.h"
+#include "third_party/array/array.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+namespace {
+
+// Solves a * x = b in place for `num_rhs` right-hand sides, with `a` an n x n
+// symmetric positive definite matrix (row-major, lower triangle used) and `b`
+// n x num_rhs (row-major), by Cholesky decomposition. Returns false if `a` is
+// not numerically positive definite.
+bool CholeskySolve(int n, int num_rhs, float* a, float* b) {
+  for (int j = 0; j < n; ++j) {
+    float d = a[j * n + j];
+    for (int k = 0; k < j; ++k) {
+      d -= a[j * n + k] * a[j * n + k];
+    }
+    if (!(d > 0.0f)) {
+      return false;
+    }
+    a[j * n + j] = std::sqrt(d);
+    for (int i = j + 1; i < n; ++i) {
+      float s = a[i * n + j];
+      for (int k = 0; k < j; ++k) {
+        s -= a[i * n + k] * a[j * n + k];
+      }
+      a[i * n + j] = s / a[j * n + j];
+    }
+  }
+  for (int r = 0; r < num_rhs; ++r) {
+    // L * y = b, then L^T * x = y.
+    for (int i = 0; i < n; ++i) {
+      float s = b[i * num_rhs + r];
+      for (int k = 0; k < i; ++k) {
+        s -= a[i * n + k] * b[k * num_rhs + r];
+      }
+      b[i * num_rhs + r] = s / a[i * n + i];
+    }
+    for (int i = n - 1; i >= 0; --i) {
+      float s = b[i * num_rhs + r];
+      for (int k = i + 1; k < n; ++k) {
+        s -= a[k * n + i] * b[k * num_rhs + r];
+      }
+      b[i * num_rhs + r] = s / a[i * n + i];
+    }
+  }
+  return true;
+}
+
+// The normal equations of one cell, in the layout of CholeskySolve. Reused by
+// the cells of a task's chunk of grid rows.
+struct NormalEquations {
+  NormalEquations(int n, int num_rhs) : a(n * n), rhs(n * num_rhs) {}
+
+  std::vector<float> a;
+  std::vector<float> rhs;
+};
+
+}  // namespace
+
+void BilateralAffineFit(nda::array_ref_of_rank<const float, 4> lowres_input,
+                        nda::array_ref_of_rank<const float, 4> lowres_output,
+                        nda::array_ref_of_rank<const float, 3> guide,
+                        int blur_iterations, float regularization,
+                        nda::array_ref_of_rank<float, 6> grid_out) {
+  const int input_channels = lowres_input.dim<0>().extent();
+  const int width = lowres_input.dim<1>().extent();
+  const int height = lowres_input.dim<2>().extent();
+  const int batch_size = lowres_input.dim<3>().extent();
+  const int output_channels = lowres_output.dim<0>().extent();
+  const int grid_depth = grid_out.dim<2>().extent();
+  const int grid_width = grid_out.dim<3>().extent();
+  const int grid_height = grid_out.dim<4>().extent();
+
+  // Per pixel, with x = [input, 1] of size n: the lower triangle of x * x^T,
+  // then x * output^T, row-major.
+  const int n = input_channels + 1;
+  const int num_lhs = n * (n + 1) / 2;
+  const int num_stats = num_lhs + n * output_channels;
+  std::vector<float> stats(static_cast<size_t>(num_stats) * width * height *
+                           batch_size);
+  auto stats_ref = nda::make_array_ref(
+      stats.data(),
+      nda::shape_of_rank<4>(num_stats, width, height, batch_size));
+  ParallelForRowsWithScratch(
+      height, batch_size, width * num_stats,
+      [&] { return std::vector<float>(n, 1.0f); },
+      [&](int y, int b, std::vector<float>& x_h) {
+        for (int x = 0; x < width; ++x) {
+          for (int c = 0; c < input_channels; ++c) {
+            x_h[c] = lowres_input(c, x, y, b);
+          }
+          int s = 0;
+          for (int i = 0; i < n; ++i) {
+            for (int j = 0; j <= i; ++j) {
+              stats_ref(s++, x, y, b) = x_h[i] * x_h[j];
+            }
+          }
+          for (int i = 0; i < n; ++i) {
+            for (int o = 0; o < output_channels; ++o) {
+              stats_ref(s++, x, y, b) = x_h[i] * lowres_output(o, x, y, b);
+            }
+          }
+        }
+      });
+
+  const auto grid_shape = nda::shape_of_rank<5>(
+      num_stats, grid_depth, grid_width, grid_height, batch_size);
+  std::vector<float> splatted(grid_shape.flat_extent());
+  std::vector<float> blurred(grid_shape.flat_extent());
+  auto splatted_ref = nda::make_array_ref(splatted.data(), grid_shape);
+  auto blurred_ref = nda::make_array_ref(blurred.data(), grid_shape);
+  BilateralSplat(stats_ref, guide, splatted_ref);
+  BilateralGridBlur(splatted_ref, blur_iterations, blurred_ref);
+
+  ParallelForRowsWithScratch(
+      grid_height, batch_size,
+      static_cast<int64_t>(grid_width) * grid_depth * n * n *
+          (n + output_channels),
+      [&] { return NormalEquations(n, output_channels); },
+      [&](int gy, int b, NormalEquations& equations) {
+        std::vector<float>& a = equations.a;
+        std::vector<float>& rhs = equations.rhs;
+        for (int gx = 0; gx < grid_width; ++gx) {
+          for (int gz = 0; gz < grid_depth; ++gz) {
+            // (A + r * I) * M^T = B + r * P^T, for the prior P.
+            int s = 0;
+            for (int i = 0; i < n; ++i) {
+              for (int j = 0; j <= i; ++j) {
+                a[i * n + j] = blurred_ref(s++, gz, gx, gy, b);
+              }
+              a[i * n + i] += regularization;
+            }
+            for (int i = 0; i < n; ++i) {
+              for (int o = 0; o < output_channels; ++o) {
+                const bool prior =
+                    input_channels == output_channels && i == o;
+                rhs[i * output_channels + o] =
+                    blurred_ref(s++, gz, gx, gy, b) +
+                    (prior ? regularization : 0.0f);
+              }
+            }
+            const bool solved =
+                CholeskySolve(n, output_channels, a.data(), rhs.data());
+            for (int o = 0; o < output_channels; ++o) {
+              for (int i = 0; i < n; ++i) {
+                const bool prior =
+                    input_channels == output_channels && i == o;
+                grid_out(i, o, gz, gx, gy, b) =
+                    solved ? rhs[i * output_channels + o]
+                           : (prior ? 1.0f : 0.0f);
+              }
+            }
+          }
+        }
+      });
+}
+
+}  // namespace hdrnet
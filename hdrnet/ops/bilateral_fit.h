@@ -0,0 +1,49 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_BILATERAL_FIT_H_
+#define HDRNET_OPS_BILATERAL_FIT_H_
+
+#include "third_party/array/array.h"
+
+namespace hdrnet {
+
+// Fits a grid of local affine color transforms mapping `lowres_input` to
+// `lowres_output` (bilateral guided upsampling), for BilateralSliceApply with
+// an offset to apply to the full-resolution input. Any image-to-image model
+// can then run at low resolution only.
+//
+// - lowres_input: (input_channels, width, height, batch_size).
+// - lowres_output: (output_channels, width, height, batch_size).
+// - guide: (width, height, batch_size), the same function of the input as the
+//   guide that the grid will be sliced with at full resolution.
+// - grid_out: (input_channels + 1, output_channels, grid_depth, grid_width,
+//   grid_height, batch_size).
+//
+// The least-squares statistics of [input, 1] -> output are splatted into the
+// grid with BilateralSplat, so that each pixel counts with the weights that
+// slicing gives it, and blurred `blur_iterations` times with
+// BilateralGridBlur for smoothness across cells. Each cell then solves its
+// normal equations, regularized by `regularization` (in units of pixel weight)
+// towards the identity transform, or towards zero if input_channels differs
+// from output_channels. Cells without pixels nearby get that transform.
+void BilateralAffineFit(nda::array_ref_of_rank<const float, 4> lowres_input,
+                        nda::array_ref_of_rank<const float, 4> lowres_output,
+                        nda::array_ref_of_rank<const float, 3> guide,
+                        int blur_iterations, float regularization,
+                        nda::array_ref_of_rank<float, 6> grid_out);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_BILATERAL_FIT_H_
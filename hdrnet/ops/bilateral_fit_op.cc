@@ -0,0 +1,170 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+
+#include "bilateral_fit.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::DimensionHandle;
+using ::tensorflow::shape_inference::InferenceContext;
+using ::tensorflow::shape_inference::ShapeHandle;
+
+namespace hdrnet {
+
+class BilateralAffineFitOp : public OpKernel {
+ public:
+  explicit BilateralAffineFitOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("grid_height", &grid_height_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_width", &grid_width_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_depth", &grid_depth_));
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("blur_iterations", &blur_iterations_));
+    OP_REQUIRES_OK(context,
+                   context->GetAttr("regularization", &regularization_));
+    OP_REQUIRES(context, regularization_ >= 0.0f,
+                tensorflow::errors::InvalidArgument(
+                    "regularization should be non-negative, got ",
+                    regularization_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& lowres_input = context->input(0);
+    const Tensor& lowres_output = context->input(1);
+    const Tensor& guide = context->input(2);
+
+    OP_REQUIRES(context, lowres_input.dims() == 4 && lowres_output.dims() == 4,
+                tensorflow::errors::InvalidArgument(
+                    "Low-resolution input and output should be 4D "
+                    "(batch_size, height, width, channels)"));
+    OP_REQUIRES(
+        context, guide.dims() == 3,
+        tensorflow::errors::InvalidArgument(
+            "Input guide should be 3D (batch_size, height, width)"));
+
+    const int batch_size = lowres_input.dim_size(0);
+    const int height = lowres_input.dim_size(1);
+    const int width = lowres_input.dim_size(2);
+    const int input_channels = lowres_input.dim_size(3);
+    const int output_channels = lowres_output.dim_size(3);
+    OP_REQUIRES(context,
+                lowres_output.dim_size(0) == batch_size &&
+                    lowres_output.dim_size(1) == height &&
+                    lowres_output.dim_size(2) == width,
+                tensorflow::errors::InvalidArgument(
+                    "Low-resolution input and output should have the same "
+                    "batch size, height and width"));
+    OP_REQUIRES(context,
+                guide.dim_size(0) == batch_size &&
+                    guide.dim_size(1) == height && guide.dim_size(2) == width,
+                tensorflow::errors::InvalidArgument(
+                    "Guide should have the batch size, height and width of "
+                    "the low-resolution input"));
+    OP_REQUIRES(context, height > 0 && width > 0,
+                tensorflow::errors::InvalidArgument(
+                    "Low-resolution height and width should be positive"));
+
+    Tensor* grid = nullptr;
+    OP_REQUIRES_OK(
+        context, context->allocate_output(
+                     0,
+                     TensorShape({batch_size, grid_height_, grid_width_,
+                                  grid_depth_, output_channels,
+                                  input_channels + 1}),
+                     &grid));
+
+    auto input_ref = nda::make_array_ref(
+        lowres_input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, width, height, batch_size));
+    auto output_ref = nda::make_array_ref(
+        lowres_output.flat<float>().data(),
+        nda::shape_of_rank<4>(output_channels, width, height, batch_size));
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(width, height, batch_size));
+    auto grid_ref = nda::make_array_ref(
+        grid->flat<float>().data(),
+        nda::shape_of_rank<6>(input_channels + 1, output_channels,
+                              grid_depth_, grid_width_, grid_height_,
+                              batch_size));
+    BilateralAffineFit(input_ref, output_ref, guide_ref, blur_iterations_,
+                       regularization_, grid_ref);
+  }
+
+ private:
+  int grid_height_;
+  int grid_width_;
+  int grid_depth_;
+  int blur_iterations_;
+  float regularization_;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralAffineFit").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralAffineFitOp);
+
+REGISTER_OP("BilateralAffineFit")
+    .Input("lowres_input: float")
+    .Input("lowres_output: float")
+    .Input("guide: float")
+    .Attr("grid_height: int >= 1 = 16")
+    .Attr("grid_width: int >= 1 = 16")
+    .Attr("grid_depth: int >= 1 = 8")
+    .Attr("blur_iterations: int >= 0 = 1")
+    .Attr("regularization: float = 1e-4")
+    .Output("grid: float")
+    .Doc(
+        "Fits a grid of affine transforms from lowres_input to lowres_output "
+        "along guide, for BilateralSliceApply with has_offset on the "
+        "full-resolution input.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle lowres_input;
+      ShapeHandle lowres_output;
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 4, &lowres_input));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 4, &lowres_output));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 3, &guide));
+      int grid_height;
+      int grid_width;
+      int grid_depth;
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_height", &grid_height));
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_width", &grid_width));
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_depth", &grid_depth));
+
+      DimensionHandle batch_size;
+      TF_RETURN_IF_ERROR(c->Merge(c->Dim(lowres_input, 0),
+                                  c->Dim(lowres_output, 0), &batch_size));
+      TF_RETURN_IF_ERROR(c->Merge(batch_size, c->Dim(guide, 0), &batch_size));
+      DimensionHandle grid_input_channels;
+      TF_RETURN_IF_ERROR(
+          c->Add(c->Dim(lowres_input, 3), 1, &grid_input_channels));
+      c->set_output(0, c->MakeShape({batch_size, grid_height, grid_width,
+                                     grid_depth, c->Dim(lowres_output, 3),
+                                     grid_input_channels}));
+      return Status::OK();
+    });
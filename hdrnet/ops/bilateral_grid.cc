@@ -0,0 +1,245 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bilateral_grid.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "boundary.h"
+#include "numerics.h"
+#include "third_party/array/array.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+namespace {
+
+// [1, 2, 1] / 4 at `i` of an axis of `extent`, clamped.
+template <typename Fn>
+float Blur3(Fn at, int i, int extent) {
+  return 0.25f * (at(std::max(i - 1, 0)) + 2.0f * at(i) +
+                  at(std::min(i + 1, extent - 1)));
+}
+
+// Scratch of a BilateralSplat task, reused by the bands of its chunk.
+struct SplatScratch {
+  SplatScratch(int width, int grid_channels)
+      : row(width), pixel(grid_channels, 1.0f) {}
+
+  DepthRow row;
+  // The channels of the current pixel, then its weight of 1 if homogeneous.
+  std::vector<float> pixel;
+};
+
+}  // namespace
+
+void BilateralSplat(nda::array_ref_of_rank<const float, 4> image,
+                    nda::array_ref_of_rank<const float, 3> guide,
+                    nda::array_ref_of_rank<float, 5> grid_out) {
+  const int channels = image.dim<0>().extent();
+  const int width = image.dim<1>().extent();
+  const int height = image.dim<2>().extent();
+  const int batch_size = image.dim<3>().extent();
+  const int grid_channels = grid_out.dim<0>().extent();
+  const int grid_depth = grid_out.dim<1>().extent();
+  const int grid_width = grid_out.dim<2>().extent();
+  const int grid_height = grid_out.dim<3>().extent();
+  const float scale_x = static_cast<float>(grid_width) / width;
+  const float scale_y = static_cast<float>(grid_height) / height;
+
+  // The same cells and weights as BilateralSlice.
+  LerpTable xs(width);
+  LerpTable ys(height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
+  const bool approximate = ApproximateNumerics();
+
+  // Pixel rows y with ys.cell0[y] == g, for g in [-1, grid_height - 1], form
+  // band g + 1, contiguous since the cells increase with y. Band g + 1 adds to
+  // grid rows g and g + 1 only, which its task accumulates privately; the
+  // y clamping is left to the reduction below.
+  const int num_bands = grid_height + 1;
+  auto band_of = [&](int y) {
+    return std::clamp(ys.cell0[y] + 1, 0, num_bands - 1);
+  };
+  std::vector<int> band_begin(num_bands + 1, height);
+  for (int y = height - 1; y >= 0; --y) {
+    band_begin[band_of(y)] = y;
+  }
+  for (int band = num_bands - 1; band >= 0; --band) {
+    band_begin[band] = std::min(band_begin[band], band_begin[band + 1]);
+  }
+
+  const int64_t row_size =
+      static_cast<int64_t>(grid_channels) * grid_depth * grid_width;
+  std::vector<float> partials(
+      static_cast<size_t>(num_bands) * batch_size * 2 * row_size);
+  auto partial_row = [&](int band, int b, int k) {
+    return &partials[((static_cast<size_t>(b) * num_bands + band) * 2 + k) *
+                     row_size];
+  };
+
+  const InteriorRange interior_x = SampledInterior(width, grid_width, scale_x);
+  const int64_t rows_per_band = (height + grid_height - 1) / grid_height + 1;
+  ParallelForRowsWithScratch(
+      num_bands, batch_size, rows_per_band * width * grid_channels * 8,
+      [&] { return SplatScratch(width, grid_channels); },
+      [&](int band, int b, SplatScratch& scratch) {
+        float* rows[2] = {partial_row(band, b, 0), partial_row(band, b, 1)};
+        std::fill(rows[0], rows[0] + 2 * row_size, 0.0f);
+        DepthRow& row = scratch.row;
+        const LerpTable& zs = row.zs;
+        std::vector<float>& pixel = scratch.pixel;
+        for (int y = band_begin[band]; y < band_begin[band + 1]; ++y) {
+          for (int x = 0; x < width; ++x) {
+            row.gzf[x] = guide(x, y, b) * grid_depth;
+          }
+          SmoothedLerpWeights(row.gzf.data(), &row.zs, approximate);
+          const float wy[2] = {ys.weight0[y], ys.weight1[y]};
+          ForEachInRow(width, interior_x, true, [&](auto policy, int x) {
+            using Policy = decltype(policy);
+            const float wx[2] = {xs.weight0[x], xs.weight1[x]};
+            const float wz[2] = {zs.weight0[x], zs.weight1[x]};
+            for (int c = 0; c < channels; ++c) {
+              pixel[c] = image(c, x, y, b);
+            }
+            for (int kx = 0; kx < 2; ++kx) {
+              const int gx = Policy::GridIndex(xs.cell0[x] + kx, grid_width);
+              for (int kz = 0; kz < 2; ++kz) {
+                const int gz = std::clamp(zs.cell0[x] + kz, 0, grid_depth - 1);
+                const int64_t offset =
+                    (static_cast<int64_t>(gx) * grid_depth + gz) *
+                    grid_channels;
+                const float w0 = wx[kx] * wy[0] * wz[kz];
+                const float w1 = wx[kx] * wy[1] * wz[kz];
+                float* cell0 = rows[0] + offset;
+                float* cell1 = rows[1] + offset;
+                for (int c = 0; c < grid_channels; ++c) {
+                  cell0[c] += w0 * pixel[c];
+                  cell1[c] += w1 * pixel[c];
+                }
+              }
+            }
+          });
+        }
+      });
+
+  ParallelForRows(
+      grid_height, batch_size, row_size * 2, [&](int gy, int b) {
+        // The (at most four) partial rows adding to grid row gy, in order.
+        const float* sources[4];
+        int num_sources = 0;
+        for (int band = std::max(gy - 1, 0);
+             band <= std::min(gy + 2, num_bands - 1); ++band) {
+          for (int k = 0; k < 2; ++k) {
+            if (std::clamp(band - 1 + k, 0, grid_height - 1) == gy) {
+              sources[num_sources++] = partial_row(band, b, k);
+            }
+          }
+        }
+        for (int gx = 0; gx < grid_width; ++gx) {
+          for (int gz = 0; gz < grid_depth; ++gz) {
+            const int64_t offset =
+                (static_cast<int64_t>(gx) * grid_depth + gz) * grid_channels;
+            for (int c = 0; c < grid_channels; ++c) {
+              float value = 0.0f;
+              for (int s = 0; s < num_sources; ++s) {
+                value += sources[s][offset + c];
+              }
+              grid_out(c, gz, gx, gy, b) = value;
+            }
+          }
+        }
+      });
+}
+
+void BilateralGridBlur(nda::array_ref_of_rank<const float, 5> grid,
+                       int iterations,
+                       nda::array_ref_of_rank<float, 5> grid_out) {
+  const int grid_channels = grid.dim<0>().extent();
+  const int grid_depth = grid.dim<1>().extent();
+  const int grid_width = grid.dim<2>().extent();
+  const int grid_height = grid.dim<3>().extent();
+  const int batch_size = grid.dim<4>().extent();
+  const int64_t row_size =
+      static_cast<int64_t>(grid_channels) * grid_depth * grid_width;
+
+  if (iterations <= 0) {
+    ParallelForRows(grid_height, batch_size, row_size, [&](int gy, int b) {
+      for (int gx = 0; gx < grid_width; ++gx) {
+        for (int gz = 0; gz < grid_depth; ++gz) {
+          for (int c = 0; c < grid_channels; ++c) {
+            grid_out(c, gz, gx, gy, b) = grid(c, gz, gx, gy, b);
+          }
+        }
+      }
+    });
+    return;
+  }
+
+  // Each iteration blurs the rows along x and depth into `blurred_xz`, then
+  // blurs it along y into `grid_out`, which the next iteration reads from.
+  std::vector<float> blurred_xz(static_cast<size_t>(row_size) * grid_height *
+                                batch_size);
+  auto blurred_row = [&](int gy, int b) {
+    return &blurred_xz[(static_cast<size_t>(b) * grid_height + gy) * row_size];
+  };
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    nda::array_ref_of_rank<const float, 5> src = grid;
+    if (iteration > 0) {
+      src = grid_out;
+    }
+    ParallelForRowsWithScratch(
+        grid_height, batch_size, row_size * 6,
+        [&] { return std::vector<float>(grid_depth); },
+        [&](int gy, int b, std::vector<float>& blurred_x) {
+          float* row = blurred_row(gy, b);
+          for (int gx = 0; gx < grid_width; ++gx) {
+            for (int c = 0; c < grid_channels; ++c) {
+              for (int gz = 0; gz < grid_depth; ++gz) {
+                blurred_x[gz] =
+                    Blur3([&](int i) { return src(c, gz, i, gy, b); }, gx,
+                          grid_width);
+              }
+              for (int gz = 0; gz < grid_depth; ++gz) {
+                row[(static_cast<int64_t>(gx) * grid_depth + gz) *
+                        grid_channels +
+                    c] = Blur3([&](int i) { return blurred_x[i]; }, gz,
+                               grid_depth);
+              }
+            }
+          }
+        });
+    ParallelForRows(grid_height, batch_size, row_size * 3, [&](int gy, int b) {
+      const float* rows[3] = {blurred_row(std::max(gy - 1, 0), b),
+                              blurred_row(gy, b),
+                              blurred_row(std::min(gy + 1, grid_height - 1), b)};
+      for (int gx = 0; gx < grid_width; ++gx) {
+        for (int gz = 0; gz < grid_depth; ++gz) {
+          const int64_t offset =
+              (static_cast<int64_t>(gx) * grid_depth + gz) * grid_channels;
+          for (int c = 0; c < grid_channels; ++c) {
+            grid_out(c, gz, gx, gy, b) =
+                0.25f * (rows[0][offset + c] + 2.0f * rows[1][offset + c] +
+                         rows[2][offset + c]);
+          }
+        }
+      }
+    });
+  }
+}
+
+}  // namespace hdrnet
@@ -0,0 +1,55 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_BILATERAL_GRID_H_
+#define HDRNET_OPS_BILATERAL_GRID_H_
+
+#include "third_party/array/array.h"
+
+namespace hdrnet {
+
+// The other half of a classic bilateral grid pipeline, to filter images with
+// grids built from the images themselves rather than predicted by a network:
+// splat an image into a grid, blur the grid, then BilateralSlice it.
+
+// `BilateralSplat` accumulates `image`, an array with shape
+// (channels, width, height, batch_size), into `grid_out`, an array with shape
+// (grid_channels, grid_depth, grid_width, grid_height, batch_size), at the
+// positions given by `guide`, with shape (width, height, batch_size).
+//
+// It is the transpose of BilateralSlice: each pixel adds its value to the grid
+// cells that BilateralSlice would interpolate at (x, y), with the same
+// trilinear weights and clamping, so that the coordinates match. If
+// grid_channels == channels + 1, the last channel accumulates the weights
+// themselves (homogeneous coordinates): dividing the sliced channels by the
+// sliced weight normalizes the result.
+//
+// Each task accumulates the pixel rows between two grid rows into a private
+// pair of grid rows, which are summed in a fixed order, so the result does not
+// depend on the number of threads.
+void BilateralSplat(nda::array_ref_of_rank<const float, 4> image,
+                    nda::array_ref_of_rank<const float, 3> guide,
+                    nda::array_ref_of_rank<float, 5> grid_out);
+
+// Blurs each channel of `grid` with the kernel [1, 2, 1] / 4 along its depth,
+// width and height, `iterations` times, clamping at the boundaries. The blur
+// is self-adjoint, and so is its own gradient. `grid` and `grid_out` have
+// shape (grid_channels, grid_depth, grid_width, grid_height, batch_size).
+void BilateralGridBlur(nda::array_ref_of_rank<const float, 5> grid,
+                       int iterations,
+                       nda::array_ref_of_rank<float, 5> grid_out);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_BILATERAL_GRID_H_
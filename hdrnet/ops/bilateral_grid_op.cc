@@ -0,0 +1,200 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+
+#include "bilateral_grid.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::DimensionHandle;
+using ::tensorflow::shape_inference::InferenceContext;
+using ::tensorflow::shape_inference::ShapeHandle;
+
+namespace hdrnet {
+
+class BilateralSplatOp : public OpKernel {
+ public:
+  explicit BilateralSplatOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("grid_height", &grid_height_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_width", &grid_width_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_depth", &grid_depth_));
+    OP_REQUIRES_OK(context, context->GetAttr("homogeneous", &homogeneous_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& image = context->input(0);
+    const Tensor& guide = context->input(1);
+
+    OP_REQUIRES(
+        context, image.dims() == 4,
+        tensorflow::errors::InvalidArgument(
+            "Input image should be 4D (batch_size, height, width, channels)"));
+    OP_REQUIRES(
+        context, guide.dims() == 3,
+        tensorflow::errors::InvalidArgument(
+            "Input guide should be 3D (batch_size, height, width)"));
+
+    const int batch_size = image.dim_size(0);
+    const int height = image.dim_size(1);
+    const int width = image.dim_size(2);
+    const int channels = image.dim_size(3);
+    OP_REQUIRES(context,
+                guide.dim_size(0) == batch_size &&
+                    guide.dim_size(1) == height && guide.dim_size(2) == width,
+                tensorflow::errors::InvalidArgument(
+                    "Image and guide should have the same batch size, height "
+                    "and width"));
+    OP_REQUIRES(context, height > 0 && width > 0,
+                tensorflow::errors::InvalidArgument(
+                    "Image height and width should be positive"));
+    const int grid_channels = channels + (homogeneous_ ? 1 : 0);
+
+    Tensor* grid = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0,
+                       TensorShape({batch_size, grid_height_, grid_width_,
+                                    grid_depth_, grid_channels}),
+                       &grid));
+
+    auto image_ref = nda::make_array_ref(
+        image.flat<float>().data(),
+        nda::shape_of_rank<4>(channels, width, height, batch_size));
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(width, height, batch_size));
+    auto grid_ref = nda::make_array_ref(
+        grid->flat<float>().data(),
+        nda::shape_of_rank<5>(grid_channels, grid_depth_, grid_width_,
+                              grid_height_, batch_size));
+    BilateralSplat(image_ref, guide_ref, grid_ref);
+  }
+
+ private:
+  int grid_height_;
+  int grid_width_;
+  int grid_depth_;
+  bool homogeneous_;
+};
+
+class BilateralGridBlurOp : public OpKernel {
+ public:
+  explicit BilateralGridBlurOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("iterations", &iterations_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& grid = context->input(0);
+
+    OP_REQUIRES(context, grid.dims() == 5,
+                tensorflow::errors::InvalidArgument(
+                    "Input grid should be 5D (batch_size, height, width, "
+                    "depth, channels)"));
+
+    const int batch_size = grid.dim_size(0);
+    const int grid_height = grid.dim_size(1);
+    const int grid_width = grid.dim_size(2);
+    const int grid_depth = grid.dim_size(3);
+    const int grid_channels = grid.dim_size(4);
+
+    Tensor* out = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(0, grid.shape(), &out));
+    if (grid.NumElements() == 0) {
+      return;
+    }
+
+    const auto shape =
+        nda::shape_of_rank<5>(grid_channels, grid_depth, grid_width,
+                              grid_height, batch_size);
+    auto grid_ref = nda::make_array_ref(grid.flat<float>().data(), shape);
+    auto out_ref = nda::make_array_ref(out->flat<float>().data(), shape);
+    BilateralGridBlur(grid_ref, iterations_, out_ref);
+  }
+
+ private:
+  int iterations_;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(Name("BilateralSplat").Device(tensorflow::DEVICE_CPU),
+                        hdrnet::BilateralSplatOp);
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralGridBlur").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralGridBlurOp);
+
+REGISTER_OP("BilateralSplat")
+    .Input("image: float")
+    .Input("guide: float")
+    .Attr("grid_height: int >= 1")
+    .Attr("grid_width: int >= 1")
+    .Attr("grid_depth: int >= 1")
+    .Attr("homogeneous: bool = true")
+    .Output("grid: float")
+    .Doc(
+        "Accumulates image into a grid of (grid_height, grid_width, "
+        "grid_depth) cells at the locations defined by guide, the transpose "
+        "of BilateralSlice. If homogeneous, the grid has one more channel "
+        "accumulating the weights.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle image;
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 4, &image));
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 3, &guide));
+      int grid_height;
+      int grid_width;
+      int grid_depth;
+      bool homogeneous;
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_height", &grid_height));
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_width", &grid_width));
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_depth", &grid_depth));
+      TF_RETURN_IF_ERROR(c->GetAttr("homogeneous", &homogeneous));
+
+      DimensionHandle batch_size;
+      TF_RETURN_IF_ERROR(
+          c->Merge(c->Dim(image, 0), c->Dim(guide, 0), &batch_size));
+      DimensionHandle grid_channels;
+      TF_RETURN_IF_ERROR(
+          c->Add(c->Dim(image, 3), homogeneous ? 1 : 0, &grid_channels));
+      c->set_output(0, c->MakeShape({batch_size, grid_height, grid_width,
+                                     grid_depth, grid_channels}));
+      return Status::OK();
+    });
+
+REGISTER_OP("BilateralGridBlur")
+    .Input("grid: float")
+    .Attr("iterations: int >= 0 = 1")
+    .Output("out: float")
+    .Doc(
+        "Blurs each channel of grid with [1, 2, 1] / 4 along its height, "
+        "width and depth, iterations times.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &grid));
+      c->set_output(0, grid);
+      return Status::OK();
+    });
@@ -16,15 +16,21 @@
 
 #include <algorithm>
 #include <cmath>
+#include <string>
+#include <vector>
 
+#include "autotune.h"
+#include "boundary.h"
 #include "numerics.h"
 #include "third_party/array/array.h"
+#include "worker_pool.h"
 
 namespace hdrnet {
 
 void BilateralSlice(nda::array_ref_of_rank<const float, 5> grid,
                     nda::array_ref_of_rank<const float, 3> guide,
-                    nda::array_ref_of_rank<float, 4> out) {
+                    nda::array_ref_of_rank<float, 4> out,
+                    const Schedule& schedule) {
   // - Samples centered at 0.5f.
   // - Repeating boundary conditions.
   const int grid_depth = grid.dim<1>().extent();
@@ -33,40 +39,87 @@ void BilateralSlice(nda::array_ref_of_rank<const float, 5> grid,
   const float scale_x = static_cast<float>(grid_width) / guide.width();
   const float scale_y = static_cast<float>(grid_height) / guide.height();
 
-  nda::for_all_indices(out.shape(), [&](int c, int x, int y, int b) {
-    const float gxf = (x + 0.5f) * scale_x;
-    const float gyf = (y + 0.5f) * scale_y;
-    // Because 0.5f applied afterwards in calculating gz0 and wz, the effective
-    // depth index is:
-    //    guide * grid_depth + 0.5f
-    const float gzf = guide(x, y, b) * grid_depth;
-
-    const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
-    const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
-    const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
-
-    // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
-    float value = 0.0f;
-    for (int gy = gy0; gy < gy0 + 2; ++gy) {
-      const int gyc = std::clamp(gy, 0, grid_height - 1);
-      const float wy = LerpWeight(gy + 0.5f, gyf);
+  const int grid_channels = out.dim<0>().extent();
+  const int width = out.dim<1>().extent();
+  const int height = out.dim<2>().extent();
+  const int batch_size = out.dim<3>().extent();
 
-      for (int gx = gx0; gx < gx0 + 2; ++gx) {
-        const int gxc = std::clamp(gx, 0, grid_width - 1);
-        const float wx = LerpWeight(gx + 0.5f, gxf);
+  // The x and y cells and weights are the same for every row and column, and
+  // the depth ones are computed a row at a time.
+  LerpTable xs(width);
+  LerpTable ys(height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
+  const bool approximate = ApproximateNumerics();
 
-        for (int gz = gz0; gz < gz0 + 2; ++gz) {
-          const int gzc = std::clamp(gz, 0, grid_depth - 1);
-          const float wz = SmoothedLerpWeight(gz + 0.5f, gzf);
+  auto sample = [&](auto policy, int x, int y, int b, const LerpTable& zs) {
+    using Policy = decltype(policy);
+    const float wx[2] = {xs.weight0[x], xs.weight1[x]};
+    const float wy[2] = {ys.weight0[y], ys.weight1[y]};
+    const float wz[2] = {zs.weight0[x], zs.weight1[x]};
+    int gxc[2];
+    int gyc[2];
+    int gzc[2];
+    for (int k = 0; k < 2; ++k) {
+      gxc[k] = Policy::GridIndex(xs.cell0[x] + k, grid_width);
+      gyc[k] = Policy::GridIndex(ys.cell0[y] + k, grid_height);
+      gzc[k] = std::clamp(zs.cell0[x] + k, 0, grid_depth - 1);
+    }
 
-          value += wx * wy * wz * grid(c, gzc, gxc, gyc, b);
+    for (int c = 0; c < grid_channels; ++c) {
+      // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
+      float value = 0.0f;
+      for (int ky = 0; ky < 2; ++ky) {
+        for (int kx = 0; kx < 2; ++kx) {
+          for (int kz = 0; kz < 2; ++kz) {
+            value += wx[kx] * wy[ky] * wz[kz] *
+                     grid(c, gzc[kz], gxc[kx], gyc[ky], b);
+          }
         }
       }
+      // Grid trilinear interpolation.
+
+      out(c, x, y, b) = value;
     }
-    // Grid trilinear interpolation.
+  };
+  const InteriorRange interior_x = SampledInterior(width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(height, grid_height, scale_y);
+  ParallelForRowsWithScratch(
+      height, batch_size, width * grid_channels,
+      [&] { return DepthRow(width); },
+      [&](int y, int b, DepthRow& row) {
+        for (int x = 0; x < width; ++x) {
+          // Because 0.5f applied afterwards in calculating gz0 and wz, the
+          // effective depth index is:
+          //    guide * grid_depth + 0.5f
+          row.gzf[x] = guide(x, y, b) * grid_depth;
+        }
+        SmoothedLerpWeights(row.gzf.data(), &row.zs, approximate);
+        ForEachInRow(width, interior_x, interior_y.Contains(y),
+                     [&](auto policy, int x) {
+                       sample(policy, x, y, b, row.zs);
+                     });
+      },
+      schedule);
+}
 
-    out(c, x, y, b) = value;
-  });
+void TunedBilateralSlice(nda::array_ref_of_rank<const float, 5> grid,
+                         nda::array_ref_of_rank<const float, 3> guide,
+                         nda::array_ref_of_rank<float, 4> out) {
+  const std::string key = TuningKey(
+      "BilateralSlice",
+      {out.dim<3>().extent(), out.dim<2>().extent(), out.dim<1>().extent(),
+       grid.dim<3>().extent(), grid.dim<2>().extent(), grid.dim<1>().extent(),
+       grid.dim<0>().extent()});
+  const int64_t rows =
+      static_cast<int64_t>(out.dim<2>().extent()) * out.dim<3>().extent();
+  const Schedule schedule = AutoTuner::Get().Select(
+      key, rows,
+      [&](const Schedule& candidate) {
+        BilateralSlice(grid, guide, out, candidate);
+      });
+  BilateralSlice(grid, guide, out, schedule);
 }
 
 void BilateralSliceGridGrad(
@@ -81,8 +134,11 @@ void BilateralSliceGridGrad(
   const float scale_x = static_cast<float>(guide.width()) / grid_width;
   const float scale_y = static_cast<float>(guide.height()) / grid_height;
 
-  nda::for_all_indices(grid_vjp_out.shape(), [&](int gc, int gz, int gx, int gy,
-                                                 int b) {
+  const int grid_channels = grid_vjp_out.dim<0>().extent();
+  const int batch_size = grid_vjp_out.dim<4>().extent();
+
+  auto accumulate = [&](auto policy, int gc, int gz, int gx, int gy, int b) {
+    using Policy = decltype(policy);
     const int x0 = static_cast<int>(std::floor(scale_x * (gx + 0.5f - 1.0f)));
     const int x1_exclusive =
         static_cast<int>(std::ceil(scale_x * (gx + 0.5f + 1.0f)));
@@ -92,13 +148,13 @@ void BilateralSliceGridGrad(
 
     float vjp_value = 0.0f;
     for (int y = y0; y < y1_exclusive; ++y) {
-      const int y_mirror = MirrorBoundary(y, guide_height);
+      const int y_mirror = Policy::ImageIndex(y, guide_height);
       const float gyf = (y + 0.5f) / scale_y;
       const float wy = LerpWeight(gy + 0.5f, gyf);
 
       for (int x = x0; x < x1_exclusive; ++x) {
         // TODO(jiawen): Consider using clamp boundary.
-        const int x_mirror = MirrorBoundary(x, guide_width);
+        const int x_mirror = Policy::ImageIndex(x, guide_width);
         const float gxf = (x + 0.5f) / scale_x;
         const float wx = LerpWeight(gx + 0.5f, gxf);
 
@@ -114,7 +170,28 @@ void BilateralSliceGridGrad(
     }    // x
 
     grid_vjp_out(gc, gz, gx, gy, b) = vjp_value;
-  });
+  };
+  // Each grid cell gathers from about 2 x 2 of its footprints.
+  const int64_t pixels_per_cell =
+      static_cast<int64_t>(4 * scale_x * scale_y) + 1;
+  const InteriorRange interior_x =
+      GatheredInterior(grid_width, guide_width, scale_x);
+  const InteriorRange interior_y =
+      GatheredInterior(grid_height, guide_height, scale_y);
+  ParallelForRows(grid_height, batch_size,
+                  grid_width * grid_depth * grid_channels * pixels_per_cell,
+                  [&](int gy, int b) {
+                    ForEachInRow(grid_width, interior_x,
+                                 interior_y.Contains(gy),
+                                 [&](auto policy, int gx) {
+                                   for (int gz = 0; gz < grid_depth; ++gz) {
+                                     for (int gc = 0; gc < grid_channels;
+                                          ++gc) {
+                                       accumulate(policy, gc, gz, gx, gy, b);
+                                     }
+                                   }
+                                 });
+                  });
 }
 
 void BilateralSliceGuideGrad(
@@ -129,34 +206,42 @@ void BilateralSliceGuideGrad(
   const float scale_x = static_cast<float>(grid_width) / guide.width();
   const float scale_y = static_cast<float>(grid_height) / guide.height();
 
-  nda::for_all_indices(guide_vjp_out.shape(), [&](int x, int y, int b) {
-    const float gxf = (x + 0.5f) * scale_x;
-    const float gyf = (y + 0.5f) * scale_y;
-    const float gzf = guide(x, y, b) * grid_depth;
+  const int width = guide_vjp_out.dim<0>().extent();
+  const int height = guide_vjp_out.dim<1>().extent();
+  const int batch_size = guide_vjp_out.dim<2>().extent();
+
+  LerpTable xs(width);
+  LerpTable ys(height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
 
-    const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
-    const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
-    const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+  // `dzs` holds the derivatives of the depth weights with respect to the
+  // guide.
+  auto accumulate = [&](auto policy, int x, int y, int b,
+                        const LerpTable& dzs) {
+    using Policy = decltype(policy);
+    const float wx[2] = {xs.weight0[x], xs.weight1[x]};
+    const float wy[2] = {ys.weight0[y], ys.weight1[y]};
+    const float dwz[2] = {dzs.weight0[x], dzs.weight1[x]};
+    int gxc[2];
+    int gyc[2];
+    int gzc[2];
+    for (int k = 0; k < 2; ++k) {
+      gxc[k] = Policy::GridIndex(xs.cell0[x] + k, grid_width);
+      gyc[k] = Policy::GridIndex(ys.cell0[y] + k, grid_height);
+      gzc[k] = std::clamp(dzs.cell0[x] + k, 0, grid_depth - 1);
+    }
 
     float vjp_value = 0.0f;
     for (int c = 0; c < grid_channels; ++c) {
       float grid_sample = 0.0f;
 
       // Grid trilinear interpolation to retrieve grid(c, gzf, gxf, gyf, gzf).
-      for (int gy = gy0; gy < gy0 + 2; ++gy) {
-        const int gyc = std::clamp(gy, 0, grid_height - 1);
-        const float wy = LerpWeight(gy + 0.5f, gyf);
-
-        for (int gx = gx0; gx < gx0 + 2; ++gx) {
-          const int gxc = std::clamp(gx, 0, grid_width - 1);
-          const float wx = LerpWeight(gx + 0.5f, gxf);
-
-          for (int gz = gz0; gz < gz0 + 2; ++gz) {
-            const int gzc = std::clamp(gz, 0, grid_depth - 1);
-            const float dwz =
-                grid_depth * SmoothedLerpWeightGrad(gz + 0.5f, gzf);
-
-            grid_sample += wx * wy * dwz * grid(c, gzc, gxc, gyc, b);
+      for (int ky = 0; ky < 2; ++ky) {
+        for (int kx = 0; kx < 2; ++kx) {
+          for (int kz = 0; kz < 2; ++kz) {
+            grid_sample += wx[kx] * wy[ky] * dwz[kz] *
+                           grid(c, gzc[kz], gxc[kx], gyc[ky], b);
           }
         }
       }
@@ -164,7 +249,28 @@ void BilateralSliceGuideGrad(
     }  // Sum over c.
 
     guide_vjp_out(x, y, b) = vjp_value;
-  });
+  };
+  const InteriorRange interior_x = SampledInterior(width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(height, grid_height, scale_y);
+  ParallelForRowsWithScratch(
+      height, batch_size, width * grid_channels,
+      [&] { return DepthRow(width); },
+      [&](int y, int b, DepthRow& row) {
+        for (int x = 0; x < width; ++x) {
+          row.gzf[x] = guide(x, y, b) * grid_depth;
+        }
+        LerpTable& dzs = row.zs;
+        SmoothedLerpWeightGrads(row.gzf.data(), &dzs);
+        for (int x = 0; x < width; ++x) {
+          dzs.weight0[x] *= grid_depth;
+          dzs.weight1[x] *= grid_depth;
+        }
+        ForEachInRow(width, interior_x, interior_y.Contains(y),
+                     [&](auto policy, int x) {
+                       accumulate(policy, x, y, b, dzs);
+                     });
+      });
 }
 
 }  // namespace hdrnet
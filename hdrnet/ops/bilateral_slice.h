@@ -16,6 +16,7 @@
 #define HDRNET_OPS_BILATERAL_SLICE_H_
 
 #include "third_party/array/array.h"
+#include "worker_pool.h"
 
 namespace hdrnet {
 
@@ -38,9 +39,17 @@ namespace hdrnet {
 //   gy = (y + 0.5) * grid_height / height
 //   gz = guide[x, y] * grid_depth
 // We sample grid[:, gz, gx, gy, gz, b] using trilinear interpolation.
+// Rows are processed on WorkerPool::Current() according to `schedule`.
 void BilateralSlice(nda::array_ref_of_rank<const float, 5> grid,
                     nda::array_ref_of_rank<const float, 3> guide,
-                    nda::array_ref_of_rank<float, 4> out);
+                    nda::array_ref_of_rank<float, 4> out,
+                    const Schedule& schedule = Schedule());
+
+// BilateralSlice with the schedule that AutoTuner::Get() picks for these
+// shapes, see TunedBilateralSliceApply.
+void TunedBilateralSlice(nda::array_ref_of_rank<const float, 5> grid,
+                         nda::array_ref_of_rank<const float, 3> guide,
+                         nda::array_ref_of_rank<float, 4> out);
 
 // Let f(c) be BilateralSlice(grid, guide), and u(c) be the
 // codomain tangent vector. We drop the implicit indices (gz, gx, gy, b) for f
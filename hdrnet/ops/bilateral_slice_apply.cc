@@ -16,15 +16,60 @@
 
 #include <algorithm>
 #include <cmath>
+#include <string>
+#include <vector>
 
+#include "autotune.h"
+#include "boundary.h"
 #include "numerics.h"
+#include "worker_pool.h"
 
 namespace hdrnet {
 
+namespace {
+
+// The 2 x 2 x 2 grid cells a pixel samples, in the grid, with their
+// trilinear weights and the derivatives of these weights with respect to the
+// guide. Cells are numbered ((gy - gy0) * 2 + (gx - gx0)) * 2 + (gz - gz0), in
+// the order of the y, x and depth loops of the CUDA kernels, so that sums come
+// out the same.
+struct Footprint {
+  int gxc[2];
+  int gyc[2];
+  int gzc[2];
+  float weight[8];
+  float weight_grad[8];
+};
+
+// The footprint of pixel (x, y) from the kernels' x, y and depth tables, with
+// the depth weights of `zs` in `weight`. `weight_grad` is not set.
+template <typename Policy>
+inline Footprint TableFootprint(Policy, int x, int y, const LerpTable& xs,
+                                const LerpTable& ys, const LerpTable& zs,
+                                int grid_width, int grid_height,
+                                int grid_depth) {
+  Footprint footprint;
+  const float wx[2] = {xs.weight0[x], xs.weight1[x]};
+  const float wy[2] = {ys.weight0[y], ys.weight1[y]};
+  const float wz[2] = {zs.weight0[x], zs.weight1[x]};
+  for (int k = 0; k < 2; ++k) {
+    footprint.gxc[k] = Policy::GridIndex(xs.cell0[x] + k, grid_width);
+    footprint.gyc[k] = Policy::GridIndex(ys.cell0[y] + k, grid_height);
+    footprint.gzc[k] = std::clamp(zs.cell0[x] + k, 0, grid_depth - 1);
+  }
+  for (int cell = 0; cell < 8; ++cell) {
+    footprint.weight[cell] = wx[(cell >> 1) & 1] * wy[cell >> 2] * wz[cell & 1];
+  }
+  return footprint;
+}
+
+}  // namespace
+
 void BilateralSliceApply(nda::array_ref_of_rank<const float, 6> grid,
                          nda::array_ref_of_rank<const float, 3> guide,
                          nda::array_ref_of_rank<const float, 4> input,
-                         nda::array_ref_of_rank<float, 4> out) {
+                         nda::array_ref_of_rank<float, 4> out,
+                         const Schedule& schedule) {
   // - Samples centered at 0.5.
   // - Repeating boundary conditions.
   const int grid_input_channels = grid.dim<0>().extent();
@@ -37,48 +82,85 @@ void BilateralSliceApply(nda::array_ref_of_rank<const float, 6> grid,
   const float scale_x = static_cast<float>(grid_width) / input_width;
   const float scale_y = static_cast<float>(grid_height) / input_height;
 
-  nda::for_all_indices(out.shape(), [&](int i, int x, int y, int b) {
-    const float gxf = (x + 0.5f) * scale_x;
-    const float gyf = (y + 0.5f) * scale_y;
-    // TODO(jiawen): Offset gz by 0.5 as well.
-    const float gzf = guide(x, y, b) * grid_depth;
-
-    const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
-    const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
-    const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
-
-    float value = 0.0f;
-    for (int j = 0; j < grid_input_channels; ++j) {
-      // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
-      float grid_sample = 0.0f;
-      for (int gy = gy0; gy < gy0 + 2; ++gy) {
-        const int gyc = std::clamp(gy, 0, grid_height - 1);
-        const float wy = LerpWeight(gy + 0.5f, gyf);
-
-        for (int gx = gx0; gx < gx0 + 2; ++gx) {
-          const int gxc = std::clamp(gx, 0, grid_width - 1);
-          const float wx = LerpWeight(gx + 0.5f, gxf);
-
-          for (int gz = gz0; gz < gz0 + 2; ++gz) {
-            const int gzc = std::clamp(gz, 0, grid_depth - 1);
-            const float wz = SmoothedLerpWeight(gz + 0.5f, gzf);
-
-            grid_sample += wx * wy * wz * grid(j, i, gzc, gxc, gyc, b);
-          }  // gz
-        }    // gy
-      }      // gx
-      // Grid trilinear interpolation.
-
-      // Matrix multiply.
-      if (j < input_channels) {
-        value += grid_sample * input(j, x, y, b);
-      } else {  // Offset term
-        value += grid_sample;
-      }
-    }  // j
+  const int output_channels = out.dim<0>().extent();
+  const int batch_size = out.dim<3>().extent();
 
-    out(i, x, y, b) = value;
-  });
+  // The x and y cells and weights are the same for every row and column, and
+  // the depth ones are computed a row at a time.
+  LerpTable xs(input_width);
+  LerpTable ys(input_height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
+  const bool approximate = ApproximateNumerics();
+
+  auto sample = [&](auto policy, int x, int y, int b, const LerpTable& zs) {
+    const Footprint fp = TableFootprint(policy, x, y, xs, ys, zs, grid_width,
+                                        grid_height, grid_depth);
+    for (int i = 0; i < output_channels; ++i) {
+      float value = 0.0f;
+      for (int j = 0; j < grid_input_channels; ++j) {
+        // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
+        float grid_sample = 0.0f;
+        for (int cell = 0; cell < 8; ++cell) {
+          grid_sample += fp.weight[cell] * grid(j, i, fp.gzc[cell & 1],
+                                                fp.gxc[(cell >> 1) & 1],
+                                                fp.gyc[cell >> 2], b);
+        }
+
+        // Matrix multiply.
+        if (j < input_channels) {
+          value += grid_sample * input(j, x, y, b);
+        } else {  // Offset term
+          value += grid_sample;
+        }
+      }  // j
+
+      out(i, x, y, b) = value;
+    }  // i
+  };
+  const InteriorRange interior_x =
+      SampledInterior(input_width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(input_height, grid_height, scale_y);
+  ParallelForRowsWithScratch(
+      input_height, batch_size,
+      input_width * output_channels * grid_input_channels,
+      [&] { return DepthRow(input_width); },
+      [&](int y, int b, DepthRow& row) {
+        for (int x = 0; x < input_width; ++x) {
+          // TODO(jiawen): Offset gz by 0.5 as well.
+          row.gzf[x] = guide(x, y, b) * grid_depth;
+        }
+        SmoothedLerpWeights(row.gzf.data(), &row.zs, approximate);
+        ForEachInRow(input_width, interior_x, interior_y.Contains(y),
+                     [&](auto policy, int x) {
+                       sample(policy, x, y, b, row.zs);
+                     });
+      },
+      schedule);
+}
+
+void TunedBilateralSliceApply(nda::array_ref_of_rank<const float, 6> grid,
+                              nda::array_ref_of_rank<const float, 3> guide,
+                              nda::array_ref_of_rank<const float, 4> input,
+                              nda::array_ref_of_rank<float, 4> out,
+                              LatencyMode mode) {
+  const std::string key = TuningKey(
+      "BilateralSliceApply",
+      {out.dim<3>().extent(), out.dim<2>().extent(), out.dim<1>().extent(),
+       grid.dim<4>().extent(), grid.dim<3>().extent(), grid.dim<2>().extent(),
+       grid.dim<1>().extent() * grid.dim<0>().extent(),
+       input.dim<0>().extent()});
+  const int64_t rows =
+      static_cast<int64_t>(out.dim<2>().extent()) * out.dim<3>().extent();
+  auto run = [&](const Schedule& candidate) {
+    Schedule schedule = candidate;
+    schedule.mode = mode;
+    BilateralSliceApply(grid, guide, input, out, schedule);
+  };
+  Schedule schedule = AutoTuner::Get().Select(key, rows, run);
+  schedule.mode = mode;
+  BilateralSliceApply(grid, guide, input, out, schedule);
 }
 
 void BilateralSliceApplyGridGrad(
@@ -95,8 +177,13 @@ void BilateralSliceApplyGridGrad(
   const float scale_x = static_cast<float>(input_width) / grid_width;
   const float scale_y = static_cast<float>(input_height) / grid_height;
 
-  nda::for_all_indices(vjp_out.shape(), [&](int j, int i, int gz, int gx,
-                                            int gy, int b) {
+  const int grid_input_channels = vjp_out.dim<0>().extent();
+  const int output_channels = vjp_out.dim<1>().extent();
+  const int batch_size = vjp_out.dim<5>().extent();
+
+  auto accumulate = [&](auto policy, int j, int i, int gz, int gx, int gy,
+                        int b) {
+    using Policy = decltype(policy);
     const int x0 = static_cast<int>(std::floor(scale_x * (gx + 0.5f - 1.0f)));
     const int x1_exclusive =
         static_cast<int>(std::ceil(scale_x * (gx + 0.5f + 1.0f)));
@@ -106,13 +193,13 @@ void BilateralSliceApplyGridGrad(
 
     float vjp_value = 0.0f;
     for (int y = y0; y < y1_exclusive; ++y) {
-      const int y_mirror = MirrorBoundary(y, input_height);
+      const int y_mirror = Policy::ImageIndex(y, input_height);
       const float gyf = (y + 0.5f) / scale_y;
       const float wy = LerpWeight(gy + 0.5f, gyf);
 
       for (int x = x0; x < x1_exclusive; ++x) {
         // TODO(jiawen): Consider using clamp boundary.
-        const int x_mirror = MirrorBoundary(x, input_width);
+        const int x_mirror = Policy::ImageIndex(x, input_width);
         const float gxf = (x + 0.5f) / scale_x;
         const float wx = LerpWeight(gx + 0.5f, gxf);
 
@@ -134,7 +221,31 @@ void BilateralSliceApplyGridGrad(
     }    // x
 
     vjp_out(j, i, gz, gx, gy, b) = vjp_value;
-  });
+  };
+  // Each grid cell gathers from about 2 x 2 of its footprints.
+  const int64_t pixels_per_cell =
+      static_cast<int64_t>(4 * scale_x * scale_y) + 1;
+  const InteriorRange interior_x =
+      GatheredInterior(grid_width, input_width, scale_x);
+  const InteriorRange interior_y =
+      GatheredInterior(grid_height, input_height, scale_y);
+  ParallelForRows(
+      grid_height, batch_size,
+      grid_width * grid_depth * output_channels * grid_input_channels *
+          pixels_per_cell,
+      [&](int gy, int b) {
+        ForEachInRow(
+            grid_width, interior_x, interior_y.Contains(gy),
+            [&](auto policy, int gx) {
+              for (int gz = 0; gz < grid_depth; ++gz) {
+                for (int i = 0; i < output_channels; ++i) {
+                  for (int j = 0; j < grid_input_channels; ++j) {
+                    accumulate(policy, j, i, gz, gx, gy, b);
+                  }
+                }
+              }
+            });
+      });
 }
 
 void BilateralSliceApplyGuideGrad(
@@ -154,43 +265,32 @@ void BilateralSliceApplyGuideGrad(
   const float scale_x = static_cast<float>(grid_width) / input_width;
   const float scale_y = static_cast<float>(grid_height) / input_height;
 
-  nda::for_all_indices(vjp_out.shape(), [&](int x, int y, int b) {
-    const float gxf = (x + 0.5f) * scale_x;
-    const float gyf = (y + 0.5f) * scale_y;
-    // TODO(jiawen): Offset gz by 0.5 as well.
-    const float gzf = guide(x, y, b) * grid_depth;
+  const int batch_size = vjp_out.dim<2>().extent();
 
-    const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
-    const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
-    const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+  LerpTable xs(input_width);
+  LerpTable ys(input_height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
+
+  // `dzs` holds the derivatives of the depth weights with respect to the
+  // guide.
+  auto accumulate = [&](auto policy, int x, int y, int b,
+                        const LerpTable& dzs) {
+    const Footprint fp = TableFootprint(policy, x, y, xs, ys, dzs, grid_width,
+                                        grid_height, grid_depth);
 
     float vjp_value = 0.0f;
     for (int i = 0; i < output_channels; ++i) {
       float grad_value = 0.0f;
 
       for (int j = 0; j < grid_input_channels; ++j) {
-        float grid_sample = 0.0f;
-
         // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
-        for (int gy = gy0; gy < gy0 + 2; ++gy) {
-          const int gyc = std::clamp(gy, 0, grid_height - 1);
-          const float wy = LerpWeight(gy + 0.5f, gyf);
-
-          for (int gx = gx0; gx < gx0 + 2; ++gx) {
-            const int gxc = std::clamp(gx, 0, grid_width - 1);
-            const float wx = LerpWeight(gx + 0.5f, gxf);
-
-            for (int gz = gz0; gz < gz0 + 2; ++gz) {
-              const int gzc = std::clamp(gz, 0, grid_depth - 1);
-              // TODO(jiawen): Offset gz by 0.5 as well?
-              const float dwz =
-                  grid_depth * SmoothedLerpWeightGrad(gz + 0.5f, gzf);
-
-              grid_sample += wx * wy * dwz * grid(j, i, gzc, gxc, gyc, b);
-            }  // gz
-          }    // gy
-        }      // gx
-        // Grid trilinear interpolation.
+        float grid_sample = 0.0f;
+        for (int cell = 0; cell < 8; ++cell) {
+          grid_sample += fp.weight[cell] * grid(j, i, fp.gzc[cell & 1],
+                                                fp.gxc[(cell >> 1) & 1],
+                                                fp.gyc[cell >> 2], b);
+        }
 
         // Index `input` accounting for optional offset.
         const float input_value =
@@ -202,7 +302,31 @@ void BilateralSliceApplyGuideGrad(
     }  // Sum over i.
 
     vjp_out(x, y, b) = vjp_value;
-  });
+  };
+  const InteriorRange interior_x =
+      SampledInterior(input_width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(input_height, grid_height, scale_y);
+  ParallelForRowsWithScratch(
+      input_height, batch_size,
+      input_width * output_channels * grid_input_channels,
+      [&] { return DepthRow(input_width); },
+      [&](int y, int b, DepthRow& row) {
+        for (int x = 0; x < input_width; ++x) {
+          // TODO(jiawen): Offset gz by 0.5 as well.
+          row.gzf[x] = guide(x, y, b) * grid_depth;
+        }
+        LerpTable& dzs = row.zs;
+        SmoothedLerpWeightGrads(row.gzf.data(), &dzs);
+        for (int x = 0; x < input_width; ++x) {
+          dzs.weight0[x] *= grid_depth;
+          dzs.weight1[x] *= grid_depth;
+        }
+        ForEachInRow(input_width, interior_x, interior_y.Contains(y),
+                     [&](auto policy, int x) {
+                       accumulate(policy, x, y, b, dzs);
+                     });
+      });
 }
 
 void BilateralSliceApplyInputGrad(
@@ -219,43 +343,339 @@ void BilateralSliceApplyInputGrad(
   const float scale_x = static_cast<float>(grid_width) / guide_width;
   const float scale_y = static_cast<float>(grid_height) / guide_height;
 
-  nda::for_all_indices(vjp_out.shape(), [&](int j, int x, int y, int b) {
-    const float gxf = (x + 0.5f) * scale_x;
-    const float gyf = (y + 0.5f) * scale_y;
-    // TODO(jiawen): Offset gz by 0.5 as well.
-    const float gzf = guide(x, y, b) * grid_depth;
+  const int input_channels = vjp_out.dim<0>().extent();
+  const int batch_size = vjp_out.dim<3>().extent();
 
-    const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
-    const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
-    const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+  LerpTable xs(guide_width);
+  LerpTable ys(guide_height);
+  PixelLerpWeights(scale_x, &xs);
+  PixelLerpWeights(scale_y, &ys);
 
-    float vjp_value = 0.0f;
-    for (int i = 0; i < output_channels; ++i) {
-      float grad_value = 0.0f;
-      // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
-      for (int gy = gy0; gy < gy0 + 2; ++gy) {
-        const int gyc = std::clamp(gy, 0, grid_height - 1);
-        const float wy = LerpWeight(gy + 0.5f, gyf);
+  auto accumulate = [&](auto policy, int x, int y, int b, const LerpTable& zs) {
+    const Footprint fp = TableFootprint(policy, x, y, xs, ys, zs, grid_width,
+                                        grid_height, grid_depth);
 
-        for (int gx = gx0; gx < gx0 + 2; ++gx) {
-          const int gxc = std::clamp(gx, 0, grid_width - 1);
-          const float wx = LerpWeight(gx + 0.5f, gxf);
+    for (int j = 0; j < input_channels; ++j) {
+      float vjp_value = 0.0f;
+      for (int i = 0; i < output_channels; ++i) {
+        // Grid trilinear interpolation to retrieve grid(gxf, gyf, gzf, i, j).
+        float grad_value = 0.0f;
+        for (int cell = 0; cell < 8; ++cell) {
+          grad_value += fp.weight[cell] * grid(j, i, fp.gzc[cell & 1],
+                                               fp.gxc[(cell >> 1) & 1],
+                                               fp.gyc[cell >> 2], b);
+        }
 
-          for (int gz = gz0; gz < gz0 + 2; ++gz) {
-            const int gzc = std::clamp(gz, 0, grid_depth - 1);
-            const float wz = SmoothedLerpWeight(gz + 0.5f, gzf);
+        vjp_value += grad_value * codomain_tangent(i, x, y, b);
+      }  // Sum over i.
 
-            grad_value += wx * wy * wz * grid(j, i, gzc, gxc, gyc, b);
-          }  // gz
-        }    // gy
-      }      // gx
-      // Grid trilinear interpolation.
+      vjp_out(j, x, y, b) = vjp_value;
+    }  // j
+  };
+  const InteriorRange interior_x =
+      SampledInterior(guide_width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(guide_height, grid_height, scale_y);
+  ParallelForRowsWithScratch(
+      guide_height, batch_size, guide_width * input_channels * output_channels,
+      [&] { return DepthRow(guide_width); },
+      [&](int y, int b, DepthRow& row) {
+        for (int x = 0; x < guide_width; ++x) {
+          // TODO(jiawen): Offset gz by 0.5 as well.
+          row.gzf[x] = guide(x, y, b) * grid_depth;
+        }
+        SmoothedLerpWeights(row.gzf.data(), &row.zs);
+        ForEachInRow(guide_width, interior_x, interior_y.Contains(y),
+                     [&](auto policy, int x) {
+                       accumulate(policy, x, y, b, row.zs);
+                     });
+      });
+}
 
-      vjp_value += grad_value * codomain_tangent(i, x, y, b);
-    }  // Sum over i.
+namespace {
+
+// Fills `record` (kSliceRecordChannels values) for a pixel at depth `gzf`.
+// The weights are those of BilateralSliceApply, approximate or not (see
+// SmoothedLerpWeights), so that the gradients are those of the samples the
+// forward pass used.
+inline void FillRecord(float gzf, int grid_depth, bool approximate,
+                       float* record) {
+  const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+  record[0] = gzf;
+  for (int k = 0; k < 2; ++k) {
+    const float dz = (gz0 + k + 0.5f) - gzf;
+    const float abs_dz =
+        approximate ? ApproximateSmoothedAbs(dz) : SmoothedAbs(dz);
+    record[1 + k] = std::max(1.0f - abs_dz, 0.0f);
+    record[3 + k] =
+        grid_depth * SmoothedLerpWeightGrad(gz0 + k + 0.5f, gzf);
+  }
+}
+
+template <typename Policy>
+inline Footprint MakeFootprint(Policy, int x, int y, float scale_x,
+                               float scale_y, int grid_width, int grid_height,
+                               int grid_depth, const float* record) {
+  const float gxf = (x + 0.5f) * scale_x;
+  const float gyf = (y + 0.5f) * scale_y;
+  const float gzf = record[0];
+  const int gx0 = static_cast<int>(std::floor(gxf - 0.5f));
+  const int gy0 = static_cast<int>(std::floor(gyf - 0.5f));
+  const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+
+  Footprint footprint;
+  float wx[2];
+  float wy[2];
+  for (int k = 0; k < 2; ++k) {
+    footprint.gxc[k] = Policy::GridIndex(gx0 + k, grid_width);
+    footprint.gyc[k] = Policy::GridIndex(gy0 + k, grid_height);
+    footprint.gzc[k] = std::clamp(gz0 + k, 0, grid_depth - 1);
+    wx[k] = LerpWeight(gx0 + k + 0.5f, gxf);
+    wy[k] = LerpWeight(gy0 + k + 0.5f, gyf);
+  }
+  for (int ky = 0; ky < 2; ++ky) {
+    for (int kx = 0; kx < 2; ++kx) {
+      for (int kz = 0; kz < 2; ++kz) {
+        const int cell = (ky * 2 + kx) * 2 + kz;
+        footprint.weight[cell] = wx[kx] * wy[ky] * record[1 + kz];
+        footprint.weight_grad[cell] = wx[kx] * wy[ky] * record[3 + kz];
+      }
+    }
+  }
+  return footprint;
+}
 
-    vjp_out(j, x, y, b) = vjp_value;
-  });
+}  // namespace
+
+void BilateralSliceApplyRecord(nda::array_ref_of_rank<const float, 6> grid,
+                               nda::array_ref_of_rank<const float, 3> guide,
+                               nda::array_ref_of_rank<const float, 4> input,
+                               nda::array_ref_of_rank<float, 4> out,
+                               nda::array_ref_of_rank<float, 4> record_out) {
+  const int grid_input_channels = grid.dim<0>().extent();
+  const int grid_depth = grid.dim<2>().extent();
+  const int grid_width = grid.dim<3>().extent();
+  const int grid_height = grid.dim<4>().extent();
+  const int input_channels = input.dim<0>().extent();
+  const int input_width = input.dim<1>().extent();
+  const int input_height = input.dim<2>().extent();
+  const float scale_x = static_cast<float>(grid_width) / input_width;
+  const float scale_y = static_cast<float>(grid_height) / input_height;
+
+  const int output_channels = out.dim<0>().extent();
+  const int batch_size = out.dim<3>().extent();
+
+  const bool approximate = ApproximateNumerics();
+  const InteriorRange interior_x =
+      SampledInterior(input_width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(input_height, grid_height, scale_y);
+  ParallelForRows(
+      input_height, batch_size,
+      input_width * output_channels * grid_input_channels, [&](int y, int b) {
+        ForEachInRow(
+            input_width, interior_x, interior_y.Contains(y),
+            [&](auto policy, int x) {
+              float* record = &record_out(0, x, y, b);
+              // TODO(jiawen): Offset gz by 0.5 as well.
+              FillRecord(guide(x, y, b) * grid_depth, grid_depth, approximate,
+                         record);
+              const Footprint fp =
+                  MakeFootprint(policy, x, y, scale_x, scale_y, grid_width,
+                                grid_height, grid_depth, record);
+
+              for (int i = 0; i < output_channels; ++i) {
+                float value = 0.0f;
+                for (int j = 0; j < grid_input_channels; ++j) {
+                  float grid_sample = 0.0f;
+                  for (int cell = 0; cell < 8; ++cell) {
+                    grid_sample += fp.weight[cell] *
+                                   grid(j, i, fp.gzc[cell & 1],
+                                        fp.gxc[(cell >> 1) & 1],
+                                        fp.gyc[cell >> 2], b);
+                  }
+                  if (j < input_channels) {
+                    value += grid_sample * input(j, x, y, b);
+                  } else {  // Offset term
+                    value += grid_sample;
+                  }
+                }  // j
+                out(i, x, y, b) = value;
+              }  // i
+            });
+      });
+}
+
+void BilateralSliceApplyRecordGrad(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> record,
+    nda::array_ref_of_rank<const float, 4> input,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 3> guide_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out) {
+  const int grid_input_channels = grid.dim<0>().extent();
+  const int output_channels = grid.dim<1>().extent();
+  const int grid_depth = grid.dim<2>().extent();
+  const int grid_width = grid.dim<3>().extent();
+  const int grid_height = grid.dim<4>().extent();
+  const int input_channels = input.dim<0>().extent();
+  const int input_width = input.dim<1>().extent();
+  const int input_height = input.dim<2>().extent();
+  const int batch_size = input.dim<3>().extent();
+
+  // Grid gradient: a gather over the pixels around each cell, as
+  // BilateralSliceApplyGridGrad, but a pixel only visits the depth cells it
+  // samples instead of all of them. Each (x, y) cell accumulates its whole
+  // depth column in pixel order, so the sums are the same.
+  const float pixels_per_cell_x = static_cast<float>(input_width) / grid_width;
+  const float pixels_per_cell_y =
+      static_cast<float>(input_height) / grid_height;
+  const int column_size = grid_depth * output_channels * grid_input_channels;
+  auto accumulate_column = [&](auto policy, int gx, int gy, int b,
+                               float* column) {
+    using Policy = decltype(policy);
+    std::fill(column, column + column_size, 0.0f);
+    const int x0 = static_cast<int>(
+        std::floor(pixels_per_cell_x * (gx + 0.5f - 1.0f)));
+    const int x1_exclusive = static_cast<int>(
+        std::ceil(pixels_per_cell_x * (gx + 0.5f + 1.0f)));
+    const int y0 = static_cast<int>(
+        std::floor(pixels_per_cell_y * (gy + 0.5f - 1.0f)));
+    const int y1_exclusive = static_cast<int>(
+        std::ceil(pixels_per_cell_y * (gy + 0.5f + 1.0f)));
+
+    for (int y = y0; y < y1_exclusive; ++y) {
+      const int y_mirror = Policy::ImageIndex(y, input_height);
+      const float gyf = (y + 0.5f) / pixels_per_cell_y;
+      const float wy = LerpWeight(gy + 0.5f, gyf);
+
+      for (int x = x0; x < x1_exclusive; ++x) {
+        const int x_mirror = Policy::ImageIndex(x, input_width);
+        const float gxf = (x + 0.5f) / pixels_per_cell_x;
+        const float wx = LerpWeight(gx + 0.5f, gxf);
+
+        // Only cells gz0 and gz0 + 1 have a nonzero weight, except that the
+        // end cells take all of a guide beyond them.
+        const float gzf = record(0, x_mirror, y_mirror, b);
+        const int gz0 = static_cast<int>(std::floor(gzf - 0.5f));
+        int gzs[3];
+        float wzs[3];
+        int num_gz = 0;
+        for (int k = 0; k < 2; ++k) {
+          if (gz0 + k >= 0 && gz0 + k < grid_depth) {
+            gzs[num_gz] = gz0 + k;
+            wzs[num_gz++] = record(1 + k, x_mirror, y_mirror, b);
+          }
+        }
+        auto set_end_weight = [&](int gz) {
+          for (int k = 0; k < num_gz; ++k) {
+            if (gzs[k] == gz) {
+              wzs[k] = 1.0f;
+              return;
+            }
+          }
+          gzs[num_gz] = gz;
+          wzs[num_gz++] = 1.0f;
+        };
+        if (gzf < 0.5f) {
+          set_end_weight(0);
+        }
+        if (gzf > grid_depth - 0.5f) {
+          set_end_weight(grid_depth - 1);
+        }
+
+        for (int k = 0; k < num_gz; ++k) {
+          float* cell = column + gzs[k] * output_channels * grid_input_channels;
+          for (int i = 0; i < output_channels; ++i) {
+            const float tangent = codomain_tangent(i, x_mirror, y_mirror, b);
+            for (int j = 0; j < grid_input_channels; ++j) {
+              const float input_value =
+                  (j < input_channels) ? input(j, x_mirror, y_mirror, b)
+                                       : 1.0f;
+              const float grad_value = wx * wy * wzs[k] * input_value;
+              cell[i * grid_input_channels + j] += grad_value * tangent;
+            }
+          }
+        }
+      }  // x
+    }    // y
+  };
+  const int64_t pixels_per_cell =
+      static_cast<int64_t>(4 * pixels_per_cell_x * pixels_per_cell_y) + 1;
+  const InteriorRange interior_gx =
+      GatheredInterior(grid_width, input_width, pixels_per_cell_x);
+  const InteriorRange interior_gy =
+      GatheredInterior(grid_height, input_height, pixels_per_cell_y);
+  ParallelForRowsWithScratch(
+      grid_height, batch_size,
+      grid_width * 2 * output_channels * grid_input_channels * pixels_per_cell,
+      [&] { return std::vector<float>(column_size); },
+      [&](int gy, int b, std::vector<float>& column) {
+        ForEachInRow(
+            grid_width, interior_gx, interior_gy.Contains(gy),
+            [&](auto policy, int gx) {
+              accumulate_column(policy, gx, gy, b, column.data());
+              for (int gz = 0; gz < grid_depth; ++gz) {
+                for (int i = 0; i < output_channels; ++i) {
+                  for (int j = 0; j < grid_input_channels; ++j) {
+                    grid_vjp_out(j, i, gz, gx, gy, b) =
+                        column[(gz * output_channels + i) *
+                                   grid_input_channels +
+                               j];
+                  }
+                }
+              }
+            });
+      });
+
+  // Guide and input gradients: one pass over the pixels, reading each grid
+  // sample once for both.
+  const float scale_x = static_cast<float>(grid_width) / input_width;
+  const float scale_y = static_cast<float>(grid_height) / input_height;
+  const InteriorRange interior_x =
+      SampledInterior(input_width, grid_width, scale_x);
+  const InteriorRange interior_y =
+      SampledInterior(input_height, grid_height, scale_y);
+  ParallelForRows(
+      input_height, batch_size,
+      input_width * output_channels * grid_input_channels, [&](int y, int b) {
+        ForEachInRow(
+            input_width, interior_x, interior_y.Contains(y),
+            [&](auto policy, int x) {
+              const Footprint fp =
+                  MakeFootprint(policy, x, y, scale_x, scale_y, grid_width,
+                                grid_height, grid_depth, &record(0, x, y, b));
+
+              float guide_vjp = 0.0f;
+              for (int j = 0; j < input_channels; ++j) {
+                input_vjp_out(j, x, y, b) = 0.0f;
+              }
+              for (int i = 0; i < output_channels; ++i) {
+                const float tangent = codomain_tangent(i, x, y, b);
+                float guide_grad = 0.0f;
+                for (int j = 0; j < grid_input_channels; ++j) {
+                  float grid_sample = 0.0f;
+                  float grid_sample_grad = 0.0f;
+                  for (int cell = 0; cell < 8; ++cell) {
+                    const float grid_value =
+                        grid(j, i, fp.gzc[cell & 1], fp.gxc[(cell >> 1) & 1],
+                             fp.gyc[cell >> 2], b);
+                    grid_sample += fp.weight[cell] * grid_value;
+                    grid_sample_grad += fp.weight_grad[cell] * grid_value;
+                  }
+                  if (j < input_channels) {
+                    guide_grad += grid_sample_grad * input(j, x, y, b);
+                    input_vjp_out(j, x, y, b) += grid_sample * tangent;
+                  } else {  // Offset term
+                    guide_grad += grid_sample_grad;
+                  }
+                }  // j
+                guide_vjp += guide_grad * tangent;
+              }  // i
+              guide_vjp_out(x, y, b) = guide_vjp;
+            });
+      });
 }
 
 }  // namespace hdrnet
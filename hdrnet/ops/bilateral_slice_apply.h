@@ -16,6 +16,7 @@
 #define HDRNET_OPS_BILATERAL_SLICE_APPLY_H_
 
 #include "third_party/array/array.h"
+#include "worker_pool.h"
 
 namespace hdrnet {
 
@@ -27,10 +28,23 @@ namespace hdrnet {
 //   - input has shape (N, W, H, B) or (N-1, W, H, B).
 //   - This is a per-pixel multiply. In the former, it is a linear transform,
 //     otherwise, it is affine.
+//
+// Rows are processed on WorkerPool::Current() according to `schedule`. Use
+// LatencyMode::kLowLatency for a stream of small interactive calls.
 void BilateralSliceApply(nda::array_ref_of_rank<const float, 6> grid,
                          nda::array_ref_of_rank<const float, 3> guide,
                          nda::array_ref_of_rank<const float, 4> input,
-                         nda::array_ref_of_rank<float, 4> out);
+                         nda::array_ref_of_rank<float, 4> out,
+                         const Schedule& schedule = Schedule());
+
+// BilateralSliceApply with the schedule that AutoTuner::Get() picks for these
+// shapes. With tuning enabled, the first call for a new shape benchmarks the
+// candidates (writing `out` several times) before the final run.
+void TunedBilateralSliceApply(nda::array_ref_of_rank<const float, 6> grid,
+                              nda::array_ref_of_rank<const float, 3> guide,
+                              nda::array_ref_of_rank<const float, 4> input,
+                              nda::array_ref_of_rank<float, 4> out,
+                              LatencyMode mode = LatencyMode::kThroughput);
 
 // Let f(i) be BilateralSliceApply(grid, guide, input), and u(i, j) be the
 // codomain tangent vector. We drop the implicit indices (gz, gx, gy, b) for f
@@ -99,6 +113,70 @@ void BilateralSliceApplyInputGrad(
     nda::array_ref_of_rank<const float, 4> codomain_tangent,
     nda::array_ref_of_rank<float, 4> vjp_out);
 
+// The (j, i, d, w, h, b) grid of the functions above as a view of the packed
+// prediction conv output of HDRNetCurves._coefficients: TF (b, h, w, k) with
+// k = (j * output_channels + i) * depth + d, the layout that its unroll_grid
+// block re-stacks with tf.split and tf.stack. The functions above only index
+// the grid through `grid(j, i, d, x, y, b)`, so they take either layout.
+template <typename T>
+nda::array_ref_of_rank<T, 6> PackedGridRef(T* data, int grid_input_channels,
+                                           int output_channels, int depth,
+                                           int width, int height,
+                                           int batch_size) {
+  const int channels = grid_input_channels * output_channels * depth;
+  return nda::make_array_ref(
+      data, nda::shape_of_rank<6>(
+                nda::dim<>(0, grid_input_channels, output_channels * depth),
+                nda::dim<>(0, output_channels, depth), nda::dim<>(0, depth, 1),
+                nda::dim<>(0, width, channels),
+                nda::dim<>(0, height, channels * width),
+                nda::dim<>(0, batch_size, channels * width * height)));
+}
+
+// Per-pixel sample records, to trade memory for a faster backward pass.
+//
+// The forward pass and each gradient above recompute, for every pixel, where
+// its guide value falls in the grid and the (smoothed) depth weights of the
+// two cells it samples. A record keeps them from the forward pass, as
+// kSliceRecordChannels floats per pixel, record(k, x, y, b):
+//   k = 0: gzf, the guide value scaled to grid depth.
+//   k = 1, 2: the weights of depth cells gz0 and gz0 + 1, where
+//     gz0 = floor(gzf - 0.5).
+//   k = 3, 4: the derivatives of these weights with respect to the guide.
+// The x and y weights only depend on the pixel position and are not stored,
+// nor are the cell indices: gz0 is derived from gzf, and the x and y cells
+// from the pixel position.
+//
+// The depth weights are those of BilateralSliceApply, approximate with
+// HDRNET_APPROXIMATE_NUMERICS (see numerics.h), and the output is the same as
+// its output, bit for bit. Without approximate numerics, the gradients are
+// also the same, bit for bit, as those of the functions above. With them,
+// they are the gradients of the approximate samples, where the functions
+// above use exact ones, and differ from them by about the approximation
+// error.
+constexpr int kSliceRecordChannels = 5;
+
+// BilateralSliceApply, also filling `record_out` (kSliceRecordChannels, W, H,
+// B) for BilateralSliceApplyRecordGrad.
+void BilateralSliceApplyRecord(nda::array_ref_of_rank<const float, 6> grid,
+                               nda::array_ref_of_rank<const float, 3> guide,
+                               nda::array_ref_of_rank<const float, 4> input,
+                               nda::array_ref_of_rank<float, 4> out,
+                               nda::array_ref_of_rank<float, 4> record_out);
+
+// BilateralSliceApplyGridGrad, BilateralSliceApplyGuideGrad and
+// BilateralSliceApplyInputGrad, reading the guide geometry from `record`
+// instead of recomputing it. The guide and input gradients share one pass
+// over the pixels, and so one read of the grid.
+void BilateralSliceApplyRecordGrad(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> record,
+    nda::array_ref_of_rank<const float, 4> input,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 3> guide_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out);
+
 }  // namespace hdrnet
 
 #endif  // HDRNET_OPS_BILATERAL_SLICE_APPLY_H_
@@ -0,0 +1,242 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Latency of a single batch-size-1 BilateralSliceApply call, as issued by an
+// interactive editor, under different pool configurations:
+//
+//   Serial:     one thread.
+//   Parking:    workers park as soon as they are idle (spin_us = 0), like a
+//               generic task pool; every call pays a wake-up.
+//   Spinning:   the default spin-then-park policy.
+//   LowLatency: LatencyMode::kLowLatency, workers stay hot between calls.
+//   Concurrent: the spinning pool called from 1, 2 and 4 threads at once, as
+//               ops run in parallel by TF's inter-op threads would.
+//
+// Arguments are the image width and height. The grid is 16x16x8 with a 3x4
+// affine model, as in HDRNetCurves.
+//
+// The SliceApplyGrad benchmarks compare a training step's slice-apply, forward
+// and backward, with the gradients recomputing the guide geometry (Recompute)
+// and reading the per-pixel sample records of the forward pass (Record).
+
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "bilateral_slice_apply.h"
+#include "third_party/array/array.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+namespace {
+
+constexpr int kGridWidth = 16;
+constexpr int kGridHeight = 16;
+constexpr int kGridDepth = 8;
+constexpr int kInputChannels = 3;
+constexpr int kOutputChannels = 3;
+
+void RunSliceApply(benchmark::State& state, WorkerPool* pool,
+                   LatencyMode mode) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const int grid_input_channels = kInputChannels + 1;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<float> grid(grid_input_channels * kOutputChannels * kGridDepth *
+                          kGridWidth * kGridHeight);
+  std::vector<float> guide(width * height);
+  std::vector<float> input(kInputChannels * width * height);
+  std::vector<float> out(kOutputChannels * width * height);
+  for (float& v : grid) v = uniform(rng);
+  for (float& v : guide) v = uniform(rng);
+  for (float& v : input) v = uniform(rng);
+
+  auto grid_ref = nda::make_array_ref(
+      grid.data(),
+      nda::shape_of_rank<6>(grid_input_channels, kOutputChannels, kGridDepth,
+                            kGridWidth, kGridHeight, 1));
+  auto guide_ref = nda::make_array_ref(
+      guide.data(), nda::shape_of_rank<3>(width, height, 1));
+  auto input_ref = nda::make_array_ref(
+      input.data(), nda::shape_of_rank<4>(kInputChannels, width, height, 1));
+  auto out_ref = nda::make_array_ref(
+      out.data(), nda::shape_of_rank<4>(kOutputChannels, width, height, 1));
+
+  ScopedWorkerPool scoped_pool(pool);
+  Schedule schedule;
+  schedule.mode = mode;
+  for (auto _ : state) {
+    BilateralSliceApply(grid_ref, guide_ref, input_ref, out_ref, schedule);
+    benchmark::DoNotOptimize(out.data());
+  }
+  state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+WorkerPool* MakePool(int num_threads, int spin_us) {
+  WorkerPoolOptions options;
+  options.num_threads = num_threads;
+  options.spin_us = spin_us;
+  return new WorkerPool(options);
+}
+
+void BM_SliceApplySerial(benchmark::State& state) {
+  static WorkerPool* pool = MakePool(1, 0);
+  RunSliceApply(state, pool, LatencyMode::kThroughput);
+}
+
+void BM_SliceApplyParking(benchmark::State& state) {
+  static WorkerPool* pool = MakePool(0, 0);
+  RunSliceApply(state, pool, LatencyMode::kThroughput);
+}
+
+void BM_SliceApplySpinning(benchmark::State& state) {
+  static WorkerPool* pool = MakePool(0, WorkerPoolOptions().spin_us);
+  RunSliceApply(state, pool, LatencyMode::kThroughput);
+}
+
+void BM_SliceApplyLowLatency(benchmark::State& state) {
+  static WorkerPool* pool = MakePool(0, WorkerPoolOptions().spin_us);
+  RunSliceApply(state, pool, LatencyMode::kLowLatency);
+}
+
+void BM_SliceApplyConcurrent(benchmark::State& state) {
+  static WorkerPool* pool = MakePool(0, WorkerPoolOptions().spin_us);
+  RunSliceApply(state, pool, LatencyMode::kThroughput);
+}
+
+// Slider-sized previews up to a 720p frame.
+void PreviewSizes(benchmark::internal::Benchmark* b) {
+  b->Args({64, 48})->Args({160, 120})->Args({320, 240})->Args({640, 480})
+      ->Args({1280, 720});
+  b->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+BENCHMARK(BM_SliceApplySerial)->Apply(PreviewSizes);
+BENCHMARK(BM_SliceApplyParking)->Apply(PreviewSizes);
+BENCHMARK(BM_SliceApplySpinning)->Apply(PreviewSizes);
+BENCHMARK(BM_SliceApplyLowLatency)->Apply(PreviewSizes);
+BENCHMARK(BM_SliceApplyConcurrent)
+    ->Apply(PreviewSizes)
+    ->Threads(1)
+    ->Threads(2)
+    ->Threads(4);
+
+void RunSliceApplyGrad(benchmark::State& state, bool use_record) {
+  const int width = state.range(0);
+  const int height = state.range(1);
+  const int grid_input_channels = kInputChannels + 1;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+  std::vector<float> grid(grid_input_channels * kOutputChannels * kGridDepth *
+                          kGridWidth * kGridHeight);
+  std::vector<float> guide(width * height);
+  std::vector<float> input(kInputChannels * width * height);
+  std::vector<float> out(kOutputChannels * width * height);
+  std::vector<float> record(kSliceRecordChannels * width * height);
+  std::vector<float> codomain_tangent(kOutputChannels * width * height);
+  std::vector<float> grid_vjp(grid.size());
+  std::vector<float> guide_vjp(guide.size());
+  std::vector<float> input_vjp(input.size());
+  for (float& v : grid) v = uniform(rng);
+  for (float& v : guide) v = uniform(rng);
+  for (float& v : input) v = uniform(rng);
+  for (float& v : codomain_tangent) v = uniform(rng);
+
+  auto grid_ref = nda::make_array_ref(
+      grid.data(),
+      nda::shape_of_rank<6>(grid_input_channels, kOutputChannels, kGridDepth,
+                            kGridWidth, kGridHeight, 1));
+  auto guide_ref = nda::make_array_ref(
+      guide.data(), nda::shape_of_rank<3>(width, height, 1));
+  auto input_ref = nda::make_array_ref(
+      input.data(), nda::shape_of_rank<4>(kInputChannels, width, height, 1));
+  auto out_ref = nda::make_array_ref(
+      out.data(), nda::shape_of_rank<4>(kOutputChannels, width, height, 1));
+  auto record_ref = nda::make_array_ref(
+      record.data(),
+      nda::shape_of_rank<4>(kSliceRecordChannels, width, height, 1));
+  auto codomain_tangent_ref = nda::make_array_ref(
+      codomain_tangent.data(),
+      nda::shape_of_rank<4>(kOutputChannels, width, height, 1));
+  auto grid_vjp_ref = nda::make_array_ref(grid_vjp.data(), grid_ref.shape());
+  auto guide_vjp_ref =
+      nda::make_array_ref(guide_vjp.data(), guide_ref.shape());
+  auto input_vjp_ref =
+      nda::make_array_ref(input_vjp.data(), input_ref.shape());
+
+  for (auto _ : state) {
+    if (use_record) {
+      BilateralSliceApplyRecord(grid_ref, guide_ref, input_ref, out_ref,
+                                record_ref);
+      BilateralSliceApplyRecordGrad(grid_ref, record_ref, input_ref,
+                                    codomain_tangent_ref, grid_vjp_ref,
+                                    guide_vjp_ref, input_vjp_ref);
+    } else {
+      BilateralSliceApply(grid_ref, guide_ref, input_ref, out_ref);
+      BilateralSliceApplyGridGrad(guide_ref, input_ref, codomain_tangent_ref,
+                                  grid_vjp_ref);
+      BilateralSliceApplyGuideGrad(grid_ref, guide_ref, input_ref,
+                                   codomain_tangent_ref, guide_vjp_ref);
+      BilateralSliceApplyInputGrad(grid_ref, guide_ref, codomain_tangent_ref,
+                                   input_vjp_ref);
+    }
+    benchmark::DoNotOptimize(grid_vjp.data());
+  }
+  state.SetItemsProcessed(state.iterations() * width * height);
+}
+
+void BM_SliceApplyGradRecompute(benchmark::State& state) {
+  RunSliceApplyGrad(state, /*use_record=*/false);
+}
+
+void BM_SliceApplyGradRecord(benchmark::State& state) {
+  RunSliceApplyGrad(state, /*use_record=*/true);
+}
+
+// Training crops.
+void TrainingSizes(benchmark::internal::Benchmark* b) {
+  b->Args({256, 256})->Args({512, 512});
+  b->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+BENCHMARK(BM_SliceApplyGradRecompute)->Apply(TrainingSizes);
+BENCHMARK(BM_SliceApplyGradRecord)->Apply(TrainingSizes);
+
+// Overhead of the pool itself on a trivial 1000-item loop that is forced
+// through the workers.
+void BM_ParallelForOverhead(benchmark::State& state) {
+  WorkerPoolOptions options;
+  options.spin_us = state.range(0);
+  options.inline_threshold = 0;
+  WorkerPool pool(options);
+  std::vector<float> data(1000);
+  const std::function<void(int64_t, int64_t)> fn = [&](int64_t begin,
+                                                       int64_t end) {
+    for (int64_t i = begin; i < end; ++i) data[i] += 1.0f;
+  };
+  for (auto _ : state) {
+    pool.ParallelFor(data.size(), 1, fn);
+  }
+}
+BENCHMARK(BM_ParallelForOverhead)
+    ->Arg(0)
+    ->Arg(50)
+    ->Unit(benchmark::kMicrosecond)
+    ->UseRealTime();
+
+}  // namespace
+}  // namespace hdrnet
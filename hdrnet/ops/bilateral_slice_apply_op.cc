@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <cstdint>
+
 #include "bilateral_slice_apply.h"
 #include "third_party/array/array.h"
 #include "third_party/tensorflow/core/framework/op.h"
@@ -43,7 +45,8 @@ bool BilateralSliceApply(const Device& device,
                          nda::array_ref_of_rank<const float, 6> grid,
                          nda::array_ref_of_rank<const float, 3> guide,
                          nda::array_ref_of_rank<const float, 4> input,
-                         nda::array_ref_of_rank<float, 4> out);
+                         nda::array_ref_of_rank<float, 4> out,
+                         LatencyMode mode);
 
 template <typename Device>
 bool BilateralSliceApplyGrad(
@@ -55,14 +58,15 @@ bool BilateralSliceApplyGrad(
     nda::array_ref_of_rank<float, 3> guide_vjp_out,
     nda::array_ref_of_rank<float, 4> input_vjp_out);
 
-// Specialize for the CPU (ignoring the device).
+// Specialize for the CPU (ignoring the device, the kernels run on
+// WorkerPool::Current() with the schedule from AutoTuner::Get()).
 template <>
 bool BilateralSliceApply<CpuDevice>(
     const CpuDevice& device, nda::array_ref_of_rank<const float, 6> grid,
     nda::array_ref_of_rank<const float, 3> guide,
     nda::array_ref_of_rank<const float, 4> input,
-    nda::array_ref_of_rank<float, 4> out) {
-  BilateralSliceApply(grid, guide, input, out);
+    nda::array_ref_of_rank<float, 4> out, LatencyMode mode) {
+  TunedBilateralSliceApply(grid, guide, input, out, mode);
   return true;
 }
 
@@ -106,7 +110,7 @@ bool BilateralSliceApply<GpuDevice>(
     const GpuDevice& device, nda::array_ref_of_rank<const float, 6> grid,
     nda::array_ref_of_rank<const float, 3> guide,
     nda::array_ref_of_rank<const float, 4> input,
-    nda::array_ref_of_rank<float, 4> out) {
+    nda::array_ref_of_rank<float, 4> out, LatencyMode mode) {
   return BilateralSliceApplyCudaLauncher(device, grid, guide, input, out);
 }
 
@@ -130,11 +134,13 @@ template <typename Device>
 class BilateralSliceApplyOp : public OpKernel {
  private:
   bool has_offset_;
+  bool low_latency_;
 
  public:
   explicit BilateralSliceApplyOp(OpKernelConstruction* context)
       : OpKernel(context) {
     OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+    OP_REQUIRES_OK(context, context->GetAttr("low_latency", &low_latency_));
   }
 
   void Compute(OpKernelContext* context) override {
@@ -227,7 +233,9 @@ class BilateralSliceApplyOp : public OpKernel {
                                                   guide_height, batch_size));
     const bool status =
         BilateralSliceApply(context->eigen_device<Device>(), grid_ref,
-                            guide_ref, input_ref, output_ref);
+                            guide_ref, input_ref, output_ref,
+                            low_latency_ ? LatencyMode::kLowLatency
+                                         : LatencyMode::kThroughput);
     if (!status) {
       context->SetStatus(
           tensorflow::errors::Internal("BilateralSliceApply kernel failed."));
@@ -362,6 +370,385 @@ class BilateralSliceApplyGradOp : public OpKernel {
   }
 };
 
+// BilateralSliceApply that also outputs the per-pixel sample records of
+// bilateral_slice_apply.h, for BilateralSliceApplyRecordGrad. CPU only.
+class BilateralSliceApplyRecordOp : public OpKernel {
+ private:
+  bool has_offset_;
+
+ public:
+  explicit BilateralSliceApplyRecordOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& grid = context->input(0);
+    const Tensor& guide = context->input(1);
+    const Tensor& input = context->input(2);
+
+    OP_REQUIRES(context, grid.dims() == 5,
+                tensorflow::errors::InvalidArgument(
+                    "Input grid should be 5D (batch_size, height, width, "
+                    "depth, output_channels * input_channels)"));
+    OP_REQUIRES(context, guide.dims() == 3,
+                tensorflow::errors::InvalidArgument(
+                    "Guide image should be 3D (batch_size, height, width)"));
+    OP_REQUIRES(context, input.dims() == 4,
+                tensorflow::errors::InvalidArgument(
+                    "Input image should be 4D (batch_size, height, width, "
+                    "input_channels)"));
+
+    const int batch_size = grid.dim_size(0);
+    const int grid_height = grid.dim_size(1);
+    const int grid_width = grid.dim_size(2);
+    const int grid_depth = grid.dim_size(3);
+    const int grid_channels = grid.dim_size(4);
+    const int guide_height = guide.dim_size(1);
+    const int guide_width = guide.dim_size(2);
+    const int input_channels = input.dim_size(3);
+
+    OP_REQUIRES(context,
+                (input.dim_size(0) == guide.dim_size(0)) &&
+                    input.dim_size(1) == guide_height &&
+                    input.dim_size(2) == guide_width,
+                tensorflow::errors::InvalidArgument(
+                    "Input and guide size should match."));
+    OP_REQUIRES(
+        context, guide.dim_size(0) == batch_size,
+        tensorflow::errors::InvalidArgument("Batch sizes should match."));
+    const int grid_input_channels =
+        has_offset_ ? input_channels + 1 : input_channels;
+    const int output_channels = grid_channels / grid_input_channels;
+    OP_REQUIRES(context, grid_channels % grid_input_channels == 0,
+                tensorflow::errors::InvalidArgument(
+                    "Grid should have output_channels * ",
+                    has_offset_ ? "(input_channels + 1)" : "input_channels",
+                    " channels."));
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0,
+                       TensorShape({batch_size, guide_height, guide_width,
+                                    output_channels}),
+                       &output));
+    Tensor* record = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       1,
+                       TensorShape({batch_size, guide_height, guide_width,
+                                    kSliceRecordChannels}),
+                       &record));
+
+    auto grid_ref = nda::make_array_ref(
+        grid.flat<float>().data(),
+        nda::shape_of_rank<6>(grid_input_channels, output_channels, grid_depth,
+                              grid_width, grid_height, batch_size));
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(guide_width, guide_height, batch_size));
+    auto input_ref =
+        nda::make_array_ref(input.flat<float>().data(),
+                            nda::shape_of_rank<4>(input_channels, guide_width,
+                                                  guide_height, batch_size));
+    auto output_ref =
+        nda::make_array_ref(output->flat<float>().data(),
+                            nda::shape_of_rank<4>(output_channels, guide_width,
+                                                  guide_height, batch_size));
+    // TF: (b, h, w, k), k changes fastest.
+    // nda: (k, w, h, b), k changes fastest.
+    auto record_ref = nda::make_array_ref(
+        record->flat<float>().data(),
+        nda::shape_of_rank<4>(kSliceRecordChannels, guide_width, guide_height,
+                              batch_size));
+    BilateralSliceApplyRecord(grid_ref, guide_ref, input_ref, output_ref,
+                              record_ref);
+  }
+};
+
+// The gradient of BilateralSliceApplyRecord, reading the sample records
+// instead of the guide. CPU only.
+class BilateralSliceApplyRecordGradOp : public OpKernel {
+ private:
+  bool has_offset_;
+
+ public:
+  explicit BilateralSliceApplyRecordGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& grid = context->input(0);
+    const Tensor& record = context->input(1);
+    const Tensor& input = context->input(2);
+    const Tensor& codomain_tangent = context->input(3);
+
+    OP_REQUIRES(context, grid.dims() == 5,
+                tensorflow::errors::InvalidArgument(
+                    "Grid should be 5D (batch, h, w, depth, output_channels * "
+                    "input_channels)"));
+    OP_REQUIRES(context, input.dims() == 4,
+                tensorflow::errors::InvalidArgument(
+                    "Input image should be 4D (batches, height, width, "
+                    "input_channels)"));
+    const int batch_size = input.dim_size(0);
+    const int height = input.dim_size(1);
+    const int width = input.dim_size(2);
+    const int input_channels = input.dim_size(3);
+    OP_REQUIRES(context,
+                record.shape() == TensorShape({batch_size, height, width,
+                                               kSliceRecordChannels}),
+                tensorflow::errors::InvalidArgument(
+                    "Record should be 4D (batches, height, width, ",
+                    kSliceRecordChannels, "), matching the input."));
+
+    const int grid_height = grid.dim_size(1);
+    const int grid_width = grid.dim_size(2);
+    const int grid_depth = grid.dim_size(3);
+    const int grid_channels = grid.dim_size(4);
+    const int grid_input_channels =
+        has_offset_ ? input_channels + 1 : input_channels;
+    const int output_channels = grid_channels / grid_input_channels;
+    OP_REQUIRES(context, grid_channels % grid_input_channels == 0,
+                tensorflow::errors::InvalidArgument(
+                    "Grid should have output_channels * ",
+                    has_offset_ ? "(input_channels + 1)" : "input_channels",
+                    " channels."));
+    OP_REQUIRES(context,
+                codomain_tangent.shape() ==
+                    TensorShape({batch_size, height, width, output_channels}),
+                tensorflow::errors::InvalidArgument(
+                    "Backprop should have the shape of the output."));
+
+    // Allocate vjp buffers, which have the same shape as the primals. The
+    // guide's is that of the record without its last dimension.
+    Tensor* grid_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(0, grid.shape(), &grid_vjp));
+    Tensor* guide_vjp = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                1, TensorShape({batch_size, height, width}),
+                                &guide_vjp));
+    Tensor* input_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(2, input.shape(), &input_vjp));
+
+    auto grid_ref = nda::make_array_ref(
+        grid.flat<float>().data(),
+        nda::shape_of_rank<6>(grid_input_channels, output_channels, grid_depth,
+                              grid_width, grid_height, batch_size));
+    auto grid_vjp_ref =
+        nda::make_array_ref(grid_vjp->flat<float>().data(), grid_ref.shape());
+    auto record_ref = nda::make_array_ref(
+        record.flat<float>().data(),
+        nda::shape_of_rank<4>(kSliceRecordChannels, width, height,
+                              batch_size));
+    auto guide_vjp_ref = nda::make_array_ref(
+        guide_vjp->flat<float>().data(),
+        nda::shape_of_rank<3>(width, height, batch_size));
+    auto input_ref = nda::make_array_ref(
+        input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, width, height, batch_size));
+    auto input_vjp_ref = nda::make_array_ref(input_vjp->flat<float>().data(),
+                                             input_ref.shape());
+    auto codomain_tangent_ref = nda::make_array_ref(
+        codomain_tangent.flat<float>().data(),
+        nda::shape_of_rank<4>(output_channels, width, height, batch_size));
+
+    BilateralSliceApplyRecordGrad(grid_ref, record_ref, input_ref,
+                                  codomain_tangent_ref, grid_vjp_ref,
+                                  guide_vjp_ref, input_vjp_ref);
+  }
+};
+
+// The shape of a packed grid, (batch_size, height, width, depth *
+// output_channels * grid_input_channels), as the prediction conv outputs it.
+struct PackedGridShape {
+  int batch_size;
+  int height;
+  int width;
+  int depth;
+  int output_channels;
+  int grid_input_channels;
+};
+
+Status GetPackedGridShape(const Tensor& grid, const Tensor& input,
+                          int grid_depth, bool has_offset,
+                          PackedGridShape* shape) {
+  if (grid.dims() != 4) {
+    return tensorflow::errors::InvalidArgument(
+        "Packed grid should be 4D (batch_size, height, width, depth * "
+        "output_channels * input_channels)");
+  }
+  if (input.dims() != 4) {
+    return tensorflow::errors::InvalidArgument(
+        "Input image should be 4D (batch_size, height, width, "
+        "input_channels)");
+  }
+  if (grid.dim_size(0) != input.dim_size(0)) {
+    return tensorflow::errors::InvalidArgument("Batch sizes should match.");
+  }
+  shape->batch_size = grid.dim_size(0);
+  shape->height = grid.dim_size(1);
+  shape->width = grid.dim_size(2);
+  shape->depth = grid_depth;
+  shape->grid_input_channels =
+      has_offset ? input.dim_size(3) + 1 : input.dim_size(3);
+  const int64_t depth_channels = grid_depth * shape->grid_input_channels;
+  if (grid_depth <= 0 || grid.dim_size(3) % depth_channels != 0) {
+    return tensorflow::errors::InvalidArgument(
+        "Packed grid should have grid_depth * output_channels * ",
+        has_offset ? "(input_channels + 1)" : "input_channels",
+        " channels, got ", grid.dim_size(3), " with grid_depth ", grid_depth,
+        ".");
+  }
+  shape->output_channels = grid.dim_size(3) / depth_channels;
+  return Status::OK();
+}
+
+// BilateralSliceApply reading the grid in the packed layout of the prediction
+// conv (see PackedGridRef), so that the model does not unroll it into a 6D
+// grid first. CPU only.
+class BilateralSliceApplyPackedOp : public OpKernel {
+ private:
+  bool has_offset_;
+  int grid_depth_;
+
+ public:
+  explicit BilateralSliceApplyPackedOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_depth", &grid_depth_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& grid = context->input(0);
+    const Tensor& guide = context->input(1);
+    const Tensor& input = context->input(2);
+
+    PackedGridShape shape;
+    OP_REQUIRES_OK(context, GetPackedGridShape(grid, input, grid_depth_,
+                                               has_offset_, &shape));
+    OP_REQUIRES(context, guide.dims() == 3,
+                tensorflow::errors::InvalidArgument(
+                    "Guide image should be 3D (batch_size, height, width)"));
+    const int guide_height = guide.dim_size(1);
+    const int guide_width = guide.dim_size(2);
+    const int input_channels = input.dim_size(3);
+    OP_REQUIRES(context,
+                guide.dim_size(0) == shape.batch_size &&
+                    input.dim_size(1) == guide_height &&
+                    input.dim_size(2) == guide_width,
+                tensorflow::errors::InvalidArgument(
+                    "Input and guide size should match."));
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0,
+                       TensorShape({shape.batch_size, guide_height,
+                                    guide_width, shape.output_channels}),
+                       &output));
+
+    auto grid_ref = PackedGridRef(
+        grid.flat<float>().data(), shape.grid_input_channels,
+        shape.output_channels, shape.depth, shape.width, shape.height,
+        shape.batch_size);
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(guide_width, guide_height, shape.batch_size));
+    auto input_ref = nda::make_array_ref(
+        input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, guide_width, guide_height,
+                              shape.batch_size));
+    auto output_ref = nda::make_array_ref(
+        output->flat<float>().data(),
+        nda::shape_of_rank<4>(shape.output_channels, guide_width,
+                              guide_height, shape.batch_size));
+    TunedBilateralSliceApply(grid_ref, guide_ref, input_ref, output_ref);
+  }
+};
+
+// The gradient of BilateralSliceApplyPacked, with the grid gradient in the
+// packed layout too. CPU only.
+class BilateralSliceApplyPackedGradOp : public OpKernel {
+ private:
+  bool has_offset_;
+  int grid_depth_;
+
+ public:
+  explicit BilateralSliceApplyPackedGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+    OP_REQUIRES_OK(context, context->GetAttr("grid_depth", &grid_depth_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    const Tensor& grid = context->input(0);
+    const Tensor& guide = context->input(1);
+    const Tensor& input = context->input(2);
+    const Tensor& codomain_tangent = context->input(3);
+
+    PackedGridShape shape;
+    OP_REQUIRES_OK(context, GetPackedGridShape(grid, input, grid_depth_,
+                                               has_offset_, &shape));
+    const int height = input.dim_size(1);
+    const int width = input.dim_size(2);
+    const int input_channels = input.dim_size(3);
+    OP_REQUIRES(context,
+                guide.shape() == TensorShape({shape.batch_size, height, width}),
+                tensorflow::errors::InvalidArgument(
+                    "Guide should be 3D (batch_size, height, width), matching "
+                    "the input."));
+    OP_REQUIRES(context,
+                codomain_tangent.shape() ==
+                    TensorShape({shape.batch_size, height, width,
+                                 shape.output_channels}),
+                tensorflow::errors::InvalidArgument(
+                    "Backprop should have the shape of the output."));
+
+    Tensor* grid_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(0, grid.shape(), &grid_vjp));
+    Tensor* guide_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, guide.shape(), &guide_vjp));
+    Tensor* input_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(2, input.shape(), &input_vjp));
+
+    auto grid_ref = PackedGridRef(
+        grid.flat<float>().data(), shape.grid_input_channels,
+        shape.output_channels, shape.depth, shape.width, shape.height,
+        shape.batch_size);
+    auto grid_vjp_ref = PackedGridRef(
+        grid_vjp->flat<float>().data(), shape.grid_input_channels,
+        shape.output_channels, shape.depth, shape.width, shape.height,
+        shape.batch_size);
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(width, height, shape.batch_size));
+    auto guide_vjp_ref = nda::make_array_ref(guide_vjp->flat<float>().data(),
+                                             guide_ref.shape());
+    auto input_ref = nda::make_array_ref(
+        input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, width, height,
+                              shape.batch_size));
+    auto input_vjp_ref = nda::make_array_ref(input_vjp->flat<float>().data(),
+                                             input_ref.shape());
+    auto codomain_tangent_ref = nda::make_array_ref(
+        codomain_tangent.flat<float>().data(),
+        nda::shape_of_rank<4>(shape.output_channels, width, height,
+                              shape.batch_size));
+
+    BilateralSliceApplyGrad(context->eigen_device<CpuDevice>(), grid_ref,
+                            guide_ref, input_ref, codomain_tangent_ref,
+                            grid_vjp_ref, guide_vjp_ref, input_vjp_ref);
+  }
+};
+
 }  // namespace hdrnet
 
 REGISTER_KERNEL_BUILDER(
@@ -378,15 +765,30 @@ REGISTER_KERNEL_BUILDER(
     Name("BilateralSliceApplyGrad").Device(tensorflow::DEVICE_GPU),
     hdrnet::BilateralSliceApplyGradOp<GpuDevice>);
 #endif  // GOOGLE_CUDA
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralSliceApplyRecord").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralSliceApplyRecordOp);
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralSliceApplyRecordGrad").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralSliceApplyRecordGradOp);
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralSliceApplyPacked").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralSliceApplyPackedOp);
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralSliceApplyPackedGrad").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralSliceApplyPackedGradOp);
 
 REGISTER_OP("BilateralSliceApply")
     .Input("grid: float")
     .Input("guide: float")
     .Input("input: float")
     .Attr("has_offset: bool")
+    .Attr("low_latency: bool = false")
     .Output("out: float")
     .Doc(
-        "Slices grid at the location defined by guide and applies it to input.")
+        "Slices grid at the location defined by guide and applies it to input.\n"
+        "low_latency: on CPU, keep the worker threads spinning between calls "
+        "for interactive use.")
     .SetShapeFn([](InferenceContext* c) {
       ShapeHandle grid;
       TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &grid));
@@ -439,3 +841,131 @@ REGISTER_OP("BilateralSliceApplyGrad")
     .Output("grid_grad: float")
     .Output("guide_grad: float")
     .Output("input_grad: float");
+
+REGISTER_OP("BilateralSliceApplyRecord")
+    .Input("grid: float")
+    .Input("guide: float")
+    .Input("input: float")
+    .Attr("has_offset: bool")
+    .Output("out: float")
+    .Output("record: float")
+    .Doc(
+        "BilateralSliceApply that also outputs, per pixel, the depth and "
+        "weights at which the guide samples the grid, so that the gradient "
+        "does not recompute them.\n"
+        "record: (batch_size, height, width, 5), see bilateral_slice_apply.h.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &grid));
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 3, &guide));
+      ShapeHandle input_image;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 4, &input_image));
+      const DimensionHandle batch_size = c->Dim(grid, 0);
+      const DimensionHandle h = c->Dim(input_image, 1);
+      const DimensionHandle w = c->Dim(input_image, 2);
+      bool has_offset;
+      TF_RETURN_IF_ERROR(c->GetAttr("has_offset", &has_offset));
+      DimensionHandle grid_input_channels = c->Dim(input_image, 3);
+      if (has_offset) {
+        TF_RETURN_IF_ERROR(
+            c->Add(grid_input_channels, 1, &grid_input_channels));
+      }
+      DimensionHandle output_channels;
+      TF_RETURN_IF_ERROR(c->Divide(c->Dim(grid, 4), grid_input_channels, true,
+                                   &output_channels));
+      c->set_output(0, c->MakeShape({batch_size, h, w, output_channels}));
+      c->set_output(1, c->MakeShape({batch_size, h, w,
+                                     hdrnet::kSliceRecordChannels}));
+      return Status::OK();
+    });
+
+REGISTER_OP("BilateralSliceApplyRecordGrad")
+    .Input("grid: float")
+    .Input("record: float")
+    .Input("input: float")
+    .Input("backprop: float")
+    .Attr("has_offset: bool")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &grid));
+      ShapeHandle record;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 4, &record));
+      ShapeHandle input_image;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 4, &input_image));
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->Subshape(record, 0, 3, &guide));
+      c->set_output(0, grid);
+      c->set_output(1, guide);
+      c->set_output(2, input_image);
+      return Status::OK();
+    })
+    .Output("grid_grad: float")
+    .Output("guide_grad: float")
+    .Output("input_grad: float");
+
+REGISTER_OP("BilateralSliceApplyPacked")
+    .Input("grid: float")
+    .Input("guide: float")
+    .Input("input: float")
+    .Attr("has_offset: bool")
+    .Attr("grid_depth: int")
+    .Output("out: float")
+    .Doc(
+        "BilateralSliceApply of the prediction conv output before it is "
+        "unrolled into a 6D grid.\n"
+        "grid: (batch_size, height, width, grid_depth * output_channels * "
+        "grid_input_channels), with the channels packed as "
+        "(grid_input_channels, output_channels, grid_depth), grid_depth "
+        "changing fastest.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 4, &grid));
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 3, &guide));
+      ShapeHandle input_image;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 4, &input_image));
+      const DimensionHandle batch_size = c->Dim(grid, 0);
+      const DimensionHandle h = c->Dim(input_image, 1);
+      const DimensionHandle w = c->Dim(input_image, 2);
+      bool has_offset;
+      TF_RETURN_IF_ERROR(c->GetAttr("has_offset", &has_offset));
+      int grid_depth;
+      TF_RETURN_IF_ERROR(c->GetAttr("grid_depth", &grid_depth));
+      DimensionHandle grid_input_channels = c->Dim(input_image, 3);
+      if (has_offset) {
+        TF_RETURN_IF_ERROR(
+            c->Add(grid_input_channels, 1, &grid_input_channels));
+      }
+      DimensionHandle depth_channels;
+      TF_RETURN_IF_ERROR(
+          c->Multiply(grid_input_channels, grid_depth, &depth_channels));
+      DimensionHandle output_channels;
+      TF_RETURN_IF_ERROR(c->Divide(c->Dim(grid, 3), depth_channels, true,
+                                   &output_channels));
+      c->set_output(0, c->MakeShape({batch_size, h, w, output_channels}));
+      return Status::OK();
+    });
+
+REGISTER_OP("BilateralSliceApplyPackedGrad")
+    .Input("grid: float")
+    .Input("guide: float")
+    .Input("input: float")
+    .Input("backprop: float")
+    .Attr("has_offset: bool")
+    .Attr("grid_depth: int")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 4, &grid));
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 3, &guide));
+      ShapeHandle input_image;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(2), 4, &input_image));
+      c->set_output(0, grid);
+      c->set_output(1, guide);
+      c->set_output(2, input_image);
+      return Status::OK();
+    })
+    .Output("grid_grad: float")
+    .Output("guide_grad: float")
+    .Output("input_grad: float");
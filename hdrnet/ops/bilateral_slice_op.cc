@@ -52,13 +52,14 @@ bool BilateralSliceGrad(const Device& device,
                         nda::array_ref_of_rank<float, 5> grid_vjp_out,
                         nda::array_ref_of_rank<float, 3> guide_vjp_out);
 
-// Specialize for the CPU (ignoring the device).
+// Specialize for the CPU (ignoring the device, the kernels run on
+// WorkerPool::Current() with the schedule from AutoTuner::Get()).
 template <>
 bool BilateralSlice<CpuDevice>(const CpuDevice& device,
                                nda::array_ref_of_rank<const float, 5> grid,
                                nda::array_ref_of_rank<const float, 3> guide,
                                nda::array_ref_of_rank<float, 4> out) {
-  BilateralSlice(grid, guide, out);
+  TunedBilateralSlice(grid, guide, out);
   return true;
 }
 
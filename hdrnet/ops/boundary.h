@@ -0,0 +1,125 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_BOUNDARY_H_
+#define HDRNET_OPS_BOUNDARY_H_
+
+#include <algorithm>
+#include <cmath>
+
+#include "numerics.h"
+
+namespace hdrnet {
+
+// Boundary policies of the CPU kernels, which split the pixels (or grid cells)
+// they loop over into an interior and border strips around it. In the
+// interior, every grid cell that a pixel samples, or every pixel that a cell
+// gathers, is in bounds, and InteriorPolicy indexes it directly. The border
+// runs with BorderPolicy. Both give the same indices in the interior, so the
+// results do not depend on the split.
+//
+// The depth cells depend on the guide rather than on the position, and are
+// always clamped.
+struct BorderPolicy {
+  // Cell `g` of a grid axis of `extent` cells, clamped.
+  static int GridIndex(int g, int extent) {
+    return std::clamp(g, 0, extent - 1);
+  }
+  // Pixel `x` of an image axis of `extent` pixels, mirrored.
+  static int ImageIndex(int x, int extent) { return MirrorBoundary(x, extent); }
+};
+
+struct InteriorPolicy {
+  static int GridIndex(int g, int /*extent*/) { return g; }
+  static int ImageIndex(int x, int /*extent*/) { return x; }
+};
+
+// A [begin, end) range of pixels along an axis.
+struct InteriorRange {
+  int begin;
+  int end;
+
+  bool Contains(int x) const { return x >= begin && x < end; }
+};
+
+// The pixels along an axis of `extent` pixels whose two samples,
+// floor((x + 0.5) * scale - 0.5) and the next cell, are both in a grid axis of
+// `grid_extent` cells. Cells increase with x, so the other pixels are a strip
+// at each end. The range leaves out one more pixel at each end, so that the
+// kernels' own rounding of the same expression cannot disagree with it.
+inline InteriorRange SampledInterior(int extent, int grid_extent,
+                                     float scale) {
+  auto cell = [scale](int x) {
+    const float gf = (x + 0.5f) * scale;
+    return static_cast<int>(std::floor(gf - 0.5f));
+  };
+  InteriorRange range = {0, extent};
+  while (range.begin < extent && cell(range.begin) < 0) {
+    ++range.begin;
+  }
+  while (range.end > range.begin && cell(range.end - 1) + 1 >= grid_extent) {
+    --range.end;
+  }
+  range.begin = std::min(range.begin + 1, range.end);
+  range.end = std::max(range.end - 1, range.begin);
+  return range;
+}
+
+// The cells along a grid axis of `grid_extent` cells whose gradients gather
+// from pixels [floor(scale * (g - 0.5)), ceil(scale * (g + 1.5))) that are all
+// in an image axis of `extent` pixels, with the same margin as above. `scale`
+// is in pixels per cell.
+inline InteriorRange GatheredInterior(int grid_extent, int extent,
+                                      float scale) {
+  auto first = [scale](int g) {
+    return static_cast<int>(std::floor(scale * (g + 0.5f - 1.0f)));
+  };
+  auto last_exclusive = [scale](int g) {
+    return static_cast<int>(std::ceil(scale * (g + 0.5f + 1.0f)));
+  };
+  InteriorRange range = {0, grid_extent};
+  while (range.begin < grid_extent && first(range.begin) < 0) {
+    ++range.begin;
+  }
+  while (range.end > range.begin && last_exclusive(range.end - 1) > extent) {
+    --range.end;
+  }
+  range.begin = std::min(range.begin + 1, range.end);
+  range.end = std::max(range.end - 1, range.begin);
+  return range;
+}
+
+// Calls fn(policy, x) for the pixels (or grid cells) x of a row of `width` in
+// order, with InteriorPolicy on `interior` if `interior_row`, and BorderPolicy
+// elsewhere.
+template <typename Fn>
+void ForEachInRow(int width, InteriorRange interior, bool interior_row,
+                  Fn&& fn) {
+  int x = 0;
+  if (interior_row) {
+    for (; x < interior.begin; ++x) {
+      fn(BorderPolicy(), x);
+    }
+    for (; x < interior.end; ++x) {
+      fn(InteriorPolicy(), x);
+    }
+  }
+  for (; x < width; ++x) {
+    fn(BorderPolicy(), x);
+  }
+}
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_BOUNDARY_H_
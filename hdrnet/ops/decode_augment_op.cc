@@ -0,0 +1,320 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <vector>
+
+#include "augment.h"
+#include "worker_pool.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+#include "third_party/tensorflow/core/lib/jpeg/jpeg_mem.h"
+#include "third_party/tensorflow/core/lib/png/png_io.h"
+#include "third_party/tensorflow/core/lib/random/simple_philox.h"
+#include "third_party/tensorflow/core/util/guarded_philox_random.h"
+
+using ::tensorflow::GuardedPhiloxRandom;
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::StringPiece;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::DimensionHandle;
+using ::tensorflow::shape_inference::InferenceContext;
+using ::tensorflow::shape_inference::ShapeHandle;
+
+namespace hdrnet {
+namespace {
+
+constexpr int kChannels = 3;
+
+// A decoded RGB image. PNGs are always decoded to 16 bits: libpng expands 8-bit
+// values by replicating them (v * 257), so v * 257 / 65535 == v / 255 and the
+// normalized values are the same as decoding at the native depth.
+struct DecodedImage {
+  int width = 0;
+  int height = 0;
+  std::vector<uint8_t> pixels8;
+  std::vector<uint16_t> pixels16;
+};
+
+bool IsJpeg(StringPiece contents) {
+  return contents.size() >= 3 && static_cast<uint8_t>(contents[0]) == 0xff &&
+         static_cast<uint8_t>(contents[1]) == 0xd8 &&
+         static_cast<uint8_t>(contents[2]) == 0xff;
+}
+
+Status Decode(StringPiece contents, DecodedImage* image) {
+  if (IsJpeg(contents)) {
+    tensorflow::jpeg::UncompressFlags flags;
+    flags.components = kChannels;
+    tensorflow::int64 warnings = 0;
+    const bool ok = tensorflow::jpeg::Uncompress(
+                        contents.data(), contents.size(), flags, &warnings,
+                        [image](int width, int height, int channels) {
+                          image->width = width;
+                          image->height = height;
+                          image->pixels8.resize(static_cast<size_t>(width) *
+                                                height * channels);
+                          return image->pixels8.data();
+                        }) != nullptr;
+    if (!ok) {
+      return tensorflow::errors::InvalidArgument("Invalid JPEG data.");
+    }
+    return Status::OK();
+  }
+
+  tensorflow::png::DecodeContext decode;
+  if (!tensorflow::png::CommonInitDecode(contents, kChannels, 16, &decode)) {
+    tensorflow::png::CommonFreeDecode(&decode);
+    return tensorflow::errors::InvalidArgument(
+        "Image data is neither JPEG nor PNG.");
+  }
+  image->width = decode.width;
+  image->height = decode.height;
+  image->pixels16.resize(static_cast<size_t>(decode.width) * decode.height *
+                         kChannels);
+  const bool ok = tensorflow::png::CommonFinishDecode(
+      reinterpret_cast<png_bytep>(image->pixels16.data()),
+      decode.width * kChannels * sizeof(uint16_t), &decode);
+  tensorflow::png::CommonFreeDecode(&decode);
+  if (!ok) {
+    return tensorflow::errors::InvalidArgument("Invalid PNG data.");
+  }
+  return Status::OK();
+}
+
+void Augment(const DecodedImage& image, const AugmentParams& params,
+             nda::array_ref_of_rank<float, 3> fullres,
+             nda::array_ref_of_rank<float, 3> lowres) {
+  const auto shape =
+      nda::shape_of_rank<3>(kChannels, image.width, image.height);
+  if (image.pixels16.empty()) {
+    AugmentImage(nda::make_array_ref(
+                     static_cast<const uint8_t*>(image.pixels8.data()), shape),
+                 params, 1.0f / 255.0f, fullres, lowres);
+  } else {
+    AugmentImage(
+        nda::make_array_ref(
+            static_cast<const uint16_t*>(image.pixels16.data()), shape),
+        params, 1.0f / 65535.0f, fullres, lowres);
+  }
+}
+
+// The random part of a sample's augmentation, drawn before decoding.
+struct AugmentDraw {
+  AugmentParams params;
+  uint32_t crop_y_bits = 0;
+  uint32_t crop_x_bits = 0;
+};
+
+}  // namespace
+
+// Decodes a batch of (input, output) image pairs and applies the training
+// augmentation of DataPipeline._augment_data: random flips, a random multiple
+// of 90 degree rotation, a (random or centered) crop to the output
+// resolution, and a nearest-neighbour resize of the crop to the low-res
+// network input. Each output pixel is read directly from the decoded image,
+// with no intermediate flipped, rotated or cropped copies, and samples are
+// processed in parallel on WorkerPool::Current().
+class DecodeAugmentPairOp : public OpKernel {
+ public:
+  explicit DecodeAugmentPairOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("output_height", &output_height_));
+    OP_REQUIRES_OK(context, context->GetAttr("output_width", &output_width_));
+    OP_REQUIRES_OK(context, context->GetAttr("lowres_size", &lowres_size_));
+    OP_REQUIRES_OK(context, context->GetAttr("fliplr", &fliplr_));
+    OP_REQUIRES_OK(context, context->GetAttr("flipud", &flipud_));
+    OP_REQUIRES_OK(context, context->GetAttr("rotate", &rotate_));
+    OP_REQUIRES_OK(context, context->GetAttr("random_crop", &random_crop_));
+    OP_REQUIRES(context,
+                output_height_ > 0 && output_width_ > 0 && lowres_size_ > 0,
+                tensorflow::errors::InvalidArgument(
+                    "Output sizes should be positive."));
+    OP_REQUIRES_OK(context, generator_.Init(context));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    // Grab the inputs.
+    const Tensor& input_contents = context->input(0);
+    const Tensor& output_contents = context->input(1);
+
+    OP_REQUIRES(context, input_contents.dims() == 1,
+                tensorflow::errors::InvalidArgument(
+                    "Input contents should be 1D (batch_size)."));
+    OP_REQUIRES(context, output_contents.shape() == input_contents.shape(),
+                tensorflow::errors::InvalidArgument(
+                    "Input and output contents should have the same shape."));
+    const int batch_size = input_contents.dim_size(0);
+
+    Tensor* outputs[4] = {nullptr, nullptr, nullptr, nullptr};
+    const TensorShape fullres_shape(
+        {batch_size, output_height_, output_width_, kChannels});
+    const TensorShape lowres_shape(
+        {batch_size, lowres_size_, lowres_size_, kChannels});
+    for (int i = 0; i < 4; ++i) {
+      OP_REQUIRES_OK(context,
+                     context->allocate_output(
+                         i, i < 2 ? fullres_shape : lowres_shape, &outputs[i]));
+    }
+
+    // Draw serially, so that the batch does not depend on the thread count.
+    std::vector<AugmentDraw> draws(batch_size);
+    tensorflow::random::PhiloxRandom philox =
+        generator_.ReserveSamples32(5 * batch_size);
+    tensorflow::random::SimplePhilox rng(&philox);
+    for (AugmentDraw& draw : draws) {
+      draw.params.flip_left_right = fliplr_ && rng.Uniform(2) == 1;
+      draw.params.flip_up_down = flipud_ && rng.Uniform(2) == 1;
+      draw.params.quarter_turns = rotate_ ? rng.Uniform(4) : 0;
+      draw.crop_y_bits = rng.Rand32();
+      draw.crop_x_bits = rng.Rand32();
+    }
+
+    const auto input_data = input_contents.flat<tensorflow::string>();
+    const auto output_data = output_contents.flat<tensorflow::string>();
+    const int64_t fullres_size =
+        static_cast<int64_t>(output_height_) * output_width_ * kChannels;
+    const int64_t lowres_size =
+        static_cast<int64_t>(lowres_size_) * lowres_size_ * kChannels;
+    std::vector<Status> status(batch_size);
+    WorkerPool::Current().ParallelFor(
+        batch_size, 2 * (fullres_size + lowres_size),
+        [&](int64_t begin, int64_t end) {
+          for (int64_t b = begin; b < end; ++b) {
+            status[b] = ProcessSample(
+                input_data(b), output_data(b), &draws[b],
+                outputs[0]->flat<float>().data() + b * fullres_size,
+                outputs[1]->flat<float>().data() + b * fullres_size,
+                outputs[2]->flat<float>().data() + b * lowres_size,
+                outputs[3]->flat<float>().data() + b * lowres_size);
+          }
+        });
+    for (const Status& s : status) {
+      OP_REQUIRES_OK(context, s);
+    }
+  }
+
+ private:
+  Status ProcessSample(StringPiece input_contents, StringPiece output_contents,
+                       AugmentDraw* draw, float* image_input,
+                       float* image_output, float* lowres_input,
+                       float* lowres_output) const {
+    DecodedImage input;
+    DecodedImage output;
+    TF_RETURN_IF_ERROR(Decode(input_contents, &input));
+    TF_RETURN_IF_ERROR(Decode(output_contents, &output));
+    if (input.width != output.width || input.height != output.height) {
+      return tensorflow::errors::InvalidArgument(
+          "Input and output images have different sizes: ", input.width, "x",
+          input.height, " and ", output.width, "x", output.height, ".");
+    }
+
+    const bool transposed = draw->params.quarter_turns % 2 == 1;
+    const int height = transposed ? input.width : input.height;
+    const int width = transposed ? input.height : input.width;
+    if (output_height_ > height || output_width_ > width) {
+      return tensorflow::errors::InvalidArgument(
+          "Crop of ", output_width_, "x", output_height_,
+          " does not fit in a ", width, "x", height, " image.");
+    }
+    if (random_crop_) {
+      draw->params.crop_y = draw->crop_y_bits % (height - output_height_ + 1);
+      draw->params.crop_x = draw->crop_x_bits % (width - output_width_ + 1);
+    } else {
+      draw->params.crop_y = (height - output_height_) / 2;
+      draw->params.crop_x = (width - output_width_) / 2;
+    }
+
+    // TF: (h, w, c), c changes fastest.
+    // nda: (c, w, h), c changes fastest.
+    const auto fullres_shape =
+        nda::shape_of_rank<3>(kChannels, output_width_, output_height_);
+    const auto lowres_shape =
+        nda::shape_of_rank<3>(kChannels, lowres_size_, lowres_size_);
+    Augment(input, draw->params, nda::make_array_ref(image_input, fullres_shape),
+            nda::make_array_ref(lowres_input, lowres_shape));
+    Augment(output, draw->params,
+            nda::make_array_ref(image_output, fullres_shape),
+            nda::make_array_ref(lowres_output, lowres_shape));
+    return Status::OK();
+  }
+
+  int output_height_;
+  int output_width_;
+  int lowres_size_;
+  bool fliplr_;
+  bool flipud_;
+  bool rotate_;
+  bool random_crop_;
+  GuardedPhiloxRandom generator_;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(
+    Name("DecodeAugmentPair").Device(tensorflow::DEVICE_CPU),
+    hdrnet::DecodeAugmentPairOp);
+
+REGISTER_OP("DecodeAugmentPair")
+    .Input("input_contents: string")
+    .Input("output_contents: string")
+    .Output("image_input: float")
+    .Output("image_output: float")
+    .Output("lowres_input: float")
+    .Output("lowres_output: float")
+    .Attr("output_height: int")
+    .Attr("output_width: int")
+    .Attr("lowres_size: int = 256")
+    .Attr("fliplr: bool = false")
+    .Attr("flipud: bool = false")
+    .Attr("rotate: bool = false")
+    .Attr("random_crop: bool = false")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetIsStateful()
+    .Doc(
+        "Decodes PNG or JPEG (input, output) pairs to RGB in [0, 1], then "
+        "flips, rotates and crops them, and resizes the crops to low-res.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle input_contents;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 1, &input_contents));
+      ShapeHandle output_contents;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 1, &output_contents));
+      TF_RETURN_IF_ERROR(
+          c->Merge(input_contents, output_contents, &input_contents));
+      int output_height;
+      int output_width;
+      int lowres_size;
+      TF_RETURN_IF_ERROR(c->GetAttr("output_height", &output_height));
+      TF_RETURN_IF_ERROR(c->GetAttr("output_width", &output_width));
+      TF_RETURN_IF_ERROR(c->GetAttr("lowres_size", &lowres_size));
+      const DimensionHandle batch_size = c->Dim(input_contents, 0);
+      const ShapeHandle fullres =
+          c->MakeShape({batch_size, output_height, output_width, 3});
+      const ShapeHandle lowres =
+          c->MakeShape({batch_size, lowres_size, lowres_size, 3});
+      c->set_output(0, fullres);
+      c->set_output(1, fullres);
+      c->set_output(2, lowres);
+      c->set_output(3, lowres);
+      return Status::OK();
+    });
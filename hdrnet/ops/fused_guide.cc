@@ -0,0 +1,257 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "fused_guide.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bilateral_slice_apply.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+CurveGuide::CurveGuide(int channels, int points, const float* params)
+    : channels_(channels), points_(points) {
+  ccm_ = params;
+  ccm_bias_ = ccm_ + channels * channels;
+  shifts_ = ccm_bias_ + channels;
+  slopes_ = shifts_ + channels * points;
+  mix_weights_ = slopes_ + channels * points;
+  mix_bias_ = mix_weights_ + channels;
+}
+
+float CurveGuide::Eval(const float* x) const {
+  float value = *mix_bias_;
+  for (int j = 0; j < channels_; ++j) {
+    float c = ccm_bias_[j];
+    for (int i = 0; i < channels_; ++i) {
+      c += x[i] * ccm_[i * channels_ + j];
+    }
+    float t = 0.0f;
+    for (int k = 0; k < points_; ++k) {
+      t += slopes_[j * points_ + k] *
+           std::max(c - shifts_[j * points_ + k], 0.0f);
+    }
+    value += mix_weights_[j] * t;
+  }
+  return std::min(std::max(value, 0.0f), 1.0f);
+}
+
+void CurveGuide::Backprop(const float* x, float dguide, float* dparams,
+                          float* dx) const {
+  float c[kMaxChannels];
+  float t[kMaxChannels];
+  float value = *mix_bias_;
+  for (int j = 0; j < channels_; ++j) {
+    c[j] = ccm_bias_[j];
+    for (int i = 0; i < channels_; ++i) {
+      c[j] += x[i] * ccm_[i * channels_ + j];
+    }
+    t[j] = 0.0f;
+    for (int k = 0; k < points_; ++k) {
+      t[j] += slopes_[j * points_ + k] *
+              std::max(c[j] - shifts_[j * points_ + k], 0.0f);
+    }
+    value += mix_weights_[j] * t[j];
+  }
+  // The gradient of tf.clip_by_value passes at the bounds.
+  if (value < 0.0f || value > 1.0f) {
+    return;
+  }
+
+  float* dccm = dparams;
+  float* dccm_bias = dccm + channels_ * channels_;
+  float* dshifts = dccm_bias + channels_;
+  float* dslopes = dshifts + channels_ * points_;
+  float* dmix_weights = dslopes + channels_ * points_;
+  float* dmix_bias = dmix_weights + channels_;
+
+  *dmix_bias += dguide;
+  for (int j = 0; j < channels_; ++j) {
+    dmix_weights[j] += dguide * t[j];
+    const float dt = dguide * mix_weights_[j];
+    float dc = 0.0f;
+    for (int k = 0; k < points_; ++k) {
+      const float a = c[j] - shifts_[j * points_ + k];
+      // As tf.nn.relu, no gradient at 0.
+      if (a > 0.0f) {
+        const float slope = slopes_[j * points_ + k];
+        dslopes[j * points_ + k] += dt * a;
+        dshifts[j * points_ + k] -= dt * slope;
+        dc += dt * slope;
+      }
+    }
+    dccm_bias[j] += dc;
+    for (int i = 0; i < channels_; ++i) {
+      dccm[i * channels_ + j] += x[i] * dc;
+      dx[i] += ccm_[i * channels_ + j] * dc;
+    }
+  }
+}
+
+PointwiseGuide::PointwiseGuide(int channels, int features, const float* params)
+    : channels_(channels), features_(features) {
+  weights1_ = params;
+  biases1_ = weights1_ + channels * features;
+  weights2_ = biases1_ + features;
+  bias2_ = weights2_ + features;
+}
+
+float PointwiseGuide::Eval(const float* x) const {
+  float value = *bias2_;
+  for (int f = 0; f < features_; ++f) {
+    float h = biases1_[f];
+    for (int i = 0; i < channels_; ++i) {
+      h += x[i] * weights1_[i * features_ + f];
+    }
+    value += weights2_[f] * std::max(h, 0.0f);
+  }
+  return 1.0f / (1.0f + std::exp(-value));
+}
+
+void PointwiseGuide::Backprop(const float* x, float dguide, float* dparams,
+                              float* dx) const {
+  float h[kMaxFeatures];
+  float value = *bias2_;
+  for (int f = 0; f < features_; ++f) {
+    h[f] = biases1_[f];
+    for (int i = 0; i < channels_; ++i) {
+      h[f] += x[i] * weights1_[i * features_ + f];
+    }
+    value += weights2_[f] * std::max(h[f], 0.0f);
+  }
+  const float sigmoid = 1.0f / (1.0f + std::exp(-value));
+  const float dvalue = dguide * sigmoid * (1.0f - sigmoid);
+
+  float* dweights1 = dparams;
+  float* dbiases1 = dweights1 + channels_ * features_;
+  float* dweights2 = dbiases1 + features_;
+  float* dbias2 = dweights2 + features_;
+
+  *dbias2 += dvalue;
+  for (int f = 0; f < features_; ++f) {
+    if (h[f] <= 0.0f) {
+      continue;
+    }
+    dweights2[f] += dvalue * h[f];
+    const float dh = dvalue * weights2_[f];
+    dbiases1[f] += dh;
+    for (int i = 0; i < channels_; ++i) {
+      dweights1[i * features_ + f] += x[i] * dh;
+      dx[i] += weights1_[i * features_ + f] * dh;
+    }
+  }
+}
+
+namespace {
+
+template <typename Guide>
+void EvalGuide(nda::array_ref_of_rank<const float, 4> input,
+               const Guide& guide, nda::array_ref_of_rank<float, 3> guide_map) {
+  const int width = input.dim<1>().extent();
+  const int height = input.dim<2>().extent();
+  const int batch_size = input.dim<3>().extent();
+  ParallelForRows(height, batch_size, width * guide.num_params(),
+                  [&](int y, int b) {
+                    for (int x = 0; x < width; ++x) {
+                      guide_map(x, y, b) = guide.Eval(&input(0, x, y, b));
+                    }
+                  });
+}
+
+}  // namespace
+
+template <typename Guide>
+void GuideSliceApply(nda::array_ref_of_rank<const float, 6> grid,
+                     nda::array_ref_of_rank<const float, 4> input,
+                     const Guide& guide,
+                     nda::array_ref_of_rank<float, 3> guide_map,
+                     nda::array_ref_of_rank<float, 4> out) {
+  EvalGuide(input, guide, guide_map);
+  TunedBilateralSliceApply(grid, guide_map, input, out);
+}
+
+template <typename Guide>
+void GuideSliceApplyGrad(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const Guide& guide,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 3> guide_vjp_map,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out, float* params_vjp_out) {
+  EvalGuide(input, guide, guide_map);
+  BilateralSliceApplyGridGrad(guide_map, input, codomain_tangent, grid_vjp_out);
+  BilateralSliceApplyInputGrad(grid, guide_map, codomain_tangent,
+                               input_vjp_out);
+  BilateralSliceApplyGuideGrad(grid, guide_map, input, codomain_tangent,
+                               guide_vjp_map);
+
+  // Chain the guide gradient through the guide. The parameter gradients are
+  // reduced per row, then over rows in order, so that the result does not
+  // depend on the schedule.
+  const int width = input.dim<1>().extent();
+  const int height = input.dim<2>().extent();
+  const int batch_size = input.dim<3>().extent();
+  const int num_params = guide.num_params();
+  std::vector<float> row_params_vjp(
+      static_cast<size_t>(height) * batch_size * num_params, 0.0f);
+  ParallelForRows(height, batch_size, width * num_params, [&](int y, int b) {
+    float* params_vjp =
+        &row_params_vjp[(static_cast<size_t>(b) * height + y) * num_params];
+    for (int x = 0; x < width; ++x) {
+      guide.Backprop(&input(0, x, y, b), guide_vjp_map(x, y, b), params_vjp,
+                     &input_vjp_out(0, x, y, b));
+    }
+  });
+  std::fill(params_vjp_out, params_vjp_out + num_params, 0.0f);
+  for (int row = 0; row < height * batch_size; ++row) {
+    const float* params_vjp =
+        &row_params_vjp[static_cast<size_t>(row) * num_params];
+    for (int p = 0; p < num_params; ++p) {
+      params_vjp_out[p] += params_vjp[p];
+    }
+  }
+}
+
+template void GuideSliceApply<CurveGuide>(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const CurveGuide& guide,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 4> out);
+template void GuideSliceApply<PointwiseGuide>(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const PointwiseGuide& guide,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 4> out);
+template void GuideSliceApplyGrad<CurveGuide>(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const CurveGuide& guide,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 3> guide_vjp_map,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out, float* params_vjp_out);
+template void GuideSliceApplyGrad<PointwiseGuide>(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const PointwiseGuide& guide,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 3> guide_vjp_map,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out, float* params_vjp_out);
+
+}  // namespace hdrnet
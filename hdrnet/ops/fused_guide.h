@@ -0,0 +1,124 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_FUSED_GUIDE_H_
+#define HDRNET_OPS_FUSED_GUIDE_H_
+
+#include "third_party/array/array.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+// The guides of models.py as per-pixel functions of the input, so that
+// training can recompute them instead of keeping their full-res activations.
+//
+// A guide has `num_params()` parameters, packed in one flat array in the
+// order of the model's variables. Eval() maps an input pixel (`channels`
+// values) to the guide value; Backprop() adds `dguide` times the gradient of
+// Eval() with respect to the parameters to `dparams`, and with respect to the
+// pixel to `dx`.
+
+// HDRNetCurves._guide:
+//   c = x * ccm + ccm_bias
+//   t[j] = sum_k slopes[j][k] * relu(c[j] - shifts[j][k])
+//   guide = clip(sum_j mix_weights[j] * t[j] + mix_bias, 0, 1)
+// Parameters: ccm (channels, channels) as (in, out), ccm_bias (channels),
+// shifts and slopes (channels, points), mix_weights (channels), mix_bias (1).
+class CurveGuide {
+ public:
+  static constexpr int kMaxChannels = 4;
+
+  CurveGuide(int channels, int points, const float* params);
+
+  static int NumParams(int channels, int points) {
+    return channels * channels + channels + 2 * channels * points + channels +
+           1;
+  }
+
+  int channels() const { return channels_; }
+  int num_params() const { return NumParams(channels_, points_); }
+
+  float Eval(const float* x) const;
+  void Backprop(const float* x, float dguide, float* dparams, float* dx) const;
+
+ private:
+  int channels_;
+  int points_;
+  const float* ccm_;
+  const float* ccm_bias_;
+  const float* shifts_;
+  const float* slopes_;
+  const float* mix_weights_;
+  const float* mix_bias_;
+};
+
+// HDRNetPointwiseNNGuide._guide, with the first layer's batch normalization
+// folded into its weights and biases by the caller:
+//   h = relu(x * weights1 + biases1)
+//   guide = sigmoid(h * weights2 + bias2)
+// Parameters: weights1 (channels, features), biases1 (features),
+// weights2 (features), bias2 (1).
+class PointwiseGuide {
+ public:
+  static constexpr int kMaxChannels = 4;
+  static constexpr int kMaxFeatures = 64;
+
+  PointwiseGuide(int channels, int features, const float* params);
+
+  static int NumParams(int channels, int features) {
+    return channels * features + 2 * features + 1;
+  }
+
+  int channels() const { return channels_; }
+  int num_params() const { return NumParams(channels_, features_); }
+
+  float Eval(const float* x) const;
+  void Backprop(const float* x, float dguide, float* dparams, float* dx) const;
+
+ private:
+  int channels_;
+  int features_;
+  const float* weights1_;
+  const float* biases1_;
+  const float* weights2_;
+  const float* bias2_;
+};
+
+// BilateralSliceApply(grid, guide(input), input), see bilateral_slice_apply.h.
+// `guide_map` (w, h, b) is scratch for the guide: one value per pixel instead
+// of the guide network's activations.
+template <typename Guide>
+void GuideSliceApply(nda::array_ref_of_rank<const float, 6> grid,
+                     nda::array_ref_of_rank<const float, 4> input,
+                     const Guide& guide,
+                     nda::array_ref_of_rank<float, 3> guide_map,
+                     nda::array_ref_of_rank<float, 4> out);
+
+// The gradients of GuideSliceApply with respect to `grid`, `input` (through
+// both the slice-apply and the guide) and the guide parameters, reduced over
+// all pixels into `params_vjp_out` (guide.num_params() values). The guide is
+// recomputed into `guide_map`; `guide_vjp_map` (w, h, b) is scratch too.
+template <typename Guide>
+void GuideSliceApplyGrad(
+    nda::array_ref_of_rank<const float, 6> grid,
+    nda::array_ref_of_rank<const float, 4> input, const Guide& guide,
+    nda::array_ref_of_rank<const float, 4> codomain_tangent,
+    nda::array_ref_of_rank<float, 3> guide_map,
+    nda::array_ref_of_rank<float, 3> guide_vjp_map,
+    nda::array_ref_of_rank<float, 6> grid_vjp_out,
+    nda::array_ref_of_rank<float, 4> input_vjp_out, float* params_vjp_out);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_FUSED_GUIDE_H_
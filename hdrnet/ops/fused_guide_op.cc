@@ -0,0 +1,416 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "fused_guide.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::DimensionHandle;
+using ::tensorflow::shape_inference::InferenceContext;
+using ::tensorflow::shape_inference::ShapeHandle;
+
+namespace hdrnet {
+namespace {
+
+// How the parameters of each guide come in as op inputs, after the grid and
+// the input image: parameter k is input 2 + k. `extent` is the guide's second
+// size (curve points or features), read off the parameter shapes, up to
+// kMaxExtent.
+struct CurveGuideInputs {
+  using Guide = CurveGuide;
+  static constexpr int kNumParams = 6;
+  static constexpr int kMaxExtent = std::numeric_limits<int>::max();
+
+  // ccm, ccm_bias, shifts, slopes, mix_weights, mix_bias.
+  static int Extent(OpKernelContext* context, int channels) {
+    return context->input(2 + 2).NumElements() / channels;
+  }
+  static std::vector<int64_t> Sizes(int channels, int points) {
+    return {channels * channels, channels, channels * points,
+            channels * points,   channels, 1};
+  }
+};
+
+struct PointwiseGuideInputs {
+  using Guide = PointwiseGuide;
+  static constexpr int kNumParams = 4;
+  // Backprop keeps the hidden features on the stack.
+  static constexpr int kMaxExtent = PointwiseGuide::kMaxFeatures;
+
+  // weights1, biases1, weights2, bias2.
+  static int Extent(OpKernelContext* context, int channels) {
+    return context->input(2 + 1).NumElements();
+  }
+  static std::vector<int64_t> Sizes(int channels, int features) {
+    return {channels * features, features, features, 1};
+  }
+};
+
+// Checks the shapes shared by the forward and gradient ops, and packs the
+// guide parameters (inputs 2 to 2 + kNumParams) into `packed`.
+template <typename Inputs>
+Status ReadInputs(OpKernelContext* context, bool has_offset, int* extent,
+                  std::vector<float>* packed) {
+  const Tensor& grid = context->input(0);
+  const Tensor& input = context->input(1);
+  if (grid.dims() != 5) {
+    return tensorflow::errors::InvalidArgument(
+        "Input grid should be 5D (batch_size, height, width, depth, "
+        "output_channels * input_channels)");
+  }
+  if (input.dims() != 4) {
+    return tensorflow::errors::InvalidArgument(
+        "Input image should be 4D (batch_size, height, width, "
+        "input_channels)");
+  }
+  if (input.dim_size(0) != grid.dim_size(0)) {
+    return tensorflow::errors::InvalidArgument("Batch sizes should match.");
+  }
+  const int input_channels = input.dim_size(3);
+  const int grid_input_channels =
+      has_offset ? input_channels + 1 : input_channels;
+  if (grid.dim_size(4) % grid_input_channels != 0) {
+    return tensorflow::errors::InvalidArgument(
+        "Grid should have output_channels * ",
+        has_offset ? "(input_channels + 1)" : "input_channels", " channels.");
+  }
+  if (input_channels <= 0 || input_channels > Inputs::Guide::kMaxChannels) {
+    return tensorflow::errors::InvalidArgument(
+        "The guide supports up to ", Inputs::Guide::kMaxChannels,
+        " input channels.");
+  }
+
+  *extent = Inputs::Extent(context, input_channels);
+  if (*extent > Inputs::kMaxExtent) {
+    return tensorflow::errors::InvalidArgument(
+        "The guide supports up to ", Inputs::kMaxExtent, " features, got ",
+        *extent, ".");
+  }
+  const std::vector<int64_t> sizes = Inputs::Sizes(input_channels, *extent);
+  packed->clear();
+  for (int p = 0; p < Inputs::kNumParams; ++p) {
+    const Tensor& param = context->input(2 + p);
+    if (param.NumElements() != sizes[p]) {
+      return tensorflow::errors::InvalidArgument(
+          "Guide parameter ", p, " has ", param.NumElements(),
+          " values, expected ", sizes[p], ".");
+    }
+    const auto values = param.flat<float>();
+    packed->insert(packed->end(), values.data(),
+                   values.data() + values.size());
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+// BilateralSliceApply(grid, guide(input), input), where guide() is the guide
+// network of HDRNetCurves or HDRNetPointwiseNNGuide, evaluated per pixel.
+template <typename Inputs>
+class GuideSliceApplyOp : public OpKernel {
+ public:
+  explicit GuideSliceApplyOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    int extent = 0;
+    std::vector<float> params;
+    OP_REQUIRES_OK(context, ReadInputs<Inputs>(context, has_offset_, &extent,
+                                               &params));
+    const Tensor& grid = context->input(0);
+    const Tensor& input = context->input(1);
+
+    // Input shapes.
+    const int batch_size = grid.dim_size(0);
+    const int grid_height = grid.dim_size(1);
+    const int grid_width = grid.dim_size(2);
+    const int grid_depth = grid.dim_size(3);
+    const int grid_channels = grid.dim_size(4);
+    const int height = input.dim_size(1);
+    const int width = input.dim_size(2);
+    const int input_channels = input.dim_size(3);
+    const int grid_input_channels =
+        has_offset_ ? input_channels + 1 : input_channels;
+    const int output_channels = grid_channels / grid_input_channels;
+
+    Tensor* output = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       0, TensorShape({batch_size, height, width,
+                                       output_channels}),
+                       &output));
+    Tensor guide_map;
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                tensorflow::DT_FLOAT,
+                                TensorShape({batch_size, height, width}),
+                                &guide_map));
+
+    // TF: (b, h, w, d, c), c changes fastest.
+    // nda: reinterpreted as (j, i, d, w, h, b), j changes fastest, then i.
+    auto grid_ref = nda::make_array_ref(
+        grid.flat<float>().data(),
+        nda::shape_of_rank<6>(grid_input_channels, output_channels, grid_depth,
+                              grid_width, grid_height, batch_size));
+    // TF: (b, h, w, c), c changes fastest.
+    // nda: (c, w, h, b), c changes fastest.
+    auto input_ref = nda::make_array_ref(
+        input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, width, height, batch_size));
+    auto output_ref = nda::make_array_ref(
+        output->flat<float>().data(),
+        nda::shape_of_rank<4>(output_channels, width, height, batch_size));
+    auto guide_map_ref =
+        nda::make_array_ref(guide_map.flat<float>().data(),
+                            nda::shape_of_rank<3>(width, height, batch_size));
+
+    const typename Inputs::Guide guide(input_channels, extent, params.data());
+    GuideSliceApply(grid_ref, input_ref, guide, guide_map_ref, output_ref);
+  }
+
+ private:
+  bool has_offset_;
+};
+
+// Gradients of GuideSliceApplyOp with respect to the grid, the input and each
+// guide parameter. The guide is recomputed, so no guide activations need to
+// be kept from the forward pass.
+template <typename Inputs>
+class GuideSliceApplyGradOp : public OpKernel {
+ public:
+  explicit GuideSliceApplyGradOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("has_offset", &has_offset_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    int extent = 0;
+    std::vector<float> params;
+    OP_REQUIRES_OK(context, ReadInputs<Inputs>(context, has_offset_, &extent,
+                                               &params));
+    const Tensor& grid = context->input(0);
+    const Tensor& input = context->input(1);
+    const Tensor& codomain_tangent = context->input(2 + Inputs::kNumParams);
+
+    // Input shapes.
+    const int batch_size = grid.dim_size(0);
+    const int grid_height = grid.dim_size(1);
+    const int grid_width = grid.dim_size(2);
+    const int grid_depth = grid.dim_size(3);
+    const int grid_channels = grid.dim_size(4);
+    const int height = input.dim_size(1);
+    const int width = input.dim_size(2);
+    const int input_channels = input.dim_size(3);
+    const int grid_input_channels =
+        has_offset_ ? input_channels + 1 : input_channels;
+    const int output_channels = grid_channels / grid_input_channels;
+    OP_REQUIRES(context,
+                codomain_tangent.shape() ==
+                    TensorShape({batch_size, height, width, output_channels}),
+                tensorflow::errors::InvalidArgument(
+                    "Backprop should have the shape of the output."));
+
+    // Allocate vjp buffers, which have the same shape as the primals.
+    Tensor* grid_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(0, grid.shape(), &grid_vjp));
+    Tensor* input_vjp = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(1, input.shape(), &input_vjp));
+    Tensor guide_map;
+    OP_REQUIRES_OK(context, context->allocate_temp(
+                                tensorflow::DT_FLOAT,
+                                TensorShape({batch_size, height, width}),
+                                &guide_map));
+    Tensor guide_vjp_map;
+    OP_REQUIRES_OK(context, context->allocate_temp(tensorflow::DT_FLOAT,
+                                                   guide_map.shape(),
+                                                   &guide_vjp_map));
+
+    auto grid_ref = nda::make_array_ref(
+        grid.flat<float>().data(),
+        nda::shape_of_rank<6>(grid_input_channels, output_channels, grid_depth,
+                              grid_width, grid_height, batch_size));
+    auto grid_vjp_ref =
+        nda::make_array_ref(grid_vjp->flat<float>().data(), grid_ref.shape());
+    auto input_ref = nda::make_array_ref(
+        input.flat<float>().data(),
+        nda::shape_of_rank<4>(input_channels, width, height, batch_size));
+    auto input_vjp_ref = nda::make_array_ref(input_vjp->flat<float>().data(),
+                                             input_ref.shape());
+    auto codomain_tangent_ref = nda::make_array_ref(
+        codomain_tangent.flat<float>().data(),
+        nda::shape_of_rank<4>(output_channels, width, height, batch_size));
+    const auto map_shape = nda::shape_of_rank<3>(width, height, batch_size);
+    auto guide_map_ref =
+        nda::make_array_ref(guide_map.flat<float>().data(), map_shape);
+    auto guide_vjp_map_ref =
+        nda::make_array_ref(guide_vjp_map.flat<float>().data(), map_shape);
+
+    const typename Inputs::Guide guide(input_channels, extent, params.data());
+    std::vector<float> params_vjp(params.size());
+    GuideSliceApplyGrad(grid_ref, input_ref, guide, codomain_tangent_ref,
+                        guide_map_ref, guide_vjp_map_ref, grid_vjp_ref,
+                        input_vjp_ref, params_vjp.data());
+
+    // Unpack the parameter gradients, in the shapes of the parameters.
+    const float* next = params_vjp.data();
+    for (int p = 0; p < Inputs::kNumParams; ++p) {
+      const Tensor& param = context->input(2 + p);
+      Tensor* param_vjp = nullptr;
+      OP_REQUIRES_OK(context, context->allocate_output(2 + p, param.shape(),
+                                                       &param_vjp));
+      std::copy(next, next + param.NumElements(),
+                param_vjp->flat<float>().data());
+      next += param.NumElements();
+    }
+  }
+
+ private:
+  bool has_offset_;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(
+    Name("CurveGuideSliceApply").Device(tensorflow::DEVICE_CPU),
+    hdrnet::GuideSliceApplyOp<hdrnet::CurveGuideInputs>);
+REGISTER_KERNEL_BUILDER(
+    Name("CurveGuideSliceApplyGrad").Device(tensorflow::DEVICE_CPU),
+    hdrnet::GuideSliceApplyGradOp<hdrnet::CurveGuideInputs>);
+REGISTER_KERNEL_BUILDER(
+    Name("PointwiseGuideSliceApply").Device(tensorflow::DEVICE_CPU),
+    hdrnet::GuideSliceApplyOp<hdrnet::PointwiseGuideInputs>);
+REGISTER_KERNEL_BUILDER(
+    Name("PointwiseGuideSliceApplyGrad").Device(tensorflow::DEVICE_CPU),
+    hdrnet::GuideSliceApplyGradOp<hdrnet::PointwiseGuideInputs>);
+
+namespace {
+
+Status GuideSliceApplyShape(InferenceContext* c) {
+  ShapeHandle grid;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(0), 5, &grid));
+  ShapeHandle input_image;
+  TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 4, &input_image));
+  const DimensionHandle batch_size = c->Dim(grid, 0);
+  const DimensionHandle h = c->Dim(input_image, 1);
+  const DimensionHandle w = c->Dim(input_image, 2);
+  bool has_offset;
+  TF_RETURN_IF_ERROR(c->GetAttr("has_offset", &has_offset));
+  DimensionHandle grid_input_channels = c->Dim(input_image, 3);
+  if (has_offset) {
+    TF_RETURN_IF_ERROR(
+        c->Add(grid_input_channels, 1, &grid_input_channels));
+  }
+  DimensionHandle output_channels;
+  TF_RETURN_IF_ERROR(c->Divide(c->Dim(grid, 4), grid_input_channels,
+                               /*evenly_divisible=*/true, &output_channels));
+  c->set_output(0, c->MakeShape({batch_size, h, w, output_channels}));
+  return Status::OK();
+}
+
+// Gradients have the shapes of the primals, the inputs before `backprop`.
+Status GuideSliceApplyGradShape(InferenceContext* c) {
+  for (int i = 0; i < c->num_outputs(); ++i) {
+    c->set_output(i, c->input(i));
+  }
+  return Status::OK();
+}
+
+}  // namespace
+
+REGISTER_OP("CurveGuideSliceApply")
+    .Input("grid: float")
+    .Input("input: float")
+    .Input("ccm: float")
+    .Input("ccm_bias: float")
+    .Input("shifts: float")
+    .Input("slopes: float")
+    .Input("mix_weights: float")
+    .Input("mix_bias: float")
+    .Attr("has_offset: bool")
+    .Output("out: float")
+    .Doc(
+        "BilateralSliceApply with the HDRNetCurves guide computed from input "
+        "per pixel.")
+    .SetShapeFn(GuideSliceApplyShape);
+
+REGISTER_OP("CurveGuideSliceApplyGrad")
+    .Input("grid: float")
+    .Input("input: float")
+    .Input("ccm: float")
+    .Input("ccm_bias: float")
+    .Input("shifts: float")
+    .Input("slopes: float")
+    .Input("mix_weights: float")
+    .Input("mix_bias: float")
+    .Input("backprop: float")
+    .Attr("has_offset: bool")
+    .Output("grid_grad: float")
+    .Output("input_grad: float")
+    .Output("ccm_grad: float")
+    .Output("ccm_bias_grad: float")
+    .Output("shifts_grad: float")
+    .Output("slopes_grad: float")
+    .Output("mix_weights_grad: float")
+    .Output("mix_bias_grad: float")
+    .SetShapeFn(GuideSliceApplyGradShape);
+
+REGISTER_OP("PointwiseGuideSliceApply")
+    .Input("grid: float")
+    .Input("input: float")
+    .Input("weights1: float")
+    .Input("biases1: float")
+    .Input("weights2: float")
+    .Input("bias2: float")
+    .Attr("has_offset: bool")
+    .Output("out: float")
+    .Doc(
+        "BilateralSliceApply with the HDRNetPointwiseNNGuide guide computed "
+        "from input per pixel. Batch normalization is folded into weights1 and "
+        "biases1.")
+    .SetShapeFn(GuideSliceApplyShape);
+
+REGISTER_OP("PointwiseGuideSliceApplyGrad")
+    .Input("grid: float")
+    .Input("input: float")
+    .Input("weights1: float")
+    .Input("biases1: float")
+    .Input("weights2: float")
+    .Input("bias2: float")
+    .Input("backprop: float")
+    .Attr("has_offset: bool")
+    .Output("grid_grad: float")
+    .Output("input_grad: float")
+    .Output("weights1_grad: float")
+    .Output("biases1_grad: float")
+    .Output("weights2_grad: float")
+    .Output("bias2_grad: float")
+    .SetShapeFn(GuideSliceApplyGradShape);
@@ -0,0 +1,567 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A Grappler pass rewriting the guide subgraphs of HDRNetCurves and
+// HDRNetPointwiseNNGuide, together with the BilateralSliceApply they feed,
+// into CurveGuideSliceApply and PointwiseGuideSliceApply (fused_guide_op.cc).
+// Graphs built before the fused ops existed get them without re-exporting.
+//
+// It is registered as "HDRNetGuideFusion" when the op library is loaded, and
+// runs when a session's RewriterConfig lists it in custom_optimizers (see
+// hdrnet_ops.enable_guide_fusion).
+//
+// The fused ops are CPU only: slice-apply nodes placed on another device are
+// left alone, unless the "move_to_cpu" parameter is set, in which case the
+// fused node moves to the CPU of the same task. That is cheap when the input
+// comes from the host and the output goes back to it, as in bin/run.py, since
+// only the grid then crosses devices. The guide nodes are left in place: they
+// are pruned if nothing else reads them. Every rewrite is checked against the
+// statically inferred shapes, and anything that does not match exactly is
+// left alone.
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "fused_guide.h"
+#include "third_party/tensorflow/core/framework/attr_value.pb.h"
+#include "third_party/tensorflow/core/framework/graph.pb.h"
+#include "third_party/tensorflow/core/framework/node_def.pb.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+#include "third_party/tensorflow/core/grappler/costs/graph_properties.h"
+#include "third_party/tensorflow/core/grappler/grappler_item.h"
+#include "third_party/tensorflow/core/grappler/optimizers/custom_graph_optimizer.h"
+#include "third_party/tensorflow/core/grappler/optimizers/custom_graph_optimizer_registry.h"
+#include "third_party/tensorflow/core/grappler/utils.h"
+#include "third_party/tensorflow/core/util/device_name_utils.h"
+
+using ::tensorflow::AttrValue;
+using ::tensorflow::GraphDef;
+using ::tensorflow::NodeDef;
+using ::tensorflow::PartialTensorShape;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::grappler::Cluster;
+using ::tensorflow::grappler::CustomGraphOptimizer;
+using ::tensorflow::grappler::GraphProperties;
+using ::tensorflow::grappler::GrapplerItem;
+using ::tensorflow::grappler::NodeMap;
+
+namespace hdrnet {
+namespace {
+
+// Walks a graph from a node to the producers of its inputs.
+class Matcher {
+ public:
+  Matcher(const NodeMap& node_map, const GraphProperties& properties)
+      : node_map_(node_map), properties_(properties) {}
+
+  // The producer of data input `i` of `node` if it is output 0 of an `op`
+  // node (any of them if `op` lists several, separated by '|'), or nullptr.
+  const NodeDef* Input(const NodeDef* node, int i,
+                       const std::string& op) const {
+    if (node == nullptr || i >= node->input_size() ||
+        tensorflow::grappler::NodePosition(node->input(i)) != 0) {
+      return nullptr;
+    }
+    const NodeDef* input = node_map_.GetNode(node->input(i));
+    if (input == nullptr) {
+      return nullptr;
+    }
+    for (size_t begin = 0; begin <= op.size();) {
+      size_t end = op.find('|', begin);
+      if (end == std::string::npos) {
+        end = op.size();
+      }
+      if (input->op() == op.substr(begin, end - begin)) {
+        return input;
+      }
+      begin = end + 1;
+    }
+    return nullptr;
+  }
+
+  // The values of data input `i` of `node` if it is a constant, looking
+  // through Identity nodes.
+  bool ConstInput(const NodeDef* node, int i,
+                  std::vector<double>* values) const {
+    const NodeDef* input = Input(node, i, "Const|Identity");
+    while (input != nullptr && input->op() == "Identity") {
+      input = Input(input, 0, "Const|Identity");
+    }
+    if (input == nullptr || input->attr().count("value") == 0) {
+      return false;
+    }
+    Tensor tensor;
+    if (!tensor.FromProto(input->attr().at("value").tensor())) {
+      return false;
+    }
+    values->clear();
+    for (int64_t k = 0; k < tensor.NumElements(); ++k) {
+      switch (tensor.dtype()) {
+        case tensorflow::DT_FLOAT:
+          values->push_back(tensor.flat<float>()(k));
+          break;
+        case tensorflow::DT_INT32:
+          values->push_back(tensor.flat<int32_t>()(k));
+          break;
+        case tensorflow::DT_INT64:
+          values->push_back(tensor.flat<int64_t>()(k));
+          break;
+        default:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  bool ConstInputIs(const NodeDef* node, int i, double value) const {
+    std::vector<double> values;
+    return ConstInput(node, i, &values) && values.size() == 1 &&
+           values[0] == value;
+  }
+
+  // The statically known shape of data input `i` of `node`, or an unknown
+  // shape.
+  PartialTensorShape InputShape(const NodeDef* node, int i) const {
+    const auto& inputs = properties_.GetInputProperties(node->name());
+    if (i >= static_cast<int>(inputs.size()) ||
+        inputs[i].dtype() != tensorflow::DT_FLOAT) {
+      return PartialTensorShape();
+    }
+    return PartialTensorShape(inputs[i].shape());
+  }
+
+  // Whether data input `i` of `node` has exactly the shape `dims`.
+  bool InputShapeIs(const NodeDef* node, int i,
+                    const std::vector<int64_t>& dims) const {
+    const PartialTensorShape shape = InputShape(node, i);
+    if (!shape.IsFullyDefined() ||
+        shape.dims() != static_cast<int>(dims.size())) {
+      return false;
+    }
+    for (size_t d = 0; d < dims.size(); ++d) {
+      if (shape.dim_size(d) != dims[d]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether data inputs `i` of `a` and `j` of `b` are the same tensor.
+  static bool SameInput(const NodeDef* a, int i, const NodeDef* b, int j) {
+    using ::tensorflow::grappler::NodeName;
+    using ::tensorflow::grappler::NodePosition;
+    return NodeName(a->input(i)) == NodeName(b->input(j)) &&
+           NodePosition(a->input(i)) == NodePosition(b->input(j));
+  }
+
+ private:
+  const NodeMap& node_map_;
+  const GraphProperties& properties_;
+};
+
+bool HasIntList(const NodeDef* node, const std::string& name,
+                const std::vector<int64_t>& values) {
+  const auto it = node->attr().find(name);
+  if (it == node->attr().end() ||
+      it->second.list().i_size() != static_cast<int>(values.size())) {
+    return false;
+  }
+  for (size_t k = 0; k < values.size(); ++k) {
+    if (it->second.list().i(k) != values[k]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool HasBool(const NodeDef* node, const std::string& name, bool value) {
+  const auto it = node->attr().find(name);
+  return it == node->attr().end() ? !value : it->second.b() == value;
+}
+
+// A 1x1, stride 1, NHWC convolution.
+bool IsPointwiseConv(const NodeDef* conv) {
+  const auto format = conv->attr().find("data_format");
+  if (format != conv->attr().end() && format->second.s() != "NHWC") {
+    return false;
+  }
+  const auto dilations = conv->attr().find("dilations");
+  if (dilations != conv->attr().end() &&
+      !HasIntList(conv, "dilations", {1, 1, 1, 1})) {
+    return false;
+  }
+  return HasIntList(conv, "strides", {1, 1, 1, 1});
+}
+
+// Either operand of a commutative node: sets `a` to the input matching
+// `a_op` and returns the index of the other one, or returns -1.
+int MatchEither(const Matcher& m, const NodeDef* node, const std::string& a_op,
+                const NodeDef** a) {
+  for (int k = 0; k < 2; ++k) {
+    *a = m.Input(node, k, a_op);
+    if (*a != nullptr) {
+      return 1 - k;
+    }
+  }
+  return -1;
+}
+
+// What replaces a slice-apply node: the fused op and its guide parameters,
+// as tensor names, and the nodes to add to compute those that are not in the
+// graph already.
+struct Rewrite {
+  std::string op;
+  std::vector<std::string> params;
+  std::vector<NodeDef> new_nodes;
+};
+
+// HDRNetCurves._guide feeding `slice`:
+//   Squeeze(Maximum(Minimum(BiasAdd(Conv2D(
+//     Sum(Mul(slopes, Relu(Sub(ExpandDims(Reshape(BiasAdd(MatMul(
+//       Reshape(input), ccm), ccm_bias)), 4), shifts))), 4),
+//     mix_weights), mix_bias), 1), 0), 3)
+bool MatchCurveGuide(const Matcher& m, const NodeDef* slice, int channels,
+                     Rewrite* rewrite) {
+  const NodeDef* squeeze = m.Input(slice, 1, "Squeeze");
+  if (squeeze == nullptr || !(HasIntList(squeeze, "squeeze_dims", {3}) ||
+                              HasIntList(squeeze, "squeeze_dims", {-1}))) {
+    return false;
+  }
+  const NodeDef* max = m.Input(squeeze, 0, "Maximum");
+  const NodeDef* min = m.Input(max, 0, "Minimum");
+  if (min == nullptr || !m.ConstInputIs(max, 1, 0.0) ||
+      !m.ConstInputIs(min, 1, 1.0)) {
+    return false;
+  }
+  const NodeDef* mix_bias_add = m.Input(min, 0, "BiasAdd");
+  const NodeDef* mix = m.Input(mix_bias_add, 0, "Conv2D");
+  if (mix == nullptr || !IsPointwiseConv(mix) ||
+      !m.InputShapeIs(mix, 1, {1, 1, channels, 1}) ||
+      !m.InputShapeIs(mix_bias_add, 1, {1})) {
+    return false;
+  }
+
+  const NodeDef* sum = m.Input(mix, 0, "Sum");
+  std::vector<double> axes;
+  if (sum == nullptr || !m.ConstInput(sum, 1, &axes) || axes.size() != 1 ||
+      !(axes[0] == 4 || axes[0] == -1) || !HasBool(sum, "keep_dims", false)) {
+    return false;
+  }
+  const NodeDef* relu = nullptr;
+  const NodeDef* curve = m.Input(sum, 0, "Mul");
+  const int slopes_index = MatchEither(m, curve, "Relu", &relu);
+  const NodeDef* sub = m.Input(relu, 0, "Sub");
+  const NodeDef* expand = m.Input(sub, 0, "ExpandDims");
+  if (slopes_index < 0 || expand == nullptr ||
+      !(m.ConstInputIs(expand, 1, 4) || m.ConstInputIs(expand, 1, -1))) {
+    return false;
+  }
+  // shifts and slopes broadcast as (channels, points) over the last two
+  // dimensions.
+  const PartialTensorShape shifts = m.InputShape(sub, 1);
+  const PartialTensorShape slopes = m.InputShape(curve, slopes_index);
+  if (!shifts.IsFullyDefined() || shifts.dims() < 2 ||
+      !slopes.IsSameSize(PartialTensorShape({1, 1, 1, channels,
+                                             shifts.dim_size(
+                                                 shifts.dims() - 1)}))) {
+    return false;
+  }
+  const int64_t points = shifts.dim_size(shifts.dims() - 1);
+  for (int d = 0; d < shifts.dims(); ++d) {
+    const int64_t expected = d == shifts.dims() - 1   ? points
+                             : d == shifts.dims() - 2 ? channels
+                                                      : 1;
+    if (shifts.dim_size(d) != expected) {
+      return false;
+    }
+  }
+
+  const NodeDef* reshape = m.Input(expand, 0, "Reshape");
+  const NodeDef* ccm_bias_add = m.Input(reshape, 0, "BiasAdd");
+  const NodeDef* ccm = m.Input(ccm_bias_add, 0, "MatMul");
+  const NodeDef* flatten = m.Input(ccm, 0, "Reshape");
+  if (flatten == nullptr || !HasBool(ccm, "transpose_a", false) ||
+      !HasBool(ccm, "transpose_b", false) ||
+      !m.InputShapeIs(ccm, 1, {channels, channels}) ||
+      !m.InputShapeIs(ccm_bias_add, 1, {channels}) ||
+      !Matcher::SameInput(flatten, 0, slice, 2)) {
+    return false;
+  }
+
+  rewrite->op = "CurveGuideSliceApply";
+  rewrite->params = {ccm->input(1),  ccm_bias_add->input(1),
+                     sub->input(1),  curve->input(slopes_index),
+                     mix->input(1),  mix_bias_add->input(1)};
+  return true;
+}
+
+NodeDef NewNode(const NodeDef* slice, const std::string& name,
+                const std::string& op, const std::vector<std::string>& inputs) {
+  NodeDef node;
+  node.set_name(slice->name() + "/fused_guide/" + name);
+  node.set_op(op);
+  node.set_device(slice->device());
+  for (const std::string& input : inputs) {
+    node.add_input(input);
+  }
+  (*node.mutable_attr())["T"].set_type(tensorflow::DT_FLOAT);
+  return node;
+}
+
+// HDRNetPointwiseNNGuide._guide feeding `slice`:
+//   Squeeze(Sigmoid(BiasAdd(Conv2D(Relu(normalized), weights2), bias2)), 3)
+// where `normalized` is conv1 = Conv2D(input, weights1) followed by one of:
+// - BiasAdd or Add of biases1 (no batch norm, or folded by
+//   optimize_graph.sh),
+// - Add(Mul(conv1, inv), shift), as tf.nn.batch_normalization,
+// - FusedBatchNorm in inference mode.
+// The batch norm is folded into weights1 and biases1 with new nodes.
+bool MatchPointwiseGuide(const Matcher& m, const NodeDef* slice, int channels,
+                         Rewrite* rewrite) {
+  const NodeDef* squeeze = m.Input(slice, 1, "Squeeze");
+  if (squeeze == nullptr || !(HasIntList(squeeze, "squeeze_dims", {3}) ||
+                              HasIntList(squeeze, "squeeze_dims", {-1}))) {
+    return false;
+  }
+  const NodeDef* sigmoid = m.Input(squeeze, 0, "Sigmoid");
+  const NodeDef* bias_add2 = m.Input(sigmoid, 0, "BiasAdd");
+  const NodeDef* conv2 = m.Input(bias_add2, 0, "Conv2D");
+  const NodeDef* relu = m.Input(conv2, 0, "Relu");
+  if (relu == nullptr || !IsPointwiseConv(conv2) ||
+      !m.InputShapeIs(bias_add2, 1, {1})) {
+    return false;
+  }
+  const PartialTensorShape weights2 = m.InputShape(conv2, 1);
+  if (!weights2.IsFullyDefined() || weights2.dims() != 4 ||
+      weights2.dim_size(3) != 1) {
+    return false;
+  }
+  const int64_t features = weights2.dim_size(2);
+  if (features > PointwiseGuide::kMaxFeatures ||
+      !weights2.IsSameSize(PartialTensorShape({1, 1, features, 1}))) {
+    return false;
+  }
+
+  const NodeDef* normalized =
+      m.Input(relu, 0,
+              "BiasAdd|Add|AddV2|FusedBatchNorm|FusedBatchNormV2|"
+              "FusedBatchNormV3");
+  if (normalized == nullptr) {
+    return false;
+  }
+  const NodeDef* conv1 = nullptr;
+  std::string weights1;
+  std::string biases1;
+  if (normalized->op() == "BiasAdd") {
+    conv1 = m.Input(normalized, 0, "Conv2D");
+    if (!m.InputShapeIs(normalized, 1, {features})) {
+      return false;
+    }
+    weights1 = conv1 == nullptr ? "" : conv1->input(1);
+    biases1 = normalized->input(1);
+  } else if (normalized->op() == "Add" || normalized->op() == "AddV2") {
+    const NodeDef* lhs = nullptr;
+    const int bias_index =
+        MatchEither(m, normalized, "Conv2D|Mul", &lhs);
+    if (bias_index < 0 || !m.InputShapeIs(normalized, bias_index, {features})) {
+      return false;
+    }
+    biases1 = normalized->input(bias_index);
+    if (lhs->op() == "Conv2D") {
+      conv1 = lhs;
+      weights1 = conv1->input(1);
+    } else {
+      const int inv_index = MatchEither(m, lhs, "Conv2D", &conv1);
+      if (inv_index < 0 || !m.InputShapeIs(lhs, inv_index, {features})) {
+        return false;
+      }
+      rewrite->new_nodes.push_back(
+          NewNode(slice, "weights1", "Mul",
+                  {conv1->input(1), lhs->input(inv_index)}));
+      weights1 = rewrite->new_nodes.back().name();
+    }
+  } else {
+    conv1 = m.Input(normalized, 0, "Conv2D");
+    const auto format = normalized->attr().find("data_format");
+    if (conv1 == nullptr || !HasBool(normalized, "is_training", false) ||
+        (format != normalized->attr().end() && format->second.s() != "NHWC")) {
+      return false;
+    }
+    for (int k = 1; k < 5; ++k) {
+      if (!m.InputShapeIs(normalized, k, {features})) {
+        return false;
+      }
+    }
+    const auto epsilon = normalized->attr().find("epsilon");
+    NodeDef epsilon_node;
+    epsilon_node.set_name(slice->name() + "/fused_guide/epsilon");
+    epsilon_node.set_op("Const");
+    epsilon_node.set_device(slice->device());
+    (*epsilon_node.mutable_attr())["dtype"].set_type(tensorflow::DT_FLOAT);
+    Tensor epsilon_value(
+        epsilon == normalized->attr().end() ? 1e-4f : epsilon->second.f());
+    epsilon_value.AsProtoTensorContent(
+        (*epsilon_node.mutable_attr())["value"].mutable_tensor());
+    rewrite->new_nodes.push_back(epsilon_node);
+
+    // inv = scale / sqrt(variance + epsilon), as the inference-mode op.
+    rewrite->new_nodes.push_back(NewNode(
+        slice, "variance_epsilon", "AddV2",
+        {normalized->input(4), epsilon_node.name()}));
+    rewrite->new_nodes.push_back(
+        NewNode(slice, "rsqrt", "Rsqrt",
+                {rewrite->new_nodes.back().name()}));
+    rewrite->new_nodes.push_back(
+        NewNode(slice, "inv", "Mul",
+                {rewrite->new_nodes.back().name(), normalized->input(1)}));
+    const std::string inv = rewrite->new_nodes.back().name();
+    rewrite->new_nodes.push_back(
+        NewNode(slice, "weights1", "Mul", {conv1->input(1), inv}));
+    weights1 = rewrite->new_nodes.back().name();
+    rewrite->new_nodes.push_back(
+        NewNode(slice, "mean_inv", "Mul", {normalized->input(3), inv}));
+    rewrite->new_nodes.push_back(
+        NewNode(slice, "biases1", "Sub",
+                {normalized->input(2), rewrite->new_nodes.back().name()}));
+    biases1 = rewrite->new_nodes.back().name();
+  }
+  if (conv1 == nullptr || !IsPointwiseConv(conv1) ||
+      !m.InputShapeIs(conv1, 1, {1, 1, channels, features}) ||
+      !Matcher::SameInput(conv1, 0, slice, 2)) {
+    return false;
+  }
+
+  rewrite->op = "PointwiseGuideSliceApply";
+  rewrite->params = {weights1, biases1, conv2->input(1),
+                     bias_add2->input(1)};
+  return true;
+}
+
+bool OnCpu(const NodeDef& node) {
+  using ::tensorflow::DeviceNameUtils;
+  DeviceNameUtils::ParsedName device;
+  return node.device().empty() ||
+         (DeviceNameUtils::ParseFullName(node.device(), &device) &&
+          device.has_type && device.type == "CPU");
+}
+
+// The CPU of the task `device` is on.
+std::string CpuDevice(const std::string& device) {
+  using ::tensorflow::DeviceNameUtils;
+  DeviceNameUtils::ParsedName cpu;
+  if (!DeviceNameUtils::ParseFullName(device, &cpu)) {
+    return "/device:CPU:0";
+  }
+  cpu.has_type = true;
+  cpu.type = "CPU";
+  cpu.has_id = true;
+  cpu.id = 0;
+  return DeviceNameUtils::ParsedNameToString(cpu);
+}
+
+}  // namespace
+
+class GuideFusionOptimizer : public CustomGraphOptimizer {
+ public:
+  Status Init(
+      const tensorflow::RewriterConfig_CustomGraphOptimizer* config) override {
+    if (config != nullptr) {
+      const auto it = config->parameter_map().find("move_to_cpu");
+      move_to_cpu_ = it != config->parameter_map().end() && it->second.b();
+    }
+    return Status::OK();
+  }
+
+  std::string name() const override { return "HDRNetGuideFusion"; }
+
+  bool UsesFunctionLibrary() const override { return false; }
+
+  Status Optimize(Cluster* cluster, const GrapplerItem& item,
+                  GraphDef* optimized_graph) override {
+    *optimized_graph = item.graph;
+    GraphProperties properties(item);
+    TF_RETURN_IF_ERROR(properties.InferStatically(
+        /*assume_valid_feeds=*/false));
+    NodeMap node_map(optimized_graph);
+    const Matcher matcher(node_map, properties);
+
+    std::vector<NodeDef*> slices;
+    for (NodeDef& node : *optimized_graph->mutable_node()) {
+      if (node.op() == "BilateralSliceApply" &&
+          (move_to_cpu_ || OnCpu(node))) {
+        slices.push_back(&node);
+      }
+    }
+    for (NodeDef* slice : slices) {
+      const PartialTensorShape input = matcher.InputShape(slice, 2);
+      if (input.dims() != 4 || input.dim_size(3) <= 0 ||
+          input.dim_size(3) > CurveGuide::kMaxChannels) {
+        continue;
+      }
+      const int channels = input.dim_size(3);
+      Rewrite rewrite;
+      if (!MatchCurveGuide(matcher, slice, channels, &rewrite)) {
+        rewrite = Rewrite();
+        if (!MatchPointwiseGuide(matcher, slice, channels, &rewrite)) {
+          continue;
+        }
+      }
+
+      // Rewrite in place, so that the output keeps its name.
+      if (!OnCpu(*slice)) {
+        slice->set_device(CpuDevice(slice->device()));
+      }
+      const std::string grid = slice->input(0);
+      const std::string image = slice->input(2);
+      std::vector<std::string> control_inputs;
+      for (const std::string& input : slice->input()) {
+        if (tensorflow::grappler::IsControlInput(input)) {
+          control_inputs.push_back(input);
+        }
+      }
+      const auto offset_attr = slice->attr().find("has_offset");
+      AttrValue has_offset;
+      has_offset.set_b(offset_attr != slice->attr().end() &&
+                       offset_attr->second.b());
+      slice->set_op(rewrite.op);
+      slice->clear_input();
+      slice->add_input(grid);
+      slice->add_input(image);
+      for (const std::string& param : rewrite.params) {
+        slice->add_input(param);
+      }
+      for (const std::string& input : control_inputs) {
+        slice->add_input(input);
+      }
+      slice->clear_attr();
+      (*slice->mutable_attr())["has_offset"] = has_offset;
+      for (NodeDef& node : rewrite.new_nodes) {
+        node.set_device(slice->device());
+        *optimized_graph->add_node() = std::move(node);
+      }
+    }
+    return Status::OK();
+  }
+
+ private:
+  bool move_to_cpu_ = false;
+};
+
+REGISTER_GRAPH_OPTIMIZER_AS(GuideFusionOptimizer, "HDRNetGuideFusion");
+
+}  // namespace hdrnet
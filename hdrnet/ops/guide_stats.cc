@@ -0,0 +1,108 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "guide_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "worker_pool.h"
+
+namespace hdrnet {
+
+namespace {
+
+// The cell of each pixel along an axis, clamped.
+std::vector<int> PixelCells(int extent, int grid_extent) {
+  const float scale = static_cast<float>(grid_extent) / extent;
+  std::vector<int> cells(extent);
+  for (int x = 0; x < extent; ++x) {
+    cells[x] = std::clamp(static_cast<int>(std::floor((x + 0.5f) * scale)), 0,
+                          grid_extent - 1);
+  }
+  return cells;
+}
+
+// Bin of `value` in `num_bins` equal bins of [0, 1], clamped. NaNs go to bin 0.
+inline int Bin(float value, int num_bins) {
+  if (!(value > 0.0f)) {
+    return 0;
+  }
+  return std::min(static_cast<int>(std::min(value, 1.0f) * num_bins),
+                  num_bins - 1);
+}
+
+}  // namespace
+
+void GuideStats(nda::array_ref_of_rank<const float, 3> guide,
+                nda::array_ref_of_rank<int32_t, 2> histogram_out,
+                nda::array_ref_of_rank<int32_t, 4> occupancy_out) {
+  const int width = guide.dim<0>().extent();
+  const int height = guide.dim<1>().extent();
+  const int num_bins = histogram_out.dim<0>().extent();
+  const int grid_depth = occupancy_out.dim<0>().extent();
+  const int grid_width = occupancy_out.dim<1>().extent();
+  const int grid_height = occupancy_out.dim<2>().extent();
+  const int batch_size = occupancy_out.dim<3>().extent();
+
+  const std::vector<int> x_cells = PixelCells(width, grid_width);
+  const std::vector<int> y_cells = PixelCells(height, grid_height);
+
+  // One task per grid row: it owns its row of `occupancy_out` and a partial
+  // histogram, summed in order afterwards.
+  std::vector<int32_t> row_histograms(
+      static_cast<size_t>(grid_height) * batch_size * num_bins, 0);
+  const int64_t rows_per_cell = (height + grid_height - 1) / grid_height;
+  ParallelForRows(
+      grid_height, batch_size, rows_per_cell * width, [&](int gy, int b) {
+        int32_t* histogram =
+            &row_histograms[(static_cast<size_t>(b) * grid_height + gy) *
+                            num_bins];
+        for (int gx = 0; gx < grid_width; ++gx) {
+          for (int gz = 0; gz < grid_depth; ++gz) {
+            occupancy_out(gz, gx, gy, b) = 0;
+          }
+        }
+        const int y_begin = static_cast<int>(
+            std::lower_bound(y_cells.begin(), y_cells.end(), gy) -
+            y_cells.begin());
+        const int y_end = static_cast<int>(
+            std::upper_bound(y_cells.begin(), y_cells.end(), gy) -
+            y_cells.begin());
+        for (int y = y_begin; y < y_end; ++y) {
+          for (int x = 0; x < width; ++x) {
+            const float value = guide(x, y, b);
+            ++histogram[Bin(value, num_bins)];
+            ++occupancy_out(Bin(value, grid_depth), x_cells[x], gy, b);
+          }
+        }
+      });
+
+  for (int b = 0; b < batch_size; ++b) {
+    for (int bin = 0; bin < num_bins; ++bin) {
+      histogram_out(bin, b) = 0;
+    }
+    for (int gy = 0; gy < grid_height; ++gy) {
+      const int32_t* histogram =
+          &row_histograms[(static_cast<size_t>(b) * grid_height + gy) *
+                          num_bins];
+      for (int bin = 0; bin < num_bins; ++bin) {
+        histogram_out(bin, b) += histogram[bin];
+      }
+    }
+  }
+}
+
+}  // namespace hdrnet
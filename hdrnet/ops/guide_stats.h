@@ -0,0 +1,41 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_GUIDE_STATS_H_
+#define HDRNET_OPS_GUIDE_STATS_H_
+
+#include <cstdint>
+
+#include "third_party/array/array.h"
+
+namespace hdrnet {
+
+// Telemetry of how a guide uses the depth of the grid it slices, to size
+// params['luma_bins'] and the spatial bins from data.
+//
+// - histogram_out (num_bins, B): the guide values of each image, clamped to
+//   [0, 1], in num_bins equal bins.
+// - occupancy_out (D, W, H, B), for a grid of D x W x H cells: the number of
+//   pixels whose sample falls in each cell, i.e. the cell containing
+//   ((x + 0.5) * W / width, (y + 0.5) * H / height, guide * D), clamped to the
+//   grid. BilateralSlice interpolates this cell and its nearest neighbors.
+//
+// A single pass over the guide, much cheaper than the slice itself.
+void GuideStats(nda::array_ref_of_rank<const float, 3> guide,
+                nda::array_ref_of_rank<int32_t, 2> histogram_out,
+                nda::array_ref_of_rank<int32_t, 4> occupancy_out);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_GUIDE_STATS_H_
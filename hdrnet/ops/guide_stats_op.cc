@@ -0,0 +1,136 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+
+#include "guide_stats.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::InferenceContext;
+using ::tensorflow::shape_inference::ShapeHandle;
+
+namespace hdrnet {
+
+class BilateralGuideStatsOp : public OpKernel {
+ public:
+  explicit BilateralGuideStatsOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("num_bins", &num_bins_));
+    OP_REQUIRES(context, num_bins_ > 0,
+                tensorflow::errors::InvalidArgument(
+                    "num_bins should be positive, got ", num_bins_));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    // Only the shape of the grid is used.
+    const Tensor& grid = context->input(0);
+    const Tensor& guide = context->input(1);
+
+    OP_REQUIRES(context, grid.dims() >= 4,
+                tensorflow::errors::InvalidArgument(
+                    "Input grid should be at least 4D (batch_size, height, "
+                    "width, depth, ...)"));
+    OP_REQUIRES(
+        context, guide.dims() == 3,
+        tensorflow::errors::InvalidArgument(
+            "Input guide should be 3D (batch_size, height, width)"));
+
+    const int64_t batch_size = grid.dim_size(0);
+    const int64_t grid_height = grid.dim_size(1);
+    const int64_t grid_width = grid.dim_size(2);
+    const int64_t grid_depth = grid.dim_size(3);
+    const int64_t height = guide.dim_size(1);
+    const int64_t width = guide.dim_size(2);
+    OP_REQUIRES(context, guide.dim_size(0) == batch_size,
+                tensorflow::errors::InvalidArgument(
+                    "Grid and guide batch sizes should match"));
+    OP_REQUIRES(context,
+                grid_height > 0 && grid_width > 0 && grid_depth > 0,
+                tensorflow::errors::InvalidArgument(
+                    "Grid height, width and depth should be positive"));
+
+    Tensor* histogram = nullptr;
+    OP_REQUIRES_OK(context, context->allocate_output(
+                                0, TensorShape({batch_size, num_bins_}),
+                                &histogram));
+    Tensor* occupancy = nullptr;
+    OP_REQUIRES_OK(context,
+                   context->allocate_output(
+                       1,
+                       TensorShape(
+                           {batch_size, grid_height, grid_width, grid_depth}),
+                       &occupancy));
+    if (height == 0 || width == 0) {
+      histogram->flat<int32_t>().setZero();
+      occupancy->flat<int32_t>().setZero();
+      return;
+    }
+
+    auto guide_ref = nda::make_array_ref(
+        guide.flat<float>().data(),
+        nda::shape_of_rank<3>(width, height, batch_size));
+    auto histogram_ref = nda::make_array_ref(
+        histogram->flat<int32_t>().data(),
+        nda::shape_of_rank<2>(num_bins_, batch_size));
+    auto occupancy_ref = nda::make_array_ref(
+        occupancy->flat<int32_t>().data(),
+        nda::shape_of_rank<4>(grid_depth, grid_width, grid_height,
+                              batch_size));
+    GuideStats(guide_ref, histogram_ref, occupancy_ref);
+  }
+
+ private:
+  int num_bins_;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(
+    Name("BilateralGuideStats").Device(tensorflow::DEVICE_CPU),
+    hdrnet::BilateralGuideStatsOp);
+
+REGISTER_OP("BilateralGuideStats")
+    .Input("grid: float")
+    .Input("guide: float")
+    .Attr("num_bins: int = 64")
+    .Output("histogram: int32")
+    .Output("occupancy: int32")
+    .Doc(
+        "Telemetry of the guide of a BilateralSlice(Apply) of `grid`: the "
+        "histogram of the guide values of each image in `num_bins` bins of "
+        "[0, 1], and the number of pixels whose sample falls in each "
+        "(height, width, depth) cell of the grid.")
+    .SetShapeFn([](InferenceContext* c) {
+      ShapeHandle grid;
+      TF_RETURN_IF_ERROR(c->WithRankAtLeast(c->input(0), 4, &grid));
+      ShapeHandle guide;
+      TF_RETURN_IF_ERROR(c->WithRank(c->input(1), 3, &guide));
+      int num_bins;
+      TF_RETURN_IF_ERROR(c->GetAttr("num_bins", &num_bins));
+      c->set_output(0, c->MakeShape({c->Dim(grid, 0), num_bins}));
+      c->set_output(1, c->MakeShape({c->Dim(grid, 0), c->Dim(grid, 1),
+                                     c->Dim(grid, 2), c->Dim(grid, 3)}));
+      return Status::OK();
+    });
@@ -0,0 +1,123 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_shard.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace hdrnet {
+
+size_t ShardDtypeSize(uint32_t dtype) {
+  switch (static_cast<ShardDtype>(dtype)) {
+    case ShardDtype::kUint8:
+      return 1;
+    case ShardDtype::kInt16:
+    case ShardDtype::kUint16:
+      return 2;
+    case ShardDtype::kFloat32:
+    case ShardDtype::kInt32:
+      return 4;
+  }
+  return 0;
+}
+
+MappedShard::~MappedShard() {
+  if (base_) {
+    munmap(base_, size_);
+  }
+}
+
+bool MappedShard::Open(const std::string& path, std::string* error) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *error = "Cannot open " + path + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ShardHeader)) {
+    close(fd);
+    *error = path + " is not a shard (too small).";
+    return false;
+  }
+  size_ = st.st_size;
+  base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  // The mapping keeps the file alive.
+  close(fd);
+  if (base_ == MAP_FAILED) {
+    base_ = nullptr;
+    *error = "Cannot map " + path + ": " + strerror(errno);
+    return false;
+  }
+
+  const char* bytes = static_cast<const char*>(base_);
+  ShardHeader header;
+  std::memcpy(&header, bytes, sizeof(header));
+  if (header.magic != kShardMagic || header.version != kShardVersion) {
+    *error = path + " is not a version " + std::to_string(kShardVersion) +
+             " shard.";
+    return false;
+  }
+  const uint64_t entries =
+      static_cast<uint64_t>(header.num_samples) * header.arrays_per_sample;
+  if (header.index_offset > size_ ||
+      (size_ - header.index_offset) / sizeof(ShardIndexEntry) < entries) {
+    *error = path + " has a truncated index.";
+    return false;
+  }
+
+  num_samples_ = header.num_samples;
+  arrays_per_sample_ = header.arrays_per_sample;
+  arrays_.resize(entries);
+  for (uint64_t e = 0; e < entries; ++e) {
+    ShardIndexEntry entry;
+    std::memcpy(&entry, bytes + header.index_offset + e * sizeof(entry),
+                sizeof(entry));
+    ShardArray& array = arrays_[e];
+    array.dtype = static_cast<ShardDtype>(entry.dtype);
+    array.height = entry.dims[0];
+    array.width = entry.dims[1];
+    array.channels = entry.dims[2];
+    array.size = ShardDtypeSize(entry.dtype) * entry.dims[0] * entry.dims[1] *
+                 entry.dims[2];
+    if (array.size == 0 || entry.offset % kShardAlignment != 0 ||
+        entry.offset > header.index_offset ||
+        header.index_offset - entry.offset < array.size) {
+      *error = path + " has an invalid entry " + std::to_string(e) + ".";
+      return false;
+    }
+    array.data = bytes + entry.offset;
+  }
+  return true;
+}
+
+void MappedShard::Prefetch(int i) const {
+  const long page = sysconf(_SC_PAGESIZE);
+  for (int a = 0; a < arrays_per_sample_; ++a) {
+    const ShardArray& array = this->array(i, a);
+    const uintptr_t begin =
+        reinterpret_cast<uintptr_t>(array.data) &
+        ~static_cast<uintptr_t>(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(array.data) + array.size;
+    madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+  }
+}
+
+}  // namespace hdrnet
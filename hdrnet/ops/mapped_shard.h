@@ -0,0 +1,119 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_MAPPED_SHARD_H_
+#define HDRNET_OPS_MAPPED_SHARD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace hdrnet {
+
+// A training shard (.hdrs) holds pre-decoded (input, output) image pairs, so
+// that an epoch costs a page-in instead of a decode. Written by ShardWriter in
+// data_pipeline.py; little-endian:
+//
+//   ShardHeader
+//   array data, each starting on a kShardAlignment boundary
+//   ShardIndexEntry[num_samples * arrays_per_sample] at `index_offset`
+//
+// Entries are sample-major: entry (i * arrays_per_sample + a) is array `a` of
+// sample i (0: input, 1: output).
+constexpr uint32_t kShardMagic = 0x53524448;  // "HDRS"
+constexpr uint32_t kShardVersion = 1;
+constexpr size_t kShardAlignment = 64;
+
+// The TYPEMAP codes of data_pipeline.py.
+enum class ShardDtype : uint32_t {
+  kUint8 = 0,
+  kInt16 = 1,
+  kFloat32 = 2,
+  kInt32 = 3,
+  kUint16 = 4,
+};
+
+struct ShardHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_samples;
+  uint32_t arrays_per_sample;
+  uint64_t index_offset;
+  uint64_t reserved;
+};
+
+static_assert(sizeof(ShardHeader) == 32, "ShardHeader layout changed");
+
+struct ShardIndexEntry {
+  uint64_t offset;
+  uint32_t dtype;
+  // (height, width, channels).
+  uint32_t dims[3];
+  uint32_t reserved[2];
+};
+
+static_assert(sizeof(ShardIndexEntry) == 32, "ShardIndexEntry layout changed");
+
+// Size of one element of `dtype`, 0 for unknown codes.
+size_t ShardDtypeSize(uint32_t dtype);
+
+// A read-only view of one image in a mapped shard.
+struct ShardArray {
+  const void* data = nullptr;
+  ShardDtype dtype = ShardDtype::kUint8;
+  int height = 0;
+  int width = 0;
+  int channels = 0;
+  size_t size = 0;
+};
+
+// A shard file mapped into memory. The mapping is private and writable, so
+// that a consumer writing into an array (e.g. a TF op forwarding its input
+// buffer) gets copy-on-write pages instead of a fault, and never modifies the
+// file.
+class MappedShard {
+ public:
+  MappedShard() = default;
+  ~MappedShard();
+
+  MappedShard(const MappedShard&) = delete;
+  MappedShard& operator=(const MappedShard&) = delete;
+
+  // Maps and validates `path`. Returns false with a message in `error` if it
+  // cannot be read or is not a valid shard.
+  bool Open(const std::string& path, std::string* error);
+
+  int num_samples() const { return num_samples_; }
+  int arrays_per_sample() const { return arrays_per_sample_; }
+
+  // Array `a` of sample `i`.
+  const ShardArray& array(int i, int a) const {
+    return arrays_[static_cast<size_t>(i) * arrays_per_sample_ + a];
+  }
+
+  // Asks the kernel to start reading sample `i` in the background.
+  void Prefetch(int i) const;
+
+ private:
+  void* base_ = nullptr;
+  size_t size_ = 0;
+  int num_samples_ = 0;
+  int arrays_per_sample_ = 0;
+  std::vector<ShardArray> arrays_;
+};
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_MAPPED_SHARD_H_
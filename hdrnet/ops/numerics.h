@@ -17,6 +17,18 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Defining HDRNET_NUMERICS_NO_SIMD selects the portable paths below, e.g. to
+// test them on x86.
+#if defined(__SSE__) && !defined(__CUDA_ARCH__) && \
+    !defined(HDRNET_NUMERICS_NO_SIMD)
+#include <xmmintrin.h>
+#define HDRNET_NUMERICS_SSE 1
+#endif
 
 // TODO(jiawen): Document this elsewhere:
 // From LLVM:
@@ -127,4 +139,160 @@ HDRNET_CUDA_INLINE_FUNC float SmoothedLerpWeightGrad(float x, float xs,
 
 #undef HDRNET_CUDA_INLINE_FUNC
 
+// ---------------------------------------------------------------------------
+// Batched versions of the functions above, for the CPU kernels.
+//
+// Each one evaluates a scalar function above for the n values of an array, in
+// a plain loop over non-aliasing arrays that the compiler can vectorize, and
+// gives the same results, bit for bit. The kernels fill them per row, or once
+// per call for the x axis, instead of calling the scalar functions per sample.
+
+// 1 / sqrt(s) for s > 0, from a hardware estimate (rsqrtss, 12 bits) refined by
+// one Newton step. Without SSE, the estimate is the classic integer one,
+// refined by two steps.
+inline float ApproximateRsqrt(float s) {
+#ifdef HDRNET_NUMERICS_SSE
+  const float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(s)));
+  return y * (1.5f - 0.5f * s * y * y);
+#else
+  uint32_t bits;
+  std::memcpy(&bits, &s, sizeof(bits));
+  bits = 0x5f375a86u - (bits >> 1);
+  float y;
+  std::memcpy(&y, &bits, sizeof(y));
+  y = y * (1.5f - 0.5f * s * y * y);
+  return y * (1.5f - 0.5f * s * y * y);
+#endif
+}
+
+// SmoothedAbs, with sqrt(s) computed as s * ApproximateRsqrt(s). Over all
+// floats in [0, 2] with the default eps, the relative error against the exact
+// value is at most 3.5e-7 with SSE (SmoothedAbs: 1.2e-7), and 4.8e-6 without.
+// Valid for |x| < 1e19, where x * x does not overflow.
+inline float ApproximateSmoothedAbs(float x, float eps = 1.0e-8f) {
+  const float s = x * x + eps;
+  return s * ApproximateRsqrt(s);
+}
+
+// Whether the forward CPU kernels use ApproximateSmoothedAbs, set with
+// HDRNET_APPROXIMATE_NUMERICS=1. Off by default. The gradients always use the
+// exact functions.
+inline bool ApproximateNumerics() {
+  static const bool approximate = [] {
+    const char* value = std::getenv("HDRNET_APPROXIMATE_NUMERICS");
+    return value != nullptr && std::atoi(value) != 0;
+  }();
+  return approximate;
+}
+
+// out[k] = SmoothedAbs(x[k], eps), or ApproximateSmoothedAbs if `approximate`.
+// `out` may be `x`.
+inline void SmoothedAbs(const float* x, int n, float* out,
+                        bool approximate = false, float eps = 1.0e-8f) {
+  if (!approximate) {
+    for (int k = 0; k < n; ++k) {
+      out[k] = SmoothedAbs(x[k], eps);
+    }
+    return;
+  }
+  int k = 0;
+#ifdef HDRNET_NUMERICS_SSE
+  // The scalar tail below gives the same results: rsqrtps and rsqrtss share
+  // their estimate.
+  const __m128 eps4 = _mm_set1_ps(eps);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 three_halves = _mm_set1_ps(1.5f);
+  for (; k + 4 <= n; k += 4) {
+    const __m128 v = _mm_loadu_ps(x + k);
+    const __m128 s = _mm_add_ps(_mm_mul_ps(v, v), eps4);
+    __m128 y = _mm_rsqrt_ps(s);
+    y = _mm_mul_ps(
+        y, _mm_sub_ps(three_halves,
+                      _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(half, s), y), y)));
+    _mm_storeu_ps(out + k, _mm_mul_ps(s, y));
+  }
+#endif
+  for (; k < n; ++k) {
+    out[k] = ApproximateSmoothedAbs(x[k], eps);
+  }
+}
+
+// The two cells that each of n samples along an axis interpolates, cell0[k]
+// and cell0[k] + 1, with their weights.
+struct LerpTable {
+  explicit LerpTable(int n) : cell0(n), weight0(n), weight1(n) {}
+
+  int size() const { return static_cast<int>(cell0.size()); }
+
+  std::vector<int> cell0;
+  std::vector<float> weight0;
+  std::vector<float> weight1;
+};
+
+// The depth weights of a row of pixels, and the guide scaled to grid depth
+// that they are computed from. The row kernels allocate one per chunk of rows,
+// see ParallelForRowsWithScratch.
+struct DepthRow {
+  explicit DepthRow(int n) : gzf(n), zs(n) {}
+
+  std::vector<float> gzf;
+  LerpTable zs;
+};
+
+// The LerpWeights of the pixel centers x + 0.5 along an axis, at
+// xf = (x + 0.5) * scale in cells: cell0 = floor(xf - 0.5), and
+// weight0 = LerpWeight(cell0 + 0.5, xf).
+inline void PixelLerpWeights(float scale, LerpTable* table) {
+  const int n = table->size();
+  int* __restrict cell0 = table->cell0.data();
+  float* __restrict weight0 = table->weight0.data();
+  float* __restrict weight1 = table->weight1.data();
+  for (int k = 0; k < n; ++k) {
+    const float xf = (k + 0.5f) * scale;
+    const int x0 = static_cast<int>(std::floor(xf - 0.5f));
+    cell0[k] = x0;
+    weight0[k] = LerpWeight(x0 + 0.5f, xf);
+    weight1[k] = LerpWeight(x0 + 1 + 0.5f, xf);
+  }
+}
+
+// The SmoothedLerpWeights of samples at xf[k] (e.g. guide values in depth
+// cells), with ApproximateSmoothedAbs if `approximate`.
+inline void SmoothedLerpWeights(const float* __restrict xf, LerpTable* table,
+                                bool approximate = false) {
+  const int n = table->size();
+  int* __restrict cell0 = table->cell0.data();
+  float* __restrict weight0 = table->weight0.data();
+  float* __restrict weight1 = table->weight1.data();
+  for (int k = 0; k < n; ++k) {
+    const int x0 = static_cast<int>(std::floor(xf[k] - 0.5f));
+    cell0[k] = x0;
+    weight0[k] = (x0 + 0.5f) - xf[k];
+    weight1[k] = (x0 + 1 + 0.5f) - xf[k];
+  }
+  SmoothedAbs(weight0, n, weight0, approximate);
+  SmoothedAbs(weight1, n, weight1, approximate);
+  for (int k = 0; k < n; ++k) {
+    weight0[k] = std::max(1.0f - weight0[k], 0.0f);
+    weight1[k] = std::max(1.0f - weight1[k], 0.0f);
+  }
+}
+
+// As SmoothedLerpWeights, with the SmoothedLerpWeightGrads as weights.
+inline void SmoothedLerpWeightGrads(const float* __restrict xf,
+                                    LerpTable* table) {
+  const int n = table->size();
+  int* __restrict cell0 = table->cell0.data();
+  float* __restrict weight0 = table->weight0.data();
+  float* __restrict weight1 = table->weight1.data();
+  for (int k = 0; k < n; ++k) {
+    const int x0 = static_cast<int>(std::floor(xf[k] - 0.5f));
+    cell0[k] = x0;
+    weight0[k] = SmoothedLerpWeightGrad(x0 + 0.5f, xf[k]);
+    weight1[k] = SmoothedLerpWeightGrad(x0 + 1 + 0.5f, xf[k]);
+  }
+}
+
+#undef HDRNET_NUMERICS_SSE
+
 #endif  // HDRNET_OPS_NUMERICS_H_
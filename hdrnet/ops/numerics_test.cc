@@ -0,0 +1,128 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the error bounds documented for the approximate numerics of
+// numerics.h. Built twice: as numerics_test, with the SSE paths where
+// available, and as numerics_scalar_test, with HDRNET_NUMERICS_NO_SIMD.
+
+#include "numerics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace hdrnet {
+namespace {
+
+#if defined(__SSE__) && !defined(HDRNET_NUMERICS_NO_SIMD)
+constexpr double kMaxRelativeError = 3.5e-7;
+#else
+constexpr double kMaxRelativeError = 4.8e-6;
+#endif
+
+constexpr float kEps = 1.0e-8f;
+
+// SmoothedAbs in double precision, the reference of the documented bounds.
+double ExactSmoothedAbs(float x) {
+  return std::sqrt(static_cast<double>(x) * x + kEps);
+}
+
+// Every `stride`th float in [0, 2]. An odd stride visits all the low
+// mantissa bit patterns.
+std::vector<float> FloatsUpToTwo(uint32_t stride) {
+  const float two = 2.0f;
+  uint32_t end;
+  std::memcpy(&end, &two, sizeof(end));
+  std::vector<float> values;
+  for (uint32_t bits = 0; bits <= end; bits += stride) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    values.push_back(value);
+  }
+  values.push_back(two);
+  return values;
+}
+
+TEST(NumericsTest, ApproximateSmoothedAbsBound) {
+  const std::vector<float> xs = FloatsUpToTwo(31);
+  // Odd lengths also exercise the scalar tail of the batched version.
+  std::vector<float> batched(xs.size());
+  SmoothedAbs(xs.data(), static_cast<int>(xs.size()), batched.data(),
+              /*approximate=*/true);
+
+  double max_error = 0.0;
+  for (size_t k = 0; k < xs.size(); ++k) {
+    for (const float x : {xs[k], -xs[k]}) {
+      const double exact = ExactSmoothedAbs(x);
+      const double error =
+          std::fabs(ApproximateSmoothedAbs(x) - exact) / exact;
+      ASSERT_LE(error, kMaxRelativeError) << "x = " << x;
+      max_error = std::max(max_error, error);
+    }
+    // The batched version gives the scalar results, bit for bit.
+    ASSERT_EQ(batched[k], ApproximateSmoothedAbs(xs[k])) << "x = " << xs[k];
+  }
+  // The sweep reaches close to the bound, so that it would catch a worse
+  // approximation.
+  EXPECT_GT(max_error, 0.5 * kMaxRelativeError);
+}
+
+TEST(NumericsTest, ExactSmoothedAbsIsUnchanged) {
+  const std::vector<float> xs = FloatsUpToTwo(1021);
+  std::vector<float> batched(xs.size());
+  SmoothedAbs(xs.data(), static_cast<int>(xs.size()), batched.data());
+  for (size_t k = 0; k < xs.size(); ++k) {
+    ASSERT_EQ(batched[k], SmoothedAbs(xs[k])) << "x = " << xs[k];
+  }
+}
+
+TEST(NumericsTest, ApproximateSmoothedLerpWeightsBound) {
+  // Guides over [-0.25, 1.25], beyond the grid at both ends, scaled to an
+  // 8-cell grid depth as in the kernels.
+  const int grid_depth = 8;
+  const int n = 1000003;
+  std::vector<float> gzf(n);
+  for (int k = 0; k < n; ++k) {
+    gzf[k] = (-0.25f + 1.5f * k / (n - 1)) * grid_depth;
+  }
+  LerpTable exact(n);
+  LerpTable approximate(n);
+  SmoothedLerpWeights(gzf.data(), &exact);
+  SmoothedLerpWeights(gzf.data(), &approximate, /*approximate=*/true);
+
+  for (int k = 0; k < n; ++k) {
+    ASSERT_EQ(exact.cell0[k], approximate.cell0[k]);
+    const float weights[2][2] = {
+        {exact.weight0[k], approximate.weight0[k]},
+        {exact.weight1[k], approximate.weight1[k]}};
+    for (int c = 0; c < 2; ++c) {
+      const float dz = (exact.cell0[k] + c + 0.5f) - gzf[k];
+      const double smoothed_abs = ExactSmoothedAbs(dz);
+      // The exact weights are the scalar ones.
+      ASSERT_EQ(weights[c][0],
+                SmoothedLerpWeight(exact.cell0[k] + c + 0.5f, gzf[k]));
+      // 1 - |dz| adds the rounding of a value below 1 to the error of |dz|.
+      ASSERT_LE(std::fabs(weights[c][1] - std::max(1.0 - smoothed_abs, 0.0)),
+                kMaxRelativeError * smoothed_abs + 0x1p-24)
+          << "gzf = " << gzf[k];
+    }
+  }
+}
+
+}  // namespace
+}  // namespace hdrnet
@@ -0,0 +1,229 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mapped_shard.h"
+#include "third_party/tensorflow/core/framework/allocation_description.pb.h"
+#include "third_party/tensorflow/core/framework/op.h"
+#include "third_party/tensorflow/core/framework/op_kernel.h"
+#include "third_party/tensorflow/core/framework/shape_inference.h"
+#include "third_party/tensorflow/core/framework/tensor.h"
+#include "third_party/tensorflow/core/framework/tensor_shape.h"
+#include "third_party/tensorflow/core/lib/random/simple_philox.h"
+#include "third_party/tensorflow/core/util/guarded_philox_random.h"
+
+using ::tensorflow::DataType;
+using ::tensorflow::GuardedPhiloxRandom;
+using ::tensorflow::OpKernel;
+using ::tensorflow::OpKernelConstruction;
+using ::tensorflow::OpKernelContext;
+using ::tensorflow::Status;
+using ::tensorflow::Tensor;
+using ::tensorflow::TensorShape;
+using ::tensorflow::shape_inference::InferenceContext;
+
+namespace hdrnet {
+namespace {
+
+bool Matches(ShardDtype shard_dtype, DataType dtype) {
+  switch (shard_dtype) {
+    case ShardDtype::kUint8:
+      return dtype == tensorflow::DT_UINT8;
+    case ShardDtype::kInt16:
+      return dtype == tensorflow::DT_INT16;
+    case ShardDtype::kFloat32:
+      return dtype == tensorflow::DT_FLOAT;
+    case ShardDtype::kInt32:
+      return dtype == tensorflow::DT_INT32;
+    case ShardDtype::kUint16:
+      return dtype == tensorflow::DT_UINT16;
+  }
+  return false;
+}
+
+// Tensor memory inside a mapped shard. Holds a reference to the shard, so the
+// mapping outlives every tensor pointing into it.
+class MappedBuffer : public tensorflow::TensorBuffer {
+ public:
+  MappedBuffer(std::shared_ptr<const MappedShard> shard,
+               const ShardArray& array)
+      : TensorBuffer(const_cast<void*>(array.data)),
+        shard_(std::move(shard)),
+        size_(array.size) {}
+
+  size_t size() const override { return size_; }
+  TensorBuffer* root_buffer() override { return this; }
+  void FillAllocationDescription(
+      tensorflow::AllocationDescription* proto) const override {
+    proto->set_requested_bytes(size_);
+    proto->set_allocator_name("mapped_shard");
+  }
+  bool OwnsMemory() const override { return false; }
+
+ private:
+  std::shared_ptr<const MappedShard> shard_;
+  size_t size_;
+};
+
+}  // namespace
+
+// Yields the (input, output) pairs of a list of shards (see mapped_shard.h)
+// one sample per call, as tensors pointing into the mapped files: a sample
+// costs no decode and no copy. Each epoch visits every sample once, in a
+// fresh random order if `shuffle`. After `num_epochs` epochs (unless 0), calls
+// fail with OutOfRange, like the queues of the other pipelines.
+//
+// Calls are thread-safe, so several queue runners can share one op.
+class ReadShardSampleOp : public OpKernel {
+ public:
+  explicit ReadShardSampleOp(OpKernelConstruction* context)
+      : OpKernel(context) {
+    OP_REQUIRES_OK(context, context->GetAttr("shards", &paths_));
+    OP_REQUIRES_OK(context, context->GetAttr("input_dtype", &input_dtype_));
+    OP_REQUIRES_OK(context, context->GetAttr("output_dtype", &output_dtype_));
+    OP_REQUIRES_OK(context, context->GetAttr("shuffle", &shuffle_));
+    OP_REQUIRES_OK(context, context->GetAttr("num_epochs", &num_epochs_));
+    OP_REQUIRES(context, !paths_.empty(),
+                tensorflow::errors::InvalidArgument("No shards to read."));
+    OP_REQUIRES_OK(context, generator_.Init(context));
+  }
+
+  void Compute(OpKernelContext* context) override {
+    std::shared_ptr<const MappedShard> shard;
+    int index = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (shards_.empty()) {
+        OP_REQUIRES_OK(context, OpenShards());
+      }
+      if (position_ == order_.size()) {
+        OP_REQUIRES(context, num_epochs_ <= 0 || epoch_ < num_epochs_,
+                    tensorflow::errors::OutOfRange(
+                        "Read all samples of ", num_epochs_, " epochs."));
+        NewEpoch();
+      }
+      const std::pair<int, int> sample = order_[position_++];
+      shard = shards_[sample.first];
+      index = sample.second;
+      if (position_ < order_.size()) {
+        const std::pair<int, int> next = order_[position_];
+        shards_[next.first]->Prefetch(next.second);
+      }
+    }
+
+    for (int a = 0; a < 2; ++a) {
+      const ShardArray& array = shard->array(index, a);
+      const DataType dtype = a == 0 ? input_dtype_ : output_dtype_;
+      OP_REQUIRES(context, Matches(array.dtype, dtype),
+                  tensorflow::errors::InvalidArgument(
+                      "Sample ", index, " has ", a == 0 ? "input" : "output",
+                      " dtype code ", static_cast<int>(array.dtype),
+                      ", expected ", tensorflow::DataTypeString(dtype), "."));
+      MappedBuffer* buffer = new MappedBuffer(shard, array);
+      Tensor tensor(dtype,
+                    TensorShape({array.height, array.width, array.channels}),
+                    buffer);
+      buffer->Unref();
+      context->set_output(a, tensor);
+    }
+  }
+
+ private:
+  Status OpenShards() {
+    for (size_t s = 0; s < paths_.size(); ++s) {
+      auto shard = std::make_shared<MappedShard>();
+      std::string error;
+      if (!shard->Open(paths_[s], &error)) {
+        shards_.clear();
+        samples_.clear();
+        return tensorflow::errors::InvalidArgument(error);
+      }
+      if (shard->arrays_per_sample() != 2) {
+        shards_.clear();
+        samples_.clear();
+        return tensorflow::errors::InvalidArgument(
+            paths_[s], " has ", shard->arrays_per_sample(),
+            " arrays per sample, expected an (input, output) pair.");
+      }
+      for (int i = 0; i < shard->num_samples(); ++i) {
+        samples_.emplace_back(s, i);
+      }
+      shards_.push_back(std::move(shard));
+    }
+    if (samples_.empty()) {
+      shards_.clear();
+      return tensorflow::errors::InvalidArgument("The shards are empty.");
+    }
+    return Status::OK();
+  }
+
+  // Shuffles by index only: the samples stay where they are in the files.
+  void NewEpoch() {
+    order_ = samples_;
+    if (shuffle_) {
+      tensorflow::random::PhiloxRandom philox =
+          generator_.ReserveSamples32(order_.size());
+      tensorflow::random::SimplePhilox rng(&philox);
+      for (size_t i = order_.size() - 1; i > 0; --i) {
+        std::swap(order_[i], order_[rng.Uniform(i + 1)]);
+      }
+    }
+    position_ = 0;
+    ++epoch_;
+  }
+
+  std::vector<std::string> paths_;
+  DataType input_dtype_;
+  DataType output_dtype_;
+  bool shuffle_;
+  int num_epochs_;
+  GuardedPhiloxRandom generator_;
+
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<const MappedShard>> shards_;
+  // (shard, sample) of every sample, and of this epoch in order.
+  std::vector<std::pair<int, int>> samples_;
+  std::vector<std::pair<int, int>> order_;
+  size_t position_ = 0;
+  int epoch_ = 0;
+};
+
+}  // namespace hdrnet
+
+REGISTER_KERNEL_BUILDER(Name("ReadShardSample").Device(tensorflow::DEVICE_CPU),
+                        hdrnet::ReadShardSampleOp);
+
+REGISTER_OP("ReadShardSample")
+    .Output("image_input: input_dtype")
+    .Output("image_output: output_dtype")
+    .Attr("shards: list(string)")
+    .Attr("input_dtype: {uint8, uint16, int16, int32, float}")
+    .Attr("output_dtype: {uint8, uint16, int16, int32, float}")
+    .Attr("shuffle: bool = true")
+    .Attr("num_epochs: int = 0")
+    .Attr("seed: int = 0")
+    .Attr("seed2: int = 0")
+    .SetIsStateful()
+    .Doc("Reads the next (input, output) pair of a list of .hdrs shards.")
+    .SetShapeFn([](InferenceContext* c) {
+      c->set_output(0, c->UnknownShapeOfRank(3));
+      c->set_output(1, c->UnknownShapeOfRank(3));
+      return Status::OK();
+    });
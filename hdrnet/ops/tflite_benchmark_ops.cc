@@ -0,0 +1,23 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Adds the HDRnet custom ops to TFLite's benchmark_model, which resolves the
+// custom ops of a model with this weak, global-scope hook.
+
+#include "third_party/tensorflow/lite/mutable_op_resolver.h"
+#include "tflite_ops.h"
+
+void RegisterSelectedOps(::tflite::MutableOpResolver* resolver) {
+  hdrnet::RegisterTfLiteOps(resolver);
+}
@@ -0,0 +1,384 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tflite_ops.h"
+
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bilateral_slice.h"
+#include "bilateral_slice_apply.h"
+#include "flatbuffers/flexbuffers.h"
+#include "fused_guide.h"
+#include "third_party/array/array.h"
+#include "third_party/tensorflow/lite/kernels/internal/tensor_ctypes.h"
+#include "third_party/tensorflow/lite/kernels/kernel_util.h"
+#include "worker_pool.h"
+
+namespace hdrnet {
+namespace {
+
+// The attributes of a node, from its custom options.
+struct OpData {
+  bool has_offset = false;
+  // Guide parameters packed as fused_guide.h expects them, and the guide
+  // map scratch of the fused ops.
+  std::vector<float> params;
+  std::vector<float> guide_map;
+};
+
+void* Init(TfLiteContext* context, const char* buffer, size_t length) {
+  auto* data = new OpData;
+  if (buffer != nullptr && length > 0) {
+    const flexbuffers::Map attrs =
+        flexbuffers::GetRoot(reinterpret_cast<const uint8_t*>(buffer), length)
+            .AsMap();
+    data->has_offset = attrs["has_offset"].AsBool();
+  }
+  return data;
+}
+
+void Free(TfLiteContext* context, void* buffer) {
+  delete static_cast<OpData*>(buffer);
+}
+
+// A pool with the interpreter's thread count, shared by all the nodes (and
+// interpreters) that ask for it.
+WorkerPool* PoolFor(TfLiteContext* context) {
+  const int num_threads = context->recommended_num_threads;
+  if (num_threads <= 0) {
+    return &WorkerPool::Current();
+  }
+  static std::mutex mutex;
+  static auto* pools = new std::map<int, std::unique_ptr<WorkerPool>>;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<WorkerPool>& pool = (*pools)[num_threads];
+  if (pool == nullptr) {
+    WorkerPoolOptions options;
+    options.num_threads = num_threads;
+    pool = std::make_unique<WorkerPool>(options);
+  }
+  return pool.get();
+}
+
+TfLiteStatus ResizeOutput(TfLiteContext* context, TfLiteTensor* output,
+                          int batch_size, int height, int width,
+                          int channels) {
+  TfLiteIntArray* shape = TfLiteIntArrayCreate(4);
+  shape->data[0] = batch_size;
+  shape->data[1] = height;
+  shape->data[2] = width;
+  shape->data[3] = channels;
+  return context->ResizeTensor(context, output, shape);
+}
+
+TfLiteStatus CheckFloat(TfLiteContext* context, const TfLiteTensor* tensor,
+                        int dims) {
+  TF_LITE_ENSURE_TYPES_EQ(context, tensor->type, kTfLiteFloat32);
+  TF_LITE_ENSURE_EQ(context, tflite::NumDimensions(tensor), dims);
+  return kTfLiteOk;
+}
+
+// -- BilateralSlice -----------------------------------------------------------
+
+TfLiteStatus SlicePrepare(TfLiteContext* context, TfLiteNode* node) {
+  TF_LITE_ENSURE_EQ(context, tflite::NumInputs(node), 2);
+  TF_LITE_ENSURE_EQ(context, tflite::NumOutputs(node), 1);
+  const TfLiteTensor* grid;
+  TF_LITE_ENSURE_OK(context, tflite::GetInputSafe(context, node, 0, &grid));
+  const TfLiteTensor* guide;
+  TF_LITE_ENSURE_OK(context, tflite::GetInputSafe(context, node, 1, &guide));
+  TfLiteTensor* output;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, 0, &output));
+  TF_LITE_ENSURE_OK(context, CheckFloat(context, grid, 5));
+  TF_LITE_ENSURE_OK(context, CheckFloat(context, guide, 3));
+  TF_LITE_ENSURE_EQ(context, tflite::SizeOfDimension(guide, 0),
+                    tflite::SizeOfDimension(grid, 0));
+  return ResizeOutput(context, output, tflite::SizeOfDimension(guide, 0),
+                      tflite::SizeOfDimension(guide, 1),
+                      tflite::SizeOfDimension(guide, 2),
+                      tflite::SizeOfDimension(grid, 4));
+}
+
+TfLiteStatus SliceEval(TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteTensor* grid = tflite::GetInput(context, node, 0);
+  const TfLiteTensor* guide = tflite::GetInput(context, node, 1);
+  TfLiteTensor* output = tflite::GetOutput(context, node, 0);
+  const int batch_size = tflite::SizeOfDimension(grid, 0);
+  const int grid_height = tflite::SizeOfDimension(grid, 1);
+  const int grid_width = tflite::SizeOfDimension(grid, 2);
+  const int grid_depth = tflite::SizeOfDimension(grid, 3);
+  const int grid_channels = tflite::SizeOfDimension(grid, 4);
+  const int height = tflite::SizeOfDimension(guide, 1);
+  const int width = tflite::SizeOfDimension(guide, 2);
+
+  // Same layouts as the TF op, see bilateral_slice_op.cc.
+  auto grid_ref = nda::make_array_ref(
+      tflite::GetTensorData<float>(grid),
+      nda::shape_of_rank<5>(grid_channels, grid_depth, grid_width, grid_height,
+                            batch_size));
+  auto guide_ref = nda::make_array_ref(
+      tflite::GetTensorData<float>(guide),
+      nda::shape_of_rank<3>(width, height, batch_size));
+  auto output_ref = nda::make_array_ref(
+      tflite::GetTensorData<float>(output),
+      nda::shape_of_rank<4>(grid_channels, width, height, batch_size));
+  ScopedWorkerPool pool(PoolFor(context));
+  TunedBilateralSlice(grid_ref, guide_ref, output_ref);
+  return kTfLiteOk;
+}
+
+// -- BilateralSliceApply ------------------------------------------------------
+
+// Checks the grid and input image, inputs `grid_index` and `input_index`, and
+// returns the grid's input and output channels.
+TfLiteStatus CheckGridAndInput(TfLiteContext* context, TfLiteNode* node,
+                               int grid_index, int input_index,
+                               bool has_offset, int* grid_input_channels,
+                               int* output_channels) {
+  const TfLiteTensor* grid;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, grid_index, &grid));
+  const TfLiteTensor* input;
+  TF_LITE_ENSURE_OK(context,
+                    tflite::GetInputSafe(context, node, input_index, &input));
+  TF_LITE_ENSURE_OK(context, CheckFloat(context, grid, 5));
+  TF_LITE_ENSURE_OK(context, CheckFloat(context, input, 4));
+  TF_LITE_ENSURE_EQ(context, tflite::SizeOfDimension(input, 0),
+                    tflite::SizeOfDimension(grid, 0));
+  const int input_channels = tflite::SizeOfDimension(input, 3);
+  *grid_input_channels = has_offset ? input_channels + 1 : input_channels;
+  TF_LITE_ENSURE_EQ(context,
+                    tflite::SizeOfDimension(grid, 4) % *grid_input_channels,
+                    0);
+  *output_channels = tflite::SizeOfDimension(grid, 4) / *grid_input_channels;
+  return kTfLiteOk;
+}
+
+// TF: (b, h, w, d, c), c changes fastest.
+// nda: reinterpreted as (j, i, d, w, h, b), j changes fastest, then i.
+nda::array_ref_of_rank<const float, 6> GridRef(const TfLiteTensor* grid,
+                                               int grid_input_channels,
+                                               int output_channels) {
+  return nda::make_array_ref(
+      tflite::GetTensorData<float>(grid),
+      nda::shape_of_rank<6>(grid_input_channels, output_channels,
+                            tflite::SizeOfDimension(grid, 3),
+                            tflite::SizeOfDimension(grid, 2),
+                            tflite::SizeOfDimension(grid, 1),
+                            tflite::SizeOfDimension(grid, 0)));
+}
+
+// TF: (b, h, w, c), c changes fastest.
+// nda: (c, w, h, b), c changes fastest.
+template <typename T>
+nda::array_ref_of_rank<T, 4> ImageRef(T* data, const TfLiteTensor* tensor) {
+  return nda::make_array_ref(
+      data, nda::shape_of_rank<4>(tflite::SizeOfDimension(tensor, 3),
+                                  tflite::SizeOfDimension(tensor, 2),
+                                  tflite::SizeOfDimension(tensor, 1),
+                                  tflite::SizeOfDimension(tensor, 0)));
+}
+
+TfLiteStatus SliceApplyPrepare(TfLiteContext* context, TfLiteNode* node) {
+  const OpData* data = static_cast<const OpData*>(node->user_data);
+  TF_LITE_ENSURE_EQ(context, tflite::NumInputs(node), 3);
+  TF_LITE_ENSURE_EQ(context, tflite::NumOutputs(node), 1);
+  int grid_input_channels = 0;
+  int output_channels = 0;
+  TF_LITE_ENSURE_OK(context, CheckGridAndInput(context, node, 0, 2,
+                                               data->has_offset,
+                                               &grid_input_channels,
+                                               &output_channels));
+  const TfLiteTensor* guide;
+  TF_LITE_ENSURE_OK(context, tflite::GetInputSafe(context, node, 1, &guide));
+  const TfLiteTensor* input = tflite::GetInput(context, node, 2);
+  TF_LITE_ENSURE_OK(context, CheckFloat(context, guide, 3));
+  for (int d = 0; d < 3; ++d) {
+    TF_LITE_ENSURE_EQ(context, tflite::SizeOfDimension(guide, d),
+                      tflite::SizeOfDimension(input, d));
+  }
+  TfLiteTensor* output;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, 0, &output));
+  return ResizeOutput(context, output, tflite::SizeOfDimension(input, 0),
+                      tflite::SizeOfDimension(input, 1),
+                      tflite::SizeOfDimension(input, 2), output_channels);
+}
+
+TfLiteStatus SliceApplyEval(TfLiteContext* context, TfLiteNode* node) {
+  const OpData* data = static_cast<const OpData*>(node->user_data);
+  const TfLiteTensor* grid = tflite::GetInput(context, node, 0);
+  const TfLiteTensor* guide = tflite::GetInput(context, node, 1);
+  const TfLiteTensor* input = tflite::GetInput(context, node, 2);
+  TfLiteTensor* output = tflite::GetOutput(context, node, 0);
+  const int grid_input_channels = data->has_offset
+                                      ? tflite::SizeOfDimension(input, 3) + 1
+                                      : tflite::SizeOfDimension(input, 3);
+  const int output_channels = tflite::SizeOfDimension(output, 3);
+
+  auto guide_ref = nda::make_array_ref(
+      tflite::GetTensorData<float>(guide),
+      nda::shape_of_rank<3>(tflite::SizeOfDimension(guide, 2),
+                            tflite::SizeOfDimension(guide, 1),
+                            tflite::SizeOfDimension(guide, 0)));
+  ScopedWorkerPool pool(PoolFor(context));
+  TunedBilateralSliceApply(
+      GridRef(grid, grid_input_channels, output_channels), guide_ref,
+      ImageRef(tflite::GetTensorData<float>(input), input),
+      ImageRef(tflite::GetTensorData<float>(output), output));
+  return kTfLiteOk;
+}
+
+// -- CurveGuideSliceApply and PointwiseGuideSliceApply ------------------------
+
+// Inputs: grid, input, then the guide parameters, as fused_guide_op.cc.
+struct CurveGuideInputs {
+  using Guide = CurveGuide;
+  static constexpr int kNumParams = 6;
+  static constexpr int kMaxExtent = std::numeric_limits<int>::max();
+
+  // ccm, ccm_bias, shifts, slopes, mix_weights, mix_bias.
+  static int Extent(TfLiteContext* context, TfLiteNode* node, int channels) {
+    return tflite::NumElements(tflite::GetInput(context, node, 4)) / channels;
+  }
+  static std::vector<int> Sizes(int channels, int points) {
+    return {channels * channels, channels, channels * points,
+            channels * points,   channels, 1};
+  }
+};
+
+struct PointwiseGuideInputs {
+  using Guide = PointwiseGuide;
+  static constexpr int kNumParams = 4;
+  static constexpr int kMaxExtent = PointwiseGuide::kMaxFeatures;
+
+  // weights1, biases1, weights2, bias2.
+  static int Extent(TfLiteContext* context, TfLiteNode* node, int channels) {
+    return tflite::NumElements(tflite::GetInput(context, node, 3));
+  }
+  static std::vector<int> Sizes(int channels, int features) {
+    return {channels * features, features, features, 1};
+  }
+};
+
+template <typename Inputs>
+TfLiteStatus GuideSliceApplyPrepare(TfLiteContext* context, TfLiteNode* node) {
+  OpData* data = static_cast<OpData*>(node->user_data);
+  TF_LITE_ENSURE_EQ(context, tflite::NumInputs(node), 2 + Inputs::kNumParams);
+  TF_LITE_ENSURE_EQ(context, tflite::NumOutputs(node), 1);
+  int grid_input_channels = 0;
+  int output_channels = 0;
+  TF_LITE_ENSURE_OK(context, CheckGridAndInput(context, node, 0, 1,
+                                               data->has_offset,
+                                               &grid_input_channels,
+                                               &output_channels));
+  const TfLiteTensor* input = tflite::GetInput(context, node, 1);
+  const int channels = tflite::SizeOfDimension(input, 3);
+  TF_LITE_ENSURE(context,
+                 channels > 0 && channels <= Inputs::Guide::kMaxChannels);
+
+  const int extent = Inputs::Extent(context, node, channels);
+  TF_LITE_ENSURE(context, extent <= Inputs::kMaxExtent);
+  const std::vector<int> sizes = Inputs::Sizes(channels, extent);
+  for (int p = 0; p < Inputs::kNumParams; ++p) {
+    const TfLiteTensor* param;
+    TF_LITE_ENSURE_OK(context,
+                      tflite::GetInputSafe(context, node, 2 + p, &param));
+    TF_LITE_ENSURE_TYPES_EQ(context, param->type, kTfLiteFloat32);
+    TF_LITE_ENSURE_EQ(context, tflite::NumElements(param), sizes[p]);
+  }
+  data->guide_map.resize(tflite::NumElements(input) / channels);
+
+  TfLiteTensor* output;
+  TF_LITE_ENSURE_OK(context, tflite::GetOutputSafe(context, node, 0, &output));
+  return ResizeOutput(context, output, tflite::SizeOfDimension(input, 0),
+                      tflite::SizeOfDimension(input, 1),
+                      tflite::SizeOfDimension(input, 2), output_channels);
+}
+
+template <typename Inputs>
+TfLiteStatus GuideSliceApplyEval(TfLiteContext* context, TfLiteNode* node) {
+  OpData* data = static_cast<OpData*>(node->user_data);
+  const TfLiteTensor* grid = tflite::GetInput(context, node, 0);
+  const TfLiteTensor* input = tflite::GetInput(context, node, 1);
+  TfLiteTensor* output = tflite::GetOutput(context, node, 0);
+  const int channels = tflite::SizeOfDimension(input, 3);
+  const int grid_input_channels = data->has_offset ? channels + 1 : channels;
+  const int output_channels = tflite::SizeOfDimension(output, 3);
+
+  // The parameters may be computed by the graph, so they are packed anew.
+  data->params.clear();
+  for (int p = 0; p < Inputs::kNumParams; ++p) {
+    const TfLiteTensor* param = tflite::GetInput(context, node, 2 + p);
+    const float* values = tflite::GetTensorData<float>(param);
+    data->params.insert(data->params.end(), values,
+                        values + tflite::NumElements(param));
+  }
+  const typename Inputs::Guide guide(
+      channels, Inputs::Extent(context, node, channels), data->params.data());
+
+  auto guide_map_ref = nda::make_array_ref(
+      data->guide_map.data(),
+      nda::shape_of_rank<3>(tflite::SizeOfDimension(input, 2),
+                            tflite::SizeOfDimension(input, 1),
+                            tflite::SizeOfDimension(input, 0)));
+  ScopedWorkerPool pool(PoolFor(context));
+  GuideSliceApply(GridRef(grid, grid_input_channels, output_channels),
+                  ImageRef(tflite::GetTensorData<float>(input), input), guide,
+                  guide_map_ref,
+                  ImageRef(tflite::GetTensorData<float>(output), output));
+  return kTfLiteOk;
+}
+
+}  // namespace
+
+TfLiteRegistration* Register_BILATERAL_SLICE() {
+  static TfLiteRegistration registration = {Init, Free, SlicePrepare,
+                                            SliceEval};
+  return &registration;
+}
+
+TfLiteRegistration* Register_BILATERAL_SLICE_APPLY() {
+  static TfLiteRegistration registration = {Init, Free, SliceApplyPrepare,
+                                            SliceApplyEval};
+  return &registration;
+}
+
+TfLiteRegistration* Register_CURVE_GUIDE_SLICE_APPLY() {
+  static TfLiteRegistration registration = {
+      Init, Free, GuideSliceApplyPrepare<CurveGuideInputs>,
+      GuideSliceApplyEval<CurveGuideInputs>};
+  return &registration;
+}
+
+TfLiteRegistration* Register_POINTWISE_GUIDE_SLICE_APPLY() {
+  static TfLiteRegistration registration = {
+      Init, Free, GuideSliceApplyPrepare<PointwiseGuideInputs>,
+      GuideSliceApplyEval<PointwiseGuideInputs>};
+  return &registration;
+}
+
+void RegisterTfLiteOps(tflite::MutableOpResolver* resolver) {
+  resolver->AddCustom("BilateralSlice", Register_BILATERAL_SLICE());
+  resolver->AddCustom("BilateralSliceApply", Register_BILATERAL_SLICE_APPLY());
+  resolver->AddCustom("CurveGuideSliceApply",
+                      Register_CURVE_GUIDE_SLICE_APPLY());
+  resolver->AddCustom("PointwiseGuideSliceApply",
+                      Register_POINTWISE_GUIDE_SLICE_APPLY());
+}
+
+}  // namespace hdrnet
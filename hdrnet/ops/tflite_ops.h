@@ -0,0 +1,41 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_TFLITE_OPS_H_
+#define HDRNET_OPS_TFLITE_OPS_H_
+
+#include "third_party/tensorflow/lite/c/common.h"
+#include "third_party/tensorflow/lite/mutable_op_resolver.h"
+
+namespace hdrnet {
+
+// TFLite custom ops for the forward TF ops of this directory, with the same
+// names, inputs and attributes, so that models converted with
+// allow_custom_ops (see bin/convert_tflite.py) run on the CPU kernels. The
+// attributes come in the custom options as the converter writes them, a
+// flexbuffer map.
+//
+// The kernels run on a WorkerPool with the interpreter's thread count
+// (Interpreter::SetNumThreads), or on WorkerPool::Current() if it is not set.
+TfLiteRegistration* Register_BILATERAL_SLICE();
+TfLiteRegistration* Register_BILATERAL_SLICE_APPLY();
+TfLiteRegistration* Register_CURVE_GUIDE_SLICE_APPLY();
+TfLiteRegistration* Register_POINTWISE_GUIDE_SLICE_APPLY();
+
+// Adds the ops above to `resolver` under their TF names.
+void RegisterTfLiteOps(tflite::MutableOpResolver* resolver);
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_TFLITE_OPS_H_
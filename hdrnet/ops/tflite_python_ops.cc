@@ -0,0 +1,27 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Adds the HDRnet custom ops to TFLite's Python interpreter, which looks up
+// the registerers it is given by name in the loaded libraries:
+//
+//   ctypes.CDLL('hdrnet_tflite_ops.so', mode=ctypes.RTLD_GLOBAL)
+//   tf.lite.Interpreter(model_content=...,
+//                       custom_op_registerers=['HDRNetRegisterTfLiteOps'])
+
+#include "third_party/tensorflow/lite/mutable_op_resolver.h"
+#include "tflite_ops.h"
+
+extern "C" void HDRNetRegisterTfLiteOps(::tflite::MutableOpResolver* resolver) {
+  hdrnet::RegisterTfLiteOps(resolver);
+}
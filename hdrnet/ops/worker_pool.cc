@@ -0,0 +1,255 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace hdrnet {
+
+namespace {
+
+// True on pool threads and on a caller while it runs a ParallelFor, so that
+// nested calls run inline instead of deadlocking.
+thread_local bool in_parallel_for = false;
+
+thread_local WorkerPool* current_pool = nullptr;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+void PinToCpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % CPU_SETSIZE, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+int EnvInt(const char* name, int default_value) {
+  const char* value = std::getenv(name);
+  return value ? std::atoi(value) : default_value;
+}
+
+uint64_t Cursor(uint32_t generation, int64_t index) {
+  return (static_cast<uint64_t>(generation) << 32) |
+         static_cast<uint64_t>(index);
+}
+
+}  // namespace
+
+WorkerPool::WorkerPool(const WorkerPoolOptions& options)
+    : options_(options), spin_us_(options.spin_us) {
+  int num_threads = options_.num_threads;
+  if (num_threads <= 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // The caller is one of the threads.
+  for (int i = 1; i < num_threads; ++i) {
+    workers_.emplace_back(&WorkerPool::WorkerLoop, this, i);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+WorkerPool& WorkerPool::Default() {
+  static WorkerPool* pool = [] {
+    WorkerPoolOptions options;
+    options.num_threads = EnvInt("HDRNET_NUM_THREADS", options.num_threads);
+    options.spin_us = EnvInt("HDRNET_SPIN_US", options.spin_us);
+    options.pin_threads = EnvInt("HDRNET_PIN_THREADS", 0) != 0;
+    options.inline_threshold =
+        EnvInt("HDRNET_INLINE_THRESHOLD",
+               static_cast<int>(options.inline_threshold));
+    return new WorkerPool(options);
+  }();
+  return *pool;
+}
+
+WorkerPool& WorkerPool::Current() {
+  return current_pool ? *current_pool : Default();
+}
+
+ScopedWorkerPool::ScopedWorkerPool(WorkerPool* pool) : previous_(current_pool) {
+  current_pool = pool;
+}
+
+ScopedWorkerPool::~ScopedWorkerPool() { current_pool = previous_; }
+
+void WorkerPool::ParallelFor(int64_t n, int64_t cost_per_item,
+                             const std::function<void(int64_t, int64_t)>& fn,
+                             const Schedule& schedule) {
+  if (n <= 0) {
+    return;
+  }
+  const int64_t threads =
+      schedule.num_threads > 0 ? std::min(schedule.num_threads, num_threads())
+                               : num_threads();
+  if (threads == 1 || in_parallel_for || n == 1 ||
+      n * std::max<int64_t>(cost_per_item, 1) < options_.inline_threshold) {
+    fn(0, n);
+    return;
+  }
+
+  in_parallel_for = true;
+
+  const bool low_latency = schedule.mode == LatencyMode::kLowLatency;
+  // Low latency: one claim per thread. Throughput: a few chunks per thread so
+  // that a descheduled worker does not hold up the call.
+  const int64_t chunks = low_latency ? threads : 4 * threads;
+  spin_us_.store(low_latency ? options_.low_latency_spin_us : options_.spin_us,
+                 std::memory_order_relaxed);
+
+  Job job;
+  Slot* slot = nullptr;
+  bool wake = false;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      for (Slot& candidate : slots_) {
+        if (candidate.job.generation == 0) {
+          slot = &candidate;
+          break;
+        }
+      }
+      if (slot != nullptr) {
+        break;
+      }
+      slot_freed_.wait(lock);
+    }
+    job.generation = generation_.load(std::memory_order_relaxed) + 1;
+    // 0 marks free slots.
+    if (job.generation == 0) {
+      job.generation = 1;
+    }
+    job.fn = &fn;
+    job.n = n;
+    job.chunk = schedule.chunk > 0
+                    ? schedule.chunk
+                    : std::max<int64_t>(1, (n + chunks - 1) / chunks);
+    job.num_threads = static_cast<int>(threads);
+    slot->job = job;
+    slot->done.store(0, std::memory_order_relaxed);
+    slot->cursor.store(Cursor(job.generation, 0), std::memory_order_release);
+    generation_.store(job.generation, std::memory_order_release);
+    wake = parked_ > 0;
+  }
+  if (wake) {
+    wake_.notify_all();
+  }
+
+  RunChunks(*slot, job);
+  // The caller is hot; spin until the stragglers finish.
+  while (slot->done.load(std::memory_order_acquire) < n) {
+    CpuRelax();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slot->job = Job();
+  }
+  slot_freed_.notify_one();
+  in_parallel_for = false;
+}
+
+void WorkerPool::RunChunks(Slot& slot, const Job& job) {
+  uint64_t cursor = slot.cursor.load(std::memory_order_acquire);
+  while (true) {
+    const int64_t begin = static_cast<int64_t>(cursor & 0xffffffffu);
+    if ((cursor >> 32) != job.generation || begin >= job.n) {
+      return;
+    }
+    const int64_t end = std::min(begin + job.chunk, job.n);
+    if (slot.cursor.compare_exchange_weak(cursor, Cursor(job.generation, end),
+                                          std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+      (*job.fn)(begin, end);
+      slot.done.fetch_add(end - begin, std::memory_order_acq_rel);
+      cursor = slot.cursor.load(std::memory_order_acquire);
+    }
+  }
+}
+
+void WorkerPool::WorkerLoop(int index) {
+  in_parallel_for = true;
+  if (options_.pin_threads) {
+    PinToCpu(index);
+  }
+
+  uint32_t seen = 0;
+  while (true) {
+    // Spin, then park.
+    const auto spin_end =
+        std::chrono::steady_clock::now() +
+        std::chrono::microseconds(spin_us_.load(std::memory_order_relaxed));
+    int spins = 0;
+    while (generation_.load(std::memory_order_acquire) == seen) {
+      CpuRelax();
+      // Checking the clock is slower than a pause; do it occasionally.
+      if (++spins % 64 == 0 && std::chrono::steady_clock::now() > spin_end) {
+        break;
+      }
+    }
+
+    Job jobs[kMaxConcurrentCalls];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (generation_.load(std::memory_order_relaxed) == seen && !stop_) {
+        ++parked_;
+        wake_.wait(lock, [&] {
+          return generation_.load(std::memory_order_relaxed) != seen || stop_;
+        });
+        --parked_;
+      }
+      if (stop_) {
+        return;
+      }
+      seen = generation_.load(std::memory_order_relaxed);
+      for (int s = 0; s < kMaxConcurrentCalls; ++s) {
+        jobs[s] = slots_[s].job;
+      }
+    }
+    // Workers start from different calls, so that concurrent calls all get
+    // help.
+    for (int k = 0; k < kMaxConcurrentCalls; ++k) {
+      const int s = (index + k) % kMaxConcurrentCalls;
+      if (jobs[s].generation != 0 && index < jobs[s].num_threads) {
+        RunChunks(slots_[s], jobs[s]);
+      }
+    }
+  }
+}
+
+}  // namespace hdrnet
@@ -0,0 +1,205 @@
+// Copyright 2016 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HDRNET_OPS_WORKER_POOL_H_
+#define HDRNET_OPS_WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hdrnet {
+
+// How a ParallelFor call trades CPU time for latency.
+enum class LatencyMode {
+  // Fine-grained chunks for load balancing. Workers park shortly after the
+  // call returns.
+  kThroughput,
+  // One chunk per thread, and workers keep spinning for
+  // `WorkerPoolOptions::low_latency_spin_us` after the call so that the next
+  // call (e.g. while scrubbing a slider) does not pay a wake-up.
+  kLowLatency,
+};
+
+// How one call splits its work over the pool. Zero fields use the pool's
+// defaults. See autotune.h for choosing them per shape.
+struct Schedule {
+  LatencyMode mode = LatencyMode::kThroughput;
+  // Maximum number of threads, including the caller.
+  int num_threads = 0;
+  // Items per chunk (rows for the kernels).
+  int64_t chunk = 0;
+};
+
+struct WorkerPoolOptions {
+  // Number of threads, including the calling thread. 0 means one per
+  // hardware thread.
+  int num_threads = 0;
+
+  // How long an idle worker spins before parking on a condition variable.
+  int spin_us = 50;
+  int low_latency_spin_us = 5000;
+
+  // Pin worker i to CPU i (Linux only). The caller is left unpinned.
+  bool pin_threads = false;
+
+  // Calls with less total work than this (in the caller's cost units, see
+  // ParallelFor) run inline on the calling thread.
+  int64_t inline_threshold = 16384;
+};
+
+// A persistent pool of worker threads for the CPU kernels. Unlike a generic
+// task queue, the caller takes part in the work, and idle workers spin before
+// parking so that back-to-back small calls do not pay a thread wake-up each
+// time.
+//
+// Up to kMaxConcurrentCalls ParallelFor calls, e.g. from ops run in parallel by
+// TF's inter-op threads, share the workers; each worker drains the calls in
+// flight one after the other, starting from a different one. Further calls
+// wait for one of them to return.
+class WorkerPool {
+ public:
+  explicit WorkerPool(const WorkerPoolOptions& options = WorkerPoolOptions());
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Calls fn(begin, end) on disjoint ranges covering [0, n) and returns when
+  // all of them are done. `cost_per_item` is an estimate of the work per item
+  // (e.g. pixels per row) used to decide whether to run inline.
+  //
+  // Calls from inside `fn` run inline. Concurrent calls from several threads
+  // run together, see kMaxConcurrentCalls.
+  void ParallelFor(int64_t n, int64_t cost_per_item,
+                   const std::function<void(int64_t, int64_t)>& fn,
+                   const Schedule& schedule = Schedule());
+
+  int num_threads() const { return static_cast<int>(workers_.size()) + 1; }
+
+  // ParallelFor calls in flight at once.
+  static constexpr int kMaxConcurrentCalls = 4;
+
+  // The pool shared by the CPU kernels. Its options can be overridden with the
+  // HDRNET_NUM_THREADS, HDRNET_SPIN_US, HDRNET_PIN_THREADS and
+  // HDRNET_INLINE_THRESHOLD environment variables.
+  static WorkerPool& Default();
+
+  // The pool used by the kernels on this thread: the innermost
+  // ScopedWorkerPool, else Default().
+  static WorkerPool& Current();
+
+ private:
+  struct Job {
+    uint32_t generation = 0;
+    const std::function<void(int64_t, int64_t)>* fn = nullptr;
+    int64_t n = 0;
+    int64_t chunk = 1;
+    int num_threads = 1;
+  };
+
+  // One call in flight.
+  struct Slot {
+    // Guarded by mutex_. The job is empty (generation 0) when the slot is free.
+    Job job;
+    // (generation << 32) | next unclaimed index. Claims only succeed for the
+    // slot's current generation, so a late worker never runs a stale job.
+    std::atomic<uint64_t> cursor{0};
+    // Number of items completed in the slot's job.
+    std::atomic<int64_t> done{0};
+    // Keeps the counters of different slots on different cache lines, as
+    // every worker hammers them. (alignas would need C++17 aligned new.)
+    char padding[64];
+  };
+
+  void WorkerLoop(int index);
+  // Claims and runs chunks of `job`, in `slot`, until none are left.
+  void RunChunks(Slot& slot, const Job& job);
+
+  const WorkerPoolOptions options_;
+  std::vector<std::thread> workers_;
+
+  // Guards the slots' jobs, parked_ and stop_.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  // Notified when a slot is freed.
+  std::condition_variable slot_freed_;
+  Slot slots_[kMaxConcurrentCalls];
+  int parked_ = 0;
+  bool stop_ = false;
+
+  // Bumped for every job, and used as its generation. Spinning workers watch
+  // it.
+  std::atomic<uint32_t> generation_{0};
+  // How long idle workers spin, set by the latest call's LatencyMode.
+  std::atomic<int> spin_us_;
+};
+
+// Makes the kernels called on this thread use `pool` instead of the default
+// one while in scope.
+class ScopedWorkerPool {
+ public:
+  explicit ScopedWorkerPool(WorkerPool* pool);
+  ~ScopedWorkerPool();
+
+  ScopedWorkerPool(const ScopedWorkerPool&) = delete;
+  ScopedWorkerPool& operator=(const ScopedWorkerPool&) = delete;
+
+ private:
+  WorkerPool* previous_;
+};
+
+// Calls fn(y, b) for every row y < height of every image b < batch_size on
+// WorkerPool::Current(). `cost_per_row` is in the same units as the pool's
+// inline_threshold, roughly one per output value.
+template <typename Fn>
+void ParallelForRows(int height, int batch_size, int64_t cost_per_row, Fn fn,
+                     const Schedule& schedule = Schedule()) {
+  WorkerPool::Current().ParallelFor(
+      static_cast<int64_t>(height) * batch_size, cost_per_row,
+      [&](int64_t begin, int64_t end) {
+        for (int64_t row = begin; row < end; ++row) {
+          fn(static_cast<int>(row % height), static_cast<int>(row / height));
+        }
+      },
+      schedule);
+}
+
+// As ParallelForRows, for rows that need temporary buffers: calls
+// make_scratch() once per chunk of rows, and fn(y, b, scratch) with the result
+// for each row of the chunk, so that the buffers are allocated per chunk
+// rather than per row.
+template <typename MakeScratch, typename Fn>
+void ParallelForRowsWithScratch(int height, int batch_size,
+                                int64_t cost_per_row, MakeScratch make_scratch,
+                                Fn fn, const Schedule& schedule = Schedule()) {
+  WorkerPool::Current().ParallelFor(
+      static_cast<int64_t>(height) * batch_size, cost_per_row,
+      [&](int64_t begin, int64_t end) {
+        auto scratch = make_scratch();
+        for (int64_t row = begin; row < end; ++row) {
+          fn(static_cast<int>(row % height), static_cast<int>(row / height),
+             scratch);
+        }
+      },
+      schedule);
+}
+
+}  // namespace hdrnet
+
+#endif  // HDRNET_OPS_WORKER_POOL_H_
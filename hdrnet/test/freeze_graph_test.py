@@ -0,0 +1,95 @@
+# Copyright 2016 Google Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Test for bin/freeze_graph.py --batched."""
+
+import argparse
+import imp
+import os
+import shutil
+import tempfile
+import unittest
+
+import numpy as np
+import tensorflow as tf
+
+import hdrnet.models as models
+
+freeze_graph = imp.load_source(
+    'freeze_graph',
+    os.path.join(os.path.dirname(__file__), '..', 'bin', 'freeze_graph.py'))
+
+
+class FreezeBatchedTest(tf.test.TestCase):
+
+  def setUp(self):
+    self.checkpoint_dir = tempfile.mkdtemp()
+    self.model_params = {
+        'model_name': 'HDRNetCurves',
+        'net_input_size': 64,
+        'batch_norm': False,
+        'channel_multiplier': 1,
+        'guide_complexity': 16,
+        'luma_bins': 4,
+        'spatial_bin': 16,
+    }
+    # A checkpoint as bin/train.py saves it, with random weights.
+    sz = self.model_params['net_input_size']
+    with tf.Graph().as_default():
+      for name, value in self.model_params.items():
+        tf.add_to_collection('model_params',
+                             tf.convert_to_tensor(value, name=name))
+      lowres = tf.placeholder(tf.float32, [1, sz, sz, 3])
+      fullres = tf.placeholder(tf.float32, [1, sz, sz, 3])
+      with tf.variable_scope('inference'):
+        models.HDRNetCurves.inference(lowres, fullres, self.model_params)
+      saver = tf.train.Saver()
+      # The slicing output is pinned to the GPU.
+      config = tf.ConfigProto(allow_soft_placement=True)
+      with tf.Session(config=config) as sess:
+        sess.run(tf.global_variables_initializer())
+        saver.save(sess, os.path.join(self.checkpoint_dir, 'model.ckpt'))
+
+  def tearDown(self):
+    shutil.rmtree(self.checkpoint_dir)
+
+  def test_batched_output_coefficients(self):
+    """Each image of a batch should get its own batch-1 coefficients."""
+    freeze_graph.main(argparse.Namespace(checkpoint_dir=self.checkpoint_dir,
+                                         batched=True))
+    graph_def = tf.GraphDef()
+    with open(os.path.join(self.checkpoint_dir, 'frozen_graph.pb'), 'rb') as f:
+      graph_def.ParseFromString(f.read())
+
+    sz = self.model_params['net_input_size']
+    gd = self.model_params['luma_bins']
+    gs = sz // self.model_params['spatial_bin']
+    images = np.random.rand(3, sz, sz, 3).astype(np.float32)
+    with tf.Graph().as_default() as graph:
+      tf.import_graph_def(graph_def, name='')
+      lowres = graph.get_tensor_by_name('lowres_input:0')
+      single = graph.get_tensor_by_name('output_coefficients:0')
+      batched = graph.get_tensor_by_name('batched_output_coefficients:0')
+      with tf.Session() as sess:
+        batched_data = sess.run(batched, feed_dict={lowres: images})
+        self.assertEqual((3, 3, gd, gs, gs, 4), batched_data.shape)
+        for i in range(3):
+          single_data = sess.run(single, feed_dict={lowres: images[i:i+1]})
+          self.assertEqual((3, gd, gs, gs, 4), single_data.shape)
+          self.assertAllClose(single_data, batched_data[i], rtol=1e-4,
+                              atol=1e-5)
+
+
+if __name__ == '__main__':
+  unittest.main()